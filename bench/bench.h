@@ -0,0 +1,80 @@
+#ifndef CM_BENCH_H
+#define CM_BENCH_H
+
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "store.h"
+#include "util.h"
+
+/**
+ * A clip store in a temporary directory, removed by bench_store_destroy().
+ *
+ * @dir: The temporary directory holding the snip file and content
+ * @cs: The clip store
+ */
+struct bench_store {
+    char dir[PATH_MAX];
+    struct clip_store cs;
+};
+
+static uint64_t bench_rng_state = 88172645463325252ULL;
+
+/**
+ * Deterministic pseudo-random numbers, so runs are comparable.
+ */
+static inline uint64_t bench_rand(void) {
+    bench_rng_state ^= bench_rng_state << 13;
+    bench_rng_state ^= bench_rng_state >> 7;
+    bench_rng_state ^= bench_rng_state << 17;
+    return bench_rng_state;
+}
+
+static inline double bench_now_ms(void) {
+    struct timespec ts;
+    expect(clock_gettime(CLOCK_MONOTONIC, &ts) == 0);
+    return (double)ts.tv_sec * 1000.0 + (double)ts.tv_nsec / 1e6;
+}
+
+static inline uint64_t bench_now_ns(void) {
+    struct timespec ts;
+    expect(clock_gettime(CLOCK_MONOTONIC, &ts) == 0);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static inline void bench_store_init(struct bench_store *bs) {
+    const char *tmp = getenv("TMPDIR");
+    snprintf_safe(bs->dir, sizeof(bs->dir), "%s/clipmenu-bench-XXXXXX",
+                  tmp ? tmp : "/tmp");
+    expect(mkdtemp(bs->dir));
+
+    char path[PATH_MAX];
+    snprintf_safe(path, sizeof(path), "%s/line_cache", bs->dir);
+    int snip_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    int content_dir_fd = open(bs->dir, O_RDONLY | O_CLOEXEC);
+    expect(snip_fd >= 0 && content_dir_fd >= 0);
+    expect(cs_init(&bs->cs, snip_fd, content_dir_fd) == 0);
+}
+
+static inline int bench_rm_entry(const char *path, const struct stat *st,
+                                 int type, struct FTW *ftw) {
+    (void)st;
+    (void)type;
+    (void)ftw;
+    return remove(path);
+}
+
+static inline void bench_store_destroy(struct bench_store *bs) {
+    int snip_fd = bs->cs.snip_fd, content_dir_fd = bs->cs.content_dir_fd;
+    expect(cs_destroy(&bs->cs) == 0);
+    close(snip_fd);
+    close(content_dir_fd);
+    expect(nftw(bs->dir, bench_rm_entry, 16, FTW_DEPTH | FTW_PHYS) == 0);
+}
+
+#endif
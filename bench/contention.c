@@ -0,0 +1,247 @@
+#define _GNU_SOURCE
+
+#include <getopt.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+
+#include "bench.h"
+#include "stats.h"
+
+/**
+ * Benchmark how much other users of the clip store slow down ingest. A writer
+ * adds and trims clips the way clipmenud does, while separate reader
+ * processes walk the snips the way clipmenu builds its menu, and deleter
+ * processes run cs_remove() the way clipdel does. Each process has its own
+ * clip store, so they contend on the flock just as the real tools do.
+ *
+ * For each level of contention, the writer's throughput is compared to the
+ * uncontended run, and its per-add latency percentiles are reported. The lock
+ * wait and hold times by caller from the last run are printed at the end.
+ *
+ * Usage: bench/contention [-d duration_ms] [-r readers,...] [-x deleters]
+ *                         [clip_bytes]
+ */
+
+#define MAX_CLIPS 1000
+#define MAX_CLIPS_BATCH 1100
+#define DELETER_SLEEP_US 10000
+#define MAX_PROCS 256
+
+static const char default_levels[] = "0,1,4,16";
+
+/**
+ * Open our own clip store on the snip file and content directory in @dir, so
+ * that we hold a separate open file description and hence a separate flock.
+ */
+static void open_store(const char *dir, struct clip_store *cs,
+                       struct cm_stats *stats) {
+    char path[PATH_MAX];
+    snprintf_safe(path, sizeof(path), "%s/line_cache", dir);
+    int snip_fd = open(path, O_RDWR | O_CLOEXEC);
+    int content_dir_fd = open(dir, O_RDONLY | O_CLOEXEC);
+    expect(snip_fd >= 0 && content_dir_fd >= 0);
+    expect(cs_init(cs, snip_fd, content_dir_fd) == 0);
+    cs->stats = stats;
+}
+
+static void _noreturn_ run_reader(const char *dir, struct cm_stats *stats) {
+    struct clip_store cs;
+    open_store(dir, &cs, stats);
+    char line[CS_SNIP_LINE_SIZE];
+    while (1) {
+        _drop_(cs_unref) struct ref_guard guard = cs_ref(&cs);
+        expect(guard.status == 0);
+        struct cs_snip *snip = NULL;
+        while (cs_snip_iter(&guard, CS_ITER_NEWEST_FIRST, &snip)) {
+            memcpy(line, snip->line, sizeof(line));
+        }
+    }
+}
+
+static enum cs_remove_action remove_tagged(uint64_t hash, const char *line,
+                                           void *private) {
+    (void)hash;
+    if (strncmp(line, "delete-me", 9) != 0) {
+        return CS_ACTION_KEEP;
+    }
+    (*(size_t *)private)++;
+    return CS_ACTION_REMOVE;
+}
+
+static void _noreturn_ run_deleter(const char *dir, struct cm_stats *stats) {
+    struct clip_store cs;
+    open_store(dir, &cs, stats);
+    size_t nr_removed = 0;
+    while (1) {
+        expect(cs_remove(&cs, CS_ITER_NEWEST_FIRST, remove_tagged,
+                         &nr_removed) == 0);
+        usleep(DELETER_SLEEP_US);
+    }
+}
+
+static pid_t spawn(void (*run)(const char *, struct cm_stats *),
+                   const char *dir, struct cm_stats *stats) {
+    pid_t pid = fork();
+    expect(pid >= 0);
+    if (pid == 0) {
+        run(dir, stats);
+    }
+    return pid;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile_us(const uint64_t *sorted, size_t nr, double q) {
+    return nr ? (double)sorted[(size_t)((double)(nr - 1) * q)] / 1e3 : 0;
+}
+
+/**
+ * Add clips for @duration_ms with @nr_readers readers and @nr_deleters
+ * deleters running, and print the results. Returns the writer's throughput
+ * in adds per second.
+ */
+static double run_level(size_t nr_readers, size_t nr_deleters,
+                        uint64_t duration_ms, size_t clip_bytes,
+                        double baseline, bool print_locks) {
+    struct bench_store bs;
+    bench_store_init(&bs);
+
+    char path[PATH_MAX];
+    snprintf_safe(path, sizeof(path), "%s/stats", bs.dir);
+    struct cm_stats *stats;
+    expect(stats_map(path, STATS_MAP_CREATE, &stats) == 0);
+    bs.cs.stats = stats;
+
+    // The mapping is shared, so children inherit it
+    pid_t pids[MAX_PROCS];
+    size_t nr_pids = 0;
+    for (size_t i = 0; i < nr_readers; i++) {
+        pids[nr_pids++] = spawn(run_reader, bs.dir, stats);
+    }
+    for (size_t i = 0; i < nr_deleters; i++) {
+        pids[nr_pids++] = spawn(run_deleter, bs.dir, stats);
+    }
+
+    _drop_(free) char *content = malloc(clip_bytes + 1);
+    size_t latency_alloc = 65536, nr_adds = 0;
+    _drop_(free) uint64_t *latency_ns =
+        malloc(latency_alloc * sizeof(*latency_ns));
+    expect(content && latency_ns);
+
+    uint64_t start = bench_now_ns(), end = start + duration_ms * 1000000;
+    uint64_t now = start;
+    while (now < end) {
+        // Every tenth clip is fodder for the deleters
+        size_t pos = (size_t)snprintf(content, clip_bytes + 1, "%s %zu ",
+                                      nr_adds % 10 ? "keep" : "delete-me",
+                                      nr_adds);
+        for (; pos < clip_bytes; pos++) {
+            content[pos] = (char)('a' + bench_rand() % 26);
+        }
+        content[clip_bytes] = '\0';
+
+        uint64_t add_start = bench_now_ns();
+        expect(cs_add(&bs.cs, content, 0, NULL) == 0);
+        size_t nr_clips;
+        expect(cs_len(&bs.cs, &nr_clips) == 0);
+        if (nr_clips > MAX_CLIPS_BATCH) {
+            expect(cs_trim(&bs.cs, CS_ITER_NEWEST_FIRST, MAX_CLIPS) == 0);
+        }
+        now = bench_now_ns();
+
+        if (nr_adds == latency_alloc) {
+            latency_alloc *= 2;
+            latency_ns =
+                realloc(latency_ns, latency_alloc * sizeof(*latency_ns));
+            expect(latency_ns);
+        }
+        latency_ns[nr_adds++] = now - add_start;
+    }
+    double rate = (double)nr_adds * 1e9 / (double)(now - start);
+
+    for (size_t i = 0; i < nr_pids; i++) {
+        expect(kill(pids[i], SIGKILL) == 0);
+        expect(waitpid(pids[i], NULL, 0) == pids[i]);
+    }
+
+    qsort(latency_ns, nr_adds, sizeof(*latency_ns), cmp_u64);
+    printf("%7zu %8zu %9.0f %+7.1f%% %9.1f %9.1f %9.1f\n", nr_readers,
+           nr_deleters, rate, baseline ? (rate - baseline) / baseline * 100 : 0,
+           percentile_us(latency_ns, nr_adds, 0.5),
+           percentile_us(latency_ns, nr_adds, 0.99),
+           percentile_us(latency_ns, nr_adds, 1));
+
+    if (print_locks) {
+        printf("\n");
+        stats_print(stats, stdout);
+    }
+
+    // The children were killed rather than exiting cleanly, so one may have
+    // died holding a reference, but the flock went with it
+    bs.cs.stats = NULL;
+    stats_unmap(stats);
+    bench_store_destroy(&bs);
+    return rate;
+}
+
+int main(int argc, char *argv[]) {
+    uint64_t duration_ms = 2000, nr_deleters = 1, clip_bytes = 256;
+    const char *levels_str = default_levels;
+    int opt;
+    while ((opt = getopt(argc, argv, "d:r:x:")) != -1) {
+        bool ok = true;
+        switch (opt) {
+            case 'd':
+                ok = str_to_uint64(optarg, &duration_ms) == 0 && duration_ms;
+                break;
+            case 'r':
+                levels_str = optarg;
+                break;
+            case 'x':
+                ok = str_to_uint64(optarg, &nr_deleters) == 0;
+                break;
+            default:
+                ok = false;
+        }
+        die_on(!ok,
+               "Usage: %s [-d duration_ms] [-r readers,...] [-x deleters] "
+               "[clip_bytes]\n",
+               argv[0]);
+    }
+    die_on(optind < argc && (str_to_uint64(argv[optind], &clip_bytes) < 0 ||
+                             clip_bytes < 32),
+           "Invalid clip size: %s\n", argv[optind]);
+
+    size_t levels[MAX_PROCS], nr_levels = 0;
+    _drop_(free) char *levels_copy = strdup(levels_str);
+    expect(levels_copy);
+    char *saveptr = NULL;
+    for (char *tok = strtok_r(levels_copy, ",", &saveptr); tok;
+         tok = strtok_r(NULL, ",", &saveptr)) {
+        uint64_t level;
+        die_on(str_to_uint64(tok, &level) < 0 ||
+                   level + nr_deleters > MAX_PROCS || nr_levels == MAX_PROCS,
+               "Invalid number of readers: %s\n", tok);
+        levels[nr_levels++] = (size_t)level;
+    }
+
+    printf("%7s %8s %9s %8s %9s %9s %9s\n", "readers", "deleters", "adds/s",
+           "change", "p50_us", "p99_us", "max_us");
+    double baseline = 0;
+    for (size_t i = 0; i < nr_levels; i++) {
+        // With no readers, the writer runs alone to give the baseline
+        size_t deleters = levels[i] ? (size_t)nr_deleters : 0;
+        double rate = run_level(levels[i], deleters, duration_ms,
+                                (size_t)clip_bytes, baseline,
+                                i + 1 == nr_levels);
+        baseline = baseline ? baseline : rate;
+    }
+    return 0;
+}
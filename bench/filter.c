@@ -0,0 +1,143 @@
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "filter.h"
+#include "store.h"
+#include "util.h"
+
+/**
+ * Benchmark cs_filter() against piping the same lines to `fzf --filter`.
+ *
+ * Usage: bench/filter [nr_clips...]
+ */
+
+#define NR_RUNS 5
+
+static const char *const words[] = {
+    "the",     "quick",    "brown",  "fox",     "jumps",   "over",
+    "lazy",    "dog",      "static", "const",   "return",  "struct",
+    "https",   "github",   "com",    "example", "config",  "window",
+    "monitor", "selection", "buffer", "kernel",  "memory",  "thread",
+    "password", "token",   "cargo",  "python",  "include", "printf",
+};
+
+static const char *const queries[] = {"fox", "cfgwin", "github.com/example",
+                                      "zzzz"};
+
+/**
+ * Generate a line of a few words, with a long tail of longer lines.
+ */
+static void random_line(char *out, size_t out_len) {
+    size_t nr_words = 2 + bench_rand() % 8;
+    if (bench_rand() % 10 == 0) {
+        nr_words += bench_rand() % 40;
+    }
+    size_t pos = 0;
+    for (size_t i = 0; i < nr_words; i++) {
+        const char *word = words[bench_rand() % arrlen(words)];
+        int ret = snprintf(out + pos, out_len - pos, "%s%s", i ? " " : "",
+                           word);
+        if (ret < 0 || (size_t)ret >= out_len - pos) {
+            break;
+        }
+        pos += (size_t)ret;
+    }
+    snprintf(out + pos, out_len - pos, " %" PRIu64, bench_rand() % 100000);
+}
+
+/**
+ * Time `fzf --filter` reading all lines from @lines_path, or return a
+ * negative value if fzf isn't available.
+ */
+static double time_fzf(const char *lines_path, const char *query) {
+    double start = bench_now_ms();
+    pid_t pid = fork();
+    expect(pid >= 0);
+    if (pid == 0) {
+        int in = open(lines_path, O_RDONLY);
+        int out = open("/dev/null", O_WRONLY);
+        expect(in >= 0 && out >= 0);
+        dup2(in, STDIN_FILENO);
+        dup2(out, STDOUT_FILENO);
+        execlp("fzf", "fzf", "--filter", query, (char *)NULL);
+        _exit(127);
+    }
+    int status;
+    expect(waitpid(pid, &status, 0) == pid);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) == 127) {
+        return -1;
+    }
+    return bench_now_ms() - start;
+}
+
+static void bench_one(size_t nr_clips) {
+    struct bench_store bs;
+    bench_store_init(&bs);
+
+    char lines_path[PATH_MAX];
+    snprintf_safe(lines_path, sizeof(lines_path), "%s.lines", bs.dir);
+    _drop_(fclose) FILE *lines = fopen(lines_path, "w");
+    expect(lines);
+
+    for (size_t i = 0; i < nr_clips; i++) {
+        char line[512];
+        random_line(line, sizeof(line));
+        expect(cs_add(&bs.cs, line, 0, NULL) == 0);
+        fprintf(lines, "%s\n", line);
+    }
+    expect(fflush(lines) == 0);
+
+    struct cs_match matches[FILTER_DEFAULT_LIMIT];
+    for (size_t q = 0; q < arrlen(queries); q++) {
+        double best = -1, fzf_best = -1;
+        size_t nr_matches = 0;
+        for (size_t run = 0; run < NR_RUNS; run++) {
+            double start = bench_now_ms();
+            expect(cs_filter(&bs.cs, queries[q], arrlen(matches), matches,
+                             &nr_matches) == 0);
+            double elapsed = bench_now_ms() - start;
+            best = best < 0 || elapsed < best ? elapsed : best;
+
+            double fzf = time_fzf(lines_path, queries[q]);
+            if (fzf >= 0) {
+                fzf_best = fzf_best < 0 || fzf < fzf_best ? fzf : fzf_best;
+            }
+        }
+        printf("%8zu clips  %-20s  cs_filter %9.3f ms (%zu matches)", nr_clips,
+               queries[q], best, nr_matches);
+        if (fzf_best >= 0) {
+            printf("  fzf --filter %9.3f ms\n", fzf_best);
+        } else {
+            printf("  fzf unavailable\n");
+        }
+    }
+
+    bench_store_destroy(&bs);
+    unlink(lines_path);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc == 1) {
+        const size_t defaults[] = {1000, 10000, 100000};
+        for (size_t i = 0; i < arrlen(defaults); i++) {
+            bench_one(defaults[i]);
+        }
+        return 0;
+    }
+
+    for (int i = 1; i < argc; i++) {
+        uint64_t nr_clips;
+        die_on(str_to_uint64(argv[i], &nr_clips) < 0, "Invalid count: %s\n",
+               argv[i]);
+        bench_one((size_t)nr_clips);
+    }
+    return 0;
+}
@@ -0,0 +1,381 @@
+#define _GNU_SOURCE
+
+#include <X11/Xatom.h>
+#include <X11/Xlib.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/select.h>
+
+#include "bench.h"
+#include "config.h"
+#include "trace.h"
+
+/**
+ * Load generator for clipmenud: own a selection on a real X server and change
+ * it over and over, the way Chromium floods PRIMARY during a drag or a script
+ * sets CLIPBOARD in a loop, then report what clipmenud made of it.
+ *
+ * What clipmenud stored is read back from its trace ring, matching the hash
+ * of each store against the hash of each content we offered. A change which
+ * is overtaken by a later one before being stored counts as dropped. Latency
+ * is from us taking ownership to clipmenud recording the store. Conversions
+ * are how many times clipmenud asked us for the content, which is fewer than
+ * the changes when it debounces the selection.
+ *
+ * This needs clipmenud running against the same display and cache directory,
+ * bench/xvfb.sh sets that up.
+ *
+ * Usage: bench/ingest [-n nr_changes] [-r changes_per_sec] [-s clip_bytes]
+ *                     [-p distinct|grow|shrink|repeat]
+ *                     [-S clipboard|primary] [-w settle_ms]
+ */
+
+#define PARTIAL_RUN 16 /* Changes per growing or shrinking selection */
+
+enum load_pattern {
+    LOAD_DISTINCT, /* A new, unrelated clip every time */
+    LOAD_GROW,     /* Prefixes of a clip getting longer, like a drag */
+    LOAD_SHRINK,   /* Prefixes of a clip getting shorter */
+    LOAD_REPEAT,   /* The same clip every time */
+};
+
+static const char *const pattern_names[] = {
+    [LOAD_DISTINCT] = "distinct",
+    [LOAD_GROW] = "grow",
+    [LOAD_SHRINK] = "shrink",
+    [LOAD_REPEAT] = "repeat",
+};
+
+static const char *const words[] = {"static", "const", "return", "buffer",
+                                    "kernel", "memory", "thread", "the",
+                                    "quick",  "brown",  "fox",    "jumps"};
+
+/**
+ * The state of the load generator.
+ *
+ * @dpy: The X display
+ * @win: The window owning the selection
+ * @selection: The selection being changed
+ * @targets: The TARGETS atom
+ * @utf8_string: The UTF8_STRING atom
+ * @content: The content currently being offered
+ * @content_len: The length of @content
+ * @tr: clipmenud's trace ring
+ * @trace_pos: The next trace record to look at
+ * @trace_lost: Trace records overwritten before we could read them
+ * @hashes: The hash of the content offered by each change
+ * @sent_ns: When each change took ownership, on the monotonic clock
+ * @latency_ns: For each stored change, how long it took to be stored
+ * @nr_sent: The number of changes made so far
+ * @match_pos: The first change not yet stored or given up on
+ * @nr_stored: Changes which clipmenud stored
+ * @nr_merged: Stored changes which replaced the previous clip as a partial
+ * @nr_dropped: Changes overtaken by a later one before being stored
+ * @nr_unmatched: Stores which matched no outstanding change, such as the
+ *                same content being fetched twice
+ */
+struct load {
+    Display *dpy;
+    Window win;
+    Atom selection;
+    Atom targets;
+    Atom utf8_string;
+    char *content;
+    size_t content_len;
+
+    struct cm_trace *tr;
+    uint64_t trace_pos;
+    uint64_t trace_lost;
+
+    uint64_t *hashes;
+    uint64_t *sent_ns;
+    uint64_t *latency_ns;
+    size_t nr_sent;
+    size_t match_pos;
+    size_t nr_stored;
+    size_t nr_merged;
+    size_t nr_dropped;
+    size_t nr_unmatched;
+    size_t nr_conversions;
+};
+
+/**
+ * Fill @out with @len bytes of word soup, tagged with @tag.
+ */
+static void fill_content(char *out, size_t len, size_t tag) {
+    size_t pos = (size_t)snprintf(out, len + 1, "ingest %zu ", tag);
+    pos = pos < len ? pos : len;
+    while (pos < len) {
+        const char *word = words[bench_rand() % arrlen(words)];
+        size_t word_len = strlen(word);
+        word_len = word_len < len - pos ? word_len : len - pos;
+        memcpy(out + pos, word, word_len);
+        pos += word_len;
+        if (pos < len) {
+            out[pos++] = bench_rand() % 12 ? ' ' : '\n';
+        }
+    }
+    out[len] = '\0';
+}
+
+/**
+ * Set up the content to offer for change @i. @base holds the full clip for
+ * the partial patterns, and is regenerated at the start of each run.
+ */
+static void next_content(struct load *ld, enum load_pattern pattern,
+                         size_t clip_bytes, char *base, size_t i) {
+    size_t step = i % PARTIAL_RUN;
+    switch (pattern) {
+        case LOAD_DISTINCT:
+            fill_content(ld->content, clip_bytes, i);
+            ld->content_len = clip_bytes;
+            return;
+        case LOAD_REPEAT:
+            if (i == 0) {
+                fill_content(ld->content, clip_bytes, 0);
+                ld->content_len = clip_bytes;
+            }
+            return;
+        case LOAD_GROW:
+        case LOAD_SHRINK:
+            if (step == 0) {
+                fill_content(base, clip_bytes, i / PARTIAL_RUN);
+            }
+            if (pattern == LOAD_SHRINK) {
+                step = PARTIAL_RUN - 1 - step;
+            }
+            ld->content_len = clip_bytes * (step + 1) / PARTIAL_RUN;
+            ld->content_len = ld->content_len ? ld->content_len : 1;
+            memcpy(ld->content, base, ld->content_len);
+            ld->content[ld->content_len] = '\0';
+            return;
+    }
+}
+
+/**
+ * Answer a request for the selection with whatever we are offering right now,
+ * the same way clipserve does.
+ */
+static void serve_request(struct load *ld, XSelectionRequestEvent *req) {
+    XSelectionEvent sev = {.type = SelectionNotify,
+                           .display = req->display,
+                           .requestor = req->requestor,
+                           .selection = req->selection,
+                           .time = req->time,
+                           .target = req->target,
+                           .property = req->property};
+
+    if (req->target == ld->targets) {
+        Atom available_targets[] = {ld->utf8_string, XA_STRING};
+        XChangeProperty(ld->dpy, req->requestor, req->property, XA_ATOM, 32,
+                        PropModeReplace, (unsigned char *)&available_targets,
+                        arrlen(available_targets));
+    } else if (req->target == ld->utf8_string || req->target == XA_STRING) {
+        XChangeProperty(ld->dpy, req->requestor, req->property, req->target,
+                        8, PropModeReplace, (unsigned char *)ld->content,
+                        (int)ld->content_len);
+    } else {
+        sev.property = None;
+    }
+    XSendEvent(ld->dpy, req->requestor, False, 0, (XEvent *)&sev);
+}
+
+/**
+ * Match a store recorded by clipmenud against the changes we made. Since
+ * clipmenud stores in order, any earlier change still outstanding will never
+ * be stored, so count it as dropped.
+ */
+static void match_store(struct load *ld, const struct trace_record *rec) {
+    for (size_t i = ld->match_pos; i < ld->nr_sent; i++) {
+        if (ld->hashes[i] != rec->hash || ld->sent_ns[i] > rec->ts_ns) {
+            continue;
+        }
+        ld->latency_ns[ld->nr_stored++] = rec->ts_ns - ld->sent_ns[i];
+        ld->nr_merged += rec->arg != 0;
+        ld->nr_dropped += i - ld->match_pos;
+        ld->match_pos = i + 1;
+        return;
+    }
+    ld->nr_unmatched++;
+}
+
+/**
+ * Read any new records from clipmenud's trace ring.
+ */
+static void drain_trace(struct load *ld) {
+    uint64_t head = __atomic_load_n(&ld->tr->head, __ATOMIC_ACQUIRE);
+    if (head - ld->trace_pos > TRACE_NR_RECORDS) {
+        ld->trace_lost += head - TRACE_NR_RECORDS - ld->trace_pos;
+        ld->trace_pos = head - TRACE_NR_RECORDS;
+    }
+    for (; ld->trace_pos < head; ld->trace_pos++) {
+        struct trace_record rec;
+        if (!trace_read(ld->tr, ld->trace_pos, &rec)) {
+            ld->trace_lost++;
+        } else if (rec.event == TRACE_STORE) {
+            match_store(ld, &rec);
+        } else if (rec.event == TRACE_CONVERT_REQUEST) {
+            ld->nr_conversions++;
+        }
+    }
+}
+
+/**
+ * Serve selection requests and follow the trace until @deadline_ns.
+ */
+static void pump(struct load *ld, uint64_t deadline_ns) {
+    int x_fd = ConnectionNumber(ld->dpy);
+    while (1) {
+        while (XPending(ld->dpy)) {
+            XEvent evt;
+            XNextEvent(ld->dpy, &evt);
+            if (evt.type == SelectionRequest) {
+                serve_request(ld, &evt.xselectionrequest);
+            }
+        }
+        drain_trace(ld);
+
+        uint64_t now = bench_now_ns();
+        if (now >= deadline_ns) {
+            return;
+        }
+        // Wake up now and then even without X events, to keep up with the
+        // trace ring
+        uint64_t wait_ns = deadline_ns - now < 10000000 ? deadline_ns - now
+                                                         : 10000000;
+        struct timeval tv = {.tv_sec = 0,
+                             .tv_usec = (suseconds_t)(wait_ns / 1000)};
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(x_fd, &fds);
+        expect(select(x_fd + 1, &fds, NULL, NULL, &tv) >= 0);
+    }
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile_ms(const uint64_t *sorted, size_t nr, double q) {
+    return nr ? (double)sorted[(size_t)((double)(nr - 1) * q)] / 1e6 : 0;
+}
+
+int main(int argc, char *argv[]) {
+    _drop_(config_free) struct config cfg = setup("bench-ingest");
+    uint64_t nr_changes = 1000, rate = 100, clip_bytes = 64, settle_ms = 1000;
+    enum load_pattern pattern = LOAD_DISTINCT;
+    const char *sel_name = "primary";
+    int opt;
+    while ((opt = getopt(argc, argv, "n:r:s:p:S:w:")) != -1) {
+        bool ok = true;
+        switch (opt) {
+            case 'n':
+                ok = str_to_uint64(optarg, &nr_changes) == 0 && nr_changes;
+                break;
+            case 'r':
+                ok = str_to_uint64(optarg, &rate) == 0;
+                break;
+            case 's':
+                ok = str_to_uint64(optarg, &clip_bytes) == 0 && clip_bytes;
+                break;
+            case 'w':
+                ok = str_to_uint64(optarg, &settle_ms) == 0;
+                break;
+            case 'S':
+                sel_name = optarg;
+                ok = streq(sel_name, "primary") || streq(sel_name, "clipboard");
+                break;
+            case 'p':
+                ok = false;
+                for (size_t i = 0; i < arrlen(pattern_names); i++) {
+                    if (streq(optarg, pattern_names[i])) {
+                        pattern = (enum load_pattern)i;
+                        ok = true;
+                    }
+                }
+                break;
+            default:
+                ok = false;
+        }
+        die_on(!ok,
+               "Usage: %s [-n nr_changes] [-r changes_per_sec] "
+               "[-s clip_bytes] [-p distinct|grow|shrink|repeat] "
+               "[-S clipboard|primary] [-w settle_ms]\n",
+               argv[0]);
+    }
+
+    struct load ld = {0};
+    int ret = trace_map(get_trace_path(&cfg), TRACE_MAP_READ, &ld.tr);
+    die_on(ret < 0, "Cannot read clipmenud's trace ring, is it running? %s\n",
+           strerror(-ret));
+    ld.trace_pos = __atomic_load_n(&ld.tr->head, __ATOMIC_ACQUIRE);
+
+    die_on(!(ld.dpy = XOpenDisplay(NULL)), "Cannot open display\n");
+    ld.win = XCreateSimpleWindow(ld.dpy, DefaultRootWindow(ld.dpy), 0, 0, 1, 1,
+                                 0, 0, 0);
+    XStoreName(ld.dpy, ld.win, "clipmenu-bench-ingest");
+    ld.selection = streq(sel_name, "primary")
+                       ? XA_PRIMARY
+                       : XInternAtom(ld.dpy, "CLIPBOARD", False);
+    ld.targets = XInternAtom(ld.dpy, "TARGETS", False);
+    ld.utf8_string = XInternAtom(ld.dpy, "UTF8_STRING", False);
+
+    _drop_(free) char *base = malloc(clip_bytes + 1);
+    _drop_(free) char *content = malloc(clip_bytes + 1);
+    _drop_(free) uint64_t *hashes = malloc(nr_changes * sizeof(*hashes));
+    _drop_(free) uint64_t *sent_ns = malloc(nr_changes * sizeof(*sent_ns));
+    _drop_(free) uint64_t *latency_ns =
+        malloc(nr_changes * sizeof(*latency_ns));
+    expect(base && content && hashes && sent_ns && latency_ns);
+    ld.content = content;
+    ld.hashes = hashes;
+    ld.sent_ns = sent_ns;
+    ld.latency_ns = latency_ns;
+
+    uint64_t interval_ns = rate ? 1000000000 / rate : 0;
+    uint64_t start = bench_now_ns(), deadline = start;
+    for (size_t i = 0; i < nr_changes; i++) {
+        next_content(&ld, pattern, clip_bytes, base, i);
+        hashes[i] = djb64_hash(ld.content);
+        XSetSelectionOwner(ld.dpy, ld.selection, ld.win, CurrentTime);
+        XFlush(ld.dpy);
+        sent_ns[i] = bench_now_ns();
+        ld.nr_sent = i + 1;
+
+        deadline += interval_ns;
+        pump(&ld, deadline);
+    }
+    uint64_t elapsed = bench_now_ns() - start;
+    pump(&ld, bench_now_ns() + settle_ms * 1000000);
+    ld.nr_dropped += ld.nr_sent - ld.match_pos;
+
+    qsort(latency_ns, ld.nr_stored, sizeof(*latency_ns), cmp_u64);
+    printf("%" PRIu64 " %s changes of %" PRIu64 " bytes to %s in %.1f ms "
+           "(%.0f/s)\n",
+           nr_changes, pattern_names[pattern], clip_bytes, sel_name,
+           (double)elapsed / 1e6, (double)nr_changes * 1e9 / (double)elapsed);
+    printf("converted %zu\n", ld.nr_conversions);
+    printf("stored    %zu\n", ld.nr_stored);
+    printf("merged    %zu\n", ld.nr_merged);
+    printf("dropped   %zu\n", ld.nr_dropped);
+    printf("unmatched %zu\n", ld.nr_unmatched);
+    printf("latency   p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+           percentile_ms(latency_ns, ld.nr_stored, 0.5),
+           percentile_ms(latency_ns, ld.nr_stored, 0.9),
+           percentile_ms(latency_ns, ld.nr_stored, 0.99),
+           percentile_ms(latency_ns, ld.nr_stored, 1));
+    if (ld.trace_lost) {
+        fprintf(stderr,
+                "Warning: %" PRIu64 " trace records were overwritten before "
+                "they were read, results are incomplete\n",
+                ld.trace_lost);
+    }
+
+    XCloseDisplay(ld.dpy);
+    trace_unmap(ld.tr);
+    return 0;
+}
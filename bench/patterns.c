@@ -0,0 +1,125 @@
+#define _GNU_SOURCE
+
+#include <inttypes.h>
+#include <regex.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+#include "pattern.h"
+
+/**
+ * Benchmark matching a list of regexes against every snip line, once with a
+ * regexec() per pattern per line and once with a compiled pattern set.
+ *
+ * Usage: bench/patterns [nr_clips [nr_patterns]]
+ */
+
+/**
+ * Count the lines matching any of @patterns, trying each regex against each
+ * line in turn the way a naive multi-pattern clipdel would.
+ */
+static size_t match_naive(struct clip_store *cs, char **patterns,
+                          size_t nr_patterns) {
+    _drop_(free) regex_t *rgxs = malloc(nr_patterns * sizeof(*rgxs));
+    expect(rgxs);
+    for (size_t i = 0; i < nr_patterns; i++) {
+        expect(regcomp(&rgxs[i], patterns[i], REG_EXTENDED | REG_NOSUB) == 0);
+    }
+
+    _drop_(cs_unref) struct ref_guard guard = cs_ref(cs);
+    expect(guard.status == 0);
+
+    size_t nr_matches = 0;
+    struct cs_snip *snip = NULL;
+    while (cs_snip_iter(&guard, CS_ITER_OLDEST_FIRST, &snip)) {
+        for (size_t i = 0; i < nr_patterns; i++) {
+            if (regexec(&rgxs[i], snip->line, 0, NULL, 0) == 0) {
+                nr_matches++;
+                break;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < nr_patterns; i++) {
+        regfree(&rgxs[i]);
+    }
+    return nr_matches;
+}
+
+/**
+ * Count the lines matching any of @patterns using a pattern set.
+ */
+static size_t match_set(struct clip_store *cs, char **patterns,
+                        size_t nr_patterns) {
+    _drop_(pattern_set_free) struct pattern_set set;
+    pattern_set_init(&set, false);
+    for (size_t i = 0; i < nr_patterns; i++) {
+        expect(pattern_set_add(&set, patterns[i]) == 0);
+    }
+    pattern_set_compile(&set);
+    _drop_(pattern_matcher_free) struct pattern_matcher m;
+    pattern_matcher_init(&m, &set);
+
+    _drop_(cs_unref) struct ref_guard guard = cs_ref(cs);
+    expect(guard.status == 0);
+
+    size_t nr_matches = 0;
+    struct cs_snip *snip = NULL;
+    while (cs_snip_iter(&guard, CS_ITER_OLDEST_FIRST, &snip)) {
+        nr_matches += pattern_match(&m, snip->line, strlen(snip->line));
+    }
+    return nr_matches;
+}
+
+int main(int argc, char *argv[]) {
+    uint64_t nr_clips = 20000, nr_patterns = 200;
+    die_on(argc > 3 || (argc > 1 && str_to_uint64(argv[1], &nr_clips) < 0) ||
+               (argc > 2 && str_to_uint64(argv[2], &nr_patterns) < 0) ||
+               nr_patterns == 0,
+           "Usage: %s [nr_clips [nr_patterns]]\n", argv[0]);
+
+    struct bench_store bs;
+    bench_store_init(&bs);
+
+    char line[CS_SNIP_LINE_SIZE];
+    for (size_t i = 0; i < nr_clips; i++) {
+        snprintf_safe(line, sizeof(line),
+                      "session=%016" PRIx64 " user=u%" PRIu64 " path=/srv/%zu",
+                      bench_rand(), bench_rand() % (nr_patterns * 20), i);
+        expect(cs_add(&bs.cs, line, 0, NULL) == 0);
+    }
+
+    // Mostly literal-anchored patterns, as a blocklist would be, plus one
+    // with no literal at all so the unfiltered path is exercised too
+    _drop_(free) char **patterns = calloc(nr_patterns, sizeof(*patterns));
+    expect(patterns);
+    for (size_t i = 0; i + 1 < nr_patterns; i++) {
+        patterns[i] = malloc(64);
+        expect(patterns[i]);
+        snprintf_safe(patterns[i], 64, "user=u%zu0 path=/srv/[0-9]+$", i);
+    }
+    patterns[nr_patterns - 1] = strdup("^[0-9]+$");
+    expect(patterns[nr_patterns - 1]);
+
+    double start = bench_now_ms();
+    size_t nr_naive = match_naive(&bs.cs, patterns, nr_patterns);
+    double naive_ms = bench_now_ms() - start;
+
+    start = bench_now_ms();
+    size_t nr_set = match_set(&bs.cs, patterns, nr_patterns);
+    double set_ms = bench_now_ms() - start;
+
+    expect(nr_naive == nr_set);
+    printf("%" PRIu64 " snips, %" PRIu64 " patterns, %zu matches\n", nr_clips,
+           nr_patterns, nr_set);
+    printf("per-pattern regexec %9.1f ms\n", naive_ms);
+    printf("pattern set         %9.1f ms\n", set_ms);
+
+    for (size_t i = 0; i < nr_patterns; i++) {
+        free(patterns[i]);
+    }
+    bench_store_destroy(&bs);
+    return 0;
+}
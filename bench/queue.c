@@ -0,0 +1,187 @@
+#define _GNU_SOURCE
+
+#include <getopt.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bench.h"
+#include "spsc.h"
+
+/**
+ * Benchmark how long handing a clip to storage holds up the thread reading X
+ * events, when storing is slow. Clips arrive at a fixed rate. Each store
+ * takes store_us, and every trim_every'th one also trims, taking trim_us.
+ *
+ * "inline" stores each clip on the thread it arrived on, the way clipmenud
+ * used to. "queue" hands it to a storage thread through the SPSC queue,
+ * holding the newest clip back when the queue is full like clipmenud does, so
+ * only the handoff is timed. Held back clips replaced by newer ones are
+ * counted as dropped.
+ *
+ * Usage: bench/queue [-n nr_clips] [-i interval_us] [-s store_us]
+ *                    [-t trim_us] [-e trim_every] [-q queue_size]
+ */
+
+#define CONSUMER_POLL_NS 10000 /* How long the consumer sleeps when idle */
+
+struct options {
+    uint64_t nr_clips;
+    uint64_t interval_us;
+    uint64_t store_us;
+    uint64_t trim_us;
+    uint64_t trim_every;
+    uint64_t queue_size;
+};
+
+struct consumer {
+    const struct options *opts;
+    struct spsc_queue q;
+    atomic_bool done;
+    uint64_t nr_stored;
+};
+
+/**
+ * Sleep until @when_ns on the CLOCK_MONOTONIC clock, giving up the CPU to the
+ * other thread, as clipmenud's threads do while they wait in select().
+ */
+static void sleep_until_ns(uint64_t when_ns) {
+    struct timespec ts = {.tv_sec = (time_t)(when_ns / 1000000000),
+                          .tv_nsec = (long)(when_ns % 1000000000)};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0) {
+    }
+}
+
+static void spin_us(uint64_t us) {
+    uint64_t until = bench_now_ns() + us * 1000;
+    while (bench_now_ns() < until) {
+    }
+}
+
+/**
+ * Do the work of storing clip number @seq.
+ */
+static void store(const struct options *opts, uint64_t seq) {
+    spin_us(opts->store_us);
+    if (opts->trim_every && seq % opts->trim_every == 0) {
+        spin_us(opts->trim_us);
+    }
+}
+
+static void *consumer_run(void *arg) {
+    struct consumer *c = arg;
+    while (1) {
+        bool done = atomic_load(&c->done);
+        void *item;
+        while ((item = spsc_queue_pop(&c->q))) {
+            store(c->opts, (uint64_t)(uintptr_t)item);
+            c->nr_stored++;
+        }
+        if (done) {
+            return NULL;
+        }
+        sleep_until_ns(bench_now_ns() + CONSUMER_POLL_NS);
+    }
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile_us(const uint64_t *sorted, size_t nr, double q) {
+    return nr ? (double)sorted[(size_t)((double)(nr - 1) * q)] / 1e3 : 0;
+}
+
+static void print_row(const char *name, uint64_t *latency_ns, size_t nr,
+                      uint64_t nr_stored, uint64_t nr_dropped) {
+    qsort(latency_ns, nr, sizeof(*latency_ns), cmp_u64);
+    printf("%-7s %9.1f %9.1f %9.1f %8" PRIu64 " %8" PRIu64 "\n", name,
+           percentile_us(latency_ns, nr, 0.5),
+           percentile_us(latency_ns, nr, 0.99),
+           percentile_us(latency_ns, nr, 1), nr_stored, nr_dropped);
+}
+
+static void run_inline(const struct options *opts, uint64_t *latency_ns) {
+    uint64_t next = bench_now_ns();
+    for (uint64_t i = 1; i <= opts->nr_clips; i++) {
+        next += opts->interval_us * 1000;
+        uint64_t start = bench_now_ns();
+        store(opts, i);
+        latency_ns[i - 1] = bench_now_ns() - start;
+        sleep_until_ns(next);
+    }
+    print_row("inline", latency_ns, opts->nr_clips, opts->nr_clips, 0);
+}
+
+static void run_queue(const struct options *opts, uint64_t *latency_ns) {
+    struct consumer c = {.opts = opts};
+    expect(spsc_queue_init(&c.q, opts->queue_size) == 0);
+    atomic_init(&c.done, false);
+    pthread_t thread;
+    expect(pthread_create(&thread, NULL, consumer_run, &c) == 0);
+
+    uint64_t held = 0, nr_dropped = 0;
+    uint64_t next = bench_now_ns();
+    for (uint64_t i = 1; i <= opts->nr_clips; i++) {
+        next += opts->interval_us * 1000;
+        uint64_t start = bench_now_ns();
+        if (held && spsc_queue_push(&c.q, (void *)(uintptr_t)held)) {
+            held = 0;
+        }
+        if (held || !spsc_queue_push(&c.q, (void *)(uintptr_t)i)) {
+            nr_dropped += held != 0;
+            held = i;
+        }
+        latency_ns[i - 1] = bench_now_ns() - start;
+        sleep_until_ns(next);
+    }
+    while (held && !spsc_queue_push(&c.q, (void *)(uintptr_t)held)) {
+        sleep_until_ns(bench_now_ns() + CONSUMER_POLL_NS);
+    }
+
+    atomic_store(&c.done, true);
+    expect(pthread_join(thread, NULL) == 0);
+    spsc_queue_free(&c.q);
+    print_row("queue", latency_ns, opts->nr_clips, c.nr_stored, nr_dropped);
+}
+
+int main(int argc, char *argv[]) {
+    struct options opts = {.nr_clips = 20000,
+                           .interval_us = 50,
+                           .store_us = 20,
+                           .trim_us = 5000,
+                           .trim_every = 1000,
+                           .queue_size = 64};
+    int opt;
+    while ((opt = getopt(argc, argv, "n:i:s:t:e:q:")) != -1) {
+        uint64_t *out = opt == 'n'   ? &opts.nr_clips
+                        : opt == 'i' ? &opts.interval_us
+                        : opt == 's' ? &opts.store_us
+                        : opt == 't' ? &opts.trim_us
+                        : opt == 'e' ? &opts.trim_every
+                        : opt == 'q' ? &opts.queue_size
+                                     : NULL;
+        die_on(!out || str_to_uint64(optarg, out) < 0,
+               "Usage: %s [-n nr_clips] [-i interval_us] [-s store_us] "
+               "[-t trim_us] [-e trim_every] [-q queue_size]\n",
+               argv[0]);
+    }
+    die_on(opts.nr_clips == 0, "nr_clips must be positive\n");
+
+    _drop_(free) uint64_t *latency_ns =
+        malloc(opts.nr_clips * sizeof(*latency_ns));
+    expect(latency_ns);
+
+    printf("%" PRIu64 " clips every %" PRIu64 "us, storing takes %" PRIu64
+           "us, trimming %" PRIu64 "us every %" PRIu64 " clips\n\n",
+           opts.nr_clips, opts.interval_us, opts.store_us, opts.trim_us,
+           opts.trim_every);
+    printf("%-7s %9s %9s %9s %8s %8s\n", "handoff", "p50_us", "p99_us",
+           "max_us", "stored", "dropped");
+    run_inline(&opts, latency_ns);
+    run_queue(&opts, latency_ns);
+    return 0;
+}
@@ -0,0 +1,103 @@
+#define _GNU_SOURCE
+
+#include <inttypes.h>
+#include <regex.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+#include "scan.h"
+
+/**
+ * Benchmark matching a regex against the full content of every clip, with a
+ * single worker and with one worker per core.
+ *
+ * Usage: bench/scan [nr_clips [clip_bytes]]
+ */
+
+static const char *const words[] = {"static", "const", "return", "buffer",
+                                    "kernel", "memory", "thread", "the",
+                                    "quick",  "brown",  "fox",    "jumps"};
+
+static void random_content(char *out, size_t len) {
+    size_t pos = 0;
+    while (pos + 1 < len) {
+        const char *word = words[bench_rand() % arrlen(words)];
+        size_t word_len = strlen(word);
+        if (pos + word_len + 2 > len) {
+            break;
+        }
+        memcpy(out + pos, word, word_len);
+        pos += word_len;
+        out[pos++] = bench_rand() % 12 ? ' ' : '\n';
+    }
+    out[pos] = '\0';
+}
+
+static bool match_rgx(const char *data, size_t len, void *private) {
+    regmatch_t bounds = {.rm_so = 0, .rm_eo = (regoff_t)len};
+    return regexec(private, data, 1, &bounds, REG_STARTEND) == 0;
+}
+
+static void bench_scan(struct clip_store *cs, size_t nr_clips,
+                       size_t clip_bytes) {
+    const char *pattern = "^key=AKIA[0-9]+$";
+    _drop_(cs_unref) struct ref_guard guard = cs_ref(cs);
+    expect(guard.status == 0);
+    _drop_(free) bool *out = calloc(nr_clips + 1, sizeof(*out));
+    expect(out);
+
+    regex_t rgx;
+    expect(regcomp(&rgx, pattern, REG_EXTENDED | REG_NOSUB | REG_NEWLINE) ==
+           0);
+    void *single[] = {&rgx};
+    double start = bench_now_ms();
+    expect(cs_content_scan(cs, match_rgx, single, 1, out) == 0);
+    double single_ms = bench_now_ms() - start;
+    regfree(&rgx);
+
+    size_t nr_workers = scan_nr_workers(nr_clips);
+    start = bench_now_ms();
+    _drop_(pattern_set_free) struct pattern_set set;
+    pattern_set_init(&set, true);
+    expect(pattern_set_add(&set, pattern) == 0);
+    pattern_set_compile(&set);
+    expect(cs_content_match_patterns(cs, &set, out) == 0);
+    double pool_ms = bench_now_ms() - start;
+
+    size_t nr_matches = 0;
+    for (size_t i = 0; i < nr_clips; i++) {
+        nr_matches += out[i];
+    }
+    double mib = (double)(nr_clips * clip_bytes) / (1024.0 * 1024.0);
+    printf("%zu clips, %.0f MiB, %zu matches\n", nr_clips, mib, nr_matches);
+    printf("1 worker    %9.1f ms (%6.0f MiB/s)\n", single_ms,
+           mib / single_ms * 1000.0);
+    printf("%-3zu workers %9.1f ms (%6.0f MiB/s)\n", nr_workers, pool_ms,
+           mib / pool_ms * 1000.0);
+}
+
+int main(int argc, char *argv[]) {
+    uint64_t nr_clips = 20000, clip_bytes = 4096;
+    die_on(argc > 3 || (argc > 1 && str_to_uint64(argv[1], &nr_clips) < 0) ||
+               (argc > 2 && str_to_uint64(argv[2], &clip_bytes) < 0),
+           "Usage: %s [nr_clips [clip_bytes]]\n", argv[0]);
+
+    struct bench_store bs;
+    bench_store_init(&bs);
+
+    _drop_(free) char *content = malloc(clip_bytes + 1);
+    expect(content);
+    for (size_t i = 0; i < nr_clips; i++) {
+        random_content(content, clip_bytes + 1);
+        if (i % 1000 == 0) {
+            snprintf_safe(content, clip_bytes + 1, "key=AKIA%012zu\n", i);
+        }
+        expect(cs_add(&bs.cs, content, 0, NULL) == 0);
+    }
+
+    bench_scan(&bs.cs, (size_t)nr_clips, (size_t)clip_bytes);
+    bench_store_destroy(&bs);
+    return 0;
+}
@@ -0,0 +1,117 @@
+#define _GNU_SOURCE
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+#include "index.h"
+
+/**
+ * Benchmark cs_search() against scanning the content of every clip.
+ *
+ * Usage: bench/search [nr_clips [clip_bytes]]
+ */
+
+#define NR_RUNS 5
+
+static const char *const words[] = {
+    "static",  "const",   "return",    "struct",  "https://",  "github",
+    "example", "config",  "window",    "monitor", "selection", "buffer",
+    "kernel",  "memory",  "thread",    "cargo",   "python",    "include",
+    "printf",  "the",     "quick",     "brown",   "fox",       "jumps",
+};
+
+/**
+ * Fill @out with @len bytes of word soup, tagged with a token unique to this
+ * clip so that queries can target exactly one clip.
+ */
+static void random_content(char *out, size_t len, size_t clip_idx) {
+    size_t pos = (size_t)snprintf(out, len, "clip-%zu-token\n", clip_idx);
+    while (pos + 1 < len) {
+        const char *word = words[bench_rand() % arrlen(words)];
+        size_t word_len = strlen(word);
+        if (pos + word_len + 2 > len) {
+            break;
+        }
+        memcpy(out + pos, word, word_len);
+        pos += word_len;
+        out[pos++] = bench_rand() % 12 ? ' ' : '\n';
+    }
+    out[pos] = '\0';
+}
+
+/**
+ * Count the clips containing @query by mapping and scanning every one, the
+ * way we would have to without an index.
+ */
+static size_t scan_all(struct clip_store *cs, const char *query) {
+    _drop_(cs_unref) struct ref_guard guard = cs_ref(cs);
+    expect(guard.status == 0);
+
+    size_t nr_matches = 0;
+    struct cs_snip *snip = NULL;
+    while (cs_snip_iter(&guard, CS_ITER_NEWEST_FIRST, &snip)) {
+        _drop_(cs_content_unmap) struct cs_content content;
+        if (cs_content_get(cs, snip->hash, &content) == 0 &&
+            memmem(content.data, (size_t)content.size, query, strlen(query))) {
+            nr_matches++;
+        }
+    }
+    return nr_matches;
+}
+
+int main(int argc, char *argv[]) {
+    uint64_t nr_clips = 20000, clip_bytes = 4096;
+    die_on(argc > 3 || (argc > 1 && str_to_uint64(argv[1], &nr_clips) < 0) ||
+               (argc > 2 && str_to_uint64(argv[2], &clip_bytes) < 0),
+           "Usage: %s [nr_clips [clip_bytes]]\n", argv[0]);
+
+    struct bench_store bs;
+    bench_store_init(&bs);
+
+    _drop_(free) char *content = malloc(clip_bytes + 1);
+    expect(content);
+    for (size_t i = 0; i < nr_clips; i++) {
+        random_content(content, clip_bytes + 1, i);
+        expect(cs_add(&bs.cs, content, 0, NULL) == 0);
+    }
+
+    char unique[64];
+    snprintf_safe(unique, sizeof(unique), "clip-%" PRIu64 "-token",
+                  nr_clips / 2);
+    const char *queries[] = {unique, "fox jumps", "monitor selection",
+                             "not in any clip"};
+
+    _drop_(free) size_t *out = malloc(nr_clips * sizeof(*out));
+    expect(out);
+    size_t nr_out;
+
+    double start = bench_now_ms();
+    expect(cs_search(&bs.cs, "", 0, out, &nr_out) == 0);
+    printf("%" PRIu64 " clips of %" PRIu64 " bytes, index built in %.1f ms\n",
+           nr_clips, clip_bytes, bench_now_ms() - start);
+
+    for (size_t q = 0; q < arrlen(queries); q++) {
+        double best = -1;
+        for (size_t run = 0; run < NR_RUNS; run++) {
+            start = bench_now_ms();
+            expect(cs_search(&bs.cs, queries[q], INDEX_DEFAULT_LIMIT, out,
+                             &nr_out) == 0);
+            double elapsed = bench_now_ms() - start;
+            best = best < 0 || elapsed < best ? elapsed : best;
+        }
+
+        start = bench_now_ms();
+        size_t nr_scanned = scan_all(&bs.cs, queries[q]);
+        double scan = bench_now_ms() - start;
+
+        printf("%-20s  cs_search %9.3f ms (%zu matches)  full scan %9.3f ms "
+               "(%zu matches)\n",
+               queries[q], best, nr_out, scan, nr_scanned);
+    }
+
+    bench_store_destroy(&bs);
+    return 0;
+}
@@ -0,0 +1,351 @@
+#define _GNU_SOURCE
+
+#include <X11/Xatom.h>
+#include <X11/Xlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/select.h>
+#include <sys/wait.h>
+
+#include "bench.h"
+#include "config.h"
+
+/**
+ * Benchmark how quickly clipserve answers selection requests: start it for
+ * clips of several sizes, and have one or more requestors, each with its own
+ * X connection, convert CLIPBOARD to TARGETS, UTF8_STRING and STRING as fast
+ * as it answers. Latency is from sending the ConvertSelection to receiving
+ * the SelectionNotify.
+ *
+ * clipserve and the clip store are found the same way as for the other
+ * clipmenu tools, bench/xvfb.sh sets up a suitable environment.
+ *
+ * Usage: bench/serve [-n nr_requests] [-c concurrency,...] [clip_bytes...]
+ */
+
+#define MAX_REQUESTORS 64
+#define REPLY_TIMEOUT_SECS 5
+
+static const uint64_t default_sizes[] = {64, 4096, 65536, 1048576};
+static const char default_concurrency[] = "1,4,16";
+
+static const char *const words[] = {"static", "const", "return", "buffer",
+                                    "kernel", "memory", "thread", "the",
+                                    "quick",  "brown",  "fox",    "jumps"};
+
+/**
+ * A client asking clipserve for the selection.
+ *
+ * @dpy: The requestor's own X connection
+ * @win: The window to receive the selection on
+ * @prop: The property to receive the selection in
+ * @sent_ns: When the outstanding request was sent, or 0 if there is none
+ */
+struct requestor {
+    Display *dpy;
+    Window win;
+    Atom prop;
+    uint64_t sent_ns;
+};
+
+DEFINE_DROP_FUNC_VOID(XFree)
+
+/**
+ * The owner we ask for the title of may be gone by the time we ask.
+ */
+static int ignore_bad_window(Display *dpy _unused_, XErrorEvent *ee) {
+    die_on(ee->error_code != BadWindow, "X error with request code=%d, "
+           "error code=%d\n", ee->request_code, ee->error_code);
+    return 0;
+}
+
+static void fill_content(char *out, size_t len) {
+    size_t pos = 0;
+    while (pos < len) {
+        const char *word = words[bench_rand() % arrlen(words)];
+        size_t word_len = strlen(word);
+        word_len = word_len < len - pos ? word_len : len - pos;
+        memcpy(out + pos, word, word_len);
+        pos += word_len;
+        if (pos < len) {
+            out[pos++] = bench_rand() % 12 ? ' ' : '\n';
+        }
+    }
+    out[len] = '\0';
+}
+
+/**
+ * Add a clip of @size bytes to the clip store, returning its hash.
+ */
+static uint64_t add_clip(struct config *cfg, size_t size) {
+    _drop_(close) int content_dir_fd = open(get_cache_dir(cfg), O_RDONLY);
+    _drop_(close) int snip_fd =
+        open(get_line_cache_path(cfg), O_RDWR | O_CREAT, 0600);
+    expect(content_dir_fd >= 0 && snip_fd >= 0);
+    _drop_(cs_destroy) struct clip_store cs;
+    expect(cs_init(&cs, snip_fd, content_dir_fd) == 0);
+
+    _drop_(free) char *content = malloc(size + 1);
+    expect(content);
+    fill_content(content, size);
+    uint64_t hash;
+    expect(cs_add(&cs, content, 0, &hash) == 0);
+    return hash;
+}
+
+/**
+ * Start clipserve for @hash, and wait until it owns CLIPBOARD.
+ *
+ * @dpy: The X display
+ * @clipboard: The CLIPBOARD atom
+ * @hash: The hash of the clip to serve
+ * @out_owner: Output for clipserve's window
+ */
+static pid_t start_clipserve(Display *dpy, Atom clipboard, uint64_t hash,
+                             Window *out_owner) {
+    char hash_str[UINT64_MAX_STRLEN + 1];
+    snprintf_safe(hash_str, sizeof(hash_str), "%" PRIu64, hash);
+
+    pid_t pid = fork();
+    expect(pid >= 0);
+    if (pid == 0) {
+        execlp("clipserve", "clipserve", hash_str, (char *)NULL);
+        die("Failed to run clipserve: %s\n", strerror(errno));
+    }
+
+    uint64_t deadline = bench_now_ns() + REPLY_TIMEOUT_SECS * 1000000000ULL;
+    while (bench_now_ns() < deadline) {
+        Window owner = XGetSelectionOwner(dpy, clipboard);
+        _drop_(XFree) char *title = NULL;
+        if (owner != None) {
+            XFetchName(dpy, owner, &title);
+        }
+        if (title && streq(title, "clipserve")) {
+            *out_owner = owner;
+            return pid;
+        }
+        usleep(1000);
+    }
+    die("clipserve didn't take ownership of CLIPBOARD\n");
+}
+
+/**
+ * Stop clipserve, and wait until the X server has noticed, so that the next
+ * clipserve isn't mistaken for this one.
+ */
+static void stop_clipserve(Display *dpy, Atom clipboard, pid_t pid,
+                           Window owner) {
+    expect(kill(pid, SIGTERM) == 0);
+    expect(waitpid(pid, NULL, 0) == pid);
+    while (XGetSelectionOwner(dpy, clipboard) == owner) {
+        usleep(1000);
+    }
+}
+
+static void send_request(struct requestor *req, Atom clipboard, Atom target) {
+    XConvertSelection(req->dpy, clipboard, target, req->prop, req->win,
+                      CurrentTime);
+    XFlush(req->dpy);
+    req->sent_ns = bench_now_ns();
+}
+
+/**
+ * Handle any events on @req's connection. Returns true if its outstanding
+ * request was answered.
+ */
+static bool handle_reply(struct requestor *req, uint64_t *latency_ns) {
+    bool answered = false;
+    while (XPending(req->dpy)) {
+        XEvent evt;
+        XNextEvent(req->dpy, &evt);
+        if (evt.type != SelectionNotify || !req->sent_ns) {
+            continue;
+        }
+        *latency_ns = bench_now_ns() - req->sent_ns;
+        req->sent_ns = 0;
+        answered = true;
+        die_on(evt.xselection.property == None,
+               "clipserve refused a conversion\n");
+
+        // Read and delete the reply, as a pasting client would, so the next
+        // request starts from a clean slate
+        Atom type;
+        int format;
+        unsigned long nitems, bytes_after;
+        unsigned char *data = NULL;
+        XGetWindowProperty(req->dpy, req->win, req->prop, 0, ~0L, True,
+                           AnyPropertyType, &type, &format, &nitems,
+                           &bytes_after, &data);
+        if (data) {
+            XFree(data);
+        }
+    }
+    return answered;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile_us(const uint64_t *sorted, size_t nr, double q) {
+    return (double)sorted[(size_t)((double)(nr - 1) * q)] / 1e3;
+}
+
+/**
+ * Convert CLIPBOARD to @target @nr_requests times, with @nr_reqs requestors
+ * each keeping one request in flight, and print the latency distribution.
+ */
+static void run_requests(struct requestor *reqs, size_t nr_reqs,
+                         Atom clipboard, Atom target, const char *target_name,
+                         size_t size, size_t nr_requests) {
+    _drop_(free) uint64_t *latency_ns =
+        malloc(nr_requests * sizeof(*latency_ns));
+    expect(latency_ns);
+
+    size_t nr_sent = 0, nr_done = 0;
+    uint64_t start = bench_now_ns();
+    for (size_t i = 0; i < nr_reqs && nr_sent < nr_requests; i++) {
+        send_request(&reqs[i], clipboard, target);
+        nr_sent++;
+    }
+
+    while (nr_done < nr_requests) {
+        fd_set fds;
+        int max_fd = -1;
+        FD_ZERO(&fds);
+        for (size_t i = 0; i < nr_reqs; i++) {
+            int fd = ConnectionNumber(reqs[i].dpy);
+            FD_SET(fd, &fds);
+            max_fd = fd > max_fd ? fd : max_fd;
+        }
+        struct timeval tv = {.tv_sec = REPLY_TIMEOUT_SECS};
+        int ret = select(max_fd + 1, &fds, NULL, NULL, &tv);
+        expect(ret >= 0);
+        die_on(ret == 0, "clipserve stopped answering\n");
+
+        for (size_t i = 0; i < nr_reqs; i++) {
+            if (!FD_ISSET(ConnectionNumber(reqs[i].dpy), &fds) ||
+                !handle_reply(&reqs[i], &latency_ns[nr_done])) {
+                continue;
+            }
+            nr_done++;
+            if (nr_sent < nr_requests) {
+                send_request(&reqs[i], clipboard, target);
+                nr_sent++;
+            }
+        }
+    }
+    uint64_t elapsed = bench_now_ns() - start;
+
+    qsort(latency_ns, nr_requests, sizeof(*latency_ns), cmp_u64);
+    printf("%8zu %4zu %-11s %9.1f %9.1f %9.1f %9.1f %9.0f\n", size, nr_reqs,
+           target_name, percentile_us(latency_ns, nr_requests, 0.5),
+           percentile_us(latency_ns, nr_requests, 0.9),
+           percentile_us(latency_ns, nr_requests, 0.99),
+           percentile_us(latency_ns, nr_requests, 1),
+           (double)nr_requests * 1e9 / (double)elapsed);
+}
+
+int main(int argc, char *argv[]) {
+    _drop_(config_free) struct config cfg = setup("bench-serve");
+    uint64_t nr_requests = 1000;
+    const char *concurrency = default_concurrency;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:c:")) != -1) {
+        switch (opt) {
+            case 'n':
+                die_on(str_to_uint64(optarg, &nr_requests) < 0 ||
+                           nr_requests == 0,
+                       "Invalid number of requests: %s\n", optarg);
+                break;
+            case 'c':
+                concurrency = optarg;
+                break;
+            default:
+                die("Usage: %s [-n nr_requests] [-c concurrency,...] "
+                    "[clip_bytes...]\n",
+                    argv[0]);
+        }
+    }
+
+    size_t levels[MAX_REQUESTORS], nr_levels = 0, max_level = 0;
+    _drop_(free) char *conc = strdup(concurrency);
+    expect(conc);
+    char *saveptr = NULL;
+    for (char *tok = strtok_r(conc, ",", &saveptr); tok;
+         tok = strtok_r(NULL, ",", &saveptr)) {
+        uint64_t level;
+        die_on(str_to_uint64(tok, &level) < 0 || level == 0 ||
+                   level > MAX_REQUESTORS || nr_levels == MAX_REQUESTORS,
+               "Invalid concurrency: %s\n", tok);
+        levels[nr_levels++] = (size_t)level;
+        max_level = level > max_level ? (size_t)level : max_level;
+    }
+
+    size_t nr_sizes = optind < argc ? (size_t)(argc - optind)
+                                    : arrlen(default_sizes);
+    _drop_(free) uint64_t *sizes = malloc(nr_sizes * sizeof(*sizes));
+    expect(sizes);
+    for (size_t i = 0; i < nr_sizes; i++) {
+        if (optind < argc) {
+            die_on(str_to_uint64(argv[optind + (int)i], &sizes[i]) < 0,
+                   "Invalid clip size: %s\n", argv[optind + (int)i]);
+        } else {
+            sizes[i] = default_sizes[i];
+        }
+    }
+
+    Display *dpy = XOpenDisplay(NULL);
+    die_on(!dpy, "Cannot open display\n");
+    XSetErrorHandler(ignore_bad_window);
+    Atom clipboard = XInternAtom(dpy, "CLIPBOARD", False);
+    const struct {
+        Atom atom;
+        const char *name;
+    } targets[] = {
+        {XInternAtom(dpy, "TARGETS", False), "TARGETS"},
+        {XInternAtom(dpy, "UTF8_STRING", False), "UTF8_STRING"},
+        {XA_STRING, "STRING"},
+    };
+
+    struct requestor reqs[MAX_REQUESTORS];
+    for (size_t i = 0; i < max_level; i++) {
+        reqs[i].dpy = XOpenDisplay(NULL);
+        die_on(!reqs[i].dpy, "Cannot open display\n");
+        reqs[i].win =
+            XCreateSimpleWindow(reqs[i].dpy, DefaultRootWindow(reqs[i].dpy),
+                                0, 0, 1, 1, 0, 0, 0);
+        reqs[i].prop = XInternAtom(reqs[i].dpy, "CLIPMENU_BENCH", False);
+        reqs[i].sent_ns = 0;
+        XFlush(reqs[i].dpy);
+    }
+
+    printf("%8s %4s %-11s %9s %9s %9s %9s %9s\n", "bytes", "conc", "target",
+           "p50_us", "p90_us", "p99_us", "max_us", "req/s");
+    for (size_t s = 0; s < nr_sizes; s++) {
+        uint64_t hash = add_clip(&cfg, (size_t)sizes[s]);
+        Window owner;
+        pid_t pid = start_clipserve(dpy, clipboard, hash, &owner);
+        for (size_t l = 0; l < nr_levels; l++) {
+            for (size_t t = 0; t < arrlen(targets); t++) {
+                run_requests(reqs, levels[l], clipboard, targets[t].atom,
+                             targets[t].name, (size_t)sizes[s],
+                             (size_t)nr_requests);
+            }
+        }
+        stop_clipserve(dpy, clipboard, pid, owner);
+    }
+
+    for (size_t i = 0; i < max_level; i++) {
+        XCloseDisplay(reqs[i].dpy);
+    }
+    XCloseDisplay(dpy);
+    return 0;
+}
@@ -0,0 +1,412 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+
+/**
+ * Microbenchmarks for the clip store primitives, at several store sizes.
+ *
+ * Results are written as JSON, one result per line, so that they can be saved
+ * and passed back with -b to compare against. Any operation which got more
+ * than the threshold slower than in the baseline is reported, and makes us
+ * exit non-zero.
+ *
+ * Without any sizes, stores of 1000, 10000 and 100000 clips are benchmarked.
+ * Bigger ones can be passed through make, e.g. BENCH_STORE_ARGS=1000000.
+ *
+ * Usage: bench/store [-o out.json] [-b baseline.json] [-t threshold_pct]
+ *                    [nr_clips...]
+ */
+
+#define NR_RUNS 5           /* Runs of the cheap benchmarks, best is kept */
+#define NR_POOL 1024        /* Pregenerated clips for the non-store ops */
+#define NR_RANDOM_OPS 10000 /* Cap on the number of random lookups */
+#define NR_REPLACES 1000    /* Cap on the number of replacements */
+#define MAX_CLIP_SIZE 65536
+
+/* A million clips take about 1.5GB on disk, so those are only run on request */
+static const uint64_t default_sizes[] = {1000, 10000, 100000};
+
+static const char *const words[] = {
+    "static",  "const",   "return",    "struct",  "https://",  "github",
+    "example", "config",  "window",    "monitor", "selection", "buffer",
+    "kernel",  "memory",  "thread",    "cargo",   "python",    "include",
+    "printf",  "the",     "quick",     "brown",   "fox",       "jumps",
+};
+
+/**
+ * A single benchmark result.
+ *
+ * @size: The number of clips in the store, or 0 for operations which don't
+ *        use one
+ * @op: The name of the operation
+ * @ops: The number of times the operation was timed
+ * @ns_per_op: The mean time per operation in nanoseconds
+ */
+struct result {
+    uint64_t size;
+    char op[32];
+    uint64_t ops;
+    double ns_per_op;
+};
+
+static struct result *results;
+static size_t nr_results, results_alloc;
+
+static void report(uint64_t size, const char *op, uint64_t ops,
+                   uint64_t elapsed_ns) {
+    expect(ops > 0);
+    if (nr_results == results_alloc) {
+        results_alloc = results_alloc ? results_alloc * 2 : 32;
+        results = realloc(results, results_alloc * sizeof(*results));
+        expect(results);
+    }
+    struct result *res = &results[nr_results++];
+    res->size = size;
+    snprintf_safe(res->op, sizeof(res->op), "%s", op);
+    res->ops = ops;
+    res->ns_per_op = (double)elapsed_ns / (double)ops;
+    fprintf(stderr, "%8" PRIu64 " %-20s %12.1f ns/op\n", size, op,
+            res->ns_per_op);
+}
+
+/**
+ * Pick a clip size. Most clips are a word or a URL, some are a paragraph or a
+ * snippet of code, and a few are whole files or logs.
+ */
+static size_t random_clip_size(void) {
+    uint64_t r = bench_rand() % 100;
+    if (r < 55) {
+        return 8 + bench_rand() % 56;
+    } else if (r < 85) {
+        return 64 + bench_rand() % 960;
+    } else if (r < 98) {
+        return 1024 + bench_rand() % 7168;
+    }
+    return 8192 + bench_rand() % (MAX_CLIP_SIZE - 8192);
+}
+
+/**
+ * Fill @out with a clip of a random size made of word soup, tagged with @idx
+ * so that distinct clips have distinct content.
+ */
+static void random_clip(char *out, size_t idx) {
+    size_t len = random_clip_size();
+    size_t pos = (size_t)snprintf(out, len, "%zu ", idx);
+    pos = pos < len ? pos : len - 1;
+    while (pos + 1 < len) {
+        const char *word = words[bench_rand() % arrlen(words)];
+        size_t word_len = strlen(word);
+        if (pos + word_len + 2 > len) {
+            break;
+        }
+        memcpy(out + pos, word, word_len);
+        pos += word_len;
+        out[pos++] = bench_rand() % 12 ? ' ' : '\n';
+    }
+    out[pos] = '\0';
+}
+
+static enum cs_remove_action remove_every_hundredth(uint64_t hash,
+                                                    const char *line,
+                                                    void *private) {
+    (void)hash;
+    (void)line;
+    size_t *pos = private;
+    return (*pos)++ % 100 == 0 ? CS_ACTION_REMOVE : CS_ACTION_KEEP;
+}
+
+/**
+ * Time one full iteration over the store, returning the elapsed nanoseconds.
+ */
+static uint64_t time_iter(struct clip_store *cs,
+                          enum cs_iter_direction direction) {
+    _drop_(cs_unref) struct ref_guard guard = cs_ref(cs);
+    expect(guard.status == 0);
+    uint64_t sum = 0, start = bench_now_ns();
+    struct cs_snip *snip = NULL;
+    while (cs_snip_iter(&guard, direction, &snip)) {
+        sum += snip->hash;
+    }
+    uint64_t elapsed = bench_now_ns() - start;
+    // Don't let the loop be optimised away
+    __asm__ volatile("" : : "r"(sum));
+    return elapsed;
+}
+
+/**
+ * Benchmark the operations which need a clip store of @size clips.
+ */
+static void bench_store(uint64_t size, char **pool, char *buf) {
+    struct bench_store bs;
+    bench_store_init(&bs);
+
+    // A few percent of clips are recopies of something seen before, which
+    // exercises deduplication
+    uint64_t add_ns = 0;
+    for (size_t i = 0; i < size; i++) {
+        const char *content = buf;
+        if (bench_rand() % 100 < 5) {
+            content = pool[bench_rand() % NR_POOL];
+        } else {
+            random_clip(buf, i);
+        }
+        uint64_t start = bench_now_ns();
+        expect(cs_add(&bs.cs, content, 0, NULL) == 0);
+        add_ns += bench_now_ns() - start;
+    }
+    report(size, "cs_add", size, add_ns);
+
+    static const struct {
+        enum cs_iter_direction direction;
+        const char *name;
+    } iters[] = {{CS_ITER_NEWEST_FIRST, "cs_snip_iter_newest"},
+                 {CS_ITER_OLDEST_FIRST, "cs_snip_iter_oldest"}};
+    for (size_t i = 0; i < arrlen(iters); i++) {
+        uint64_t best = UINT64_MAX;
+        for (size_t run = 0; run < NR_RUNS; run++) {
+            uint64_t elapsed = time_iter(&bs.cs, iters[i].direction);
+            best = elapsed < best ? elapsed : best;
+        }
+        report(size, iters[i].name, size, best);
+    }
+
+    size_t nr_gets = size < NR_RANDOM_OPS ? size : NR_RANDOM_OPS;
+    _drop_(free) uint64_t *hashes = malloc(nr_gets * sizeof(*hashes));
+    expect(hashes);
+    {
+        _drop_(cs_unref) struct ref_guard guard = cs_ref(&bs.cs);
+        expect(guard.status == 0);
+        for (size_t i = 0; i < nr_gets; i++) {
+            hashes[i] = guard.cs->snips[bench_rand() % size].hash;
+        }
+    }
+    uint64_t start = bench_now_ns();
+    for (size_t i = 0; i < nr_gets; i++) {
+        _drop_(cs_content_unmap) struct cs_content content;
+        expect(cs_content_get(&bs.cs, hashes[i], &content) == 0);
+    }
+    report(size, "cs_content_get", nr_gets, bench_now_ns() - start);
+
+    size_t nr_replaces = size < NR_REPLACES ? size : NR_REPLACES;
+    start = bench_now_ns();
+    for (size_t i = 0; i < nr_replaces; i++) {
+        expect(cs_replace(&bs.cs, CS_ITER_NEWEST_FIRST, 0, pool[i % NR_POOL],
+                          NULL) == 0);
+    }
+    report(size, "cs_replace", nr_replaces, bench_now_ns() - start);
+
+    // A selection being dragged out a byte at a time, as clipmenud sees it
+    _drop_(free) char *selection = malloc(nr_replaces + 2);
+    expect(selection);
+    for (size_t i = 0; i < nr_replaces + 2; i++) {
+        selection[i] = (char)('a' + bench_rand() % 26);
+    }
+    selection[1] = '\0';
+    uint64_t hash;
+    expect(cs_add(&bs.cs, selection, 0, &hash) == 0);
+    start = bench_now_ns();
+    for (size_t len = 2; len < nr_replaces + 2; len++) {
+        char saved = selection[len];
+        selection[len - 1] = (char)('a' + len % 26);
+        selection[len] = '\0';
+        expect(cs_merge(&bs.cs, hash, selection, len, true, NULL, &hash) == 0);
+        selection[len] = saved;
+    }
+    report(size, "cs_merge_extend", nr_replaces, bench_now_ns() - start);
+
+    size_t pos = 0, before, after;
+    expect(cs_len(&bs.cs, &before) == 0);
+    start = bench_now_ns();
+    expect(cs_remove(&bs.cs, CS_ITER_OLDEST_FIRST, remove_every_hundredth,
+                     &pos) == 0);
+    uint64_t elapsed = bench_now_ns() - start;
+    expect(cs_len(&bs.cs, &after) == 0);
+    report(size, "cs_remove", before - after, elapsed);
+
+    before = after;
+    start = bench_now_ns();
+    expect(cs_trim(&bs.cs, CS_ITER_NEWEST_FIRST, before / 2) == 0);
+    elapsed = bench_now_ns() - start;
+    expect(cs_len(&bs.cs, &after) == 0);
+    report(size, "cs_trim", before - after, elapsed);
+
+    // Each policy gets a quarter of what's left to evict. Evicting one of the
+    // recopies above frees nothing while the other copy is kept, which can
+    // take evicting largest first to more than one pass
+    static const struct {
+        enum cs_evict_policy policy;
+        const char *name;
+    } evicts[] = {{CS_EVICT_OLDEST, "cs_evict_oldest"},
+                  {CS_EVICT_LARGEST, "cs_evict_largest"}};
+    for (size_t i = 0; i < arrlen(evicts); i++) {
+        uint64_t max_bytes = bs.cs.header->nr_bytes / 4 * 3;
+        size_t nr_evicted;
+        start = bench_now_ns();
+        expect(cs_evict(&bs.cs, evicts[i].policy, max_bytes, &nr_evicted) ==
+               0);
+        elapsed = bench_now_ns() - start;
+        expect(bs.cs.header->nr_bytes <= max_bytes);
+        report(size, evicts[i].name, nr_evicted, elapsed);
+    }
+
+    // What cs_remove(), cs_trim() and cs_evict() left in the graveyard
+    start = bench_now_ns();
+    int nr_collected = cs_gc(&bs.cs, SIZE_MAX, NULL);
+    elapsed = bench_now_ns() - start;
+    expect(nr_collected >= 0);
+    report(size, "cs_gc", (uint64_t)nr_collected, elapsed);
+
+    bench_store_destroy(&bs);
+}
+
+/**
+ * Benchmark the operations on clip text which don't need a store.
+ */
+static void bench_text(char **pool) {
+    char line[CS_SNIP_LINE_SIZE];
+    uint64_t best = UINT64_MAX, sum = 0;
+    for (size_t run = 0; run < NR_RUNS; run++) {
+        uint64_t start = bench_now_ns();
+        for (size_t i = 0; i < NR_POOL; i++) {
+            sum += first_line(pool[i], line);
+        }
+        uint64_t elapsed = bench_now_ns() - start;
+        best = elapsed < best ? elapsed : best;
+    }
+    report(0, "first_line", NR_POOL, best);
+
+    best = UINT64_MAX;
+    for (size_t run = 0; run < NR_RUNS; run++) {
+        uint64_t start = bench_now_ns();
+        for (size_t i = 0; i < NR_POOL; i++) {
+            sum += djb64_hash(pool[i]);
+        }
+        uint64_t elapsed = bench_now_ns() - start;
+        best = elapsed < best ? elapsed : best;
+    }
+    report(0, "djb64_hash", NR_POOL, best);
+    __asm__ volatile("" : : "r"(sum));
+}
+
+static void _nonnull_ write_json(FILE *out) {
+    fprintf(out, "{\"bench\": \"store\", \"results\": [\n");
+    for (size_t i = 0; i < nr_results; i++) {
+        fprintf(out,
+                "  {\"size\": %" PRIu64 ", \"op\": \"%s\", \"ops\": %" PRIu64
+                ", \"ns_per_op\": %.1f}%s\n",
+                results[i].size, results[i].op, results[i].ops,
+                results[i].ns_per_op, i + 1 < nr_results ? "," : "");
+    }
+    fprintf(out, "]}\n");
+}
+
+/**
+ * Compare the results against a baseline written by an earlier run, and
+ * return the number of operations which regressed by more than
+ * @threshold_pct percent.
+ */
+static size_t _nonnull_ compare_baseline(const char *path,
+                                         double threshold_pct) {
+    _drop_(fclose) FILE *file = fopen(path, "r");
+    die_on(!file, "Failed to open baseline %s: %s\n", path, strerror(errno));
+
+    size_t nr_regressed = 0;
+    char buf[256];
+    fprintf(stderr, "\n%8s %-20s %12s %12s %8s\n", "size", "op", "baseline",
+            "current", "change");
+    while (fgets(buf, sizeof(buf), file)) {
+        uint64_t size, ops;
+        char op[32];
+        double base_ns;
+        if (sscanf(buf,
+                   " {\"size\": %" SCNu64 ", \"op\": \"%31[^\"]\", \"ops\": "
+                   "%" SCNu64 ", \"ns_per_op\": %lf",
+                   &size, op, &ops, &base_ns) != 4) {
+            continue;
+        }
+        for (size_t i = 0; i < nr_results; i++) {
+            if (results[i].size != size || !streq(results[i].op, op)) {
+                continue;
+            }
+            double change = (results[i].ns_per_op - base_ns) / base_ns * 100;
+            bool regressed = change > threshold_pct;
+            nr_regressed += regressed;
+            fprintf(stderr, "%8" PRIu64 " %-20s %12.1f %12.1f %+7.1f%%%s\n",
+                    size, op, base_ns, results[i].ns_per_op, change,
+                    regressed ? " REGRESSED" : "");
+        }
+    }
+    return nr_regressed;
+}
+
+int main(int argc, char *argv[]) {
+    const char *out_path = NULL, *baseline_path = NULL;
+    uint64_t threshold_pct = 10;
+    int opt;
+    while ((opt = getopt(argc, argv, "o:b:t:")) != -1) {
+        switch (opt) {
+            case 'o':
+                out_path = optarg;
+                break;
+            case 'b':
+                baseline_path = optarg;
+                break;
+            case 't':
+                die_on(str_to_uint64(optarg, &threshold_pct) < 0,
+                       "Invalid threshold: %s\n", optarg);
+                break;
+            default:
+                die("Usage: %s [-o out.json] [-b baseline.json] "
+                    "[-t threshold_pct] [nr_clips...]\n",
+                    argv[0]);
+        }
+    }
+
+    _drop_(free) char *buf = malloc(MAX_CLIP_SIZE);
+    _drop_(free) char **pool = malloc(NR_POOL * sizeof(*pool));
+    expect(buf && pool);
+    for (size_t i = 0; i < NR_POOL; i++) {
+        pool[i] = malloc(MAX_CLIP_SIZE);
+        expect(pool[i]);
+        random_clip(pool[i], i);
+    }
+
+    bench_text(pool);
+    if (optind < argc) {
+        for (int i = optind; i < argc; i++) {
+            uint64_t size;
+            die_on(str_to_uint64(argv[i], &size) < 0 || size == 0,
+                   "Invalid number of clips: %s\n", argv[i]);
+            bench_store(size, pool, buf);
+        }
+    } else {
+        for (size_t i = 0; i < arrlen(default_sizes); i++) {
+            bench_store(default_sizes[i], pool, buf);
+        }
+    }
+
+    if (out_path) {
+        _drop_(fclose) FILE *out = fopen(out_path, "w");
+        die_on(!out, "Failed to open %s: %s\n", out_path, strerror(errno));
+        write_json(out);
+    } else {
+        write_json(stdout);
+    }
+
+    size_t nr_regressed =
+        baseline_path ? compare_baseline(baseline_path, (double)threshold_pct)
+                      : 0;
+
+    for (size_t i = 0; i < NR_POOL; i++) {
+        free(pool[i]);
+    }
+    free(results);
+    return nr_regressed ? 1 : 0;
+}
@@ -0,0 +1,30 @@
+#!/usr/bin/bash -e
+
+# Run a benchmark which needs a real X server against a private Xvfb, with
+# clipmenud running in a throwaway cache directory.
+#
+# Usage: bench/xvfb.sh command [args...]
+
+cd "${0%/*}"/..
+
+export PATH=$PWD/src:$PATH
+export CM_CONFIG=$(mktemp)
+export CM_DIR=$(mktemp -d)
+export DISPLAY=${BENCH_DISPLAY:-:1912}
+
+cleanup() {
+    local -a bg
+    readarray -t bg < <(jobs -p)
+    (( ${#bg[@]} )) && kill -- "${bg[@]}" 2>/dev/null
+    wait
+    rm -rf -- "$CM_CONFIG" "$CM_DIR"
+}
+trap cleanup EXIT
+
+Xvfb "$DISPLAY" -nolisten tcp 2>/dev/null &
+sleep 2
+
+clipmenud &
+sleep 0.5
+
+"$@"
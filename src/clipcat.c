@@ -0,0 +1,307 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "ipc.h"
+#include "stats.h"
+#include "store.h"
+#include "util.h"
+
+#define COPY_CHUNK_SIZE 65536 /* Bytes per read when we can't sendfile() */
+
+/**
+ * A range of bytes or lines to output, counting from 1.
+ *
+ * @first: The first one to output
+ * @last: The last one to output, or UINT64_MAX for everything after @first
+ */
+struct range {
+    uint64_t first;
+    uint64_t last;
+};
+
+/**
+ * Parse a range like "10-20", "10-" (10 onwards), "-20" (up to 20), or "10"
+ * (only 10).
+ *
+ * @arg: The range to parse
+ * @out: Output for the range
+ */
+static int _nonnull_ parse_range(const char *arg, struct range *out) {
+    char buf[2 * UINT64_MAX_STRLEN + 2];
+    size_t len = strlen(arg);
+    if (len == 0 || len >= sizeof(buf)) {
+        return -EINVAL;
+    }
+    memcpy(buf, arg, len + 1);
+
+    char *dash = strchr(buf, '-');
+    char *last = dash ? dash + 1 : buf;
+    if (dash) {
+        *dash = '\0';
+    }
+    out->first = 1;
+    out->last = UINT64_MAX;
+    if ((*buf && str_to_uint64(buf, &out->first) < 0) ||
+        (*last && str_to_uint64(last, &out->last) < 0)) {
+        return -EINVAL;
+    }
+    return out->first > 0 && out->first <= out->last ? 0 : -EINVAL;
+}
+
+/**
+ * Parse a menu entry as clipmenu shows it, like "[ 3] foo", into its index.
+ * Returns -EINVAL if @arg isn't one.
+ *
+ * @arg: The menu entry
+ * @out: Output for the index, with 1 being the oldest
+ */
+static int _nonnull_ parse_menu_index(const char *arg, uint64_t *out) {
+    if (arg[0] != '[') {
+        return -EINVAL;
+    }
+    const char *start = arg + 1 + strspn(arg + 1, " ");
+    const char *end = strchr(start, ']');
+    if (!end || (size_t)(end - start) > UINT64_MAX_STRLEN) {
+        return -EINVAL;
+    }
+    char buf[UINT64_MAX_STRLEN + 1];
+    memcpy(buf, start, (size_t)(end - start));
+    buf[end - start] = '\0';
+    int ret = str_to_uint64(buf, out);
+    return ret < 0 ? ret : *out > 0 ? 0 : -EINVAL;
+}
+
+/**
+ * Ask clipmenud for the hash of the clip at a menu index.
+ *
+ * @ipc_fd: A socket returned by ipc_connect()
+ * @idx: The menu index, with 1 being the oldest
+ * @out_hash: Output for the hash
+ */
+static int _nonnull_ index_to_hash_via_daemon(int ipc_fd, uint64_t idx,
+                                              uint64_t *out_hash) {
+    struct cm_ipc_request req = {.op = CM_IPC_LIST,
+                                 .direction = CS_ITER_OLDEST_FIRST,
+                                 .offset = idx - 1,
+                                 .limit = 1};
+    struct cm_ipc_reply reply;
+    _drop_(cm_buf_free) struct cm_buf body = {0};
+    int ret = ipc_request(ipc_fd, &req, NULL, &reply, &body, NULL);
+    if (ret < 0) {
+        return ret;
+    }
+    if (reply.status < 0) {
+        return reply.status;
+    }
+
+    struct cm_ipc_entry ent;
+    char line[CS_SNIP_LINE_SIZE];
+    size_t pos = 0;
+    if (!ipc_next_entry(&body, &pos, &ent, line)) {
+        return -ENOENT;
+    }
+    *out_hash = ent.hash;
+    return 0;
+}
+
+/**
+ * Open the content of a clip, given as a hash or a menu entry, returning the
+ * fd or a negative errno. The content comes from clipmenud, or straight from
+ * the clip store if clipmenud isn't running. Either way, the clip store is
+ * only locked for long enough to look up a menu index.
+ *
+ * @cfg: The config
+ * @arg: The hash, or the menu entry
+ * @out_size: Output for the size of the content
+ */
+static int _nonnull_ open_clip(struct config *cfg, const char *arg,
+                               off_t *out_size) {
+    uint64_t idx = 0, hash = 0;
+    if (parse_menu_index(arg, &idx) < 0 && str_to_uint64(arg, &hash) < 0) {
+        return -EINVAL;
+    }
+
+    _drop_(close) int ipc_fd = ipc_connect(cfg);
+    if (ipc_fd >= 0) {
+        if (idx) {
+            int ret = index_to_hash_via_daemon(ipc_fd, idx, &hash);
+            if (ret < 0) {
+                return ret;
+            }
+            // clipmenud answers one request per connection
+            close(ipc_fd);
+            ipc_fd = ipc_connect(cfg);
+            if (ipc_fd < 0) {
+                return ipc_fd;
+            }
+        }
+        return ipc_content_open(ipc_fd, hash, out_size);
+    }
+
+    _drop_(close) int content_dir_fd = open(get_cache_dir(cfg), O_RDONLY);
+    _drop_(close) int snip_fd =
+        open(get_line_cache_path(cfg), O_RDWR | O_CREAT, 0600);
+    expect(content_dir_fd >= 0 && snip_fd >= 0);
+
+    _drop_(stats_unmap) struct cm_stats *stats = NULL;
+    _drop_(cs_destroy) struct clip_store cs;
+    expect(cs_init(&cs, snip_fd, content_dir_fd) == 0);
+    // Count our lock timings along with clipmenud's, if it has stats
+    if (stats_map(get_stats_path(cfg), STATS_MAP_APPEND, &stats) == 0) {
+        cs.stats = stats;
+    }
+
+    if (idx) {
+        _drop_(cs_unref) struct ref_guard guard = cs_ref(&cs);
+        if (guard.status < 0) {
+            return guard.status;
+        }
+        if (idx > cs.header->nr_snips) {
+            return -ENOENT;
+        }
+        hash = cs.snips[idx - 1].hash;
+    }
+
+    // Content files are never changed once written, and removing one only
+    // moves it aside, so it's safe to read without the lock
+    int fd = cs_content_open(&cs, hash);
+    if (fd < 0) {
+        return fd;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        int ret = negative_errno();
+        close(fd);
+        return ret;
+    }
+    *out_size = st.st_size;
+    return fd;
+}
+
+/**
+ * Find the bytes making up a range of lines, including the newline ending the
+ * last one. Only the content up to the end of the range is read.
+ *
+ * @fd: The content fd
+ * @size: The size of the content
+ * @lines: The range of lines
+ * @out_start: Output for the offset of the first byte
+ * @out_end: Output for the offset after the last byte
+ */
+static int _nonnull_ find_lines(int fd, off_t size, const struct range *lines,
+                                off_t *out_start, off_t *out_end) {
+    *out_start = *out_end = 0;
+    if (size == 0) {
+        return 0;
+    }
+
+    char *data = mmap(NULL, (size_t)size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        return negative_errno();
+    }
+
+    const char *cur = data, *end = data + size;
+    uint64_t line = 1;
+    while (cur < end && line < lines->first) {
+        const char *nl = memchr(cur, '\n', (size_t)(end - cur));
+        cur = nl ? nl + 1 : end;
+        line++;
+    }
+    *out_start = cur - data;
+    while (cur < end && line <= lines->last) {
+        const char *nl = memchr(cur, '\n', (size_t)(end - cur));
+        cur = nl ? nl + 1 : end;
+        line++;
+    }
+    *out_end = cur - data;
+
+    munmap(data, (size_t)size);
+    return 0;
+}
+
+/**
+ * Write bytes [@start, @end) of @fd to stdout. sendfile() saves copying them
+ * through our memory, but not everything stdout can be supports it, so we
+ * fall back to reading and writing if it doesn't.
+ */
+static void copy_to_stdout(int fd, off_t start, off_t end) {
+    off_t off = start;
+    while (off < end) {
+        ssize_t written =
+            sendfile(STDOUT_FILENO, fd, &off, (size_t)(end - off));
+        if (written < 0 && (errno == EINVAL || errno == ENOSYS)) {
+            break;
+        }
+        die_on(written < 0, "Failed to write clip: %s\n", strerror(errno));
+        if (written == 0) {
+            return;
+        }
+    }
+
+    char buf[COPY_CHUNK_SIZE];
+    while (off < end) {
+        size_t want = (size_t)(end - off) < sizeof(buf) ? (size_t)(end - off)
+                                                        : sizeof(buf);
+        ssize_t got = pread(fd, buf, want, off);
+        die_on(got < 0, "Failed to read clip: %s\n", strerror(errno));
+        if (got == 0) {
+            return;
+        }
+        write_safe(STDOUT_FILENO, buf, (size_t)got);
+        off += got;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    const char usage[] = "Usage: clipcat [-c|--bytes range] "
+                         "[-n|--lines range] (hash | '[index]')";
+    const struct option long_opts[] = {{"bytes", required_argument, NULL, 'c'},
+                                       {"lines", required_argument, NULL, 'n'},
+                                       {0}};
+
+    struct range bytes = {0}, lines = {0};
+    int opt;
+    while ((opt = getopt_long(argc, argv, "c:n:", long_opts, NULL)) != -1) {
+        switch (opt) {
+            case 'c':
+                die_on(parse_range(optarg, &bytes) < 0, "%s\n", usage);
+                break;
+            case 'n':
+                die_on(parse_range(optarg, &lines) < 0, "%s\n", usage);
+                break;
+            default:
+                die("%s\n", usage);
+        }
+    }
+    die_on(argc - optind != 1 || (bytes.first && lines.first), "%s\n",
+           usage);
+
+    _drop_(config_free) struct config cfg = setup("clipcat");
+
+    off_t size;
+    _drop_(close) int fd = open_clip(&cfg, argv[optind], &size);
+    die_on(fd < 0, "Clip %s inaccessible: %s\n", argv[optind],
+           strerror(-fd));
+
+    off_t start = 0, end = size;
+    if (bytes.first) {
+        start = bytes.first - 1 < (uint64_t)size ? (off_t)bytes.first - 1
+                                                 : size;
+        end = bytes.last < (uint64_t)size ? (off_t)bytes.last : size;
+    } else if (lines.first) {
+        int ret = find_lines(fd, size, &lines, &start, &end);
+        die_on(ret < 0, "Failed to read clip: %s\n", strerror(-ret));
+    }
+
+    copy_to_stdout(fd, start, end);
+    return 0;
+}
@@ -10,6 +10,8 @@
 #include <unistd.h>
 
 #include "config.h"
+#include "stats.h"
+#include "trace.h"
 #include "util.h"
 
 /**
@@ -72,7 +74,32 @@ static bool _nonnull_ should_enable(struct config *cfg, const char *mode_str) {
 
 int main(int argc, char *argv[]) {
     _drop_(config_free) struct config cfg = setup("clipctl");
-    die_on(argc != 2, "Usage: clipctl <enable|disable|toggle|status>\n");
+    die_on(argc != 2,
+           "Usage: clipctl <enable|disable|toggle|status|stats|trace>\n");
+
+    if (streq(argv[1], "stats")) {
+        // Read straight from the shared stats region, clipmenud needn't even
+        // be running
+        struct cm_stats *stats;
+        int ret = stats_map(get_stats_path(&cfg), STATS_MAP_READ, &stats);
+        die_on(ret < 0, "Failed to read stats: %s\n", strerror(-ret));
+        stats_print(stats, stdout);
+        stats_unmap(stats);
+        return 0;
+    }
+
+    if (streq(argv[1], "trace")) {
+        struct cm_trace *trace;
+        int ret = trace_map(get_trace_path(&cfg), TRACE_MAP_READ, &trace);
+        die_on(ret < 0, "Failed to read trace: %s\n", strerror(-ret));
+        const char *sel_names[CM_SEL_MAX];
+        for (size_t i = 0; i < CM_SEL_MAX; i++) {
+            sel_names[i] = cfg.selections[i].name;
+        }
+        trace_print(trace, sel_names, CM_SEL_MAX, stdout);
+        trace_unmap(trace);
+        return 0;
+    }
 
     pid_t pid = get_clipmenud_pid();
     die_on(pid == -ENOENT, "clipmenud is not running\n");
@@ -1,11 +1,20 @@
+#include <errno.h>
 #include <fcntl.h>
-#include <regex.h>
+#include <getopt.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "config.h"
+#include "ipc.h"
+#include "pattern.h"
+#include "scan.h"
+#include "stats.h"
 #include "store.h"
 #include "util.h"
 
@@ -20,11 +29,30 @@ enum delete_mode {
 /**
  * Holds the application state for a clipdel operation in preparation for
  * passing it as private data to the cs_remove callback.
+ *
+ * @mode: Whether to actually delete
+ * @invert_match: Act on snips which do _not_ match
+ * @content: Match against the full content rather than the snip line
+ * @matcher: The matcher for snip lines, if not @content
+ * @content_matches: If @content, whether each snip's content matched, oldest
+ *                   first
+ * @pos: The index of the next snip to be passed to the callback
+ * @after: Only act on snips captured at or after this Unix time, or 0
+ * @before: Only act on snips captured before this Unix time, or 0
+ * @range_start: The index of the first snip within @after and @before
+ * @range_end: The index after the last snip within @after and @before
  */
 struct clipdel_state {
     enum delete_mode mode;
     bool invert_match;
-    regex_t rgx;
+    bool content;
+    struct pattern_matcher matcher;
+    bool *content_matches;
+    size_t pos;
+    uint64_t after;
+    uint64_t before;
+    size_t range_start;
+    size_t range_end;
 };
 
 /**
@@ -34,10 +62,15 @@ struct clipdel_state {
 static enum cs_remove_action _nonnull_
 remove_if_rgx_match(uint64_t hash _unused_, const char *line, void *private) {
     struct clipdel_state *state = private;
-    int ret = regexec(&state->rgx, line, 0, NULL, 0);
-    expect(ret == 0 || ret == REG_NOMATCH);
+    size_t idx = state->pos++;
+    if (idx < state->range_start || idx >= state->range_end) {
+        return CS_ACTION_KEEP;
+    }
+    bool matched = state->content_matches
+                       ? state->content_matches[idx]
+                       : pattern_match(&state->matcher, line, strlen(line));
 
-    bool wants_del = state->invert_match ? ret : !ret;
+    bool wants_del = state->invert_match ? !matched : matched;
     if (wants_del) {
         puts(line);
     }
@@ -46,21 +79,101 @@ remove_if_rgx_match(uint64_t hash _unused_, const char *line, void *private) {
                                                    : CS_ACTION_KEEP;
 }
 
+/**
+ * Ask clipmenud to perform the deletion, printing the lines it matched.
+ */
+static int _nonnull_ delete_via_daemon(int ipc_fd,
+                                       const struct clipdel_state *state,
+                                       const char *payload, bool list) {
+    struct cm_ipc_request req = {
+        .op = CM_IPC_DELETE,
+        .flags = (state->invert_match ? CM_IPC_F_INVERT : 0) |
+                 (state->mode == DELETE_DRY_RUN ? CM_IPC_F_DRY_RUN : 0) |
+                 (state->content ? CM_IPC_F_CONTENT : 0) |
+                 (list ? CM_IPC_F_PATTERN_LIST : 0),
+        .after = state->after,
+        .before = state->before};
+    struct cm_ipc_reply reply;
+    _drop_(cm_buf_free) struct cm_buf body = {0};
+
+    int ret = ipc_request(ipc_fd, &req, payload, &reply, &body, NULL);
+    die_on(ret < 0, "Failed to query clipmenud: %s\n", strerror(-ret));
+    die_on(reply.status == -EINVAL, "Could not compile regex\n");
+    die_on(reply.status < 0, "clipmenud failed to delete: %s\n",
+           strerror(-reply.status));
+
+    struct cm_ipc_entry ent;
+    char line[CS_SNIP_LINE_SIZE];
+    size_t pos = 0;
+    while (ipc_next_entry(&body, &pos, &ent, line)) {
+        puts(line);
+    }
+
+    return 0;
+}
+
+/**
+ * Read a whole file into a null terminated buffer, dying on failure.
+ *
+ * @path: The path of the file to read
+ */
+static char *_nonnull_ read_file(const char *path) {
+    _drop_(close) int fd = open(path, O_RDONLY | O_CLOEXEC);
+    die_on(fd < 0, "Failed to open %s: %s\n", path, strerror(errno));
+    struct stat st;
+    expect(fstat(fd, &st) == 0);
+
+    char *text = malloc((size_t)st.st_size + 1);
+    expect(text);
+    size_t len = read_safe(fd, text, (size_t)st.st_size);
+    text[len] = '\0';
+    return text;
+}
+
+/**
+ * Parse a duration argument and return the Unix time that long ago.
+ */
+static uint64_t _nonnull_ parse_age(const char *arg, const char *usage) {
+    uint64_t age;
+    die_on(str_to_duration(arg, &age) < 0, "%s\n", usage);
+    uint64_t now = (uint64_t)time(NULL);
+    return age < now ? now - age : 1;
+}
+
 int main(int argc, char *argv[]) {
-    const char usage[] = "Usage: clipdel [-d] [-v] regex";
+    const char usage[] = "Usage: clipdel [-d] [-v] [-c|--content] "
+                         "[-o|--older-than age] [-n|--newer-than age] "
+                         "(regex | -f patterns_file)";
+    const struct option long_opts[] = {
+        {"content", no_argument, NULL, 'c'},
+        {"older-than", required_argument, NULL, 'o'},
+        {"newer-than", required_argument, NULL, 'n'},
+        {0}};
 
     _drop_(config_free) struct config cfg = setup("clipdel");
 
-    struct clipdel_state state;
-    state.mode = DELETE_DRY_RUN;
-    state.invert_match = false;
+    struct clipdel_state state = {.mode = DELETE_DRY_RUN};
+    const char *patterns_path = NULL;
 
     int opt;
-    while ((opt = getopt(argc, argv, "dv")) != -1) {
+    while ((opt = getopt_long(argc, argv, "cdf:n:o:v", long_opts, NULL)) !=
+           -1) {
         switch (opt) {
+            case 'c':
+                state.content = true;
+                break;
             case 'd':
                 state.mode = DELETE_REAL;
                 break;
+            case 'f':
+                patterns_path = optarg;
+                break;
+            case 'n':
+                state.after = parse_age(optarg, usage);
+                break;
+            case 'o':
+                state.before = parse_age(optarg, usage);
+                break;
             case 'v':
                 state.invert_match = true;
                 break;
@@ -69,23 +182,74 @@ int main(int argc, char *argv[]) {
         }
     }
 
-    die_on(optind >= argc, "%s\n", usage);
+    // With only a time range, act on every snip within it
+    bool has_range = state.after || state.before;
+    const char *rgx = optind < argc ? argv[optind] : NULL;
+    if (!rgx && !patterns_path && has_range) {
+        rgx = "^";
+    }
+    die_on(!!rgx == !!patterns_path || argc - optind > 1, "%s\n", usage);
+
+    _drop_(pattern_set_free) struct pattern_set set;
+    pattern_set_init(&set, state.content);
+    _drop_(free) char *patterns_text = NULL;
+    if (patterns_path) {
+        patterns_text = read_file(patterns_path);
+        size_t bad_line;
+        die_on(pattern_set_add_lines(&set, patterns_text, &bad_line) < 0,
+               "Could not compile regex on line %zu of %s\n", bad_line,
+               patterns_path);
+    } else {
+        die_on(pattern_set_add(&set, rgx) < 0, "Could not compile regex\n");
+    }
+    pattern_set_compile(&set);
+
+    const char *payload = patterns_text ? patterns_text : rgx;
+    _drop_(close) int ipc_fd = ipc_connect(&cfg);
+    if (ipc_fd >= 0 && strlen(payload) <= CM_IPC_PAYLOAD_MAX) {
+        return delete_via_daemon(ipc_fd, &state, payload, patterns_text);
+    }
 
     _drop_(close) int content_dir_fd = open(get_cache_dir(&cfg), O_RDONLY);
     _drop_(close) int snip_fd =
         open(get_line_cache_path(&cfg), O_RDWR | O_CREAT, 0600);
     expect(content_dir_fd >= 0 && snip_fd >= 0);
 
+    _drop_(stats_unmap) struct cm_stats *stats = NULL;
     _drop_(cs_destroy) struct clip_store cs;
     expect(cs_init(&cs, snip_fd, content_dir_fd) == 0);
+    // Count our lock timings along with clipmenud's, if it has stats
+    if (stats_map(get_stats_path(&cfg), STATS_MAP_APPEND, &stats) == 0) {
+        cs.stats = stats;
+    }
 
-    die_on(regcomp(&state.rgx, argv[optind], REG_EXTENDED | REG_NOSUB),
-           "Could not compile regex\n");
-
-    expect(cs_remove(&cs, CS_ITER_OLDEST_FIRST, remove_if_rgx_match, &state) ==
-           0);
-
-    regfree(&state.rgx);
+    // Hold the lock from finding the time range (and scanning content)
+    // through to the removal, so the results still line up with the snips
+    _drop_(cs_unref) struct ref_guard guard = cs_ref(&cs);
+    expect(guard.status == 0);
+    cs_snip_time_range(&guard, state.after, state.before, &state.range_start,
+                       &state.range_end);
+
+    if (state.content) {
+        _drop_(free) bool *matches =
+            calloc(cs.header->nr_snips + 1, sizeof(*matches));
+        expect(matches);
+
+        int ret = cs_content_match_patterns(&cs, &set, matches);
+        die_on(ret < 0, "Failed to scan content: %s\n", strerror(-ret));
+
+        state.content_matches = matches;
+        expect(cs_remove(&cs, CS_ITER_OLDEST_FIRST, remove_if_rgx_match,
+                         &state) == 0);
+    } else {
+        pattern_matcher_init(&state.matcher, &set);
+        expect(cs_remove(&cs, CS_ITER_OLDEST_FIRST, remove_if_rgx_match,
+                         &state) == 0);
+        pattern_matcher_free(&state.matcher);
+    }
 
+    // Removed content is only moved aside, and there may be no daemon to
+    // delete it later
+    expect(cs_gc(&cs, SIZE_MAX, NULL) >= 0);
     return 0;
 }
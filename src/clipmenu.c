@@ -1,33 +1,30 @@
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/sendfile.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
 #include "config.h"
+#include "filter.h"
+#include "index.h"
+#include "ipc.h"
+#include "menu.h"
+#include "stats.h"
 #include "store.h"
 #include "util.h"
 
 #define MAX_ARGS 32
+#define MENU_MORE "more" /* The index shown on the entry for the next page */
 
 static int dmenu_user_argc;
 static char **dmenu_user_argv;
 
-/**
- * Calculate the base 10 padding length for a number.
- */
-static int get_padding_length(size_t num) {
-    int digits = 0;
-    do {
-        num /= 10;
-        digits++;
-    } while (num > 0);
-    return digits;
-}
-
 /**
  * Execute the launcher. Called after fork() is already done in the new child.
  */
@@ -73,64 +70,111 @@ static void _noreturn_ _nonnull_ exec_launcher(struct config *cfg,
     die("Failed to exec %s: %s\n", cmd[0], strerror(errno));
 }
 
-static int dprintf_ellipsise_long_snip_line(int fd, const char *line) {
-    size_t line_len = strlen(line);
-    if (line_len == CS_SNIP_LINE_SIZE - 1) {
-        return dprintf(fd, "%.*s...", (int)(CS_SNIP_LINE_SIZE - 4), line);
-    } else {
-        return dprintf(fd, "%s", line);
+/**
+ * Write the menu prerendered by clipmenud, returning the index to hash map.
+ * Returns NULL if clipmenud couldn't provide it.
+ */
+static uint64_t *_nonnull_ write_menu_from_daemon(int ipc_fd, int menu_fd,
+                                                  size_t *out_nr_clips) {
+    struct cm_ipc_request req = {.op = CM_IPC_MENU};
+    struct cm_ipc_reply reply;
+    _drop_(close) int snap_fd = -1;
+    if (ipc_request(ipc_fd, &req, NULL, &reply, NULL, &snap_fd) < 0 ||
+        reply.status < 0 || snap_fd < 0) {
+        return NULL;
+    }
+
+    size_t cur_clips = reply.nr_entries;
+    size_t map_size = cur_clips * sizeof(uint64_t);
+    uint64_t *idx_to_hash = malloc(map_size);
+    expect(idx_to_hash);
+    expect(pread(snap_fd, idx_to_hash, map_size, (off_t)reply.size) ==
+           (ssize_t)map_size);
+
+    off_t off = 0;
+    while ((uint64_t)off < reply.size) {
+        size_t remaining = reply.size - (uint64_t)off;
+        expect(sendfile(menu_fd, snap_fd, &off, remaining) > 0);
     }
+
+    *out_nr_clips = cur_clips;
+    return idx_to_hash;
 }
 
 /**
- * Writes the available clips to the launcher and reads back the user's
- * selection.
+ * Write the menu by reading the clip store directly, returning the index to
+ * hash map. Used when clipmenud is not running.
  */
-static int _nonnull_ interact_with_dmenu(struct config *cfg, int *input_pipe,
-                                         int *output_pipe, uint64_t *out_hash) {
-    close(input_pipe[0]);
-    close(output_pipe[1]);
-
+static uint64_t *_nonnull_ write_menu_from_store(struct config *cfg,
+                                                 int menu_fd,
+                                                 size_t *out_nr_clips) {
     _drop_(close) int content_dir_fd = open(get_cache_dir(cfg), O_RDONLY);
     _drop_(close) int snip_fd =
         open(get_line_cache_path(cfg), O_RDWR | O_CREAT, 0600);
     expect(content_dir_fd >= 0 && snip_fd >= 0);
 
+    _drop_(stats_unmap) struct cm_stats *stats = NULL;
     _drop_(cs_destroy) struct clip_store cs;
     expect(cs_init(&cs, snip_fd, content_dir_fd) == 0);
-
-    struct ref_guard guard = cs_ref(&cs);
-    size_t cur_clips;
-    expect(cs_len(&cs, &cur_clips) == 0);
-    _drop_(free) uint64_t *idx_to_hash = malloc(cur_clips * sizeof(uint64_t));
-    expect(idx_to_hash);
-    int pad = get_padding_length(cur_clips);
-    size_t clip_idx = cur_clips;
-
-    struct cs_snip *snip = NULL;
-    while (cs_snip_iter(&guard, CS_ITER_NEWEST_FIRST, &snip)) {
-        expect(dprintf(input_pipe[1], "[%*zu] ", pad, clip_idx--) > 0);
-        expect(dprintf_ellipsise_long_snip_line(input_pipe[1], snip->line) > 0);
-        if (snip->nr_lines > 1) {
-            expect(dprintf(input_pipe[1], " (%zu lines)", snip->nr_lines) > 0);
-        }
-        write_safe(input_pipe[1], "\n", 1);
-        idx_to_hash[clip_idx] = snip->hash;
+    // Count our lock timings along with clipmenud's, if it has stats
+    if (stats_map(get_stats_path(cfg), STATS_MAP_APPEND, &stats) == 0) {
+        cs.stats = stats;
     }
 
-    // We've written everything and have our own map, no need to hold any more
-    cs_unref(guard.cs);
+    _drop_(menu_free) struct menu menu = {0};
+    expect(menu_rebuild(&menu, &cs) == 0);
+    if (menu.nr > 0) {
+        write_safe(menu_fd, menu.text + menu.text_start, menu_text_len(&menu));
+    }
 
-    close(input_pipe[1]);
+    uint64_t *idx_to_hash = menu.hashes;
+    menu.hashes = NULL;
+    *out_nr_clips = menu.nr;
+    return idx_to_hash;
+}
 
-    char sel_idx_str[UINT64_MAX_STRLEN + 1];
-    read_safe(output_pipe[0], sel_idx_str, 1); // Discard the leading "["
-    size_t read_sz = read_safe(output_pipe[0], sel_idx_str, UINT64_MAX_STRLEN);
-    sel_idx_str[read_sz] = '\0';
-    char *end_ptr = strchr(sel_idx_str, ']');
+/**
+ * Read back the index of the entry the user selected from the launcher, that
+ * is, whatever is between the leading "[" of the entry and the "]".
+ *
+ * @fd: The read end of the launcher's output pipe
+ * @out: Output for the index, null terminated
+ */
+static void _nonnull_ read_selected_index(int fd,
+                                          char out[UINT64_MAX_STRLEN + 1]) {
+    read_safe(fd, out, 1); // Discard the leading "["
+    size_t read_sz = read_safe(fd, out, UINT64_MAX_STRLEN);
+    out[read_sz] = '\0';
+    char *end_ptr = strchr(out, ']');
     if (end_ptr) {
         *end_ptr = '\0';
     }
+}
+
+/**
+ * Writes the available clips to the launcher and reads back the user's
+ * selection.
+ */
+static int _nonnull_ interact_with_dmenu(struct config *cfg, int *input_pipe,
+                                         int *output_pipe, uint64_t *out_hash) {
+    close(input_pipe[0]);
+    close(output_pipe[1]);
+
+    size_t cur_clips;
+    _drop_(free) uint64_t *idx_to_hash = NULL;
+    _drop_(close) int ipc_fd = ipc_connect(cfg);
+    if (ipc_fd >= 0) {
+        idx_to_hash = write_menu_from_daemon(ipc_fd, input_pipe[1], &cur_clips);
+    }
+    if (!idx_to_hash) {
+        idx_to_hash = write_menu_from_store(cfg, input_pipe[1], &cur_clips);
+    }
+
+    // We've written everything and have our own map
+    close(input_pipe[1]);
+
+    char sel_idx_str[UINT64_MAX_STRLEN + 1];
+    read_selected_index(output_pipe[0], sel_idx_str);
 
     uint64_t sel_idx;
     int forced_ret = 0;
@@ -153,11 +197,11 @@ static int _nonnull_ interact_with_dmenu(struct config *cfg, int *input_pipe,
 }
 
 /**
- * Prompts the user to select a clip via their launcher, and returns the
- * selected content hash.
+ * Start the launcher, setting up @input_pipe for the menu and @output_pipe
+ * for the selection.
  */
-static int _nonnull_ prompt_user_for_hash(struct config *cfg, uint64_t *hash) {
-    int input_pipe[2], output_pipe[2];
+static void _nonnull_ start_launcher(struct config *cfg, int *input_pipe,
+                                     int *output_pipe) {
     expect(pipe(input_pipe) == 0 && pipe(output_pipe) == 0);
 
     pid_t pid = fork();
@@ -166,21 +210,478 @@ static int _nonnull_ prompt_user_for_hash(struct config *cfg, uint64_t *hash) {
     if (pid == 0) {
         exec_launcher(cfg, input_pipe, output_pipe);
     }
+}
+
+/**
+ * The menu, paged through newest first when menu_page or menu_limit is set.
+ *
+ * Writing the whole menu before the launcher can show any of it means the
+ * wait for the first entry grows with the history, as does the index to hash
+ * map. Instead, each page is fetched from clipmenud (or the clip store, if
+ * clipmenud isn't running) only as it's written, and its hashes are only
+ * kept from then on.
+ *
+ * Pages are fetched by their position from the oldest snip, so clips added
+ * while we page through don't shift older pages or their indexes. Removals
+ * still can, but those are rare, and at worst the user gets a neighbouring
+ * clip.
+ *
+ * @cfg: The config, for connecting to clipmenud
+ * @cs: The clip store, or NULL to fetch pages from clipmenud
+ * @nr: The number of menu entries when paging started
+ * @pad: The width of the index field
+ * @page_size: The number of entries per page
+ * @nr_pages: The number of pages
+ * @pages: For each page, the hashes of its entries oldest first, or NULL if
+ *         it hasn't been fetched
+ * @page_lens: For each page, the number of hashes in @pages
+ */
+struct menu_pager {
+    struct config *cfg;
+    struct clip_store *cs;
+    size_t nr;
+    int pad;
+    size_t page_size;
+    size_t nr_pages;
+    uint64_t **pages;
+    size_t *page_lens;
+};
+
+static void _nonnull_ menu_pager_free(struct menu_pager *pager) {
+    for (size_t i = 0; i < pager->nr_pages; i++) {
+        free(pager->pages[i]);
+    }
+    free(pager->pages);
+    free(pager->page_lens);
+}
+DEFINE_DROP_FUNC_PTR(struct menu_pager, menu_pager_free)
+
+/**
+ * Get the range of positions from the newest entry which a page covers.
+ *
+ * @pager: The pager to operate on
+ * @page: The page
+ * @out_start: Output for the position of the page's newest entry
+ * @out_end: Output for the position after the page's oldest entry
+ */
+static void _nonnull_ menu_pager_range(const struct menu_pager *pager,
+                                       size_t page, size_t *out_start,
+                                       size_t *out_end) {
+    size_t start = page * pager->page_size;
+    size_t left = pager->nr - start;
+    *out_start = start;
+    *out_end = start + (left < pager->page_size ? left : pager->page_size);
+}
+
+/**
+ * A page of menu text being rendered. Entries come oldest first, and are
+ * prepended, so that the text ends up newest first like the rest of the menu.
+ *
+ * @text: The text, which occupies text[start, alloc)
+ * @start: The offset of the newest entry so far in @text
+ * @alloc: The number of bytes allocated for @text
+ * @hashes: The hashes of the entries so far, oldest first
+ * @nr: The number of entries so far
+ * @first_idx: The menu index of the oldest entry
+ * @pad: The width of the index field
+ */
+struct menu_page {
+    char *text;
+    size_t start;
+    size_t alloc;
+    uint64_t *hashes;
+    size_t nr;
+    size_t first_idx;
+    int pad;
+};
+
+static void _nonnull_ menu_page_add(struct menu_page *mp, uint64_t hash,
+                                    uint64_t nr_lines, const char *line) {
+    char entry[MENU_ENTRY_MAX];
+    size_t len = menu_entry_render(entry, mp->pad, mp->first_idx + mp->nr,
+                                   line, nr_lines);
+    expect(mp->start >= len);
+    mp->start -= len;
+    memcpy(mp->text + mp->start, entry, len);
+    mp->hashes[mp->nr++] = hash;
+}
+
+/**
+ * Fetch a page's entries, oldest first, from clipmenud or the clip store.
+ * If clipmenud has gone away, the page is left short.
+ *
+ * @pager: The pager to operate on
+ * @offset: The position of the page's oldest entry from the oldest snip
+ * @count: The number of entries in the page
+ * @mp: The page to add the entries to
+ */
+static void _nonnull_ menu_pager_fetch(const struct menu_pager *pager,
+                                       size_t offset, size_t count,
+                                       struct menu_page *mp) {
+    if (pager->cs) {
+        _drop_(cs_unref) struct ref_guard guard = cs_ref(pager->cs);
+        expect(guard.status == 0);
+        size_t nr_snips = pager->cs->header->nr_snips;
+        for (size_t pos = offset; pos < offset + count && pos < nr_snips;
+             pos++) {
+            const struct cs_snip *snip = pager->cs->snips + pos;
+            menu_page_add(mp, snip->hash, snip->nr_lines, snip->line);
+        }
+        return;
+    }
+
+    struct cm_ipc_request req = {.op = CM_IPC_LIST,
+                                 .direction = CS_ITER_OLDEST_FIRST,
+                                 .offset = offset,
+                                 .limit = count};
+    struct cm_ipc_reply reply;
+    _drop_(cm_buf_free) struct cm_buf body = {0};
+    _drop_(close) int ipc_fd = ipc_connect(pager->cfg);
+    if (ipc_fd < 0 ||
+        ipc_request(ipc_fd, &req, NULL, &reply, &body, NULL) < 0 ||
+        reply.status < 0) {
+        return;
+    }
+
+    struct cm_ipc_entry ent;
+    char line[CS_SNIP_LINE_SIZE];
+    size_t pos = 0;
+    while (mp->nr < count && ipc_next_entry(&body, &pos, &ent, line)) {
+        menu_page_add(mp, ent.hash, ent.nr_lines, line);
+    }
+}
+
+/**
+ * Write to the launcher. Returns false if it's stopped reading, which it may
+ * well do if the user picks something while later pages are still coming.
+ */
+static bool _nonnull_ write_to_launcher(int fd, const char *buf,
+                                        size_t count) {
+    while (count > 0) {
+        ssize_t chunk_size = write(fd, buf, count);
+        if (chunk_size < 0) {
+            expect(errno == EINTR || errno == EPIPE);
+            if (errno == EPIPE) {
+                return false;
+            }
+            continue;
+        }
+        buf += chunk_size;
+        count -= (size_t)chunk_size;
+    }
+    return true;
+}
+
+/**
+ * Fetch a page and write it to the launcher, keeping its hashes for when the
+ * user selects one of its entries. Returns false if the launcher has stopped
+ * reading.
+ *
+ * @pager: The pager to operate on
+ * @page: The page to write
+ * @menu_fd: The launcher's input pipe
+ */
+static bool _nonnull_ menu_pager_write(struct menu_pager *pager, size_t page,
+                                       int menu_fd) {
+    size_t start, end;
+    menu_pager_range(pager, page, &start, &end);
+    size_t count = end - start;
+
+    struct menu_page mp = {.alloc = count * MENU_ENTRY_MAX,
+                           .first_idx = pager->nr - end + 1,
+                           .pad = pager->pad};
+    mp.start = mp.alloc;
+    _drop_(free) char *text = malloc(mp.alloc);
+    mp.text = text;
+    mp.hashes = malloc(count * sizeof(*mp.hashes));
+    expect(mp.text && mp.hashes);
+
+    menu_pager_fetch(pager, pager->nr - end, count, &mp);
+
+    free(pager->pages[page]);
+    pager->pages[page] = mp.hashes;
+    pager->page_lens[page] = mp.nr;
+    return write_to_launcher(menu_fd, mp.text + mp.start, mp.alloc - mp.start);
+}
+
+/**
+ * Look up the hash for a menu index in the pages fetched so far. Returns false
+ * if there's no such entry.
+ *
+ * @pager: The pager to operate on
+ * @idx: The menu index, with 1 being the oldest
+ * @out_hash: Output for the hash
+ */
+static bool _nonnull_ menu_pager_lookup(const struct menu_pager *pager,
+                                        uint64_t idx, uint64_t *out_hash) {
+    if (idx == 0 || idx > pager->nr) {
+        return false;
+    }
+    size_t page = (pager->nr - idx) / pager->page_size;
+    size_t start, end;
+    menu_pager_range(pager, page, &start, &end);
+    size_t pos = idx - (pager->nr - end) - 1;
+    if (!pager->pages[page] || pos >= pager->page_lens[page]) {
+        return false;
+    }
+    *out_hash = pager->pages[page][pos];
+    return true;
+}
+
+/**
+ * Write the menu to the launcher from @first_page on, and read back the user's
+ * selection. With menu_limit, only @first_page is written, followed by an
+ * entry to go on to the next page if there is one.
+ *
+ * @pager: The pager to operate on
+ * @first_page: The page to start from
+ * @out_hash: Output for the selected hash
+ * @out_more: Output for whether the user asked for the next page
+ */
+static int _nonnull_ interact_with_dmenu_paged(struct menu_pager *pager,
+                                               size_t first_page,
+                                               uint64_t *out_hash,
+                                               bool *out_more) {
+    int input_pipe[2], output_pipe[2];
+    start_launcher(pager->cfg, input_pipe, output_pipe);
+    close(input_pipe[0]);
+    close(output_pipe[1]);
+
+    size_t page = first_page;
+    size_t last_page =
+        pager->cfg->menu_limit ? first_page + 1 : pager->nr_pages;
+    while (page < last_page && page < pager->nr_pages &&
+           menu_pager_write(pager, page, input_pipe[1])) {
+        page++;
+    }
+    bool wrote_more = page == last_page && page < pager->nr_pages;
+    if (wrote_more) {
+        size_t start, end;
+        menu_pager_range(pager, page - 1, &start, &end);
+        char more[MENU_ENTRY_MAX];
+        size_t len = snprintf_safe(more, sizeof(more),
+                                   "[" MENU_MORE "] %zu older clips\n",
+                                   pager->nr - end);
+        write_to_launcher(input_pipe[1], more, len);
+    }
+    close(input_pipe[1]);
+
+    char sel_idx_str[UINT64_MAX_STRLEN + 1];
+    read_selected_index(output_pipe[0], sel_idx_str);
+
+    int dmenu_status;
+    wait(&dmenu_status);
+    close(output_pipe[0]);
+
+    uint64_t sel_idx;
+    *out_more = wrote_more && streq(sel_idx_str, MENU_MORE);
+    if (!*out_more && (str_to_uint64(sel_idx_str, &sel_idx) < 0 ||
+                       !menu_pager_lookup(pager, sel_idx, out_hash))) {
+        return EXIT_FAILURE;
+    }
+
+    return WEXITSTATUS(dmenu_status);
+}
+
+/**
+ * Page through the menu with the launcher until the user selects a clip or
+ * gives up.
+ *
+ * @cfg: The config
+ * @cs: The clip store, or NULL to fetch pages from clipmenud
+ * @nr: The number of menu entries
+ * @hash: Output for the selected hash
+ */
+static int _nonnull_n_(1, 4) prompt_user_paged(struct config *cfg,
+                                               struct clip_store *cs,
+                                               size_t nr, uint64_t *hash) {
+    size_t page_size =
+        (size_t)(cfg->menu_limit ? cfg->menu_limit : cfg->menu_page);
+    _drop_(menu_pager_free) struct menu_pager pager = {
+        .cfg = cfg,
+        .cs = cs,
+        .nr = nr,
+        .pad = get_padding_length(nr),
+        .page_size = page_size,
+        .nr_pages = (nr + page_size - 1) / page_size,
+    };
+    pager.pages = calloc(pager.nr_pages, sizeof(*pager.pages));
+    pager.page_lens = calloc(pager.nr_pages, sizeof(*pager.page_lens));
+    expect((pager.pages && pager.page_lens) || pager.nr_pages == 0);
+
+    // The launcher may exit before we're done writing later pages
+    expect(signal(SIGPIPE, SIG_IGN) != SIG_ERR);
+
+    size_t page = 0;
+    while (1) {
+        bool more;
+        int ret = interact_with_dmenu_paged(&pager, page, hash, &more);
+        if (ret != EXIT_SUCCESS || !more) {
+            return ret;
+        }
+        page++;
+    }
+}
+
+/**
+ * Prompts the user to select a clip via their launcher a page at a time,
+ * and returns the selected content hash.
+ */
+static int _nonnull_ prompt_user_for_hash_paged(struct config *cfg,
+                                                uint64_t *hash) {
+    _drop_(close) int ipc_fd = ipc_connect(cfg);
+    if (ipc_fd >= 0) {
+        struct cm_ipc_request req = {.op = CM_IPC_STATS};
+        struct cm_ipc_reply reply;
+        _drop_(cm_buf_free) struct cm_buf body = {0};
+        if (ipc_request(ipc_fd, &req, NULL, &reply, &body, NULL) == 0 &&
+            reply.status == 0) {
+            return prompt_user_paged(cfg, NULL, reply.nr_snips, hash);
+        }
+    }
+
+    _drop_(close) int content_dir_fd = open(get_cache_dir(cfg), O_RDONLY);
+    _drop_(close) int snip_fd =
+        open(get_line_cache_path(cfg), O_RDWR | O_CREAT, 0600);
+    expect(content_dir_fd >= 0 && snip_fd >= 0);
+
+    _drop_(stats_unmap) struct cm_stats *stats = NULL;
+    _drop_(cs_destroy) struct clip_store cs;
+    expect(cs_init(&cs, snip_fd, content_dir_fd) == 0);
+    // Count our lock timings along with clipmenud's, if it has stats
+    if (stats_map(get_stats_path(cfg), STATS_MAP_APPEND, &stats) == 0) {
+        cs.stats = stats;
+    }
+
+    size_t nr;
+    expect(cs_len(&cs, &nr) == 0);
+    return prompt_user_paged(cfg, &cs, nr, hash);
+}
+
+/**
+ * Prompts the user to select a clip via their launcher, and returns the
+ * selected content hash.
+ */
+static int _nonnull_ prompt_user_for_hash(struct config *cfg, uint64_t *hash) {
+    if (cfg->menu_page || cfg->menu_limit) {
+        return prompt_user_for_hash_paged(cfg, hash);
+    }
 
+    int input_pipe[2], output_pipe[2];
+    start_launcher(cfg, input_pipe, output_pipe);
     return interact_with_dmenu(cfg, input_pipe, output_pipe, hash);
 }
 
+/**
+ * Find snips matching a query in the clip store directly, for when clipmenud
+ * isn't running. Returns the number of matches stored in @out, which must have
+ * space for @limit entries.
+ *
+ * @cs: The clip store to operate on
+ * @op: CM_IPC_FILTER or CM_IPC_SEARCH, see print_matches()
+ * @query: The query
+ * @limit: The maximum number of matches
+ * @out: Output for the index in cs->snips of each match
+ */
+static size_t _nonnull_ find_matches_local(struct clip_store *cs,
+                                           enum cm_ipc_op op, const char *query,
+                                           size_t limit, size_t *out) {
+    size_t nr_matches;
+    int ret;
+
+    if (op == CM_IPC_SEARCH) {
+        ret = cs_search(cs, query, limit, out, &nr_matches);
+        die_on(ret < 0, "Failed to search: %s\n", strerror(-ret));
+        return nr_matches;
+    }
+
+    _drop_(free) struct cs_match *matches = malloc(limit * sizeof(*matches));
+    expect(matches || limit == 0);
+    ret = cs_filter(cs, query, limit, matches, &nr_matches);
+    die_on(ret < 0, "Failed to filter: %s\n", strerror(-ret));
+    for (size_t i = 0; i < nr_matches; i++) {
+        out[i] = matches[i].idx;
+    }
+    return nr_matches;
+}
+
+/**
+ * Print the snips matching a query without involving the launcher, one per
+ * line as "hash<TAB>line". With CM_IPC_FILTER, the first lines of snips are
+ * fuzzy matched and ranked best first. With CM_IPC_SEARCH, the full content
+ * is searched for the query as a substring, newest first.
+ */
+static int _nonnull_ print_matches(struct config *cfg, enum cm_ipc_op op,
+                                   const char *query, size_t limit) {
+    _drop_(close) int ipc_fd = ipc_connect(cfg);
+    if (ipc_fd >= 0) {
+        struct cm_ipc_request req = {.op = op, .limit = limit};
+        struct cm_ipc_reply reply;
+        _drop_(cm_buf_free) struct cm_buf body = {0};
+        int ret = ipc_request(ipc_fd, &req, query, &reply, &body, NULL);
+        die_on(ret < 0, "Failed to query clipmenud: %s\n", strerror(-ret));
+        die_on(reply.status < 0, "Failed to match: %s\n",
+               strerror(-reply.status));
+
+        struct cm_ipc_entry ent;
+        char line[CS_SNIP_LINE_SIZE];
+        size_t pos = 0;
+        while (ipc_next_entry(&body, &pos, &ent, line)) {
+            printf("%" PRIu64 "\t%s\n", ent.hash, line);
+        }
+        return 0;
+    }
+
+    _drop_(close) int content_dir_fd = open(get_cache_dir(cfg), O_RDONLY);
+    _drop_(close) int snip_fd =
+        open(get_line_cache_path(cfg), O_RDWR | O_CREAT, 0600);
+    expect(content_dir_fd >= 0 && snip_fd >= 0);
+
+    _drop_(stats_unmap) struct cm_stats *stats = NULL;
+    _drop_(cs_destroy) struct clip_store cs;
+    expect(cs_init(&cs, snip_fd, content_dir_fd) == 0);
+    // Count our lock timings along with clipmenud's, if it has stats
+    if (stats_map(get_stats_path(cfg), STATS_MAP_APPEND, &stats) == 0) {
+        cs.stats = stats;
+    }
+
+    _drop_(cs_unref) struct ref_guard guard = cs_ref(&cs);
+    size_t cur_clips;
+    expect(cs_len(&cs, &cur_clips) == 0);
+    size_t k = limit < cur_clips ? limit : cur_clips;
+    _drop_(free) size_t *matches = malloc(k * sizeof(*matches));
+    expect(matches || k == 0);
+
+    size_t nr_matches = find_matches_local(&cs, op, query, k, matches);
+    for (size_t i = 0; i < nr_matches; i++) {
+        const struct cs_snip *snip = cs.snips + matches[i];
+        printf("%" PRIu64 "\t%s\n", snip->hash, snip->line);
+    }
+    return 0;
+}
+
 int main(int argc, char *argv[]) {
     dmenu_user_argc = argc;
     dmenu_user_argv = argv;
 
     _drop_(config_free) struct config cfg = setup("clipmenu");
 
+    if (argc > 1 &&
+        (streq(argv[1], "--filter") || streq(argv[1], "--search"))) {
+        bool search = streq(argv[1], "--search");
+        uint64_t limit = search ? INDEX_DEFAULT_LIMIT : FILTER_DEFAULT_LIMIT;
+        die_on(argc < 3 || argc > 4 ||
+                   (argc == 4 && str_to_uint64(argv[3], &limit) < 0),
+               "Usage: clipmenu %s query [limit]\n", argv[1]);
+        return print_matches(&cfg, search ? CM_IPC_SEARCH : CM_IPC_FILTER,
+                             argv[2], limit);
+    }
+
     uint64_t hash;
     int dmenu_exit_code = prompt_user_for_hash(&cfg, &hash);
 
     if (dmenu_exit_code == EXIT_SUCCESS) {
-        run_clipserve(hash);
+        run_clipserve(hash, NULL);
     }
 
     return dmenu_exit_code;
@@ -1,79 +1,146 @@
-#include <X11/Xatom.h>
-#include <X11/Xlib.h>
-#include <X11/extensions/Xfixes.h>
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <regex.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
 #include <sys/select.h>
 #include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <time.h>
 #include <unistd.h>
 
 #include "config.h"
+#include "filter.h"
+#include "index.h"
+#include "ipc.h"
+#include "menu.h"
+#include "partial.h"
+#include "pattern.h"
+#include "scan.h"
+#include "spsc.h"
+#include "stats.h"
 #include "store.h"
+#include "trace.h"
 #include "util.h"
 #include "x.h"
 
-static Display *dpy;
 static struct clip_store cs;
+static struct menu menu;
 static struct config cfg;
-static Window win;
 
 static int enabled = 1;
 static int sig_fd;
+static int ipc_fd = -1;
+static int expiry_fd = -1;
+static uint64_t next_expiry;
+static int debounce_fd = -1;
 
-static struct cm_selections sels[CM_SEL_MAX];
+/* Storage thread only: whether removed content is waiting in the graveyard */
+#define GC_SLICE 16 /* Content entries deleted each time we're idle */
+static bool gc_pending;
+
+static struct cm_stats *stats_region;
+static struct cm_trace *trace_region;
+
+static struct pattern_matcher ignore_matchers[CM_SEL_MAX][IGNORE_FIELD_MAX];
+
+/* Bits of x_window_info.verdicts, so each owner is only matched against the
+ * ignore rules for a selection once */
+#define VERDICT_CHECKED(sel) (1u << (2 * (sel)))
+#define VERDICT_IGNORED(sel) (1u << (2 * (sel) + 1))
+
+/* Clips are stored by a separate storage thread, so that a large write or a
+ * trim never stops us reading X events. The X thread only deals with X, the
+ * signal fd and the debounce timer. Everything which touches the clip store,
+ * including expiry and query clients, belongs to the storage thread. */
+#define STORE_QUEUE_SIZE 64 /* Clips waiting to be stored, a power of two */
 
 /**
- * Check if a text s1 is a possible partial of s2.
+ * A clip handed from the X thread to the storage thread.
  *
- * Chromium and some other badly behaved applications spam PRIMARY during
- * selection, so if you're selecting the text "abc", you get three clips: "a",
- * "ab", and "abc" (or "c", "bc", "abc" if selecting right to left). Attempt to
- * detect these. It's possible we were not fast enough to get all of them, so
- * unfortunately we can't check for strlen(s1)+1 either. It's also possible the
- * user first expands, and then retracts the selection, so we need to handle
- * that too.
- */
-static bool is_possible_partial(const char *s1, const char *s2) {
-    size_t len1 = strlen(s1), len2 = strlen(s2);
-
-    // Is one a prefix of the other?
-    if (strncmp(s1, s2, len1 < len2 ? len1 : len2) == 0) {
-        return true;
-    }
+ * @text: The text, which whoever ends up with the job takes ownership of, or
+ *        NULL if there was none
+ * @display: The index in displays[] of the display the text came from
+ * @sel: The selection the text came from
+ * @ttl: The number of seconds after which the clip expires, or 0 for none
+ * @since: When we were told about the selection change, in stats_now_us()
+ *         time, or 0 if we weren't
+ */
+struct store_job {
+    char *text;
+    size_t display;
+    enum selection_type sel;
+    uint64_t ttl;
+    uint64_t since;
+};
 
-    // Is one a suffix of the other?
-    if (len1 < len2) {
-        return strcmp(s1, s2 + len2 - len1) == 0;
-    } else {
-        return strcmp(s2, s1 + len1 - len2) == 0;
-    }
-}
+static struct spsc_queue store_queue;
+static pthread_t store_thread;
+static int store_wake_fd = -1; /* Written by the X thread after queueing */
+static int store_room_fd = -1; /* Written by the storage thread on popping */
+static atomic_bool store_waiting; /* Whether the X thread holds clips back */
+static atomic_bool store_stopping;
 
 /**
- * Retrieve the converted text put into our clip atom. In order for this to
- * happen a conversion must have been performed in an earlier iteration with
- * XConvertSelection.
+ * An X display we collect clips from. Usually there's just the one from
+ * $DISPLAY, but with the displays option, one clipmenud serves several (like
+ * the seats of a multi-seat machine, or a nested Xephyr), all feeding the one
+ * clip store. Everything here belongs to the X thread.
+ *
+ * @name: The display name, or NULL for $DISPLAY
+ * @conn: The connection to the display
+ * @win: Our window, which conversions are delivered to
+ * @xfixes_event_base: The number of the first XFixes event
+ * @sels: The atoms for each selection and where we have it converted to
+ * @atoms: The other atoms we use
+ * @windows: What we know about the windows which owned selections
+ * @pending_ttl: For each selection, the TTL for the clip being converted
+ * @pending_since: For each selection, when we were told about the change
+ *                 being converted, in stats_now_us() time, or 0
+ * @debounce_due: For each selection with a debounce window running, when it
+ *                ends, in stats_now_us() time
+ * @debounce_owner: For each selection with a debounce window running, the
+ *                  newest owner seen during it
+ * @convert_queued: For each selection, whether to ask for a conversion once
+ *                  the details of all the owners we're waiting on are in
+ * @convert_owner: For each selection with a conversion queued, the owner to
+ *                 ask
+ * @fetch_pending: For each selection, whether we've asked for its converted
+ *                 text and not yet read it
+ * @fetch_cookies: For each selection with a fetch pending, the request for it
+ * @store_held: For each selection, the newest clip which didn't fit in the
+ *              storage queue
  */
-static char *get_clipboard_text(Atom clip_atom) {
-    unsigned char *cur_text;
-    Atom actual_type;
-    int actual_format;
-    unsigned long nitems, bytes_after;
+struct display {
+    const char *name;
+    xcb_connection_t *conn;
+    xcb_window_t win;
+    uint8_t xfixes_event_base;
+    struct cm_selections sels[CM_SEL_MAX];
+    struct x_atoms atoms;
+    struct x_window_cache windows;
+    uint64_t pending_ttl[CM_SEL_MAX];
+    uint64_t pending_since[CM_SEL_MAX];
+    uint64_t debounce_due[CM_SEL_MAX];
+    xcb_window_t debounce_owner[CM_SEL_MAX];
+    bool convert_queued[CM_SEL_MAX];
+    xcb_window_t convert_owner[CM_SEL_MAX];
+    bool fetch_pending[CM_SEL_MAX];
+    xcb_get_property_cookie_t fetch_cookies[CM_SEL_MAX];
+    struct store_job *store_held[CM_SEL_MAX];
+};
 
-    int res =
-        XGetWindowProperty(dpy, DefaultRootWindow(dpy), clip_atom, 0L, (~0L),
-                           False, AnyPropertyType, &actual_type, &actual_format,
-                           &nitems, &bytes_after, &cur_text);
-    return res == Success ? (char *)cur_text : NULL;
-}
+static struct display displays[CM_DISPLAYS_MAX];
+static size_t nr_displays;
 
 /**
  * Return true if the given string contains any non-whitespace characters.
@@ -110,16 +177,132 @@ static bool is_clipserve(const char *win_title) {
 }
 
 /**
- * Determine if a window with the given title should be ignored based on user
- * configuration.
+ * Match @str against the ignore rules for @field of @sel, if there are any.
+ */
+static bool ignore_match(enum selection_type sel, enum ignore_field field,
+                         const char *str) {
+    struct pattern_matcher *m = &ignore_matchers[sel][field];
+    return str && m->set->nr && pattern_match(m, str, strlen(str));
+}
+
+/**
+ * Determine if clips from a window in @sel should be ignored based on user
+ * configuration. The answer is remembered in @info until the window changes,
+ * so the rules are only run once per owner however many clips it makes.
+ */
+static bool is_ignored_window(enum selection_type sel,
+                              struct x_window_info *info) {
+    if (!info) {
+        return false;
+    }
+    if (info->verdicts & VERDICT_CHECKED(sel)) {
+        return info->verdicts & VERDICT_IGNORED(sel);
+    }
+
+    bool ignored = ignore_match(sel, IGNORE_TITLE, info->title) ||
+                   ignore_match(sel, IGNORE_CLASS, info->instance) ||
+                   ignore_match(sel, IGNORE_CLASS, info->class);
+    if (!ignored && info->pid && ignore_matchers[sel][IGNORE_EXE].set->nr) {
+        char link[PATH_MAX], exe[PATH_MAX];
+        snprintf_safe(link, sizeof(link), "/proc/%" PRIu32 "/exe", info->pid);
+        ssize_t len = readlink(link, exe, sizeof(exe) - 1);
+        if (len > 0) {
+            exe[len] = '\0';
+            ignored = ignore_match(sel, IGNORE_EXE, exe);
+        }
+    }
+
+    info->verdicts |=
+        VERDICT_CHECKED(sel) | (ignored ? VERDICT_IGNORED(sel) : 0);
+    return ignored;
+}
+
+/**
+ * Work out which window attributes the ignore rules need fetched, as a mask
+ * of `enum x_window_attr`.
  */
-static bool is_ignored_window(char *win_title) {
-    if (!win_title || !cfg.ignore_window.set) {
+static uint32_t ignore_window_attrs(void) {
+    uint32_t attrs = 0;
+    for (size_t i = 0; i < CM_SEL_MAX; i++) {
+        if (cfg.ignore_rules.sets[i][IGNORE_CLASS].nr) {
+            attrs |= X_WINDOW_CLASS;
+        }
+        if (cfg.ignore_rules.sets[i][IGNORE_EXE].nr) {
+            attrs |= X_WINDOW_PID;
+        }
+    }
+    return attrs;
+}
+
+/**
+ * Return the TTL in seconds for clips from a window with the given title, or 0
+ * if no ttl_window rule matches it.
+ */
+static uint64_t window_ttl(const char *win_title) {
+    if (!win_title) {
         return 0;
     }
-    int ret = regexec(&cfg.ignore_window.rgx, win_title, 0, NULL, 0);
-    expect(ret == 0 || ret == REG_NOMATCH);
-    return !ret;
+    for (size_t i = 0; i < cfg.ttl_windows.nr; i++) {
+        int ret = regexec(&cfg.ttl_windows.rules[i].rgx, win_title, 0, NULL, 0);
+        expect(ret == 0 || ret == REG_NOMATCH);
+        if (ret == 0) {
+            return cfg.ttl_windows.rules[i].ttl;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Arm the expiry timer to fire at the given Unix time, unless it is already
+ * due to fire sooner. Firing early is harmless: expire_clips() just finds
+ * nothing to do and arms the timer again.
+ */
+static void schedule_expiry(uint64_t when) {
+    if (!when || (next_expiry && next_expiry <= when)) {
+        return;
+    }
+    struct itimerspec its = {.it_value = {.tv_sec = (time_t)when}};
+    expect(timerfd_settime(expiry_fd, TFD_TIMER_ABSTIME, &its, NULL) == 0);
+    next_expiry = when;
+    dbg("Next clip expiry scheduled at %" PRIu64 "\n", when);
+}
+
+/**
+ * Remove every expired clip in one batch, and arm the expiry timer for the
+ * next one to expire.
+ */
+static void expire_clips(void) {
+    uint64_t start = stats_now_us();
+    size_t nr_expired;
+    uint64_t next;
+    expect(cs_expire(&cs, (uint64_t)time(NULL), cfg.ttl, &nr_expired, &next) ==
+           0);
+    if (nr_expired > 0) {
+        dbg("Expired %zu clips\n", nr_expired);
+        gc_pending = true;
+        trace_emit(trace_region, TRACE_EXPIRE, TRACE_NO_SEL, 0, nr_expired);
+        expect(menu_rebuild(&menu, &cs) == 0);
+        stats_add(stats_region, STAT_EXPIRED_SNIPS, nr_expired);
+        stats_record(stats_region, HIST_TRIM, stats_now_us() - start);
+    }
+
+    next_expiry = 0;
+    if (next) {
+        schedule_expiry(next);
+    } else {
+        struct itimerspec its = {0};
+        expect(timerfd_settime(expiry_fd, TFD_TIMER_ABSTIME, &its, NULL) == 0);
+    }
+}
+
+/**
+ * The expiry timer fired, remove whatever is due.
+ */
+static void handle_expiry_event(void) {
+    uint64_t nr_fired;
+    ssize_t s = read(expiry_fd, &nr_fired, sizeof(nr_fired));
+    expect(s == sizeof(nr_fired) || (s < 0 && errno == EAGAIN));
+    expire_clips();
 }
 
 /**
@@ -145,25 +328,133 @@ static void handle_signalfd_event(void) {
 }
 
 /**
- * Something changed about the watched selection, consider converting it to our
- * desired property type.
+ * Ask @owner to convert @sel into our storage atom for it, unless it's a window
+ * we ignore.
  */
-static void handle_xfixes_selection_notify(XFixesSelectionNotifyEvent *se) {
-    _drop_(XFree) char *win_title = get_window_title(dpy, se->owner);
-    if (is_clipserve(win_title) || is_ignored_window(win_title)) {
+static void _nonnull_ request_conversion(struct display *d,
+                                         enum selection_type sel,
+                                         xcb_window_t owner) {
+    struct x_window_info *info = x_window_cache_get(&d->windows, owner);
+    const char *win_title = info ? info->title : NULL;
+    if (is_clipserve(win_title) || is_ignored_window(sel, info)) {
         dbg("Ignoring clip from window titled '%s'\n", win_title);
+        trace_emit(trace_region, TRACE_IGNORE, (uint8_t)sel, 0,
+                   TRACE_IGNORE_WINDOW);
+        d->pending_since[sel] = 0;
         return;
     }
 
+    dbg("Converting selection %s from owner '%s' (0x%lx)\n",
+        cfg.selections[sel].name, strnull(win_title), (unsigned long)owner);
+    d->pending_ttl[sel] = window_ttl(win_title);
+    trace_emit(trace_region, TRACE_CONVERT_REQUEST, (uint8_t)sel, 0, owner);
+    stats_add(stats_region, STAT_CONVERSIONS, 1);
+    xcb_convert_selection(d->conn, d->win, d->sels[sel].selection,
+                          d->atoms.utf8_string, d->sels[sel].storage,
+                          XCB_CURRENT_TIME);
+}
+
+/**
+ * Queue a conversion of @sel from @owner, and start fetching the owner's
+ * details, so that the details for every queued conversion are waited for
+ * together by flush_conversions().
+ */
+static void _nonnull_ queue_conversion(struct display *d,
+                                       enum selection_type sel,
+                                       xcb_window_t owner) {
+    x_window_cache_prefetch(&d->windows, owner);
+    d->convert_queued[sel] = true;
+    d->convert_owner[sel] = owner;
+}
+
+/**
+ * Ask for every queued conversion on @d.
+ */
+static void _nonnull_ flush_conversions(struct display *d) {
+    for (size_t i = 0; i < CM_SEL_MAX; i++) {
+        if (d->convert_queued[i]) {
+            d->convert_queued[i] = false;
+            request_conversion(d, (enum selection_type)i, d->convert_owner[i]);
+        }
+    }
+}
+
+/**
+ * Arm the debounce timer for the earliest debounce window to end on any
+ * display, or disarm it if none are running.
+ */
+static void arm_debounce(void) {
+    uint64_t next = 0;
+    for (size_t i = 0; i < nr_displays; i++) {
+        const uint64_t *due = displays[i].debounce_due;
+        for (size_t j = 0; j < CM_SEL_MAX; j++) {
+            if (due[j] && (!next || due[j] < next)) {
+                next = due[j];
+            }
+        }
+    }
+    struct itimerspec its = {
+        .it_value = {.tv_sec = (time_t)(next / 1000000),
+                     .tv_nsec = (long)(next % 1000000) * 1000}};
+    expect(timerfd_settime(debounce_fd, TFD_TIMER_ABSTIME, &its, NULL) == 0);
+}
+
+/**
+ * The debounce timer fired. Convert every selection whose owner has now been
+ * stable for its whole window.
+ */
+static void handle_debounce_event(void) {
+    uint64_t nr_fired;
+    ssize_t s = read(debounce_fd, &nr_fired, sizeof(nr_fired));
+    expect(s == sizeof(nr_fired) || (s < 0 && errno == EAGAIN));
+
+    uint64_t now = stats_now_us();
+    for (size_t i = 0; i < nr_displays; i++) {
+        struct display *d = &displays[i];
+        for (size_t j = 0; j < CM_SEL_MAX; j++) {
+            if (!d->debounce_due[j] || d->debounce_due[j] > now) {
+                continue;
+            }
+            d->debounce_due[j] = 0;
+            if (enabled) {
+                queue_conversion(d, (enum selection_type)j,
+                                 d->debounce_owner[j]);
+            }
+        }
+    }
+    arm_debounce();
+}
+
+/**
+ * Something changed about the watched selection, consider converting it to our
+ * desired property type.
+ *
+ * While the user drags out a selection, its owner may reassert it many times a
+ * second. If the selection has a debounce window, we wait until the owner has
+ * been stable for that long, so the whole drag costs one conversion.
+ */
+static void _nonnull_ handle_xfixes_selection_notify(
+    struct display *d, const struct x_xfixes_selection_notify_event *se) {
     enum selection_type sel =
-        selection_atom_to_selection_type(se->selection, sels);
-    dbg("Notified about selection update. Selection: %s, Owner: '%s' (0x%lx)\n",
-        cfg.selections[sel].name, strnull(win_title), (unsigned long)se->owner);
-    XConvertSelection(dpy, se->selection,
-                      XInternAtom(dpy, "UTF8_STRING", False), sels[sel].storage,
-                      win, CurrentTime);
+        selection_atom_to_selection_type(se->selection, d->sels);
+    trace_emit(trace_region, TRACE_XFIXES_NOTIFY, (uint8_t)sel, 0, se->owner);
+    stats_add(stats_region, STAT_SELECTION_NOTIFIES, 1);
+    d->pending_since[sel] = stats_now_us();
+
+    uint64_t window_ms = cfg.debounce_ms[sel];
+    if (!window_ms) {
+        queue_conversion(d, sel, se->owner);
+        return;
+    }
 
-    return;
+    dbg("Debouncing selection %s for %" PRIu64 "ms\n",
+        cfg.selections[sel].name, window_ms);
+    if (d->debounce_due[sel]) {
+        stats_add(stats_region, STAT_DEBOUNCED, 1);
+    }
+    d->debounce_owner[sel] = se->owner;
+    d->debounce_due[sel] = d->pending_since[sel] + window_ms * 1000;
+    arm_debounce();
 }
 
 /**
@@ -172,10 +463,12 @@ static void handle_xfixes_selection_notify(XFixesSelectionNotifyEvent *se) {
  * an explicit request to tell us that there is no owner. In that case, return
  * -ENOENT.
  */
-static int handle_selection_notify(const XSelectionEvent *se) {
-    if (se->property == None) {
+static int _nonnull_
+handle_selection_notify(struct display *d,
+                        const xcb_selection_notify_event_t *se) {
+    if (se->property == XCB_NONE) {
         enum selection_type sel =
-            selection_atom_to_selection_type(se->selection, sels);
+            selection_atom_to_selection_type(se->selection, d->sels);
         dbg("X reports that %s has no current owner\n",
             cfg.selections[sel].name);
         return -ENOENT;
@@ -185,13 +478,35 @@ static int handle_selection_notify(const XSelectionEvent *se) {
 
 /**
  * Trims the clip store if the number of clips exceeds the configured batch
- * size.
+ * size, or evicts clips if their content exceeds the configured byte budget.
  */
 static void maybe_trim(void) {
+    uint64_t start = stats_now_us();
     uint64_t cur_clips;
     expect(cs_len(&cs, &cur_clips) == 0);
+    bool changed = false;
     if ((int)cur_clips > cfg.max_clips_batch) {
         expect(cs_trim(&cs, CS_ITER_NEWEST_FIRST, (size_t)cfg.max_clips) == 0);
+        stats_add(stats_region, STAT_TRIMMED_SNIPS,
+                  cur_clips - (uint64_t)cfg.max_clips);
+        trace_emit(trace_region, TRACE_TRIM, TRACE_NO_SEL, 0,
+                   cur_clips - (uint64_t)cfg.max_clips);
+        changed = true;
+    }
+    if (cfg.max_bytes && cs.header->nr_bytes > cfg.max_bytes) {
+        size_t nr_evicted;
+        expect(cs_evict(&cs, cfg.evict, cfg.max_bytes, &nr_evicted) == 0);
+        trace_emit(trace_region, TRACE_TRIM, TRACE_NO_SEL, 0, nr_evicted);
+        dbg("Evicted %zu clips to fit in %" PRIu64 " bytes\n", nr_evicted,
+            cfg.max_bytes);
+        stats_add(stats_region, STAT_EVICTED_SNIPS, nr_evicted);
+        changed |= nr_evicted > 0;
+    }
+    if (changed) {
+        gc_pending = true;
+        expect(menu_rebuild(&menu, &cs) == 0);
+        stats_add(stats_region, STAT_TRIMS, 1);
+        stats_record(stats_region, HIST_TRIM, stats_now_us() - start);
     }
 }
 
@@ -200,60 +515,304 @@ static void maybe_trim(void) {
  */
 #define PARTIAL_MAX_SECS 2
 
+/* How many recent clips from each selection new ones are checked against */
+#define PARTIAL_CANDIDATES 4
+
+/**
+ * A recently stored clip, which later clips from the same selection may turn
+ * out to be partials of.
+ *
+ * @text: The clip text, freed with free(), or NULL if this slot is unused
+ * @pt: @text prepared for partial detection
+ * @hash: The hash of the clip in the clip store
+ * @time: When the clip was stored
+ */
+struct partial_candidate {
+    char *text;
+    struct partial_text pt;
+    uint64_t hash;
+    time_t time;
+};
+
+/* For each display and selection, the recent clips from it, newest first */
+static struct partial_candidate partial_candidates[CM_DISPLAYS_MAX][CM_SEL_MAX]
+                                                  [PARTIAL_CANDIDATES];
+
+static void partial_candidate_clear(struct partial_candidate *pc) {
+    if (pc->text) {
+        partial_text_free(&pc->pt);
+        free(pc->text);
+        pc->text = NULL;
+    }
+}
+
 /**
- * Store the clipboard text. If the text is a possible partial of the last clip
- * and it was received shortly afterwards, replace instead of adding.
+ * Find the newest recent clip from @sel on @display which @new may be a
+ * partial of, and forget any which are too old to merge with.
+ *
+ * @display: The index in displays[] of the display @new came from
+ * @sel: The selection @new came from
+ * @new: The new clip
+ * @now: The current time
+ * @out_match: Output for how @new relates to the returned clip
  */
-static uint64_t store_clip(char *text) {
-    static char *last_text = NULL;
-    static time_t last_text_time;
+static struct partial_candidate *
+find_partial_candidate(size_t display, enum selection_type sel,
+                       const struct partial_text *new, time_t now,
+                       enum partial_match *out_match) {
+    struct partial_candidate *found = NULL;
+    for (size_t i = 0; i < PARTIAL_CANDIDATES; i++) {
+        struct partial_candidate *pc = &partial_candidates[display][sel][i];
+        if (!pc->text) {
+            continue;
+        }
+        if (difftime(now, pc->time) > PARTIAL_MAX_SECS) {
+            partial_candidate_clear(pc);
+        } else if (!found) {
+            *out_match = partial_match(&pc->pt, new);
+            found = *out_match == PARTIAL_NONE ? NULL : pc;
+        }
+    }
+    return found;
+}
 
+/**
+ * Store the clipboard text. If the text is a possible partial of a clip
+ * received shortly before from the same selection on the same display, merge
+ * it into that clip instead of adding.
+ *
+ * @text: The clipboard text
+ * @display: The index in displays[] of the display the text came from
+ * @sel: The selection the text came from
+ * @ttl: The number of seconds after which the clip expires, or 0 for none
+ * @sensitive: Whether the text has sensitive content in it. Such clips are
+ *             never merged, since the merged clip would keep the old expiry
+ */
+static uint64_t store_clip(char *text, size_t display,
+                           enum selection_type sel, uint64_t ttl,
+                           bool sensitive) {
     dbg("Clipboard text is considered salient, storing\n");
     time_t current_time = time(NULL);
-    uint64_t hash;
-    if (last_text &&
-        difftime(current_time, last_text_time) <= PARTIAL_MAX_SECS &&
-        is_possible_partial(last_text, text)) {
-        dbg("Possible partial of last clip, replacing\n");
-        expect(cs_replace(&cs, CS_ITER_NEWEST_FIRST, 0, text, &hash) == 0);
+    struct partial_candidate new = {.text = text, .time = current_time};
+    expect(partial_text_init(&new.pt, text, strlen(text)) == 0);
+
+    enum partial_match match = PARTIAL_NONE;
+    struct partial_candidate *merge_into =
+        sensitive ? NULL
+                  : find_partial_candidate(display, sel, &new.pt,
+                                           current_time, &match);
+
+    // The clip we'd merge into may have been deleted since
+    size_t age = 0;
+    int ret = merge_into ? cs_merge(&cs, merge_into->hash, text, new.pt.len,
+                                    match == PARTIAL_EXTENDS, &age, &new.hash)
+                         : -ENOENT;
+    expect(ret == 0 || ret == -ENOENT);
+    bool partial = ret == 0;
+    if (partial) {
+        dbg("Possible partial of a recent clip, replacing\n");
+        gc_pending = true;
+        expect((age == 0 ? menu_replace_newest(&menu, &cs)
+                         : menu_rebuild(&menu, &cs)) == 0);
+        stats_add(stats_region, STAT_PARTIAL_REPLACEMENTS, 1);
     } else {
-        expect(cs_add(&cs, text, &hash) == 0);
+        expect(cs_add(&cs, text, ttl, &new.hash) == 0);
+        expect(menu_add_newest(&menu, &cs) == 0);
+        stats_add(stats_region, STAT_CLIPS_ADDED, 1);
     }
+    trace_emit(trace_region, TRACE_STORE, (uint8_t)sel, new.hash, partial);
 
-    if (last_text) {
-        XFree(last_text);
+    uint64_t expires = ttl && (!cfg.ttl || ttl < cfg.ttl) ? ttl : cfg.ttl;
+    if (expires) {
+        schedule_expiry((uint64_t)current_time + expires);
     }
-    last_text = text;
-    last_text_time = current_time;
 
-    return hash;
+    // The new clip takes the place of the one it was merged into, or of the
+    // oldest, and goes to the front
+    struct partial_candidate *cands = partial_candidates[display][sel];
+    struct partial_candidate *slot =
+        merge_into ? merge_into : &cands[PARTIAL_CANDIDATES - 1];
+    partial_candidate_clear(slot);
+    memmove(cands + 1, cands, (size_t)(slot - cands) * sizeof(*cands));
+    cands[0] = new;
+
+    return new.hash;
 }
 
 /**
- * Something changed in our clip storage atoms. Work out whether we want to
- * store the new content as a clipboard entry.
+ * Something changed in our clip storage atoms, so a conversion is ready. Ask
+ * for the text, which flush_fetches() waits for.
  */
-static int handle_property_notify(const XPropertyEvent *pe) {
+static void _nonnull_
+handle_property_notify(struct display *d,
+                       const xcb_property_notify_event_t *pe) {
     bool found = false;
     for (size_t i = 0; i < CM_SEL_MAX; ++i) {
-        if (sels[i].storage == pe->atom) {
+        if (d->sels[i].storage == pe->atom) {
             found = true;
             break;
         }
     }
-    if (!found || pe->state != PropertyNewValue) {
-        return -EINVAL;
+    if (!found || pe->state != XCB_PROPERTY_NEW_VALUE) {
+        return;
     }
 
     dbg("Received notification that selection conversion is ready\n");
-    char *text = get_clipboard_text(pe->atom);
+    enum selection_type sel =
+        storage_atom_to_selection_type(pe->atom, d->sels);
+    if (d->fetch_pending[sel]) {
+        // Superseded before we got to it, the new request gets the same text
+        xcb_discard_reply(d->conn, d->fetch_cookies[sel].sequence);
+    }
+    d->fetch_cookies[sel] =
+        xcb_get_property(d->conn, 0, d->win, pe->atom,
+                         XCB_GET_PROPERTY_TYPE_ANY, 0, X_PROPERTY_ALL);
+    d->fetch_pending[sel] = true;
+}
+
+/**
+ * Look for sensitive content in @text, and act on it as configured: @text may
+ * be redacted in place, or given a shorter @ttl. Returns false if it shouldn't
+ * be stored at all.
+ *
+ * @sel: The selection the text came from
+ * @text: The text, which may be replaced
+ * @ttl: The TTL the clip would otherwise have, which may be shortened
+ * @out_found: Set to whether there was any sensitive content
+ */
+static bool filter_sensitive(enum selection_type sel, char **text,
+                             uint64_t *ttl, bool *out_found) {
+    struct sensitive_span span;
+    *out_found = sensitive_find(&cfg.sensitive, *text, strlen(*text), 0, &span);
+    if (!*out_found) {
+        return true;
+    }
+
+    dbg("Clip contains sensitive content (%s)\n",
+        sensitive_kind_name(span.kind));
+    stats_add(stats_region, STAT_SENSITIVE_CLIPS, 1);
+    switch (cfg.sensitive.action) {
+        case SENSITIVE_ACTION_SKIP:
+            trace_emit(trace_region, TRACE_IGNORE, (uint8_t)sel, 0,
+                       TRACE_IGNORE_SENSITIVE);
+            return false;
+        case SENSITIVE_ACTION_REDACT:
+            sensitive_redact(&cfg.sensitive, text);
+            break;
+        case SENSITIVE_ACTION_TTL:
+            if (cfg.sensitive.ttl && (!*ttl || cfg.sensitive.ttl < *ttl)) {
+                *ttl = cfg.sensitive.ttl;
+            }
+            break;
+    }
+    return true;
+}
+
+/**
+ * Clips copied on one display within this many seconds of the same text being
+ * copied on another are taken to have been copied across, and only move the
+ * stored clip to the front rather than being stored again
+ */
+#define DISPLAY_DEDUPE_SECS 10
+
+/* How many recently stored clips are checked for cross-display duplicates */
+#define RECENT_CLIPS 16
+
+/**
+ * A recently stored clip, for spotting the same text arriving from another
+ * display.
+ *
+ * @hash: The djb64 hash of the text
+ * @time: When it was stored
+ * @display: The index in displays[] of the display it came from
+ */
+struct recent_clip {
+    uint64_t hash;
+    time_t time;
+    size_t display;
+};
+
+static struct recent_clip recent_clips[RECENT_CLIPS];
+static size_t recent_clips_next;
+
+/**
+ * Check whether @text was just stored from a display other than @display, and
+ * remember it as stored from @display if not. Only called when watching more
+ * than one display.
+ *
+ * @out_hash: Output for the hash of @text
+ */
+static bool _nonnull_ is_display_duplicate(const char *text, size_t display,
+                                           uint64_t *out_hash) {
+    uint64_t hash = djb64_hash(text);
+    *out_hash = hash;
+    time_t now = time(NULL);
+    for (size_t i = 0; i < RECENT_CLIPS; i++) {
+        struct recent_clip *rc = &recent_clips[i];
+        if (rc->time && rc->hash == hash && rc->display != display &&
+            difftime(now, rc->time) <= DISPLAY_DEDUPE_SECS) {
+            return true;
+        }
+    }
+    recent_clips[recent_clips_next] = (struct recent_clip){
+        .hash = hash, .time = now, .display = display};
+    recent_clips_next = (recent_clips_next + 1) % RECENT_CLIPS;
+    return false;
+}
+
+/**
+ * We have the converted text for a selection. Work out whether we want to
+ * store it as a clipboard entry. Runs on the storage thread.
+ *
+ * @job: The clip, whose text we take ownership of. The caller frees the job
+ */
+static void handle_clip_text(const struct store_job *job) {
+    enum selection_type sel = job->sel;
+    char *text = job->text;
+    if (!text) {
+        dbg("No text for %s, ignoring\n", cfg.selections[sel].name);
+        trace_emit(trace_region, TRACE_IGNORE, (uint8_t)sel, 0,
+                   TRACE_IGNORE_WHITESPACE);
+        return;
+    }
+
     char line[CS_SNIP_LINE_SIZE];
     first_line(text, line);
     dbg("First line: %s\n", line);
 
     if (is_salient_text(text)) {
-        uint64_t hash = store_clip(text);
+        uint64_t ttl = job->ttl;
+        bool sensitive;
+        if (!filter_sensitive(sel, &text, &ttl, &sensitive)) {
+            free(text);
+            return;
+        }
+        uint64_t dup_hash;
+        if (nr_displays > 1 &&
+            is_display_duplicate(text, job->display, &dup_hash)) {
+            dbg("Clip was just copied on another display, moving to front\n");
+            stats_add(stats_region, STAT_DISPLAY_DUPLICATES, 1);
+            // It may have been deleted since, in which case it stays deleted
+            size_t age;
+            int ret = cs_bump(&cs, dup_hash, &age);
+            expect(ret == 0 || ret == -ENOENT);
+            if (ret == 0 && age > 0) {
+                expect(menu_rebuild(&menu, &cs) == 0);
+            }
+            trace_emit(trace_region, TRACE_IGNORE, (uint8_t)sel, 0,
+                       TRACE_IGNORE_DUPLICATE);
+            free(text);
+            return;
+        }
+        uint64_t hash = store_clip(text, job->display, sel, ttl, sensitive);
+        if (job->since) {
+            stats_record(stats_region, HIST_INGEST,
+                         stats_now_us() - job->since);
+        }
         maybe_trim();
+        // Serving a redacted clip would take away what was actually copied
+        bool redacted =
+            sensitive && cfg.sensitive.action == SENSITIVE_ACTION_REDACT;
         /* We only own CLIPBOARD because otherwise the behaviour is wonky:
          *
          *  1. When you select in a browser and press ^V, it repastes what you
@@ -261,120 +820,797 @@ static int handle_property_notify(const XPropertyEvent *pe) {
          *  2. urxvt and some other terminal emulators will unhilight on PRIMARY
          *     ownership being taken away from them
          */
-        enum selection_type sel =
-            storage_atom_to_selection_type(pe->atom, sels);
-        if (cfg.owned_selections[sel].active && cfg.own_clipboard) {
-            run_clipserve(hash);
+        if (cfg.owned_selections[sel].active && cfg.own_clipboard &&
+            !redacted) {
+            // Take ownership back on the display it was copied on
+            run_clipserve(hash, displays[job->display].name);
         }
     } else {
         dbg("Clipboard text is whitespace only, ignoring\n");
-        XFree(text);
+        trace_emit(trace_region, TRACE_IGNORE, (uint8_t)sel, 0,
+                   TRACE_IGNORE_WHITESPACE);
+        free(text);
     }
+}
+
+static void eventfd_poke(int fd) {
+    uint64_t one = 1;
+    expect(write(fd, &one, sizeof(one)) == sizeof(one));
+}
+
+static void eventfd_drain(int fd) {
+    uint64_t count;
+    ssize_t s = read(fd, &count, sizeof(count));
+    expect(s == sizeof(count) || (s < 0 && errno == EAGAIN));
+}
 
+static void store_job_free(struct store_job *job) {
+    free(job->text);
+    free(job);
+}
+
+/**
+ * Queue every clip we've held back, in display and selection order, stopping
+ * if the queue fills up again. Returns true if none are left held back.
+ */
+static bool store_flush_held(void) {
+    bool queued = false, flushed = true;
+    for (size_t i = 0; i < nr_displays * CM_SEL_MAX; i++) {
+        struct store_job **held =
+            &displays[i / CM_SEL_MAX].store_held[i % CM_SEL_MAX];
+        if (!*held) {
+            continue;
+        }
+        if (!spsc_queue_push(&store_queue, *held)) {
+            flushed = false;
+            break;
+        }
+        *held = NULL;
+        queued = true;
+    }
+    if (queued) {
+        eventfd_poke(store_wake_fd);
+    }
+    return flushed;
+}
+
+/**
+ * Try to queue the clips we've held back, and if that can't be done yet, have
+ * the storage thread tell us when there's room.
+ */
+static void store_retry_held(void) {
+    atomic_store_explicit(&store_waiting, true, memory_order_relaxed);
+    // Pairs with the fence in drain_store_queue(): either we see the room it
+    // made, or it sees that we're waiting
+    atomic_thread_fence(memory_order_seq_cst);
+    if (store_flush_held()) {
+        atomic_store_explicit(&store_waiting, false, memory_order_relaxed);
+    }
+}
+
+/**
+ * Hand the text for @sel to the storage thread. We never wait for it: if its
+ * queue is full, we hold on to the newest clip from each selection until
+ * there's room, and drop any older clip held back from the same selection.
+ *
+ * @d: The display the text came from
+ * @sel: The selection the text came from
+ * @text: The text, which we take ownership of, or NULL if there was none
+ */
+static void _nonnull_n_(1) queue_clip_text(struct display *d,
+                                           enum selection_type sel,
+                                           char *text) {
+    trace_emit(trace_region, TRACE_PROPERTY_NOTIFY, (uint8_t)sel, 0,
+               text ? strlen(text) : 0);
+    struct store_job *job = malloc(sizeof(*job));
+    expect(job);
+    *job = (struct store_job){text, (size_t)(d - displays), sel,
+                              d->pending_ttl[sel], d->pending_since[sel]};
+    d->pending_ttl[sel] = 0;
+    d->pending_since[sel] = 0;
+
+    // Clips already held back go first, so that nothing overtakes them
+    if (store_flush_held() && spsc_queue_push(&store_queue, job)) {
+        eventfd_poke(store_wake_fd);
+        return;
+    }
+
+    stats_add(stats_region, STAT_STORE_QUEUE_FULL, 1);
+    if (d->store_held[sel]) {
+        dbg("Storage queue full, dropping an older clip from %s\n",
+            cfg.selections[sel].name);
+        stats_add(stats_region, STAT_STORE_QUEUE_DROPS, 1);
+        trace_emit(trace_region, TRACE_IGNORE, (uint8_t)sel, 0,
+                   TRACE_IGNORE_QUEUE_FULL);
+        store_job_free(d->store_held[sel]);
+    }
+    d->store_held[sel] = job;
+    store_retry_held();
+}
+
+/**
+ * The storage thread made room in its queue while we were holding clips back.
+ */
+static void handle_store_room_event(void) {
+    eventfd_drain(store_room_fd);
+    store_retry_held();
+}
+
+/**
+ * Read the text for every selection on @d we asked for it for, and hand it to
+ * the storage thread. Returns how many fetches finished, with text or not.
+ */
+static size_t _nonnull_ flush_fetches(struct display *d) {
+    size_t nr_handled = 0;
+    for (size_t i = 0; i < CM_SEL_MAX; i++) {
+        if (!d->fetch_pending[i]) {
+            continue;
+        }
+        d->fetch_pending[i] = false;
+        struct cm_buf buf = {0};
+        int ret =
+            x_property_read(d->conn, d->fetch_cookies[i], stats_region, &buf);
+        if (ret < 0) {
+            // The owner gave us nothing, like when it went away first
+            dbg("No text for %s: %s\n", cfg.selections[i].name,
+                strerror(-ret));
+            cm_buf_free(&buf);
+            d->pending_ttl[i] = 0;
+            d->pending_since[i] = 0;
+        } else {
+            queue_clip_text(d, (enum selection_type)i, buf.data);
+        }
+        nr_handled++;
+    }
+    return nr_handled;
+}
+
+/**
+ * Private data for the cs_remove callback used to serve CM_IPC_DELETE.
+ *
+ * @matcher: The matcher for the patterns in the request payload, if not
+ *           matching content
+ * @content_matches: If matching content, whether each snip's content matched,
+ *                   oldest first
+ * @pos: The index of the next snip to be passed to the callback
+ * @range_start: The index of the first snip in the requested time range
+ * @range_end: The index after the last snip in the requested time range
+ * @flags: The request flags, see `enum cm_ipc_flags`
+ * @reply: The reply to count matches in
+ * @body: The reply body to add matching snips to
+ */
+struct ipc_delete_state {
+    struct pattern_matcher matcher;
+    bool *content_matches;
+    size_t pos;
+    size_t range_start;
+    size_t range_end;
+    uint32_t flags;
+    struct cm_ipc_reply *reply;
+    struct cm_buf *body;
+};
+
+/**
+ * Callback for cs_remove when serving CM_IPC_DELETE. Matching snips are sent
+ * back to the client, and only removed if this isn't a dry run.
+ */
+static enum cs_remove_action _nonnull_
+ipc_remove_if_rgx_match(uint64_t hash, const char *line, void *private) {
+    struct ipc_delete_state *state = private;
+    size_t idx = state->pos++;
+    if (idx < state->range_start || idx >= state->range_end) {
+        return CS_ACTION_KEEP;
+    }
+    bool matched = state->content_matches
+                       ? state->content_matches[idx]
+                       : pattern_match(&state->matcher, line, strlen(line));
+
+    bool wants_del = (state->flags & CM_IPC_F_INVERT) ? !matched : matched;
+    if (!wants_del) {
+        return CS_ACTION_KEEP;
+    }
+
+    ipc_buf_add_entry(state->body, hash, 0, line);
+    state->reply->nr_entries++;
+    return (state->flags & CM_IPC_F_DRY_RUN) ? CS_ACTION_KEEP
+                                             : CS_ACTION_REMOVE;
+}
+
+/**
+ * Serve CM_IPC_LIST: send up to req->limit snips after skipping req->offset,
+ * in the requested direction. The skipped snips are jumped over rather than
+ * walked, so clipmenu's later menu pages cost no more than the first.
+ */
+static int _nonnull_ ipc_handle_list(const struct cm_ipc_request *req,
+                                     struct cm_ipc_reply *reply,
+                                     struct cm_buf *body) {
+    _drop_(cs_unref) struct ref_guard guard = cs_ref(&cs);
+    if (guard.status < 0) {
+        return guard.status;
+    }
+
+    size_t nr_snips = cs.header->nr_snips;
+    uint64_t nr = req->offset < nr_snips ? nr_snips - req->offset : 0;
+    if (req->limit && req->limit < nr) {
+        nr = req->limit;
+    }
+    for (uint64_t i = 0; i < nr; i++) {
+        uint64_t pos = req->direction == CS_ITER_OLDEST_FIRST
+                           ? req->offset + i
+                           : nr_snips - 1 - req->offset - i;
+        const struct cs_snip *snip = cs.snips + pos;
+        ipc_buf_add_entry(body, snip->hash, snip->nr_lines, snip->line);
+    }
+    reply->nr_entries = nr;
+    reply->nr_snips = nr_snips;
+    return 0;
+}
+
+/**
+ * Serve CM_IPC_GET: pass the content fd for req->hash to the client.
+ */
+static int _nonnull_ ipc_handle_get(const struct cm_ipc_request *req,
+                                    struct cm_ipc_reply *reply, int *out_fd) {
+    _drop_(cs_unref) struct ref_guard guard = cs_ref(&cs);
+    if (guard.status < 0) {
+        return guard.status;
+    }
+
+    int fd = cs_content_open(&cs, req->hash);
+    if (fd < 0) {
+        return fd;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        int ret = negative_errno();
+        close(fd);
+        return ret;
+    }
+    reply->size = (uint64_t)st.st_size;
+    *out_fd = fd;
+    return 0;
+}
+
+/**
+ * Serve CM_IPC_DELETE: remove snips matching the regex in the payload, or any
+ * of the regexes in it with CM_IPC_F_PATTERN_LIST.
+ */
+static int _nonnull_ ipc_handle_delete(const struct cm_ipc_request *req,
+                                       const char *payload,
+                                       struct cm_ipc_reply *reply,
+                                       struct cm_buf *body) {
+    struct ipc_delete_state state = {
+        .flags = req->flags, .reply = reply, .body = body};
+    int ret;
+
+    _drop_(pattern_set_free) struct pattern_set set;
+    pattern_set_init(&set, req->flags & CM_IPC_F_CONTENT);
+    if (req->flags & CM_IPC_F_PATTERN_LIST) {
+        size_t bad_line;
+        ret = pattern_set_add_lines(&set, payload, &bad_line);
+    } else {
+        ret = pattern_set_add(&set, payload);
+    }
+    if (ret < 0) {
+        return ret;
+    }
+    pattern_set_compile(&set);
+
+    _drop_(cs_unref) struct ref_guard guard = cs_ref(&cs);
+    if (guard.status < 0) {
+        return guard.status;
+    }
+    cs_snip_time_range(&guard, req->after, req->before, &state.range_start,
+                       &state.range_end);
+
+    if (req->flags & CM_IPC_F_CONTENT) {
+        _drop_(free) bool *matches =
+            calloc(cs.header->nr_snips + 1, sizeof(*matches));
+        expect(matches);
+        ret = cs_content_match_patterns(&cs, &set, matches);
+        if (ret < 0) {
+            return ret;
+        }
+        state.content_matches = matches;
+        ret = cs_remove(&cs, CS_ITER_OLDEST_FIRST, ipc_remove_if_rgx_match,
+                        &state);
+    } else {
+        pattern_matcher_init(&state.matcher, &set);
+        ret = cs_remove(&cs, CS_ITER_OLDEST_FIRST, ipc_remove_if_rgx_match,
+                        &state);
+        pattern_matcher_free(&state.matcher);
+    }
+    if (ret < 0) {
+        return ret;
+    }
+    if (reply->nr_entries > 0 && !(req->flags & CM_IPC_F_DRY_RUN)) {
+        ret = menu_rebuild(&menu, &cs);
+        if (ret < 0) {
+            return ret;
+        }
+        // Unlike trimming, the user asked for these to go, so make sure the
+        // content is gone by the time we answer
+        ret = cs_gc(&cs, SIZE_MAX, &gc_pending);
+        if (ret < 0) {
+            return ret;
+        }
+        stats_add(stats_region, STAT_GC_ENTRIES, (uint64_t)ret);
+    }
+    size_t nr_snips;
+    ret = cs_len(&cs, &nr_snips);
+    reply->nr_snips = nr_snips;
+    return ret;
+}
+
+/**
+ * Serve CM_IPC_STATS: send the current clip store statistics.
+ */
+static int _nonnull_ ipc_handle_stats(struct cm_ipc_reply *reply,
+                                      struct cm_buf *body) {
+    _drop_(cs_unref) struct ref_guard guard = cs_ref(&cs);
+    if (guard.status < 0) {
+        return guard.status;
+    }
+    struct cm_ipc_stats stats = {.nr_snips = cs.header->nr_snips,
+                                 .nr_snips_alloc = cs.header->nr_snips_alloc,
+                                 .nr_bytes = cs.header->nr_bytes};
+    cm_buf_append(body, &stats, sizeof(stats));
+    reply->nr_snips = stats.nr_snips;
     return 0;
 }
 
 /**
- * Process X11 events, returning when we have either processed one clip, or
- * have received an indication that the selection is not owned.
+ * Serve CM_IPC_MENU: pass a snapshot of the prerendered menu to the client.
+ */
+static int _nonnull_ ipc_handle_menu(struct cm_ipc_reply *reply,
+                                     int *out_fd) {
+    int fd = menu_snapshot(&menu, &cs);
+    if (fd < 0) {
+        return fd;
+    }
+    reply->nr_entries = menu.nr;
+    reply->nr_snips = menu.nr;
+    reply->size = menu_text_len(&menu);
+    *out_fd = fd;
+    return 0;
+}
+
+/**
+ * Serve CM_IPC_FILTER: send the snips best matching the query in the payload.
+ */
+static int _nonnull_ ipc_handle_filter(const struct cm_ipc_request *req,
+                                       const char *payload,
+                                       struct cm_ipc_reply *reply,
+                                       struct cm_buf *body) {
+    _drop_(cs_unref) struct ref_guard guard = cs_ref(&cs);
+    if (guard.status < 0) {
+        return guard.status;
+    }
+
+    size_t k = req->limit ? req->limit : FILTER_DEFAULT_LIMIT;
+    if (k > cs.header->nr_snips) {
+        k = cs.header->nr_snips;
+    }
+    _drop_(free) struct cs_match *matches = malloc(k * sizeof(*matches));
+    expect(matches || k == 0);
+
+    size_t nr_matches;
+    int ret = cs_filter(&cs, payload, k, matches, &nr_matches);
+    if (ret < 0) {
+        return ret;
+    }
+
+    for (size_t i = 0; i < nr_matches; i++) {
+        const struct cs_snip *snip = cs.snips + matches[i].idx;
+        ipc_buf_add_entry(body, snip->hash, snip->nr_lines, snip->line);
+    }
+    reply->nr_entries = nr_matches;
+    reply->nr_snips = cs.header->nr_snips;
+    return 0;
+}
+
+/**
+ * Serve CM_IPC_SEARCH: send the snips whose content contains the payload. The
+ * first search builds the content index, after which our own clip store
+ * operations keep it up to date.
+ */
+static int _nonnull_ ipc_handle_search(const struct cm_ipc_request *req,
+                                       const char *payload,
+                                       struct cm_ipc_reply *reply,
+                                       struct cm_buf *body) {
+    _drop_(cs_unref) struct ref_guard guard = cs_ref(&cs);
+    if (guard.status < 0) {
+        return guard.status;
+    }
+
+    size_t limit = req->limit ? req->limit : INDEX_DEFAULT_LIMIT;
+    if (limit > cs.header->nr_snips) {
+        limit = cs.header->nr_snips;
+    }
+    _drop_(free) size_t *matches = malloc(limit * sizeof(*matches));
+    expect(matches || limit == 0);
+
+    size_t nr_matches;
+    int ret = cs_search(&cs, payload, limit, matches, &nr_matches);
+    if (ret < 0) {
+        return ret;
+    }
+
+    for (size_t i = 0; i < nr_matches; i++) {
+        const struct cs_snip *snip = cs.snips + matches[i];
+        ipc_buf_add_entry(body, snip->hash, snip->nr_lines, snip->line);
+    }
+    reply->nr_entries = nr_matches;
+    reply->nr_snips = cs.header->nr_snips;
+    return 0;
+}
+
+/**
+ * Accept a client on the query socket and answer its request. Clients are
+ * served one at a time: every request is answered from our existing mapping
+ * of the clip store, so they are all short.
+ */
+static void handle_ipc_client(void) {
+    _drop_(close) int fd = ipc_accept(ipc_fd);
+    if (fd < 0) {
+        dbg("Failed to accept query client: %s\n", strerror(-fd));
+        return;
+    }
+
+    struct cm_ipc_request req;
+    char payload[CM_IPC_PAYLOAD_MAX + 1];
+    int ret = ipc_read_request(fd, &req, payload);
+    if (ret < 0) {
+        dbg("Failed to read query request: %s\n", strerror(-ret));
+        return;
+    }
+
+    struct cm_ipc_reply reply = {0};
+    _drop_(cm_buf_free) struct cm_buf body = {0};
+    _drop_(close) int pass_fd = -1;
+
+    dbg("Serving query op %" PRIu32 "\n", req.op);
+    switch (req.op) {
+        case CM_IPC_LIST:
+            ret = ipc_handle_list(&req, &reply, &body);
+            break;
+        case CM_IPC_GET:
+            ret = ipc_handle_get(&req, &reply, &pass_fd);
+            break;
+        case CM_IPC_DELETE:
+            ret = ipc_handle_delete(&req, payload, &reply, &body);
+            break;
+        case CM_IPC_STATS:
+            ret = ipc_handle_stats(&reply, &body);
+            break;
+        case CM_IPC_MENU:
+            ret = ipc_handle_menu(&reply, &pass_fd);
+            break;
+        case CM_IPC_FILTER:
+            ret = ipc_handle_filter(&req, payload, &reply, &body);
+            break;
+        case CM_IPC_SEARCH:
+            ret = ipc_handle_search(&req, payload, &reply, &body);
+            break;
+        default:
+            ret = -EOPNOTSUPP;
+    }
+
+    reply.status = ret;
+    if (ret < 0) {
+        body.len = 0;
+    }
+    ret = ipc_send_reply(fd, &reply, pass_fd, &body);
+    if (ret < 0) {
+        dbg("Failed to send query reply: %s\n", strerror(-ret));
+    }
+}
+
+/**
+ * Handle a single X event from @d. Anything which needs a reply from the X
+ * server is only queued, for handle_x11_events() to complete. Returns -ENOENT
+ * if the event says a selection has no owner.
+ */
+static int _nonnull_ dispatch_x11_event(struct display *d,
+                                        const xcb_generic_event_t *evt) {
+    uint8_t type = evt->response_type & ~0x80;
+    if (type == 0) {
+        x_check_error((const xcb_generic_error_t *)evt);
+        return 0;
+    }
+
+    if (x_window_cache_handle_event(&d->windows, evt)) {
+        return 0;
+    }
+
+    if (!enabled) {
+        dbg("Got X event, but ignoring as collection is disabled\n");
+        trace_emit(trace_region, TRACE_IGNORE, TRACE_NO_SEL, 0,
+                   TRACE_IGNORE_DISABLED);
+        return 0;
+    }
+
+    if (type == d->xfixes_event_base + X_XFIXES_SELECTION_NOTIFY) {
+        handle_xfixes_selection_notify(
+            d, (const struct x_xfixes_selection_notify_event *)evt);
+    } else if (type == XCB_PROPERTY_NOTIFY) {
+        handle_property_notify(d, (const xcb_property_notify_event_t *)evt);
+    } else if (type == XCB_SELECTION_NOTIFY) {
+        return handle_selection_notify(
+            d, (const xcb_selection_notify_event_t *)evt);
+    }
+    return 0;
+}
+
+static bool _nonnull_ x11_work_queued(const struct display *d) {
+    for (size_t i = 0; i < CM_SEL_MAX; i++) {
+        if (d->convert_queued[i] || d->fetch_pending[i]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Process X11 events from @d, returning 0 if we processed at least one clip,
+ * -ENOENT if we received an indication that the selection is not owned, or
+ * -EINPROGRESS if neither.
  *
  * The usual sequence is:
  *
- * 1. Get an XFixesSelectionNotify that we have a new selection.
- * 2. Call XConvertSelection() on it to get a string in our prop.
- * 3. Wait for a PropertyNotify that says that's ready.
- * 4. When it's ready, store it, and return from the function.
+ * 1. Get an XFixes SelectionNotify that we have a new selection.
+ * 2. Ask for the owner's title, unless we already have it.
+ * 3. Call ConvertSelection on it to get a string in our prop.
+ * 4. Wait for a PropertyNotify that says that's ready.
+ * 5. When it's ready, ask for the text, and hand it to the storage thread.
+ *
+ * Steps 2 and 5 need replies from the X server. Rather than wait for each in
+ * turn, we first handle every event we have, which only sends requests, and
+ * then collect all of their replies. When several selections change at once,
+ * that costs about the same as one.
  *
  * Another possible outcome, especially when trying to get the initial state at
  * startup, is that we get a SelectionNotify even with owner == None, which
  * means the selection is unowned. At that point we also return, since it's
  * clear that an explicit request has been nacked.
  */
-static int handle_x11_event(int evt_base) {
-    while (XPending(dpy)) {
-        XEvent evt;
-        XNextEvent(dpy, &evt);
-
-        if (!enabled) {
-            dbg("Got X event, but ignoring as collection is disabled\n");
-            continue;
+static int _nonnull_ handle_x11_events(struct display *d) {
+    int ret = -EINPROGRESS;
+    while (1) {
+        xcb_flush(d->conn);
+        xcb_generic_event_t *evt;
+        while ((evt = xcb_poll_for_event(d->conn))) {
+            if (dispatch_x11_event(d, evt) == -ENOENT) {
+                ret = -ENOENT;
+            }
+            free(evt);
         }
+        die_on(xcb_connection_has_error(d->conn),
+               "Lost connection to X server %s\n", strnull(d->name));
 
-        int ret;
-        if (evt.type == evt_base + XFixesSelectionNotify) {
-            handle_xfixes_selection_notify((XFixesSelectionNotifyEvent *)&evt);
-        } else if (evt.type == PropertyNotify) {
-            ret = handle_property_notify((XPropertyEvent *)&evt);
-            if (ret == 0) {
-                return ret;
-            }
-        } else if (evt.type == SelectionNotify) {
-            ret = handle_selection_notify((XSelectionEvent *)&evt);
-            if (ret < 0) {
-                return ret;
-            }
+        // Waiting for replies may have brought more events, so go round again
+        if (!x11_work_queued(d)) {
+            return ret;
+        }
+        flush_conversions(d);
+        if (flush_fetches(d) > 0) {
+            ret = 0;
         }
     }
-
-    return -EINPROGRESS;
 }
 
 /**
  * Continuously wait for and process X11 or signal events until we fully
- * process success or failure for a clip.
+ * process success or failure for a clip on any display. Runs on the X thread.
  */
-static int get_one_clip(int evt_base) {
+static int get_one_clip(void) {
     while (1) {
-        // It's possible that we have more X events to process, but because of
-        // the way the protocol works, we won't get told about them until we
-        // next get an event if we wait for select(). Check for them first.
-        if (XPending(dpy)) {
-            return handle_x11_event(evt_base);
+        // XCB may already have read events while we were waiting for replies,
+        // which select() won't tell us about, so always check first. Every
+        // display gets a look in before we return, so none can starve another
+        int ret = -EINPROGRESS;
+        for (size_t i = 0; i < nr_displays; i++) {
+            int d_ret = handle_x11_events(&displays[i]);
+            if (d_ret != -EINPROGRESS) {
+                ret = d_ret;
+            }
+        }
+        if (ret != -EINPROGRESS) {
+            return ret;
         }
 
         fd_set fds;
-        int x_fd = ConnectionNumber(dpy);
-
         FD_ZERO(&fds);
         FD_SET(sig_fd, &fds);
-        FD_SET(x_fd, &fds);
+        FD_SET(debounce_fd, &fds);
+        FD_SET(store_room_fd, &fds);
 
-        int max_fd = sig_fd > x_fd ? sig_fd : x_fd;
+        int max_fd = sig_fd > debounce_fd ? sig_fd : debounce_fd;
+        for (size_t i = 0; i < nr_displays; i++) {
+            int x_fd = xcb_get_file_descriptor(displays[i].conn);
+            FD_SET(x_fd, &fds);
+            max_fd = x_fd > max_fd ? x_fd : max_fd;
+        }
+        max_fd = store_room_fd > max_fd ? store_room_fd : max_fd;
         expect(select(max_fd + 1, &fds, NULL, NULL, NULL) > 0);
 
         if (FD_ISSET(sig_fd, &fds)) {
             handle_signalfd_event();
         }
 
-        if (FD_ISSET(x_fd, &fds)) {
-            return handle_x11_event(evt_base);
+        if (FD_ISSET(debounce_fd, &fds)) {
+            handle_debounce_event();
+        }
+
+        if (FD_ISSET(store_room_fd, &fds)) {
+            handle_store_room_event();
+        }
+    }
+}
+
+/**
+ * Store every clip in the storage queue.
+ */
+static void drain_store_queue(void) {
+    struct store_job *job;
+    while ((job = spsc_queue_pop(&store_queue))) {
+        // Pairs with the fence in store_retry_held(). Tell the X thread about
+        // the room before spending any time on the clip
+        atomic_thread_fence(memory_order_seq_cst);
+        if (atomic_load_explicit(&store_waiting, memory_order_relaxed) &&
+            atomic_exchange(&store_waiting, false)) {
+            eventfd_poke(store_room_fd);
         }
+        handle_clip_text(job);
+        free(job);
     }
 }
 
-static int setup_watches(int evt_base) {
-    XSelectInput(dpy, win, PropertyChangeMask);
+/**
+ * Delete a slice of the content entries which trimming, eviction and expiry
+ * left in the graveyard. Each slice is kept short, so that a clip arriving
+ * meanwhile waits for at most one of them.
+ */
+static void gc_slice(void) {
+    uint64_t start = stats_now_us();
+    int ret = cs_gc(&cs, GC_SLICE, &gc_pending);
+    if (ret < 0) {
+        // Try again after the next removal, rather than spin on it now
+        dbg("Failed to delete removed content: %s\n", strerror(-ret));
+        gc_pending = false;
+        return;
+    }
+    stats_add(stats_region, STAT_GC_ENTRIES, (uint64_t)ret);
+    stats_record(stats_region, HIST_GC, stats_now_us() - start);
+}
+
+/**
+ * The storage thread: store the clips the X thread hands us, and serve
+ * everything else which needs the clip store, until store_thread_stop().
+ * Whenever there's nothing else to do, it deletes removed content.
+ */
+static void *store_thread_run(void *arg) {
+    (void)arg;
+    while (1) {
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(store_wake_fd, &fds);
+        FD_SET(expiry_fd, &fds);
+        if (ipc_fd >= 0) {
+            FD_SET(ipc_fd, &fds);
+        }
+
+        int max_fd = store_wake_fd > expiry_fd ? store_wake_fd : expiry_fd;
+        max_fd = ipc_fd > max_fd ? ipc_fd : max_fd;
+        struct timeval idle = {0};
+        int nr_ready =
+            select(max_fd + 1, &fds, NULL, NULL, gc_pending ? &idle : NULL);
+        expect(nr_ready >= 0);
+        if (nr_ready == 0) {
+            gc_slice();
+            continue;
+        }
+
+        if (FD_ISSET(store_wake_fd, &fds)) {
+            eventfd_drain(store_wake_fd);
+            // Everything queued before we were asked to stop still gets
+            // stored
+            bool stopping = atomic_load(&store_stopping);
+            drain_store_queue();
+            if (stopping) {
+                return NULL;
+            }
+        }
+
+        if (FD_ISSET(expiry_fd, &fds)) {
+            handle_expiry_event();
+        }
+
+        if (ipc_fd >= 0 && FD_ISSET(ipc_fd, &fds)) {
+            handle_ipc_client();
+        }
+    }
+}
+
+/**
+ * Start the storage thread. From here on, only it may touch the clip store,
+ * the menu, the expiry timer or the query socket.
+ */
+static void store_thread_start(void) {
+    expect(spsc_queue_init(&store_queue, STORE_QUEUE_SIZE) == 0);
+    store_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    store_room_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    expect(store_wake_fd >= 0 && store_room_fd >= 0);
+    expect(pthread_create(&store_thread, NULL, store_thread_run, NULL) == 0);
+}
+
+/**
+ * Have the storage thread store everything queued, and wait for it to exit.
+ * Anything still held back is then stored here.
+ */
+static void store_thread_stop(void) {
+    atomic_store(&store_stopping, true);
+    eventfd_poke(store_wake_fd);
+    expect(pthread_join(store_thread, NULL) == 0);
+
+    for (size_t i = 0; i < nr_displays * CM_SEL_MAX; i++) {
+        struct store_job **held =
+            &displays[i / CM_SEL_MAX].store_held[i % CM_SEL_MAX];
+        if (*held) {
+            handle_clip_text(*held);
+            free(*held);
+            *held = NULL;
+        }
+    }
+    expect(cs_gc(&cs, SIZE_MAX, NULL) >= 0);
+    spsc_queue_free(&store_queue);
+    close(store_wake_fd);
+    close(store_room_fd);
+}
+
+static int _nonnull_ setup_watches(struct display *d) {
+    x_select_input(d->conn, d->win, XCB_EVENT_MASK_PROPERTY_CHANGE);
 
     for (size_t i = 0; i < CM_SEL_MAX; i++) {
         struct selection sel = cfg.selections[i];
         if (!sel.active) {
             continue;
         }
-        Atom sel_atom = sels[i].selection;
-        XFixesSelectSelectionInput(dpy, win, sel_atom,
-                                   XFixesSetSelectionOwnerNotifyMask);
-        dbg("Getting initial value for selection %s\n", sel.name);
-        XConvertSelection(dpy, sel_atom, XInternAtom(dpy, "UTF8_STRING", False),
-                          sels[i].storage, win, CurrentTime);
-        get_one_clip(evt_base);
+        xcb_atom_t sel_atom = d->sels[i].selection;
+        x_xfixes_select_selection_input(
+            d->conn, d->win, sel_atom,
+            X_XFIXES_SET_SELECTION_OWNER_NOTIFY_MASK);
+        dbg("Getting initial value for selection %s on %s\n", sel.name,
+            strnull(d->name));
+        xcb_convert_selection(d->conn, d->win, sel_atom,
+                              d->atoms.utf8_string, d->sels[i].storage,
+                              XCB_CURRENT_TIME);
+        get_one_clip();
     }
 
     return 0;
 }
 
-static int _noreturn_ run(int evt_base) {
+/**
+ * Connect to the display @name, or $DISPLAY if it's NULL, and add it to
+ * displays[].
+ */
+static void display_open(const char *name) {
+    struct display *d = &displays[nr_displays++];
+    d->name = name;
+    d->conn = x_connect(name, &d->win);
+    setup_selections(d->conn, d->sels);
+    x_atoms_init(d->conn, &d->atoms);
+    x_window_cache_init(&d->windows, d->conn, d->win, &d->atoms,
+                        ignore_window_attrs());
+    d->windows.stats = stats_region;
+    die_on(x_xfixes_init(d->conn, &d->xfixes_event_base) < 0,
+           "XFixes missing on %s\n", strnull(name));
+}
+
+static int _noreturn_ run(void) {
     while (1) {
-        get_one_clip(evt_base);
+        get_one_clip();
     }
 }
 
@@ -382,7 +1618,6 @@ static int _noreturn_ run(int evt_base) {
 int main(int argc, char *argv[]) {
     (void)argv;
     die_on(argc != 1, "clipmenud doesn't accept any arguments\n");
-    int evt_base;
 
     cfg = setup("clipmenud");
     write_status();
@@ -393,10 +1628,53 @@ int main(int argc, char *argv[]) {
     expect(content_dir_fd >= 0 && snip_fd >= 0);
 
     expect(cs_init(&cs, snip_fd, content_dir_fd) == 0);
+    expect(menu_rebuild(&menu, &cs) == 0);
+
+    int ret = stats_map(get_stats_path(&cfg), STATS_MAP_CREATE, &stats_region);
+    if (ret < 0) {
+        // Stats are nice to have, but not worth refusing to run over
+        fprintf(stderr, "Failed to create stats region: %s\n", strerror(-ret));
+    } else {
+        cs.stats = stats_region;
+        stats_set(stats_region, STAT_BYTES_STORED, cs.header->nr_bytes);
+    }
+
+    ret = trace_map(get_trace_path(&cfg), TRACE_MAP_CREATE, &trace_region);
+    if (ret < 0) {
+        fprintf(stderr, "Failed to create trace ring: %s\n", strerror(-ret));
+    }
+
+    // Removed content may have been left behind by clipdel, or by us if we
+    // didn't get to it before exiting
+    gc_pending = true;
+
+    // Clips may have expired while we weren't running
+    expiry_fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+    expect(expiry_fd >= 0);
+    expire_clips();
+
+    debounce_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    expect(debounce_fd >= 0);
+
+    ipc_fd = ipc_listen(&cfg);
+    if (ipc_fd < 0) {
+        // Clients fall back to using the clip store directly
+        fprintf(stderr, "Failed to create query socket: %s\n",
+                strerror(-ipc_fd));
+    }
 
-    die_on(!(dpy = XOpenDisplay(NULL)), "Cannot open display\n");
-    win = DefaultRootWindow(dpy);
-    setup_selections(dpy, sels);
+    if (cfg.displays.nr == 0) {
+        display_open(NULL);
+    }
+    for (size_t i = 0; i < cfg.displays.nr; i++) {
+        display_open(cfg.displays.names[i]);
+    }
+    for (size_t i = 0; i < CM_SEL_MAX; i++) {
+        for (size_t j = 0; j < IGNORE_FIELD_MAX; j++) {
+            pattern_matcher_init(&ignore_matchers[i][j],
+                                 &cfg.ignore_rules.sets[i][j]);
+        }
+    }
 
     sigset_t mask;
     sigemptyset(&mask);
@@ -407,18 +1685,39 @@ int main(int argc, char *argv[]) {
     expect(sig_fd >= 0);
     expect(signal(SIGCHLD, SIG_IGN) != SIG_ERR);
 
-    int unused;
-    die_on(!XFixesQueryExtension(dpy, &evt_base, &unused), "XFixes missing\n");
-
-    setup_watches(evt_base);
+    // After blocking the signals above, so that the thread inherits that
+    store_thread_start();
+    for (size_t i = 0; i < nr_displays; i++) {
+        setup_watches(&displays[i]);
+    }
 
     if (!cfg.oneshot) {
-        run(evt_base);
+        run();
     }
+    store_thread_stop();
 
+    if (ipc_fd >= 0) {
+        close(ipc_fd);
+        unlink(get_sock_path(&cfg));
+    }
+    close(expiry_fd);
+    close(debounce_fd);
+    for (size_t i = 0; i < nr_displays; i++) {
+        x_window_cache_free(&displays[i].windows);
+    }
+    for (size_t i = 0; i < CM_SEL_MAX; i++) {
+        for (size_t j = 0; j < IGNORE_FIELD_MAX; j++) {
+            pattern_matcher_free(&ignore_matchers[i][j]);
+        }
+    }
+    menu_free(&menu);
     expect(cs_destroy(&cs) == 0);
+    stats_unmap(stats_region);
+    trace_unmap(trace_region);
+    for (size_t i = 0; i < nr_displays; i++) {
+        xcb_disconnect(displays[i].conn);
+    }
     config_free(&cfg);
-    XCloseDisplay(dpy);
     return 0;
 }
 #endif
@@ -1,119 +1,315 @@
-#include <X11/Xatom.h>
-#include <X11/Xlib.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "config.h"
+#include "ipc.h"
+#include "stats.h"
 #include "store.h"
+#include "trace.h"
 #include "util.h"
 #include "x.h"
 
-static Display *dpy;
+static xcb_connection_t *conn;
+static struct cm_trace *trace_region;
+
+/* Anything bigger would make XCB drop the connection, rather than the server
+ * refuse the request, so bigger content is sent with INCR in chunks of this */
+static size_t max_property_bytes;
+
+#define MAX_INCR_TRANSFERS 16
+
+/**
+ * A transfer of content too big for one property, sent a chunk at a time as
+ * the requestor deletes the last one (ICCCM 2.7.2).
+ *
+ * @requestor: The window we're writing to, or XCB_NONE if the slot is free
+ * @property: The property on @requestor we're writing to
+ * @target: The type the requestor asked for
+ * @offset: How much of the content has been sent so far
+ * @finished: Whether the zero-length chunk ending the transfer was sent
+ */
+struct incr_transfer {
+    xcb_window_t requestor;
+    xcb_atom_t property;
+    xcb_atom_t target;
+    size_t offset;
+    bool finished;
+};
+
+static struct incr_transfer incr_transfers[MAX_INCR_TRANSFERS];
+static size_t nr_incr_transfers;
+
+/**
+ * Start an INCR transfer to @req's property. Returns -EBUSY if too many
+ * transfers are already in progress.
+ */
+static int _nonnull_ incr_start(const xcb_selection_request_event_t *req,
+                                const struct x_atoms *atoms,
+                                const struct cs_content *content) {
+    struct incr_transfer *xfer = NULL;
+    for (size_t i = 0; i < arrlen(incr_transfers) && !xfer; i++) {
+        if (incr_transfers[i].requestor == XCB_NONE) {
+            xfer = &incr_transfers[i];
+        }
+    }
+    if (!xfer) {
+        return -EBUSY;
+    }
+
+    *xfer = (struct incr_transfer){.requestor = req->requestor,
+                                   .property = req->property,
+                                   .target = req->target};
+    nr_incr_transfers++;
+
+    // Deletions of the property pace the transfer, and if the requestor goes
+    // away without finishing it we still want to know
+    x_select_input(conn, req->requestor,
+                   XCB_EVENT_MASK_PROPERTY_CHANGE |
+                       XCB_EVENT_MASK_STRUCTURE_NOTIFY);
+    // The size is only a lower bound, but ours is exact
+    uint32_t size = content->size > UINT32_MAX ? UINT32_MAX
+                                               : (uint32_t)content->size;
+    xcb_change_property(conn, XCB_PROP_MODE_REPLACE, req->requestor,
+                        req->property, atoms->incr, 32, 1, &size);
+    return 0;
+}
+
+/**
+ * Free @xfer's slot, and stop listening to its requestor unless another
+ * transfer to it is still in progress.
+ */
+static void _nonnull_ incr_finish(struct incr_transfer *xfer) {
+    xcb_window_t requestor = xfer->requestor;
+    xfer->requestor = XCB_NONE;
+    nr_incr_transfers--;
+    for (size_t i = 0; i < arrlen(incr_transfers); i++) {
+        if (incr_transfers[i].requestor == requestor) {
+            return;
+        }
+    }
+    x_select_input(conn, requestor, XCB_EVENT_MASK_NO_EVENT);
+}
+
+/**
+ * Send the next chunk of an INCR transfer once the requestor has deleted the
+ * last one, ending with a zero-length chunk.
+ */
+static void _nonnull_ handle_property_notify(
+    const xcb_property_notify_event_t *pev, const struct cs_content *content) {
+    if (pev->state != XCB_PROPERTY_DELETE) {
+        return;
+    }
+    for (size_t i = 0; i < arrlen(incr_transfers); i++) {
+        struct incr_transfer *xfer = &incr_transfers[i];
+        if (xfer->requestor != pev->window || xfer->property != pev->atom) {
+            continue;
+        }
+        if (xfer->finished) {
+            incr_finish(xfer);
+            break;
+        }
+        size_t len = (size_t)content->size - xfer->offset;
+        len = len < max_property_bytes ? len : max_property_bytes;
+        xcb_change_property(conn, XCB_PROP_MODE_REPLACE, xfer->requestor,
+                            xfer->property, xfer->target, 8, (uint32_t)len,
+                            content->data + xfer->offset);
+        xfer->offset += len;
+        xfer->finished = len == 0;
+        xcb_flush(conn);
+        break;
+    }
+}
+
+/**
+ * Drop any INCR transfers to a window which was destroyed before it took all
+ * of the content.
+ */
+static void _nonnull_
+handle_destroy_notify(const xcb_destroy_notify_event_t *dev) {
+    for (size_t i = 0; i < arrlen(incr_transfers); i++) {
+        if (incr_transfers[i].requestor == dev->window) {
+            dbg("Window 0x%lx went away during INCR transfer\n",
+                (unsigned long)dev->window);
+            incr_transfers[i].requestor = XCB_NONE;
+            nr_incr_transfers--;
+        }
+    }
+}
+
+/**
+ * Answer a SelectionRequest with @content, or refuse it if we don't have the
+ * target it asks for. Content too big for one request is sent with INCR.
+ */
+static void _nonnull_ handle_selection_request(
+    const xcb_selection_request_event_t *req, const struct x_atoms *atoms,
+    uint64_t hash, const struct cs_content *content) {
+    xcb_selection_notify_event_t sev = {.response_type = XCB_SELECTION_NOTIFY,
+                                        .time = req->time,
+                                        .requestor = req->requestor,
+                                        .selection = req->selection,
+                                        .target = req->target,
+                                        .property = req->property};
+
+    // Only worth the round trip if we're going to print it
+    _drop_(free) char *window_title =
+        debug_mode_enabled() ? x_window_title(conn, atoms, req->requestor)
+                             : NULL;
+    dbg("Servicing request to window '%s' (0x%lx) for clip %" PRIu64 "\n",
+        strnull(window_title), (unsigned long)req->requestor, hash);
+    trace_emit(trace_region, TRACE_SERVE_REQUEST, TRACE_NO_SEL, hash,
+               req->requestor);
+
+    if (req->target == atoms->targets) {
+        xcb_atom_t available_targets[] = {atoms->utf8_string,
+                                          XCB_ATOM_STRING};
+        xcb_change_property(conn, XCB_PROP_MODE_REPLACE, req->requestor,
+                            req->property, XCB_ATOM_ATOM, 32,
+                            arrlen(available_targets), available_targets);
+    } else if ((req->target == atoms->utf8_string ||
+                req->target == XCB_ATOM_STRING) &&
+               (size_t)content->size <= max_property_bytes) {
+        xcb_change_property(conn, XCB_PROP_MODE_REPLACE, req->requestor,
+                            req->property, req->target, 8,
+                            (uint32_t)content->size, content->data);
+    } else if ((req->target == atoms->utf8_string ||
+                req->target == XCB_ATOM_STRING) &&
+               incr_start(req, atoms, content) == 0) {
+        dbg("Sending %zu bytes to 0x%lx with INCR\n", (size_t)content->size,
+            (unsigned long)req->requestor);
+    } else {
+        sev.property = XCB_NONE;
+    }
+
+    xcb_send_event(conn, 0, req->requestor, XCB_EVENT_MASK_NO_EVENT,
+                   (const char *)&sev);
+    xcb_flush(conn);
+}
 
 /**
  * Serve clipboard content for all X11 selection requests until all selections
- * have been claimed by another application.
+ * have been claimed by another application, and any INCR transfers are done.
  */
-static void _nonnull_ serve_clipboard(uint64_t hash,
-                                      struct cs_content *content) {
-    bool running = true;
-    XEvent evt;
-    Atom targets, utf8_string, selections[2] = {XA_PRIMARY};
-    Window win;
-    int remaining_selections;
-
-    dpy = XOpenDisplay(NULL);
-    expect(dpy);
-
-    win = XCreateSimpleWindow(dpy, DefaultRootWindow(dpy), 0, 0, 1, 1, 0, 0, 0);
-    XStoreName(dpy, win, "clipserve");
-    targets = XInternAtom(dpy, "TARGETS", False);
-    utf8_string = XInternAtom(dpy, "UTF8_STRING", False);
-
-    selections[1] = XInternAtom(dpy, "CLIPBOARD", False);
+static void _nonnull_n_(3) serve_clipboard(uint64_t hash,
+                                           const char *display,
+                                           struct cs_content *content) {
+    static const char title[] = "clipserve";
+    struct x_atoms atoms;
+    xcb_window_t root;
+
+    conn = x_connect(display, &root);
+    xcb_prefetch_maximum_request_length(conn);
+    xcb_window_t win = xcb_generate_id(conn);
+    xcb_create_window(conn, XCB_COPY_FROM_PARENT, win, root, 0, 0, 1, 1, 0,
+                      XCB_WINDOW_CLASS_INPUT_OUTPUT, XCB_COPY_FROM_PARENT, 0,
+                      NULL);
+    xcb_change_property(conn, XCB_PROP_MODE_REPLACE, win, XCB_ATOM_WM_NAME,
+                        XCB_ATOM_STRING, 8, sizeof(title) - 1, title);
+    x_atoms_init(conn, &atoms);
+    max_property_bytes = (size_t)xcb_get_maximum_request_length(conn) * 4 -
+                         sizeof(xcb_change_property_request_t);
+
+    // Take both selections, and then check both, in one round trip
+    xcb_atom_t selections[] = {XCB_ATOM_PRIMARY, atoms.clipboard};
+    xcb_get_selection_owner_cookie_t cookies[arrlen(selections)];
     for (size_t i = 0; i < arrlen(selections); i++) {
-        XSetSelectionOwner(dpy, selections[i], win, CurrentTime);
-        expect(XGetSelectionOwner(dpy, selections[i]) == win); // ICCCM 2.1
+        xcb_set_selection_owner(conn, win, selections[i], XCB_CURRENT_TIME);
+        cookies[i] = xcb_get_selection_owner(conn, selections[i]);
     }
-    remaining_selections = arrlen(selections);
-
-    while (running) {
-        XNextEvent(dpy, &evt);
-        switch (evt.type) {
-            case SelectionRequest: {
-                XSelectionRequestEvent *req = &evt.xselectionrequest;
-                XSelectionEvent sev = {.type = SelectionNotify,
-                                       .display = req->display,
-                                       .requestor = req->requestor,
-                                       .selection = req->selection,
-                                       .time = req->time,
-                                       .target = req->target,
-                                       .property = req->property};
-
-                _drop_(XFree) char *window_title =
-                    get_window_title(dpy, req->requestor);
-                dbg("Servicing request to window '%s' (0x%lx) for clip %" PRIu64
-                    "\n",
-                    strnull(window_title), (unsigned long)req->requestor, hash);
-
-                if (req->target == targets) {
-                    Atom available_targets[] = {utf8_string, XA_STRING};
-                    XChangeProperty(dpy, req->requestor, req->property, XA_ATOM,
-                                    32, PropModeReplace,
-                                    (unsigned char *)&available_targets,
-                                    arrlen(available_targets));
-                } else if (req->target == utf8_string ||
-                           req->target == XA_STRING) {
-                    XChangeProperty(dpy, req->requestor, req->property,
-                                    req->target, 8, PropModeReplace,
-                                    (unsigned char *)content->data,
-                                    (int)content->size);
-                } else {
-                    sev.property = None;
-                }
+    for (size_t i = 0; i < arrlen(selections); i++) {
+        _drop_(free) xcb_get_selection_owner_reply_t *reply =
+            x_wait_reply(conn, cookies[i].sequence, NULL);
+        expect(reply && reply->owner == win); // ICCCM 2.1
+    }
+    int remaining_selections = arrlen(selections);
+    trace_emit(trace_region, TRACE_SERVE_START, TRACE_NO_SEL, hash, 0);
 
-                XSendEvent(dpy, req->requestor, False, 0, (XEvent *)&sev);
+    while (remaining_selections > 0 || nr_incr_transfers > 0) {
+        _drop_(free) xcb_generic_event_t *evt = xcb_wait_for_event(conn);
+        die_on(!evt, "Lost connection to X server\n");
+        switch (evt->response_type & ~0x80) {
+            case 0:
+                x_check_error((xcb_generic_error_t *)evt);
                 break;
-            }
-            case SelectionClear: {
+            case XCB_SELECTION_REQUEST:
+                handle_selection_request(
+                    (xcb_selection_request_event_t *)evt, &atoms, hash,
+                    content);
+                break;
+            case XCB_PROPERTY_NOTIFY:
+                handle_property_notify((xcb_property_notify_event_t *)evt,
+                                       content);
+                break;
+            case XCB_DESTROY_NOTIFY:
+                handle_destroy_notify((xcb_destroy_notify_event_t *)evt);
+                break;
+            case XCB_SELECTION_CLEAR:
                 if (--remaining_selections == 0) {
                     dbg("Finished serving clip %" PRIu64 "\n", hash);
-                    running = false;
+                    trace_emit(trace_region, TRACE_SERVE_STOP, TRACE_NO_SEL,
+                               hash, 0);
                 } else {
                     dbg("%d selections remaining to serve for clip %" PRIu64
                         "\n",
                         remaining_selections, hash);
                 }
                 break;
-            }
         }
     }
 
-    XCloseDisplay(dpy);
+    xcb_disconnect(conn);
 }
 
-int main(int argc, char *argv[]) {
-    die_on(argc != 2, "Usage: clipserve [hash]\n");
-    _drop_(config_free) struct config cfg = setup("clipserve");
-
-    uint64_t hash;
-    expect(str_to_uint64(argv[1], &hash) == 0);
+/**
+ * Get the content for a hash from clipmenud, or directly from the clip store
+ * if clipmenud isn't running.
+ */
+static int _nonnull_ get_content(struct config *cfg, uint64_t hash,
+                                 struct cs_content *content) {
+    _drop_(close) int ipc_fd = ipc_connect(cfg);
+    if (ipc_fd >= 0) {
+        return ipc_content_get(ipc_fd, hash, content);
+    }
 
-    _drop_(close) int content_dir_fd = open(get_cache_dir(&cfg), O_RDONLY);
+    _drop_(close) int content_dir_fd = open(get_cache_dir(cfg), O_RDONLY);
     _drop_(close) int snip_fd =
-        open(get_line_cache_path(&cfg), O_RDWR | O_CREAT, 0600);
+        open(get_line_cache_path(cfg), O_RDWR | O_CREAT, 0600);
     expect(content_dir_fd >= 0 && snip_fd >= 0);
 
+    _drop_(stats_unmap) struct cm_stats *stats = NULL;
     _drop_(cs_destroy) struct clip_store cs;
     expect(cs_init(&cs, snip_fd, content_dir_fd) == 0);
+    // Count our lock timings along with clipmenud's, if it has stats
+    if (stats_map(get_stats_path(cfg), STATS_MAP_APPEND, &stats) == 0) {
+        cs.stats = stats;
+    }
+
+    return cs_content_get(&cs, hash, content);
+}
+
+int main(int argc, char *argv[]) {
+    die_on(argc < 2 || argc > 3, "Usage: clipserve hash [display]\n");
+    _drop_(config_free) struct config cfg = setup("clipserve");
+
+    uint64_t hash;
+    expect(str_to_uint64(argv[1], &hash) == 0);
 
     _drop_(cs_content_unmap) struct cs_content content;
-    die_on(cs_content_get(&cs, hash, &content) < 0,
+    die_on(get_content(&cfg, hash, &content) < 0,
            "Hash %" PRIu64 " inaccessible\n", hash);
 
-    serve_clipboard(hash, &content);
+    // Only clipmenud creates the trace ring, if it isn't there we just don't
+    // record anything
+    if (trace_map(get_trace_path(&cfg), TRACE_MAP_APPEND, &trace_region) < 0) {
+        trace_region = NULL;
+    }
+
+    serve_clipboard(hash, argc == 3 ? argv[2] : NULL, &content);
+    trace_unmap(trace_region);
 
     return 0;
 }
@@ -1,5 +1,3 @@
-#include <X11/Xatom.h>
-#include <X11/Xlib.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,7 +7,7 @@
 #include "config.h"
 #include "x.h"
 
-#define CLIPMENU_VERSION 7
+#define CLIPMENU_VERSION 9
 
 /**
  * Determines the runtime directory for storing application data. This is _not_
@@ -84,18 +82,229 @@ int convert_positive_int(const char *str, void *output) {
     return 0;
 }
 
+/**
+ * Parse a regex matching the titles of windows whose clips should be ignored,
+ * from any selection. Equivalent to "ignore title REGEX".
+ */
 int convert_ignore_window(const char *str, void *output) {
-    struct ignore_window *iw = output;
-    iw->set = (bool)str;
-    if (!iw->set) {
+    struct ignore_rules *ir = output;
+    if (!str) {
+        return 0;
+    }
+    for (size_t i = 0; i < CM_SEL_MAX; i++) {
+        if (pattern_set_add(&ir->sets[i][IGNORE_TITLE], str) < 0) {
+            return -EINVAL;
+        }
+    }
+    return 0;
+}
+
+int convert_duration(const char *str, void *output) {
+    return str_to_duration(str, output);
+}
+
+int convert_size(const char *str, void *output) {
+    return str_to_size(str, output);
+}
+
+int convert_evict_policy(const char *str, void *output) {
+    if (streq(str, "oldest")) {
+        *(enum cs_evict_policy *)output = CS_EVICT_OLDEST;
+    } else if (streq(str, "largest")) {
+        *(enum cs_evict_policy *)output = CS_EVICT_LARGEST;
+    } else {
+        return -EINVAL;
+    }
+    return 0;
+}
+
+/**
+ * Parse a rule of the form "DURATION REGEX", meaning that clips from windows
+ * with titles matching REGEX expire after DURATION. Each call adds a rule.
+ */
+int convert_ttl_window(const char *str, void *output) {
+    struct ttl_windows *tw = output;
+    if (!str) {
+        return 0;
+    }
+
+    const char *sep = strchr(str, ' ');
+    if (!sep) {
+        return -EINVAL;
+    }
+    _drop_(free) char *duration = strndup(str, (size_t)(sep - str));
+    expect(duration);
+
+    struct ttl_window_rule rule;
+    if (str_to_duration(duration, &rule.ttl) < 0 || rule.ttl == 0) {
+        return -EINVAL;
+    }
+    if (regcomp(&rule.rgx, sep + 1, REG_EXTENDED | REG_NOSUB)) {
+        return -EINVAL;
+    }
+
+    struct ttl_window_rule *rules =
+        realloc(tw->rules, (tw->nr + 1) * sizeof(*rules));
+    expect(rules);
+    rules[tw->nr++] = rule;
+    tw->rules = rules;
+    return 0;
+}
+
+static const char *const selection_names[CM_SEL_MAX] = {
+    [CM_SEL_CLIPBOARD] = "clipboard",
+    [CM_SEL_PRIMARY] = "primary",
+    [CM_SEL_SECONDARY] = "secondary",
+};
+
+static const char *const ignore_field_names[IGNORE_FIELD_MAX] = {
+    [IGNORE_TITLE] = "title",
+    [IGNORE_CLASS] = "class",
+    [IGNORE_EXE] = "exe",
+};
+
+/**
+ * Find @len bytes of @str in @names, returning its index or -1.
+ */
+static int _nonnull_ name_lookup(const char *const *names, size_t nr,
+                                 const char *str, size_t len) {
+    for (size_t i = 0; i < nr; i++) {
+        if (strlen(names[i]) == len && strncmp(str, names[i], len) == 0) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Parse a rule of the form "SELECTION MILLISECONDS", meaning that a change of
+ * owner of SELECTION is only acted on once there have been no others for
+ * MILLISECONDS. Each call sets the window for one selection.
+ */
+int convert_debounce(const char *str, void *output) {
+    uint64_t *debounce_ms = output;
+    if (!str) {
+        return 0;
+    }
+
+    const char *sep = strchr(str, ' ');
+    if (!sep) {
+        return -EINVAL;
+    }
+    int sel =
+        name_lookup(selection_names, CM_SEL_MAX, str, (size_t)(sep - str));
+    if (sel < 0) {
+        return -EINVAL;
+    }
+    return str_to_uint64(sep + 1, &debounce_ms[sel]);
+}
+
+/**
+ * Parse a rule of the form "[SELECTION:]FIELD REGEX", meaning that clips are
+ * ignored if the owner of SELECTION (or of any selection) has FIELD matching
+ * REGEX. FIELD is the window's title, its WM_CLASS instance or class, or the
+ * path of the executable which created it. Each call adds a rule.
+ */
+int convert_ignore(const char *str, void *output) {
+    struct ignore_rules *ir = output;
+    if (!str) {
+        return 0;
+    }
+
+    const char *sep = strchr(str, ' ');
+    if (!sep) {
+        return -EINVAL;
+    }
+    const char *field_start = str;
+    int sel = -1;
+    const char *colon = memchr(str, ':', (size_t)(sep - str));
+    if (colon) {
+        sel = name_lookup(selection_names, CM_SEL_MAX, str,
+                          (size_t)(colon - str));
+        if (sel < 0) {
+            return -EINVAL;
+        }
+        field_start = colon + 1;
+    }
+    int field = name_lookup(ignore_field_names, IGNORE_FIELD_MAX, field_start,
+                            (size_t)(sep - field_start));
+    if (field < 0) {
+        return -EINVAL;
+    }
+
+    for (size_t i = 0; i < CM_SEL_MAX; i++) {
+        if ((sel < 0 || (size_t)sel == i) &&
+            pattern_set_add(&ir->sets[i][field], sep + 1) < 0) {
+            return -EINVAL;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Parse a space separated list of the kinds of sensitive content to look for,
+ * or "none".
+ */
+int convert_sensitive(const char *str, void *output) {
+    struct sensitive_rules *rules = output;
+    rules->kinds = 0;
+    if (streq(str, "none")) {
         return 0;
     }
-    if (regcomp(&iw->rgx, str, REG_EXTENDED | REG_NOSUB)) {
+
+    _drop_(free) char *inner_str = strdup(str);
+    expect(inner_str);
+    for (char *token = strtok(inner_str, " "); token;
+         token = strtok(NULL, " ")) {
+        size_t kind = 0;
+        while (kind < SENSITIVE_KIND_MAX &&
+               !streq(token, sensitive_kind_name(kind))) {
+            kind++;
+        }
+        if (kind == SENSITIVE_KIND_MAX) {
+            return -EINVAL;
+        }
+        rules->kinds |= 1u << kind;
+    }
+    return 0;
+}
+
+int convert_sensitive_action(const char *str, void *output) {
+    struct sensitive_rules *rules = output;
+    if (streq(str, "ttl")) {
+        rules->action = SENSITIVE_ACTION_TTL;
+    } else if (streq(str, "skip")) {
+        rules->action = SENSITIVE_ACTION_SKIP;
+    } else if (streq(str, "redact")) {
+        rules->action = SENSITIVE_ACTION_REDACT;
+    } else {
         return -EINVAL;
     }
     return 0;
 }
 
+/**
+ * Parse a rule of the form "LITERAL [LENGTH]", meaning that LITERAL followed
+ * by at least LENGTH (by default 16) letters, digits, dashes or underscores
+ * is an API key. Each call adds a rule.
+ */
+int convert_sensitive_prefix(const char *str, void *output) {
+    struct sensitive_rules *rules = output;
+    if (!str) {
+        return 0;
+    }
+
+    uint64_t min_body = SENSITIVE_PREFIX_BODY_MIN;
+    const char *sep = strchr(str, ' ');
+    if (sep && str_to_uint64(sep + 1, &min_body) < 0) {
+        return -EINVAL;
+    }
+    _drop_(free) char *literal =
+        sep ? strndup(str, (size_t)(sep - str)) : strdup(str);
+    expect(literal);
+    return sensitive_rules_add_prefix(rules, literal, (size_t)min_body);
+}
+
 static int convert_cm_dir(const char *str, void *output) {
     if (!str) {
         str = get_runtime_directory();
@@ -106,6 +315,26 @@ static int convert_cm_dir(const char *str, void *output) {
     return 0;
 }
 
+static int convert_displays(const char *str, void *output) {
+    struct displays *displays = output;
+    if (!str) {
+        return 0;
+    }
+
+    _drop_(free) char *inner_str = strdup(str);
+    expect(inner_str);
+    for (char *token = strtok(inner_str, " "); token;
+         token = strtok(NULL, " ")) {
+        if (displays->nr == CM_DISPLAYS_MAX) {
+            return -EINVAL;
+        }
+        displays->names[displays->nr] = strdup(token);
+        expect(displays->names[displays->nr]);
+        displays->nr++;
+    }
+    return 0;
+}
+
 static int _nonnull_ convert_launcher(const char *str, void *output) {
     struct launcher *lnch = output;
 
@@ -217,7 +446,9 @@ static int config_parse_file(FILE *file, struct config_entry entries[],
             continue;
 
         for (size_t i = 0; i < entries_len; ++i) {
-            if (!entries[i].is_set && streq(entries[i].config_key, key)) {
+            if (streq(entries[i].config_key, key) &&
+                (!entries[i].is_set ||
+                 (entries[i].repeatable && !getenv(entries[i].env_var)))) {
                 if (entries[i].convert(value, entries[i].value) != 0) {
                     fprintf(stderr, "Error parsing config file for %s\n",
                             entries[i].config_key);
@@ -263,25 +494,60 @@ static int config_apply_default_values(struct config_entry entries[],
  * config_setup() instead, which provides the right file for you.
  */
 int config_setup_internal(FILE *file, struct config *cfg) {
+    cfg->ttl_windows = (struct ttl_windows){0};
+    memset(cfg->debounce_ms, 0, sizeof(cfg->debounce_ms));
+    for (size_t i = 0; i < CM_SEL_MAX; i++) {
+        for (size_t j = 0; j < IGNORE_FIELD_MAX; j++) {
+            pattern_set_init(&cfg->ignore_rules.sets[i][j], false);
+        }
+    }
+    sensitive_rules_init(&cfg->sensitive);
     struct config_entry entries[] = {
         {"max_clips", "CM_MAX_CLIPS", &cfg->max_clips, convert_positive_int,
-         "1000", 0},
+         "1000", 0, false},
         {"max_clips_batch", "CM_MAX_CLIPS_BATCH", &cfg->max_clips_batch,
-         convert_positive_int, "100", 0},
-        {"oneshot", "CM_ONESHOT", &cfg->oneshot, convert_positive_int, "0", 0},
+         convert_positive_int, "100", 0, false},
+        {"max_bytes", "CM_MAX_BYTES", &cfg->max_bytes, convert_size, "0", 0,
+         false},
+        {"evict", "CM_EVICT", &cfg->evict, convert_evict_policy, "oldest", 0,
+         false},
+        {"oneshot", "CM_ONESHOT", &cfg->oneshot, convert_positive_int, "0", 0,
+         false},
         {"own_clipboard", "CM_OWN_CLIPBOARD", &cfg->own_clipboard, convert_bool,
-         "0", 0},
+         "0", 0, false},
         {"selections", "CM_SELECTIONS", &cfg->selections, convert_selections,
-         "clipboard primary", 0},
+         "clipboard primary", 0, false},
         {"own_selections", "CM_OWN_SELECTIONS", &cfg->owned_selections,
-         convert_selections, "clipboard", 0},
-        {"ignore_window", "CM_IGNORE_WINDOW", &cfg->ignore_window,
-         convert_ignore_window, NULL, 0},
+         convert_selections, "clipboard", 0, false},
+        {"displays", "CM_DISPLAYS", &cfg->displays, convert_displays, NULL, 0,
+         false},
+        {"ignore_window", "CM_IGNORE_WINDOW", &cfg->ignore_rules,
+         convert_ignore_window, NULL, 0, false},
+        {"ignore", "CM_IGNORE", &cfg->ignore_rules, convert_ignore, NULL, 0,
+         true},
+        {"ttl", "CM_TTL", &cfg->ttl, convert_duration, "0", 0, false},
+        {"ttl_window", "CM_TTL_WINDOW", &cfg->ttl_windows, convert_ttl_window,
+         NULL, 0, true},
+        {"debounce", "CM_DEBOUNCE", cfg->debounce_ms, convert_debounce, NULL,
+         0, true},
+        {"sensitive", "CM_SENSITIVE", &cfg->sensitive, convert_sensitive,
+         "api_key jwt private_key card", 0, false},
+        {"sensitive_action", "CM_SENSITIVE_ACTION", &cfg->sensitive,
+         convert_sensitive_action, "ttl", 0, false},
+        {"sensitive_ttl", "CM_SENSITIVE_TTL", &cfg->sensitive.ttl,
+         convert_duration, "1m", 0, false},
+        {"sensitive_prefix", "CM_SENSITIVE_PREFIX", &cfg->sensitive,
+         convert_sensitive_prefix, NULL, 0, true},
         {"launcher", "CM_LAUNCHER", &cfg->launcher, convert_launcher, "dmenu",
-         0},
+         0, false},
         {"launcher_pass_dmenu_args", "CM_LAUNCHER_PASS_DMENU_ARGS",
-         &cfg->launcher_pass_dmenu_args, convert_bool, "1", 0},
-        {"cm_dir", "CM_DIR", &cfg->runtime_dir, convert_cm_dir, NULL, 0}};
+         &cfg->launcher_pass_dmenu_args, convert_bool, "1", 0, false},
+        {"menu_page", "CM_MENU_PAGE", &cfg->menu_page, convert_positive_int,
+         "0", 0, false},
+        {"menu_limit", "CM_MENU_LIMIT", &cfg->menu_limit,
+         convert_positive_int, "0", 0, false},
+        {"cm_dir", "CM_DIR", &cfg->runtime_dir, convert_cm_dir, NULL, 0,
+         false}};
 
     size_t entries_len = arrlen(entries);
 
@@ -298,6 +564,16 @@ int config_setup_internal(FILE *file, struct config *cfg) {
         return ret;
     }
 
+    for (size_t i = 0; i < CM_SEL_MAX; i++) {
+        for (size_t j = 0; j < IGNORE_FIELD_MAX; j++) {
+            pattern_set_compile(&cfg->ignore_rules.sets[i][j]);
+        }
+    }
+    ret = sensitive_rules_compile(&cfg->sensitive);
+    if (ret < 0) {
+        return ret;
+    }
+
     cfg->ready = true;
 
     return 0;
@@ -311,9 +587,19 @@ void config_free(struct config *cfg) {
     free(cfg->launcher.custom);
     free(cfg->selections);
     free(cfg->owned_selections);
-    if (cfg->ignore_window.set) {
-        regfree(&cfg->ignore_window.rgx);
+    for (size_t i = 0; i < cfg->displays.nr; i++) {
+        free(cfg->displays.names[i]);
+    }
+    for (size_t i = 0; i < CM_SEL_MAX; i++) {
+        for (size_t j = 0; j < IGNORE_FIELD_MAX; j++) {
+            pattern_set_free(&cfg->ignore_rules.sets[i][j]);
+        }
+    }
+    sensitive_rules_free(&cfg->sensitive);
+    for (size_t i = 0; i < cfg->ttl_windows.nr; i++) {
+        regfree(&cfg->ttl_windows.rules[i].rgx);
     }
+    free(cfg->ttl_windows.rules);
 }
 
 /**
@@ -334,31 +620,34 @@ const char *prog_name = "broken";
 /**
  * Performs initial setup for clipmenu applications, including setting the
  * program name (used for dbg()), making sure stdout is line buffered, getting
- * the config, and setting up X11 error handling.
+ * and the config.
  */
 struct config setup(const char *inner_prog_name) {
     struct config cfg;
     prog_name = inner_prog_name;
     expect(setvbuf(stdout, stdout_buf, _IOLBF, sizeof(stdout_buf)) == 0);
     config_setup(&cfg);
-    XSetErrorHandler(xerror_handler);
     return cfg;
 }
 
-void setup_selections(Display *dpy, struct cm_selections *sels) {
-    sels[CM_SEL_CLIPBOARD].selection = XInternAtom(dpy, "CLIPBOARD", False);
-    sels[CM_SEL_CLIPBOARD].storage =
-        XInternAtom(dpy, "CLIPMENUD_CUR_CLIPBOARD", False);
-    sels[CM_SEL_PRIMARY].selection = XA_PRIMARY;
-    sels[CM_SEL_PRIMARY].storage =
-        XInternAtom(dpy, "CLIPMENUD_CUR_PRIMARY", False);
-    sels[CM_SEL_SECONDARY].selection = XA_SECONDARY;
-    sels[CM_SEL_SECONDARY].storage =
-        XInternAtom(dpy, "CLIPMENUD_CUR_SECONDARY", False);
+void setup_selections(xcb_connection_t *conn, struct cm_selections *sels) {
+    // Interned together, so it's only one round trip
+    static const char *const names[] = {
+        "CLIPBOARD", "CLIPMENUD_CUR_CLIPBOARD", "CLIPMENUD_CUR_PRIMARY",
+        "CLIPMENUD_CUR_SECONDARY"};
+    xcb_atom_t atoms[arrlen(names)];
+    x_intern_atoms(conn, names, arrlen(names), atoms);
+
+    sels[CM_SEL_CLIPBOARD].selection = atoms[0];
+    sels[CM_SEL_CLIPBOARD].storage = atoms[1];
+    sels[CM_SEL_PRIMARY].selection = XCB_ATOM_PRIMARY;
+    sels[CM_SEL_PRIMARY].storage = atoms[2];
+    sels[CM_SEL_SECONDARY].selection = XCB_ATOM_SECONDARY;
+    sels[CM_SEL_SECONDARY].storage = atoms[3];
 }
 
 enum selection_type
-selection_atom_to_selection_type(Atom atom, struct cm_selections *sels) {
+selection_atom_to_selection_type(xcb_atom_t atom, struct cm_selections *sels) {
     for (size_t i = 0; i < CM_SEL_MAX; ++i) {
         if (sels[i].selection == atom) {
             return i;
@@ -367,7 +656,7 @@ selection_atom_to_selection_type(Atom atom, struct cm_selections *sels) {
     die("Unreachable\n");
 }
 
-enum selection_type storage_atom_to_selection_type(Atom atom,
+enum selection_type storage_atom_to_selection_type(xcb_atom_t atom,
                                                    struct cm_selections *sels) {
     for (size_t i = 0; i < CM_SEL_MAX; ++i) {
         if (sels[i].storage == atom) {
@@ -1,18 +1,21 @@
 #ifndef CM_CONFIG_H
 #define CM_CONFIG_H
 
-#include <X11/Xlib.h>
 #include <limits.h>
 #include <regex.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <xcb/xcb.h>
 
+#include "pattern.h"
+#include "sensitive.h"
+#include "store.h"
 #include "util.h"
 
 struct selection {
     const char *name;
     bool active;
-    Atom *atom;
+    xcb_atom_t *atom;
 };
 enum selection_type {
     CM_SEL_CLIPBOARD,
@@ -21,13 +24,28 @@ enum selection_type {
     CM_SEL_MAX
 };
 struct cm_selections {
-    Atom selection;
-    Atom storage;
+    xcb_atom_t selection;
+    xcb_atom_t storage;
 };
-struct ignore_window {
-    bool set;
+enum ignore_field {
+    IGNORE_TITLE,
+    IGNORE_CLASS,
+    IGNORE_EXE,
+    IGNORE_FIELD_MAX
+};
+/* Rules for which windows not to take clips from, per selection and per
+ * attribute of the owner, each compiled into a single matcher */
+struct ignore_rules {
+    struct pattern_set sets[CM_SEL_MAX][IGNORE_FIELD_MAX];
+};
+struct ttl_window_rule {
+    uint64_t ttl;
     regex_t rgx;
 };
+struct ttl_windows {
+    struct ttl_window_rule *rules;
+    size_t nr;
+};
 enum launcher_known {
     LAUNCHER_ROFI,
     LAUNCHER_CUSTOM,
@@ -36,19 +54,34 @@ struct launcher {
     enum launcher_known ltype;
     char *custom;
 };
+#define CM_DISPLAYS_MAX 8 /* X displays one clipmenud can collect from */
+/* The X displays to collect from, or none to only use $DISPLAY */
+struct displays {
+    char *names[CM_DISPLAYS_MAX];
+    size_t nr;
+};
 struct config {
     bool ready;
     bool debug;
     char *runtime_dir;
     int max_clips;
     int max_clips_batch;
+    uint64_t max_bytes;
+    enum cs_evict_policy evict;
     int oneshot;
     bool own_clipboard;
+    struct displays displays;
     struct selection *owned_selections;
     struct selection *selections;
-    struct ignore_window ignore_window;
+    struct ignore_rules ignore_rules;
+    uint64_t ttl;
+    struct ttl_windows ttl_windows;
+    uint64_t debounce_ms[CM_SEL_MAX];
+    struct sensitive_rules sensitive;
     struct launcher launcher;
     bool launcher_pass_dmenu_args;
+    int menu_page;
+    int menu_limit;
 };
 typedef int (*conversion_func_t)(const char *, void *);
 struct config_entry {
@@ -58,6 +91,7 @@ struct config_entry {
     conversion_func_t convert;
     const char *default_value;
     bool is_set;
+    bool repeatable;
 };
 
 char *get_cache_dir(struct config *cfg);
@@ -79,18 +113,31 @@ char *get_cache_dir(struct config *cfg);
 
 DEFINE_GET_PATH_FUNCTION(line_cache)
 DEFINE_GET_PATH_FUNCTION(enabled)
+DEFINE_GET_PATH_FUNCTION(sock)
+DEFINE_GET_PATH_FUNCTION(stats)
+DEFINE_GET_PATH_FUNCTION(trace)
 
 extern const char *prog_name;
 struct config _nonnull_ setup(const char *inner_prog_name);
-void _nonnull_ setup_selections(Display *dpy, struct cm_selections *sels);
+void _nonnull_ setup_selections(xcb_connection_t *conn,
+                               struct cm_selections *sels);
 enum selection_type _nonnull_
-selection_atom_to_selection_type(Atom atom, struct cm_selections *sels);
+selection_atom_to_selection_type(xcb_atom_t atom, struct cm_selections *sels);
 enum selection_type _nonnull_
-storage_atom_to_selection_type(Atom atom, struct cm_selections *sels);
+storage_atom_to_selection_type(xcb_atom_t atom, struct cm_selections *sels);
 
 int convert_bool(const char *str, void *output);
 int convert_positive_int(const char *str, void *output);
 int convert_ignore_window(const char *str, void *output);
+int convert_ignore(const char *str, void *output);
+int convert_duration(const char *str, void *output);
+int convert_size(const char *str, void *output);
+int convert_evict_policy(const char *str, void *output);
+int convert_ttl_window(const char *str, void *output);
+int convert_debounce(const char *str, void *output);
+int convert_sensitive(const char *str, void *output);
+int convert_sensitive_action(const char *str, void *output);
+int convert_sensitive_prefix(const char *str, void *output);
 int config_setup_internal(FILE *file, struct config *cfg);
 void config_free(struct config *cfg);
 DEFINE_DROP_FUNC_PTR(struct config, config_free)
@@ -0,0 +1,336 @@
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+    #include <emmintrin.h>
+#endif
+
+#include "filter.h"
+
+/**
+ * FILTER DESIGN
+ *
+ * Filtering scores each snip line against the query, and keeps the top K
+ * matches. A line scores highest if it contains the query as a substring,
+ * otherwise it may still match fuzzily if it contains all of the query's
+ * characters in order, with bonuses for runs of consecutive characters and
+ * characters at the start of words. Matching is ASCII case insensitive.
+ *
+ * Both kinds of matching spend almost all of their time looking for the next
+ * occurrence of a single character, so that is done 16 bytes at a time with
+ * SSE2 where available. Large clip stores are split into ranges which are
+ * scored in parallel, each keeping its own top K, which are then merged.
+ */
+
+#define SCORE_MATCH 16          /* Per matched query character */
+#define SCORE_CONSECUTIVE 8     /* Matched right after the previous match */
+#define SCORE_BOUNDARY 10       /* Matched at the start of a word */
+#define SCORE_GAP_MAX 8         /* Maximum penalty for a gap between matches */
+#define SCORE_SUBSTRING BIT(16) /* Exceeds any possible fuzzy score */
+#define SCORE_POSITION_MAX 255  /* Maximum penalty for a late substring */
+
+static_assert(FILTER_QUERY_MAX *
+                      (SCORE_MATCH + SCORE_CONSECUTIVE + SCORE_BOUNDARY) <
+                  SCORE_SUBSTRING - SCORE_POSITION_MAX,
+              "fuzzy scores must be lower than substring scores");
+
+/**
+ * Find the next occurrence of a lowercase ASCII character in a string, case
+ * insensitively. Returns @len if there is no such occurrence.
+ *
+ * @s: The string to search
+ * @len: The length of @s
+ * @from: The position to start searching at
+ * @c: The lowercase character to search for
+ */
+static size_t _nonnull_ find_ci(const char *s, size_t len, size_t from,
+                                char c) {
+    char upper = (char)toupper((unsigned char)c);
+
+#ifdef __SSE2__
+    __m128i v_lower = _mm_set1_epi8(c);
+    __m128i v_upper = _mm_set1_epi8(upper);
+    for (; from + 16 <= len; from += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(s + from));
+        __m128i eq = _mm_or_si128(_mm_cmpeq_epi8(chunk, v_lower),
+                                  _mm_cmpeq_epi8(chunk, v_upper));
+        unsigned mask = (unsigned)_mm_movemask_epi8(eq);
+        if (mask) {
+            return from + (size_t)__builtin_ctz(mask);
+        }
+    }
+#endif
+
+    for (; from < len; from++) {
+        if (s[from] == c || s[from] == upper) {
+            return from;
+        }
+    }
+    return len;
+}
+
+/**
+ * Return true if position @pos in @line is the start of a word.
+ */
+static bool _nonnull_ is_word_start(const char *line, size_t pos) {
+    return pos == 0 || !isalnum((unsigned char)line[pos - 1]);
+}
+
+/**
+ * Score a line against a query, returning a negative value if it doesn't
+ * match at all. Higher scores are better matches.
+ *
+ * @query: The query, which must already be lowercase
+ * @query_len: The length of @query
+ * @line: The line to score
+ */
+int filter_score(const char *query, size_t query_len, const char *line) {
+    size_t len = strlen(line);
+    if (query_len == 0) {
+        return 0;
+    }
+    if (query_len > len) {
+        return -1;
+    }
+
+    int best = -1;
+    for (size_t pos = find_ci(line, len, 0, query[0]); pos + query_len <= len;
+         pos = find_ci(line, len, pos + 1, query[0])) {
+        if (strncasecmp(line + pos, query, query_len) == 0) {
+            int score = (int)SCORE_SUBSTRING -
+                        (int)(pos < SCORE_POSITION_MAX ? pos
+                                                       : SCORE_POSITION_MAX);
+            if (is_word_start(line, pos)) {
+                score += SCORE_BOUNDARY;
+            }
+            best = score > best ? score : best;
+        }
+    }
+    if (best >= 0) {
+        return best;
+    }
+
+    int score = 0;
+    size_t pos = 0;
+    for (size_t i = 0; i < query_len; i++) {
+        size_t found = find_ci(line, len, pos, query[i]);
+        if (found == len) {
+            return -1;
+        }
+        score += SCORE_MATCH;
+        if (i > 0 && found == pos) {
+            score += SCORE_CONSECUTIVE;
+        } else if (i > 0) {
+            size_t gap = found - pos;
+            score -= (int)(gap < SCORE_GAP_MAX ? gap : SCORE_GAP_MAX);
+        }
+        if (is_word_start(line, found)) {
+            score += SCORE_BOUNDARY;
+        }
+        pos = found + 1;
+    }
+    return score;
+}
+
+/**
+ * Return true if match @a should be ranked before match @b.
+ */
+static bool _nonnull_ match_better(const struct cs_match *a,
+                                   const struct cs_match *b) {
+    return a->score > b->score || (a->score == b->score && a->idx > b->idx);
+}
+
+/**
+ * qsort() comparator to rank matches best first.
+ */
+static int match_cmp(const void *a, const void *b) {
+    if (match_better(a, b)) {
+        return -1;
+    }
+    return match_better(b, a) ? 1 : 0;
+}
+
+/**
+ * Sift an entry down a min-heap of matches, where the root is the worst
+ * match currently kept.
+ *
+ * @heap: The heap
+ * @nr: The number of entries in the heap
+ * @i: The index of the entry to sift down
+ */
+static void _nonnull_ heap_sift_down(struct cs_match *heap, size_t nr,
+                                     size_t i) {
+    while (1) {
+        size_t worst = i, left = 2 * i + 1, right = 2 * i + 2;
+        if (left < nr && match_better(heap + worst, heap + left)) {
+            worst = left;
+        }
+        if (right < nr && match_better(heap + worst, heap + right)) {
+            worst = right;
+        }
+        if (worst == i) {
+            return;
+        }
+        struct cs_match tmp = heap[i];
+        heap[i] = heap[worst];
+        heap[worst] = tmp;
+        i = worst;
+    }
+}
+
+/**
+ * Sift an entry up a min-heap of matches.
+ *
+ * @heap: The heap
+ * @i: The index of the entry to sift up
+ */
+static void _nonnull_ heap_sift_up(struct cs_match *heap, size_t i) {
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (!match_better(heap + parent, heap + i)) {
+            return;
+        }
+        struct cs_match tmp = heap[i];
+        heap[i] = heap[parent];
+        heap[parent] = tmp;
+        i = parent;
+    }
+}
+
+/**
+ * A range of snips to score, and the best matches found in it.
+ *
+ * @snips: The snips in the clip store
+ * @start: The index of the first snip to score
+ * @end: The index after the last snip to score
+ * @query: The lowercase query
+ * @query_len: The length of @query
+ * @k: The maximum number of matches to keep
+ * @heap: A min-heap of the best matches so far, with space for @k entries
+ * @nr: The number of entries in @heap
+ */
+struct filter_job {
+    const struct cs_snip *snips;
+    size_t start;
+    size_t end;
+    const char *query;
+    size_t query_len;
+    size_t k;
+    struct cs_match *heap;
+    size_t nr;
+};
+
+/**
+ * Score every snip in a job's range, keeping the top K. Runs as a pthread.
+ *
+ * @private: The `struct filter_job`
+ */
+static void *filter_job_run(void *private) {
+    struct filter_job *job = private;
+
+    for (size_t i = job->start; i < job->end; i++) {
+        int score =
+            filter_score(job->query, job->query_len, job->snips[i].line);
+        if (score < 0) {
+            continue;
+        }
+        struct cs_match match = {
+            .hash = job->snips[i].hash, .score = score, .idx = i};
+        if (job->nr < job->k) {
+            job->heap[job->nr] = match;
+            heap_sift_up(job->heap, job->nr++);
+        } else if (match_better(&match, job->heap)) {
+            job->heap[0] = match;
+            heap_sift_down(job->heap, job->nr, 0);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Filter the snips in the clip store by a query, returning the best @k
+ * matches ranked best first. Matches with equal scores are ranked newest
+ * first.
+ *
+ * @cs: The clip store to operate on
+ * @query: The query to filter by
+ * @k: The maximum number of matches to return
+ * @out: Output for the matches. Must have space for @k entries, or the number
+ *       of snips in the clip store if that's smaller
+ * @out_nr: Output for the number of matches returned
+ */
+int cs_filter(struct clip_store *cs, const char *query, size_t k,
+              struct cs_match *out, size_t *out_nr) {
+    *out_nr = 0;
+
+    size_t query_len = strlen(query);
+    if (query_len > FILTER_QUERY_MAX) {
+        return -EINVAL;
+    }
+    char lower[FILTER_QUERY_MAX + 1];
+    for (size_t i = 0; i <= query_len; i++) {
+        lower[i] = (char)tolower((unsigned char)query[i]);
+    }
+
+    if (k == 0) {
+        return 0;
+    }
+
+    _drop_(cs_unref) struct ref_guard guard = cs_ref(cs);
+    if (guard.status < 0) {
+        return guard.status;
+    }
+
+    size_t nr_snips = cs->header->nr_snips;
+    if (k > nr_snips) {
+        k = nr_snips;
+    }
+    long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t nr_jobs = nr_snips / FILTER_SNIPS_PER_JOB + 1;
+    if (nr_cpus > 0 && nr_jobs > (size_t)nr_cpus) {
+        nr_jobs = (size_t)nr_cpus;
+    }
+
+    _drop_(free) struct filter_job *jobs = calloc(nr_jobs, sizeof(*jobs));
+    _drop_(free) struct cs_match *heaps = calloc(nr_jobs * k, sizeof(*heaps));
+    _drop_(free) pthread_t *threads = calloc(nr_jobs, sizeof(*threads));
+    expect(jobs && heaps && threads);
+
+    for (size_t i = 0; i < nr_jobs; i++) {
+        jobs[i] = (struct filter_job){.snips = cs->snips,
+                                      .start = nr_snips * i / nr_jobs,
+                                      .end = nr_snips * (i + 1) / nr_jobs,
+                                      .query = lower,
+                                      .query_len = query_len,
+                                      .k = k,
+                                      .heap = heaps + i * k};
+    }
+
+    // The first job runs on this thread, so we don't spawn one needlessly
+    // for small clip stores
+    for (size_t i = 1; i < nr_jobs; i++) {
+        int ret = pthread_create(threads + i, NULL, filter_job_run, jobs + i);
+        expect(ret == 0);
+    }
+    filter_job_run(jobs);
+    for (size_t i = 1; i < nr_jobs; i++) {
+        expect(pthread_join(threads[i], NULL) == 0);
+    }
+
+    // Compact each job's matches together, then pick the best of them
+    size_t nr_matches = 0;
+    for (size_t i = 0; i < nr_jobs; i++) {
+        memmove(heaps + nr_matches, jobs[i].heap, jobs[i].nr * sizeof(*heaps));
+        nr_matches += jobs[i].nr;
+    }
+    qsort(heaps, nr_matches, sizeof(*heaps), match_cmp);
+
+    *out_nr = nr_matches < k ? nr_matches : k;
+    memcpy(out, heaps, *out_nr * sizeof(*out));
+    return 0;
+}
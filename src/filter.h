@@ -0,0 +1,34 @@
+#ifndef CM_FILTER_H
+#define CM_FILTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "store.h"
+#include "util.h"
+
+#define FILTER_QUERY_MAX 64       /* Longest query we will score */
+#define FILTER_SNIPS_PER_JOB 4096 /* Minimum snips to justify another thread */
+#define FILTER_DEFAULT_LIMIT 20   /* Matches to return if none specified */
+
+/**
+ * A single snip matching a filter query.
+ *
+ * @hash: The hash of the snip
+ * @score: How well the snip matched, higher is better
+ * @idx: The position of the snip in the clip store, with 0 being the oldest.
+ *       Used to prefer newer snips when scores are equal
+ */
+struct cs_match {
+    uint64_t hash;
+    int score;
+    size_t idx;
+};
+
+int _nonnull_ filter_score(const char *query, size_t query_len,
+                           const char *line);
+int _must_use_ _nonnull_ cs_filter(struct clip_store *cs, const char *query,
+                                   size_t k, struct cs_match *out,
+                                   size_t *out_nr);
+
+#endif
@@ -0,0 +1,583 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "index.h"
+
+/**
+ * INDEX DESIGN
+ *
+ * Snips only contain the first line of each clip, so finding a clip by
+ * anything else in it means reading every content entry. Instead, the index
+ * maps every trigram (three consecutive bytes) in the content to the sorted
+ * list of documents (content entries) containing it. A substring query can
+ * only match documents which contain all of its trigrams, so we intersect
+ * those posting lists, and then verify the few remaining candidates against
+ * their content with memmem(). Matching is exact and byte based.
+ *
+ * The index lives in memory and is attached to a clip store on the first
+ * search. From then on cs_add(), cs_replace() and content removal keep it up
+ * to date. Other processes may change the clip store too, so each search
+ * starts with cs_index_sync(), which indexes any content we haven't seen yet
+ * and marks documents which are no longer in the clip store as dead.
+ *
+ * Documents are identified by an ID which only ever increases, so posting
+ * lists stay sorted by just appending to them. Removing a document only marks
+ * it dead, since finding all of its postings would mean reading its content
+ * again. Once enough documents are dead, we compact: dead IDs are dropped from
+ * every posting list and the rest are renumbered, preserving their order.
+ */
+
+#define INDEX_POSTINGS_INITIAL 4096 /* Initial posting list slots */
+#define INDEX_DOC_SLOTS_INITIAL 1024 /* Initial content hash slots */
+#define INDEX_POSTING_INITIAL 4     /* Initial IDs in each posting list */
+
+/**
+ * The state of a document during a single cs_search().
+ *
+ * @DOC_NONE: Can't match the query
+ * @DOC_CANDIDATE: Has all of the query's trigrams, so may match the query
+ * @DOC_SEEN: Already verified, or returned via another snip with this hash
+ */
+enum doc_state { DOC_NONE, DOC_CANDIDATE, DOC_SEEN };
+
+/**
+ * Mix the bits of a trigram for use as a hash table index.
+ */
+static size_t mix32(uint32_t x) {
+    x ^= x >> 16;
+    x *= 0x45d9f3bU;
+    x ^= x >> 16;
+    return x;
+}
+
+/**
+ * Mix the bits of a content hash for use as a hash table index. djb64 hashes
+ * of similar content differ mostly in their low bits, so we can't use them
+ * directly.
+ */
+static size_t mix64(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    return (size_t)x;
+}
+
+/**
+ * Pack the three bytes at @s into a trigram.
+ */
+static uint32_t _nonnull_ trigram_at(const char *s) {
+    const uint8_t *u = (const uint8_t *)s;
+    return (uint32_t)u[0] << 16 | (uint32_t)u[1] << 8 | u[2];
+}
+
+/**
+ * Move every posting list into a new hash table with @nr_slots slots,
+ * dropping any which have become empty.
+ *
+ * @index: The index to operate on
+ * @nr_slots: The new number of slots, which must be a power of two
+ */
+static void _nonnull_ postings_rehash(struct cs_index *index, size_t nr_slots) {
+    struct index_posting *new_postings =
+        calloc(nr_slots, sizeof(*new_postings));
+    expect(new_postings);
+
+    size_t nr_trigrams = 0;
+    for (size_t i = 0; i <= index->postings_mask; i++) {
+        struct index_posting *old = index->postings + i;
+        if (!old->ids) {
+            continue;
+        }
+        if (old->nr == 0) {
+            free(old->ids);
+            continue;
+        }
+        size_t j = mix32(old->trigram) & (nr_slots - 1);
+        while (new_postings[j].ids) {
+            j = (j + 1) & (nr_slots - 1);
+        }
+        new_postings[j] = *old;
+        nr_trigrams++;
+    }
+
+    free(index->postings);
+    index->postings = new_postings;
+    index->postings_mask = nr_slots - 1;
+    index->nr_trigrams = nr_trigrams;
+}
+
+/**
+ * Find the posting list for a trigram, returning NULL if it doesn't exist and
+ * @create is false.
+ *
+ * @index: The index to operate on
+ * @trigram: The trigram to look up
+ * @create: Whether to create an empty posting list if there is none
+ */
+static struct index_posting *_nonnull_
+postings_find(struct cs_index *index, uint32_t trigram, bool create) {
+    size_t nr_slots = index->postings_mask + 1;
+    if (create && (index->nr_trigrams + 1) * 4 > nr_slots * 3) {
+        postings_rehash(index, nr_slots * 2);
+    }
+
+    for (size_t i = mix32(trigram) & index->postings_mask;;
+         i = (i + 1) & index->postings_mask) {
+        struct index_posting *posting = index->postings + i;
+        if (posting->ids && posting->trigram == trigram) {
+            return posting;
+        }
+        if (!posting->ids) {
+            if (!create) {
+                return NULL;
+            }
+            posting->trigram = trigram;
+            posting->nr = 0;
+            posting->alloc = INDEX_POSTING_INITIAL;
+            posting->ids = malloc(posting->alloc * sizeof(*posting->ids));
+            expect(posting->ids);
+            index->nr_trigrams++;
+            return posting;
+        }
+    }
+}
+
+/**
+ * Find the slot in the content hash table for @hash. If the hash isn't
+ * indexed, this is the unused slot where it would be inserted.
+ *
+ * @index: The index to operate on
+ * @hash: The content hash to look up
+ */
+static uint32_t *_nonnull_ doc_slot_find(struct cs_index *index,
+                                         uint64_t hash) {
+    for (size_t i = mix64(hash) & index->doc_slots_mask;;
+         i = (i + 1) & index->doc_slots_mask) {
+        uint32_t *slot = index->doc_slots + i;
+        if (*slot == 0 || index->docs[*slot - 1].hash == hash) {
+            return slot;
+        }
+    }
+}
+
+/**
+ * Find the document for a content hash, or NULL if it isn't indexed.
+ *
+ * @index: The index to operate on
+ * @hash: The content hash to look up
+ */
+static struct index_doc *_nonnull_ doc_find(struct cs_index *index,
+                                            uint64_t hash) {
+    uint32_t slot = *doc_slot_find(index, hash);
+    return slot ? index->docs + slot - 1 : NULL;
+}
+
+/**
+ * Rebuild the content hash table from the documents with @nr_slots slots.
+ *
+ * @index: The index to operate on
+ * @nr_slots: The new number of slots, which must be a power of two
+ */
+static void _nonnull_ doc_slots_rebuild(struct cs_index *index,
+                                        size_t nr_slots) {
+    free(index->doc_slots);
+    index->doc_slots = calloc(nr_slots, sizeof(*index->doc_slots));
+    expect(index->doc_slots);
+    index->doc_slots_mask = nr_slots - 1;
+
+    for (size_t id = 0; id < index->nr_docs; id++) {
+        *doc_slot_find(index, index->docs[id].hash) = (uint32_t)id + 1;
+    }
+}
+
+/**
+ * Drop dead documents from every posting list and renumber the remaining
+ * ones, which keeps each posting list sorted.
+ *
+ * @index: The index to operate on
+ */
+static void _nonnull_ index_compact(struct cs_index *index) {
+    _drop_(free) uint32_t *remap = malloc(index->nr_docs * sizeof(*remap));
+    expect(remap);
+
+    size_t nr_live = 0;
+    for (size_t id = 0; id < index->nr_docs; id++) {
+        if (index->docs[id].dead) {
+            remap[id] = UINT32_MAX;
+        } else {
+            remap[id] = (uint32_t)nr_live;
+            index->docs[nr_live++] = index->docs[id];
+        }
+    }
+
+    for (size_t i = 0; i <= index->postings_mask; i++) {
+        struct index_posting *posting = index->postings + i;
+        uint32_t nr = 0;
+        for (uint32_t j = 0; posting->ids && j < posting->nr; j++) {
+            uint32_t id = remap[posting->ids[j]];
+            if (id != UINT32_MAX) {
+                posting->ids[nr++] = id;
+            }
+        }
+        posting->nr = nr;
+    }
+
+    index->nr_docs = nr_live;
+    index->nr_dead = 0;
+    postings_rehash(index, index->postings_mask + 1);
+    doc_slots_rebuild(index, index->doc_slots_mask + 1);
+}
+
+/**
+ * Compact the index if at least half of the documents are dead.
+ *
+ * @index: The index to operate on
+ */
+static void _nonnull_ index_maybe_compact(struct cs_index *index) {
+    if (index->nr_dead >= INDEX_COMPACT_MIN &&
+        index->nr_dead * 2 >= index->nr_docs) {
+        index_compact(index);
+    }
+}
+
+/**
+ * Mark a document as present in the clip store, reviving it if it was dead.
+ * Dead documents keep their postings until compaction, so no reindexing is
+ * needed.
+ *
+ * @index: The index to operate on
+ * @doc: The document to mark
+ */
+static void _nonnull_ doc_mark_live(struct cs_index *index,
+                                    struct index_doc *doc) {
+    if (doc->dead) {
+        doc->dead = false;
+        index->nr_dead--;
+    }
+    doc->epoch = index->epoch;
+}
+
+/**
+ * Add a content entry to the index. Does nothing if it's already indexed.
+ *
+ * @index: The index to operate on
+ * @hash: The hash of the content entry
+ * @content: The content, which need not be null terminated
+ * @len: The length of @content
+ */
+void cs_index_add(struct cs_index *index, uint64_t hash, const char *content,
+                  size_t len) {
+    struct index_doc *doc = doc_find(index, hash);
+    if (doc) {
+        doc_mark_live(index, doc);
+        return;
+    }
+
+    expect(index->nr_docs < UINT32_MAX - 1);
+    if ((index->nr_docs + 1) * 4 > (index->doc_slots_mask + 1) * 3) {
+        doc_slots_rebuild(index, (index->doc_slots_mask + 1) * 2);
+    }
+    if (index->nr_docs == index->docs_alloc) {
+        index->docs_alloc =
+            index->docs_alloc ? index->docs_alloc * 2 : INDEX_DOC_SLOTS_INITIAL;
+        index->docs =
+            realloc(index->docs, index->docs_alloc * sizeof(*index->docs));
+        expect(index->docs);
+    }
+
+    uint32_t id = (uint32_t)index->nr_docs++;
+    index->docs[id] =
+        (struct index_doc){.hash = hash, .epoch = index->epoch, .dead = false};
+    *doc_slot_find(index, hash) = id + 1;
+
+    for (size_t i = 0; i + 3 <= len; i++) {
+        struct index_posting *posting =
+            postings_find(index, trigram_at(content + i), true);
+        if (posting->nr > 0 && posting->ids[posting->nr - 1] == id) {
+            continue; // Trigram repeated within this document
+        }
+        if (posting->nr == posting->alloc) {
+            posting->alloc *= 2;
+            posting->ids =
+                realloc(posting->ids, posting->alloc * sizeof(*posting->ids));
+            expect(posting->ids);
+        }
+        posting->ids[posting->nr++] = id;
+    }
+}
+
+/**
+ * Remove a content entry from the index. Does nothing if it isn't indexed.
+ *
+ * @index: The index to operate on
+ * @hash: The hash of the content entry
+ */
+void cs_index_remove(struct cs_index *index, uint64_t hash) {
+    struct index_doc *doc = doc_find(index, hash);
+    if (!doc || doc->dead) {
+        return;
+    }
+    doc->dead = true;
+    index->nr_dead++;
+    index_maybe_compact(index);
+}
+
+/**
+ * Free an index and everything it owns.
+ *
+ * @index: The index to free
+ */
+void cs_index_free(struct cs_index *index) {
+    for (size_t i = 0; i <= index->postings_mask; i++) {
+        free(index->postings[i].ids);
+    }
+    free(index->postings);
+    free(index->docs);
+    free(index->doc_slots);
+    free(index);
+}
+
+/**
+ * Attach a new, empty index to the clip store. It is filled in by
+ * cs_index_sync().
+ *
+ * @cs: The clip store to operate on
+ */
+static void _nonnull_ cs_index_attach(struct clip_store *cs) {
+    struct cs_index *index = calloc(1, sizeof(*index));
+    expect(index);
+    index->postings = calloc(INDEX_POSTINGS_INITIAL, sizeof(*index->postings));
+    index->doc_slots =
+        calloc(INDEX_DOC_SLOTS_INITIAL, sizeof(*index->doc_slots));
+    expect(index->postings && index->doc_slots);
+    index->postings_mask = INDEX_POSTINGS_INITIAL - 1;
+    index->doc_slots_mask = INDEX_DOC_SLOTS_INITIAL - 1;
+    cs->index = index;
+}
+
+/**
+ * Bring the index up to date with changes to the clip store made by other
+ * processes: index any content we haven't seen, and mark anything no longer in
+ * the clip store as dead.
+ *
+ * @cs: The clip store to operate on, which must have an index attached
+ */
+int cs_index_sync(struct clip_store *cs) {
+    _drop_(cs_unref) struct ref_guard guard = cs_ref(cs);
+    if (guard.status < 0) {
+        return guard.status;
+    }
+
+    struct cs_index *index = cs->index;
+    index->epoch++;
+
+    struct cs_snip *snip = NULL;
+    while (cs_snip_iter(&guard, CS_ITER_OLDEST_FIRST, &snip)) {
+        struct index_doc *doc = doc_find(index, snip->hash);
+        if (doc) {
+            doc_mark_live(index, doc);
+            continue;
+        }
+
+        _drop_(cs_content_unmap) struct cs_content content;
+        if (cs_content_get(cs, snip->hash, &content) < 0) {
+            continue; // Empty, or removed without updating the snips yet
+        }
+        cs_index_add(index, snip->hash, content.data, (size_t)content.size);
+    }
+
+    for (size_t id = 0; id < index->nr_docs; id++) {
+        struct index_doc *doc = index->docs + id;
+        if (!doc->dead && doc->epoch != index->epoch) {
+            doc->dead = true;
+            index->nr_dead++;
+        }
+    }
+    index_maybe_compact(index);
+
+    return 0;
+}
+
+/**
+ * Find the first position at or after @lo in a sorted ID list whose ID is at
+ * least @target, or @nr if there is none. Gallops forward first, so walking a
+ * long list with increasing targets is cheap.
+ *
+ * @ids: The sorted IDs
+ * @lo: The position to start at
+ * @nr: The number of IDs
+ * @target: The ID to look for
+ */
+static size_t _nonnull_ gallop(const uint32_t *ids, size_t lo, size_t nr,
+                               uint32_t target) {
+    size_t hi = lo, step = 1;
+    while (hi < nr && ids[hi] < target) {
+        lo = hi + 1;
+        hi += step;
+        step *= 2;
+    }
+    if (hi > nr) {
+        hi = nr;
+    }
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (ids[mid] < target) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/**
+ * qsort() comparator to order posting lists shortest first.
+ */
+static int posting_len_cmp(const void *a, const void *b) {
+    const struct index_posting *pa = *(const struct index_posting *const *)a;
+    const struct index_posting *pb = *(const struct index_posting *const *)b;
+    return (pa->nr > pb->nr) - (pa->nr < pb->nr);
+}
+
+/**
+ * Mark every live document which contains all of the query's trigrams as a
+ * candidate. Queries shorter than a trigram make every live document a
+ * candidate.
+ *
+ * @index: The index to operate on
+ * @query: The query
+ * @query_len: The length of @query
+ * @state: The `enum doc_state` for each document, all initially DOC_NONE
+ */
+static void _nonnull_ index_candidates(struct cs_index *index,
+                                       const char *query, size_t query_len,
+                                       uint8_t *state) {
+    if (query_len < 3) {
+        for (size_t id = 0; id < index->nr_docs; id++) {
+            state[id] = index->docs[id].dead ? DOC_NONE : DOC_CANDIDATE;
+        }
+        return;
+    }
+
+    size_t nr_lists = query_len - 2;
+    _drop_(free) const struct index_posting **lists =
+        malloc(nr_lists * sizeof(*lists));
+    expect(lists);
+    for (size_t i = 0; i < nr_lists; i++) {
+        lists[i] = postings_find(index, trigram_at(query + i), false);
+        if (!lists[i] || lists[i]->nr == 0) {
+            return; // Some trigram appears nowhere, so nothing can match
+        }
+    }
+    qsort(lists, nr_lists, sizeof(*lists), posting_len_cmp);
+
+    size_t nr_cands = lists[0]->nr;
+    _drop_(free) uint32_t *cands = malloc(nr_cands * sizeof(*cands));
+    expect(cands);
+    memcpy(cands, lists[0]->ids, nr_cands * sizeof(*cands));
+
+    for (size_t i = 1; i < nr_lists && nr_cands > 0; i++) {
+        if (lists[i] == lists[i - 1]) {
+            continue; // Repeated trigram
+        }
+        size_t nr_kept = 0, pos = 0;
+        for (size_t j = 0; j < nr_cands; j++) {
+            pos = gallop(lists[i]->ids, pos, lists[i]->nr, cands[j]);
+            if (pos == lists[i]->nr) {
+                break;
+            }
+            if (lists[i]->ids[pos] == cands[j]) {
+                cands[nr_kept++] = cands[j];
+            }
+        }
+        nr_cands = nr_kept;
+    }
+
+    for (size_t i = 0; i < nr_cands; i++) {
+        if (!index->docs[cands[i]].dead) {
+            state[cands[i]] = DOC_CANDIDATE;
+        }
+    }
+}
+
+/**
+ * Check whether the content for @hash really contains the query.
+ *
+ * @cs: The clip store to operate on
+ * @hash: The hash of the content to check
+ * @query: The query
+ * @query_len: The length of @query
+ */
+static bool _nonnull_ index_verify(struct clip_store *cs, uint64_t hash,
+                                   const char *query, size_t query_len) {
+    if (query_len == 0) {
+        return true;
+    }
+    _drop_(cs_content_unmap) struct cs_content content;
+    if (cs_content_get(cs, hash, &content) < 0) {
+        return false;
+    }
+    return memmem(content.data, (size_t)content.size, query, query_len);
+}
+
+/**
+ * Search the full content of every clip for a substring, returning up to
+ * @limit matching snips newest first. Each content entry is returned at most
+ * once, even if several snips share it.
+ *
+ * The first search on a clip store builds the index, which is then kept up to
+ * date until cs_destroy().
+ *
+ * @cs: The clip store to operate on
+ * @query: The substring to search for
+ * @limit: The maximum number of matches to return
+ * @out: Output for the index in cs->snips of each matching snip. Must have
+ *       space for @limit entries. The caller must hold a reference to the clip
+ *       store for these to stay valid
+ * @out_nr: Output for the number of matches returned
+ */
+int cs_search(struct clip_store *cs, const char *query, size_t limit,
+              size_t *out, size_t *out_nr) {
+    *out_nr = 0;
+
+    size_t query_len = strlen(query);
+    if (query_len > INDEX_QUERY_MAX) {
+        return -EINVAL;
+    }
+
+    _drop_(cs_unref) struct ref_guard guard = cs_ref(cs);
+    if (guard.status < 0) {
+        return guard.status;
+    }
+
+    if (!cs->index) {
+        cs_index_attach(cs);
+    }
+    int ret = cs_index_sync(cs);
+    if (ret < 0) {
+        return ret;
+    }
+
+    struct cs_index *index = cs->index;
+    _drop_(free) uint8_t *state = calloc(index->nr_docs + 1, sizeof(*state));
+    expect(state);
+    index_candidates(index, query, query_len, state);
+
+    struct cs_snip *snip = NULL;
+    while (*out_nr < limit &&
+           cs_snip_iter(&guard, CS_ITER_NEWEST_FIRST, &snip)) {
+        uint32_t slot = *doc_slot_find(index, snip->hash);
+        if (slot == 0 || state[slot - 1] != DOC_CANDIDATE) {
+            continue;
+        }
+        state[slot - 1] = DOC_SEEN;
+        if (index_verify(cs, snip->hash, query, query_len)) {
+            out[(*out_nr)++] = (size_t)(snip - cs->snips);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,82 @@
+#ifndef CM_INDEX_H
+#define CM_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "store.h"
+#include "util.h"
+
+#define INDEX_COMPACT_MIN 1024   /* Dead docs needed before compacting */
+#define INDEX_DEFAULT_LIMIT 20   /* Matches to return if none specified */
+#define INDEX_QUERY_MAX 1024     /* Longest query we will search for */
+
+/**
+ * The posting list for a single trigram: the IDs of every document
+ * containing it, in ascending order.
+ *
+ * @trigram: The three bytes of the trigram, packed big endian
+ * @nr: The number of document IDs in @ids
+ * @alloc: The number of document IDs allocated for @ids
+ * @ids: The document IDs, or NULL if this hash table slot is unused
+ */
+struct index_posting {
+    uint32_t trigram;
+    uint32_t nr;
+    uint32_t alloc;
+    uint32_t *ids;
+};
+
+/**
+ * A single indexed content entry.
+ *
+ * @hash: The hash of the content entry
+ * @epoch: The last cs_index_sync() which saw this hash in the clip store
+ * @dead: The content entry was removed. Its ID stays in the posting lists
+ *        until the next compaction
+ */
+struct index_doc {
+    uint64_t hash;
+    uint32_t epoch;
+    bool dead;
+};
+
+/**
+ * A trigram index over the full content of every entry in a clip store.
+ *
+ * @postings: Hash table of posting lists keyed by trigram
+ * @postings_mask: The number of slots in @postings minus one
+ * @nr_trigrams: The number of used slots in @postings
+ * @docs: Every indexed content entry, indexed by document ID
+ * @nr_docs: The number of entries in @docs
+ * @docs_alloc: The number of entries allocated for @docs
+ * @nr_dead: The number of entries in @docs which are dead
+ * @doc_slots: Hash table mapping content hashes to document ID + 1, with 0
+ *             marking an unused slot
+ * @doc_slots_mask: The number of slots in @doc_slots minus one
+ * @epoch: The number of cs_index_sync() calls so far
+ */
+struct cs_index {
+    struct index_posting *postings;
+    size_t postings_mask;
+    size_t nr_trigrams;
+
+    struct index_doc *docs;
+    size_t nr_docs;
+    size_t docs_alloc;
+    size_t nr_dead;
+    uint32_t *doc_slots;
+    size_t doc_slots_mask;
+
+    uint32_t epoch;
+};
+
+void _nonnull_ cs_index_add(struct cs_index *index, uint64_t hash,
+                            const char *content, size_t len);
+void _nonnull_ cs_index_remove(struct cs_index *index, uint64_t hash);
+void _nonnull_ cs_index_free(struct cs_index *index);
+int _must_use_ _nonnull_ cs_index_sync(struct clip_store *cs);
+int _must_use_ _nonnull_ cs_search(struct clip_store *cs, const char *query,
+                                   size_t limit, size_t *out, size_t *out_nr);
+
+#endif
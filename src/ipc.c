@@ -0,0 +1,508 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "ipc.h"
+
+/**
+ * PROTOCOL
+ *
+ * clipmenud listens on a unix socket in the cache directory and answers one
+ * request per connection. The client sends a `struct cm_ipc_request` followed
+ * by its payload, and clipmenud replies with a `struct cm_ipc_reply` followed
+ * by its body. For CM_IPC_GET, the content fd is passed alongside the reply
+ * header using SCM_RIGHTS, so the client can map it without ever opening the
+ * clip store.
+ *
+ * All structures are sent in host byte order: both ends are always on the
+ * same machine.
+ */
+
+/**
+ * Make sure that a growable buffer has space for at least @extra more bytes.
+ *
+ * @buf: The buffer to grow
+ * @extra: The number of bytes which must be available after buf->len
+ */
+void cm_buf_reserve(struct cm_buf *buf, size_t extra) {
+    if (buf->len + extra <= buf->alloc) {
+        return;
+    }
+    size_t new_alloc = buf->alloc ? buf->alloc : 4096;
+    while (new_alloc < buf->len + extra) {
+        new_alloc *= 2;
+    }
+    char *new_data = realloc(buf->data, new_alloc);
+    expect(new_data);
+    buf->data = new_data;
+    buf->alloc = new_alloc;
+}
+
+/**
+ * Append data to a growable buffer, growing it as necessary.
+ *
+ * @buf: The buffer to append to
+ * @data: The data to append
+ * @len: The number of bytes to append
+ */
+void cm_buf_append(struct cm_buf *buf, const void *data, size_t len) {
+    cm_buf_reserve(buf, len);
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+}
+
+/**
+ * Free the memory backing a growable buffer.
+ *
+ * @buf: The buffer to free
+ */
+void cm_buf_free(struct cm_buf *buf) {
+    free(buf->data);
+    buf->data = NULL;
+    buf->len = buf->alloc = 0;
+}
+
+/**
+ * Read exactly @count bytes from a socket. Unlike read_safe(), errors and
+ * early EOF are returned rather than being fatal, since the peer may go away
+ * at any time.
+ *
+ * @fd: The socket to read from
+ * @buf: The buffer to read into
+ * @count: The number of bytes to read
+ */
+static int _must_use_ _nonnull_ ipc_read_full(int fd, void *buf,
+                                              size_t count) {
+    char *cur = buf;
+    while (count > 0) {
+        ssize_t chunk_size = read(fd, cur, count);
+        if (chunk_size < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return negative_errno();
+        }
+        if (chunk_size == 0) {
+            return -EPIPE;
+        }
+        cur += chunk_size;
+        count -= (size_t)chunk_size;
+    }
+    return 0;
+}
+
+/**
+ * Write exactly @count bytes to a socket without raising SIGPIPE if the peer
+ * has gone away.
+ *
+ * @fd: The socket to write to
+ * @buf: The buffer to write
+ * @count: The number of bytes to write
+ */
+static int _must_use_ _nonnull_ ipc_write_full(int fd, const void *buf,
+                                               size_t count) {
+    const char *cur = buf;
+    while (count > 0) {
+        ssize_t chunk_size = send(fd, cur, count, MSG_NOSIGNAL);
+        if (chunk_size < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return negative_errno();
+        }
+        cur += chunk_size;
+        count -= (size_t)chunk_size;
+    }
+    return 0;
+}
+
+/**
+ * Set send and receive timeouts on a socket, so that neither a stuck client
+ * nor a stuck daemon can block the other forever.
+ *
+ * @fd: The socket to operate on
+ */
+static int _must_use_ ipc_set_timeouts(int fd) {
+    struct timeval tv = {.tv_sec = CM_IPC_TIMEOUT_MS / 1000,
+                         .tv_usec = (CM_IPC_TIMEOUT_MS % 1000) * 1000};
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0 ||
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) < 0) {
+        return negative_errno();
+    }
+    return 0;
+}
+
+/**
+ * Fill a unix socket address with the path to the query socket.
+ *
+ * @cfg: The application configuration
+ * @addr: The address to populate
+ */
+static int _must_use_ _nonnull_ ipc_sockaddr(struct config *cfg,
+                                             struct sockaddr_un *addr) {
+    const char *path = get_sock_path(cfg);
+    memset(addr, '\0', sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        return -ENAMETOOLONG;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+/**
+ * Create the query socket for clipmenud and start listening on it. Any stale
+ * socket left behind by a previous instance is replaced.
+ *
+ * @cfg: The application configuration
+ */
+int ipc_listen(struct config *cfg) {
+    struct sockaddr_un addr;
+    int ret = ipc_sockaddr(cfg, &addr);
+    if (ret < 0) {
+        return ret;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return negative_errno();
+    }
+
+    if ((unlink(addr.sun_path) < 0 && errno != ENOENT) ||
+        bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(fd, SOMAXCONN) < 0) {
+        ret = negative_errno();
+        close(fd);
+        return ret;
+    }
+
+    return fd;
+}
+
+/**
+ * Accept a pending connection on the query socket. Connections from other
+ * users are rejected, although in practice the 0700 cache directory should
+ * already prevent them.
+ *
+ * @listen_fd: The listening query socket
+ */
+int ipc_accept(int listen_fd) {
+    int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0) {
+        return negative_errno();
+    }
+
+    struct ucred cred;
+    socklen_t cred_len = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) < 0 ||
+        cred.uid != getuid()) {
+        close(fd);
+        return -EPERM;
+    }
+
+    int ret = ipc_set_timeouts(fd);
+    if (ret < 0) {
+        close(fd);
+        return ret;
+    }
+
+    return fd;
+}
+
+/**
+ * Read a request from a connected client. On success, the payload is null
+ * terminated.
+ *
+ * @fd: The client socket
+ * @req: Output for the request header
+ * @payload: Output for the payload. Must be at least CM_IPC_PAYLOAD_MAX + 1
+ *           bytes
+ */
+int ipc_read_request(int fd, struct cm_ipc_request *req, char *payload) {
+    int ret = ipc_read_full(fd, req, sizeof(*req));
+    if (ret < 0) {
+        return ret;
+    }
+    if (req->payload_len > CM_IPC_PAYLOAD_MAX) {
+        return -EMSGSIZE;
+    }
+    ret = ipc_read_full(fd, payload, req->payload_len);
+    if (ret < 0) {
+        return ret;
+    }
+    payload[req->payload_len] = '\0';
+    return 0;
+}
+
+/**
+ * Send a reply to a client, optionally passing an fd with SCM_RIGHTS.
+ *
+ * @fd: The client socket
+ * @reply: The reply header. body_len is filled in from @body
+ * @pass_fd: An fd to pass to the client, or -1
+ * @body: The reply body, or NULL
+ */
+int ipc_send_reply(int fd, const struct cm_ipc_reply *reply, int pass_fd,
+                   const struct cm_buf *body) {
+    struct cm_ipc_reply hdr = *reply;
+    hdr.body_len = body ? body->len : 0;
+
+    struct iovec iov = {.iov_base = &hdr, .iov_len = sizeof(hdr)};
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1};
+
+    if (pass_fd >= 0) {
+        memset(&control, '\0', sizeof(control));
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &pass_fd, sizeof(int));
+    }
+
+    ssize_t sent;
+    do {
+        sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    } while (sent < 0 && errno == EINTR);
+    if (sent < 0) {
+        return negative_errno();
+    }
+    if ((size_t)sent < sizeof(hdr)) {
+        int ret = ipc_write_full(fd, (char *)&hdr + sent,
+                                 sizeof(hdr) - (size_t)sent);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return body && body->len ? ipc_write_full(fd, body->data, body->len) : 0;
+}
+
+/**
+ * Append a snip entry to a reply body.
+ *
+ * @buf: The reply body
+ * @hash: The hash of the snip
+ * @nr_lines: The number of lines in the content entry
+ * @line: The snip line
+ */
+void ipc_buf_add_entry(struct cm_buf *buf, uint64_t hash, uint64_t nr_lines,
+                       const char *line) {
+    struct cm_ipc_entry ent = {
+        .hash = hash, .nr_lines = nr_lines, .line_len = (uint32_t)strlen(line)};
+    cm_buf_append(buf, &ent, sizeof(ent));
+    cm_buf_append(buf, line, ent.line_len);
+}
+
+/**
+ * Connect to the query socket of a running clipmenud.
+ *
+ * Returns the connected fd, or a negative errno. -ENOENT or -ECONNREFUSED
+ * mean that clipmenud is not running, in which case the caller should fall
+ * back to using the clip store directly.
+ *
+ * @cfg: The application configuration
+ */
+int ipc_connect(struct config *cfg) {
+    struct sockaddr_un addr;
+    int ret = ipc_sockaddr(cfg, &addr);
+    if (ret < 0) {
+        return ret;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return negative_errno();
+    }
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        ipc_set_timeouts(fd) < 0) {
+        ret = negative_errno();
+        close(fd);
+        return ret;
+    }
+
+    return fd;
+}
+
+/**
+ * Send a request to clipmenud and wait for the reply.
+ *
+ * @fd: A socket returned by ipc_connect()
+ * @req: The request header. payload_len is filled in from @payload
+ * @payload: A null terminated payload, or NULL
+ * @reply: Output for the reply header
+ * @body: Output for the reply body, or NULL to discard it. The caller must
+ *        call cm_buf_free() when done
+ * @out_fd: Output for an fd passed by clipmenud, or NULL. Set to -1 if none
+ *          was passed
+ */
+int ipc_request(int fd, const struct cm_ipc_request *req, const char *payload,
+                struct cm_ipc_reply *reply, struct cm_buf *body, int *out_fd) {
+    struct cm_ipc_request hdr = *req;
+    size_t payload_len = payload ? strlen(payload) : 0;
+    if (payload_len > CM_IPC_PAYLOAD_MAX) {
+        return -EMSGSIZE;
+    }
+    hdr.payload_len = (uint32_t)payload_len;
+
+    int ret = ipc_write_full(fd, &hdr, sizeof(hdr));
+    if (ret < 0) {
+        return ret;
+    }
+    if (payload_len) {
+        ret = ipc_write_full(fd, payload, payload_len);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    if (out_fd) {
+        *out_fd = -1;
+    }
+
+    struct iovec iov = {.iov_base = reply, .iov_len = sizeof(*reply)};
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg = {.msg_iov = &iov,
+                         .msg_iovlen = 1,
+                         .msg_control = control.buf,
+                         .msg_controllen = sizeof(control.buf)};
+
+    ssize_t got;
+    do {
+        got = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+    } while (got < 0 && errno == EINTR);
+    if (got < 0) {
+        return negative_errno();
+    }
+    if ((size_t)got < sizeof(*reply)) {
+        return -EPIPE;
+    }
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+        cmsg->cmsg_type == SCM_RIGHTS) {
+        int passed_fd;
+        memcpy(&passed_fd, CMSG_DATA(cmsg), sizeof(int));
+        if (out_fd) {
+            *out_fd = passed_fd;
+        } else {
+            close(passed_fd);
+        }
+    }
+
+    if (reply->body_len == 0) {
+        return 0;
+    }
+
+    _drop_(cm_buf_free) struct cm_buf discard = {0};
+    struct cm_buf *dst = body ? body : &discard;
+    cm_buf_reserve(dst, reply->body_len);
+    ret = ipc_read_full(fd, dst->data + dst->len, reply->body_len);
+    if (ret < 0) {
+        return ret;
+    }
+    dst->len += reply->body_len;
+    return 0;
+}
+
+/**
+ * Iterate over the snip entries in a reply body. The function should be
+ * initially called with *pos set to 0. Returns false when there are no more
+ * entries, or the body is malformed.
+ *
+ * @body: The reply body
+ * @pos: The current offset into the body
+ * @ent: Output for the entry header
+ * @line: Output for the null terminated line. Must be at least
+ *        CS_SNIP_LINE_SIZE bytes
+ */
+bool ipc_next_entry(const struct cm_buf *body, size_t *pos,
+                    struct cm_ipc_entry *ent, char *line) {
+    if (body->len - *pos < sizeof(*ent)) {
+        return false;
+    }
+    memcpy(ent, body->data + *pos, sizeof(*ent));
+    if (ent->line_len >= CS_SNIP_LINE_SIZE ||
+        body->len - *pos - sizeof(*ent) < ent->line_len) {
+        return false;
+    }
+    memcpy(line, body->data + *pos + sizeof(*ent), ent->line_len);
+    line[ent->line_len] = '\0';
+    *pos += sizeof(*ent) + ent->line_len;
+    return true;
+}
+
+/**
+ * Open the content associated with a given hash through clipmenud, as with
+ * cs_content_open(), returning the fd or a negative errno.
+ *
+ * @fd: A socket returned by ipc_connect()
+ * @hash: The hash of the content to open
+ * @out_size: Output for the size of the content
+ */
+int ipc_content_open(int fd, uint64_t hash, off_t *out_size) {
+    struct cm_ipc_request req = {.op = CM_IPC_GET, .hash = hash};
+    struct cm_ipc_reply reply;
+    _drop_(close) int content_fd = -1;
+    int ret = ipc_request(fd, &req, NULL, &reply, NULL, &content_fd);
+    if (ret < 0) {
+        return ret;
+    }
+    if (reply.status < 0) {
+        return reply.status;
+    }
+    if (content_fd < 0) {
+        return -EBADMSG;
+    }
+    *out_size = (off_t)reply.size;
+    ret = content_fd;
+    content_fd = -1;
+    return ret;
+}
+
+/**
+ * Retrieve the content associated with a given hash from clipmenud and map it
+ * into memory, as with cs_content_get().
+ *
+ * @fd: A socket returned by ipc_connect()
+ * @hash: The hash of the content to retrieve
+ * @content: A pointer to a `struct cs_content` to populate. The caller must
+ *           call cs_content_unmap() when done to free it
+ */
+int ipc_content_get(int fd, uint64_t hash, struct cs_content *content) {
+    memset(content, '\0', sizeof(struct cs_content));
+
+    off_t size;
+    _drop_(close) int content_fd = ipc_content_open(fd, hash, &size);
+    if (content_fd < 0) {
+        return content_fd;
+    }
+
+    char *data = mmap(NULL, (size_t)size, PROT_READ, MAP_PRIVATE, content_fd,
+                      0);
+    if (data == MAP_FAILED) {
+        return negative_errno();
+    }
+
+    content->data = data;
+    content->fd = content_fd;
+    content->size = size;
+    content_fd = -1;
+
+    return 0;
+}
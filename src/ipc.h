@@ -0,0 +1,173 @@
+#ifndef CM_IPC_H
+#define CM_IPC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "config.h"
+#include "store.h"
+#include "util.h"
+
+#define CM_IPC_PAYLOAD_MAX 65536 /* Maximum size of a request payload */
+#define CM_IPC_TIMEOUT_MS 1000  /* Socket timeout for clients and daemon */
+
+/**
+ * The operation requested from clipmenud over the query socket.
+ *
+ * @CM_IPC_LIST: List snips, paged using offset and limit
+ * @CM_IPC_GET: Get the content for a hash, returned as an fd by SCM_RIGHTS
+ * @CM_IPC_DELETE: Delete snips whose line matches the regex in the payload
+ * @CM_IPC_STATS: Get the current clip store statistics
+ * @CM_IPC_MENU: Get the prerendered launcher menu, returned as an fd by
+ *               SCM_RIGHTS. See menu_snapshot() for the layout
+ * @CM_IPC_FILTER: List the snips best matching the query in the payload,
+ *                 ranked best first. See cs_filter()
+ * @CM_IPC_SEARCH: List the snips whose full content contains the payload,
+ *                 newest first. See cs_search()
+ */
+enum cm_ipc_op {
+    CM_IPC_LIST,
+    CM_IPC_GET,
+    CM_IPC_DELETE,
+    CM_IPC_STATS,
+    CM_IPC_MENU,
+    CM_IPC_FILTER,
+    CM_IPC_SEARCH,
+};
+
+/**
+ * Flags modifying the behaviour of a request.
+ *
+ * @CM_IPC_F_INVERT: For CM_IPC_DELETE, act on snips which do _not_ match
+ * @CM_IPC_F_DRY_RUN: For CM_IPC_DELETE, only report what would be deleted
+ * @CM_IPC_F_CONTENT: For CM_IPC_DELETE, match the full content of each clip
+ *                    rather than its snip line
+ * @CM_IPC_F_PATTERN_LIST: For CM_IPC_DELETE, the payload holds one regex per
+ *                         line, and snips matching any of them are acted on
+ */
+enum cm_ipc_flags {
+    CM_IPC_F_INVERT = BIT(0),
+    CM_IPC_F_DRY_RUN = BIT(1),
+    CM_IPC_F_CONTENT = BIT(2),
+    CM_IPC_F_PATTERN_LIST = BIT(3),
+};
+
+/**
+ * A request sent from a client to clipmenud, followed by @payload_len bytes
+ * of payload.
+ *
+ * @op: The operation to perform, see `enum cm_ipc_op`
+ * @flags: Bitwise OR of `enum cm_ipc_flags`
+ * @direction: The `enum cs_iter_direction` to iterate snips in
+ * @payload_len: The number of payload bytes following this header
+ * @hash: For CM_IPC_GET, the hash of the content to retrieve
+ * @offset: For CM_IPC_LIST, the number of snips to skip
+ * @limit: For CM_IPC_LIST, the maximum number of snips to return, or 0 for
+ *         all of them. For CM_IPC_FILTER and CM_IPC_SEARCH, the maximum
+ *         number of matches to return, or 0 for the default
+ * @after: For CM_IPC_DELETE, only act on snips captured at or after this Unix
+ *         time, or 0 for no limit
+ * @before: For CM_IPC_DELETE, only act on snips captured before this Unix
+ *          time, or 0 for no limit
+ */
+struct _packed_ cm_ipc_request {
+    uint32_t op;
+    uint32_t flags;
+    uint32_t direction;
+    uint32_t payload_len;
+    uint64_t hash;
+    uint64_t offset;
+    uint64_t limit;
+    uint64_t after;
+    uint64_t before;
+};
+
+/**
+ * The reply header sent by clipmenud in response to a request.
+ *
+ * @status: 0 on success, or a negative errno value
+ * @nr_entries: The number of `struct cm_ipc_entry` records which follow
+ * @nr_snips: The total number of snips in the clip store
+ * @size: For CM_IPC_GET, the size of the content passed as an fd. For
+ *        CM_IPC_MENU, the size of the menu text
+ * @body_len: The number of body bytes following this header
+ */
+struct _packed_ cm_ipc_reply {
+    int32_t status;
+    uint32_t _unused_padding;
+    uint64_t nr_entries;
+    uint64_t nr_snips;
+    uint64_t size;
+    uint64_t body_len;
+};
+
+/**
+ * A single snip in a reply body, followed by @line_len bytes of line (without
+ * a terminating null byte).
+ *
+ * @hash: The hash of the snip
+ * @nr_lines: The number of lines in the content entry
+ * @line_len: The number of line bytes following this header
+ */
+struct _packed_ cm_ipc_entry {
+    uint64_t hash;
+    uint64_t nr_lines;
+    uint32_t line_len;
+};
+
+/**
+ * Statistics about the clip store, sent in reply to CM_IPC_STATS.
+ *
+ * @nr_snips: The number of snips in the clip store
+ * @nr_snips_alloc: The number of snips allocated in the snip file
+ * @nr_bytes: The total size of the content in the clip store
+ */
+struct _packed_ cm_ipc_stats {
+    uint64_t nr_snips;
+    uint64_t nr_snips_alloc;
+    uint64_t nr_bytes;
+};
+
+/**
+ * A growable buffer for building up replies.
+ *
+ * @data: The buffer data
+ * @len: The number of bytes used
+ * @alloc: The number of bytes allocated
+ */
+struct cm_buf {
+    char *data;
+    size_t len;
+    size_t alloc;
+};
+
+void _nonnull_ cm_buf_reserve(struct cm_buf *buf, size_t extra);
+void _nonnull_ cm_buf_append(struct cm_buf *buf, const void *data, size_t len);
+void _nonnull_ cm_buf_free(struct cm_buf *buf);
+DEFINE_DROP_FUNC_PTR(struct cm_buf, cm_buf_free)
+
+int _must_use_ _nonnull_ ipc_listen(struct config *cfg);
+int _must_use_ ipc_accept(int listen_fd);
+int _must_use_ _nonnull_ ipc_read_request(int fd, struct cm_ipc_request *req,
+                                          char *payload);
+int _must_use_ _nonnull_n_(2) ipc_send_reply(int fd,
+                                             const struct cm_ipc_reply *reply,
+                                             int pass_fd,
+                                             const struct cm_buf *body);
+void _nonnull_ ipc_buf_add_entry(struct cm_buf *buf, uint64_t hash,
+                                 uint64_t nr_lines, const char *line);
+
+int _must_use_ _nonnull_ ipc_connect(struct config *cfg);
+int _must_use_ _nonnull_n_(2, 4)
+    ipc_request(int fd, const struct cm_ipc_request *req, const char *payload,
+                struct cm_ipc_reply *reply, struct cm_buf *body, int *out_fd);
+int _must_use_ _nonnull_ ipc_content_open(int fd, uint64_t hash,
+                                          off_t *out_size);
+int _must_use_ _nonnull_ ipc_content_get(int fd, uint64_t hash,
+                                         struct cs_content *content);
+bool _must_use_ _nonnull_ ipc_next_entry(const struct cm_buf *body,
+                                         size_t *pos,
+                                         struct cm_ipc_entry *ent, char *line);
+
+#endif
@@ -0,0 +1,255 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <inttypes.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "menu.h"
+
+/**
+ * MENU DESIGN
+ *
+ * Rendering the menu from scratch for every clipmenu invocation is costly:
+ * each entry needs formatting, and with thousands of clips that adds up to a
+ * lot of work before the launcher sees its first line. Instead, clipmenud
+ * keeps the menu fully rendered and hands it out as a memfd.
+ *
+ * Entries are displayed newest first, and new clips are almost always added
+ * as the newest entry, so the text is kept at the end of its buffer and new
+ * entries are prepended into the free space before it. Replacing the newest
+ * entry (as with partial selections) is the same operation after dropping the
+ * old one. Anything else, like trimming, renumbers entries or changes the
+ * index width, so we just rebuild the whole menu, which is rare by
+ * comparison.
+ */
+
+/**
+ * Calculate the base 10 padding length for a number.
+ *
+ * @num: The number to calculate for
+ */
+int get_padding_length(size_t num) {
+    int digits = 0;
+    do {
+        num /= 10;
+        digits++;
+    } while (num > 0);
+    return digits;
+}
+
+/**
+ * Render a single menu entry, returning its length. The output is not null
+ * terminated.
+ *
+ * @out: The output buffer. Must be at least MENU_ENTRY_MAX bytes
+ * @pad: The width of the index field
+ * @idx: The menu index of the entry, with 1 being the oldest
+ * @line: The snip line
+ * @nr_lines: The number of lines in the content entry
+ */
+size_t menu_entry_render(char *out, int pad, size_t idx, const char *line,
+                         uint64_t nr_lines) {
+    size_t len = snprintf_safe(out, MENU_ENTRY_MAX, "[%*zu] ", pad, idx);
+
+    size_t line_len = strlen(line);
+    if (line_len == CS_SNIP_LINE_SIZE - 1) {
+        memcpy(out + len, line, CS_SNIP_LINE_SIZE - 4);
+        len += CS_SNIP_LINE_SIZE - 4;
+        memcpy(out + len, "...", 3);
+        len += 3;
+    } else {
+        memcpy(out + len, line, line_len);
+        len += line_len;
+    }
+
+    if (nr_lines > 1) {
+        len += snprintf_safe(out + len, MENU_ENTRY_MAX - len,
+                             " (%" PRIu64 " lines)", nr_lines);
+    }
+
+    out[len++] = '\n';
+    return len;
+}
+
+/**
+ * Get the length of the rendered menu text.
+ *
+ * @menu: The menu to operate on
+ */
+size_t menu_text_len(const struct menu *menu) {
+    return menu->text_alloc - menu->text_start;
+}
+
+/**
+ * Make sure there's room to prepend at least @len more bytes of text and one
+ * more entry.
+ *
+ * @menu: The menu to operate on
+ * @len: The number of bytes needed before the current text
+ */
+static void _nonnull_ menu_reserve(struct menu *menu, size_t len) {
+    if (menu->nr == menu->nr_alloc) {
+        menu->nr_alloc = menu->nr_alloc ? menu->nr_alloc * 2 : 1024;
+        menu->hashes =
+            realloc(menu->hashes, menu->nr_alloc * sizeof(*menu->hashes));
+        menu->ends = realloc(menu->ends, menu->nr_alloc * sizeof(*menu->ends));
+        expect(menu->hashes && menu->ends);
+    }
+
+    if (menu->text_start >= len) {
+        return;
+    }
+
+    size_t used = menu_text_len(menu);
+    size_t new_alloc = menu->text_alloc ? menu->text_alloc * 2 : 65536;
+    while (new_alloc < used + len) {
+        new_alloc *= 2;
+    }
+    char *new_text = malloc(new_alloc);
+    expect(new_text);
+    if (used) {
+        memcpy(new_text + new_alloc - used, menu->text + menu->text_start,
+               used);
+    }
+    free(menu->text);
+    menu->text = new_text;
+    menu->text_alloc = new_alloc;
+    menu->text_start = new_alloc - used;
+}
+
+/**
+ * Prepend a snip to the menu as its newest entry.
+ *
+ * @menu: The menu to operate on
+ * @snip: The snip to add
+ */
+static void _nonnull_ menu_prepend(struct menu *menu,
+                                   const struct cs_snip *snip) {
+    char entry[MENU_ENTRY_MAX];
+    size_t len = menu_entry_render(entry, menu->pad, menu->nr + 1, snip->line,
+                                   snip->nr_lines);
+    menu_reserve(menu, len);
+    menu->ends[menu->nr] = menu_text_len(menu);
+    menu->hashes[menu->nr] = snip->hash;
+    menu->text_start -= len;
+    memcpy(menu->text + menu->text_start, entry, len);
+    menu->nr++;
+}
+
+/**
+ * Rebuild the whole menu from the clip store.
+ *
+ * @menu: The menu to operate on
+ * @cs: The clip store to render
+ */
+int menu_rebuild(struct menu *menu, struct clip_store *cs) {
+    _drop_(cs_unref) struct ref_guard guard = cs_ref(cs);
+    if (guard.status < 0) {
+        return guard.status;
+    }
+
+    menu->text_start = menu->text_alloc;
+    menu->nr = 0;
+    menu->pad = get_padding_length(cs->header->nr_snips);
+
+    struct cs_snip *snip = NULL;
+    while (cs_snip_iter(&guard, CS_ITER_OLDEST_FIRST, &snip)) {
+        menu_prepend(menu, snip);
+    }
+
+    return 0;
+}
+
+/**
+ * Update the menu after a clip was added as the newest snip in the clip
+ * store.
+ *
+ * @menu: The menu to operate on
+ * @cs: The clip store the clip was added to
+ */
+int menu_add_newest(struct menu *menu, struct clip_store *cs) {
+    _drop_(cs_unref) struct ref_guard guard = cs_ref(cs);
+    if (guard.status < 0) {
+        return guard.status;
+    }
+
+    size_t nr_snips = cs->header->nr_snips;
+    if (nr_snips != menu->nr + 1 ||
+        get_padding_length(nr_snips) != menu->pad) {
+        return menu_rebuild(menu, cs);
+    }
+
+    menu_prepend(menu, cs->snips + nr_snips - 1);
+    return 0;
+}
+
+/**
+ * Update the menu after the newest snip in the clip store was replaced.
+ *
+ * @menu: The menu to operate on
+ * @cs: The clip store the clip was replaced in
+ */
+int menu_replace_newest(struct menu *menu, struct clip_store *cs) {
+    _drop_(cs_unref) struct ref_guard guard = cs_ref(cs);
+    if (guard.status < 0) {
+        return guard.status;
+    }
+
+    size_t nr_snips = cs->header->nr_snips;
+    if (nr_snips != menu->nr || nr_snips == 0) {
+        return menu_rebuild(menu, cs);
+    }
+
+    menu->nr--;
+    menu->text_start = menu->text_alloc - menu->ends[menu->nr];
+    menu_prepend(menu, cs->snips + nr_snips - 1);
+    return 0;
+}
+
+/**
+ * Write the menu to a new memfd for handing to a client, returning the fd.
+ * The memfd contains the menu text, followed by the hash for each entry
+ * ordered by menu index. The menu is rebuilt first if it's clearly out of
+ * date with the clip store.
+ *
+ * @menu: The menu to operate on
+ * @cs: The clip store the menu represents
+ */
+int menu_snapshot(struct menu *menu, struct clip_store *cs) {
+    _drop_(cs_unref) struct ref_guard guard = cs_ref(cs);
+    if (guard.status < 0) {
+        return guard.status;
+    }
+
+    if (menu->nr != cs->header->nr_snips) {
+        int ret = menu_rebuild(menu, cs);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    int fd = memfd_create("clipmenu-menu", MFD_CLOEXEC);
+    if (fd < 0) {
+        return negative_errno();
+    }
+    if (menu->nr > 0) {
+        write_safe(fd, menu->text + menu->text_start, menu_text_len(menu));
+        write_safe(fd, (const char *)menu->hashes,
+                   menu->nr * sizeof(*menu->hashes));
+    }
+    return fd;
+}
+
+/**
+ * Free the memory backing a menu.
+ *
+ * @menu: The menu to free
+ */
+void menu_free(struct menu *menu) {
+    free(menu->text);
+    free(menu->hashes);
+    free(menu->ends);
+    memset(menu, '\0', sizeof(*menu));
+}
@@ -0,0 +1,55 @@
+#ifndef CM_MENU_H
+#define CM_MENU_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "store.h"
+#include "util.h"
+
+/* The maximum length of a single rendered menu entry, including the index,
+ * the line, the line count suffix, and the trailing newline */
+#define MENU_ENTRY_MAX (CS_SNIP_LINE_SIZE + 2 * UINT64_MAX_STRLEN + 16)
+
+/**
+ * The launcher menu, rendered ahead of time and kept up to date as clips are
+ * added, so that it can be piped to the launcher as-is.
+ *
+ * @text: The rendered menu. Entries are stored newest first and occupy
+ *        text[text_start, text_alloc), leaving room to prepend new entries
+ * @text_start: The offset of the newest entry in @text
+ * @text_alloc: The number of bytes allocated for @text
+ * @hashes: The hash for each entry, indexed by menu index - 1 (so oldest
+ *          first)
+ * @ends: For each entry, the distance from the end of @text to the end of
+ *        the entry. This doesn't change when @text is reallocated
+ * @nr: The number of entries in the menu
+ * @nr_alloc: The number of entries allocated for @hashes and @ends
+ * @pad: The width of the index field, which depends on @nr
+ */
+struct menu {
+    char *text;
+    size_t text_start;
+    size_t text_alloc;
+    uint64_t *hashes;
+    size_t *ends;
+    size_t nr;
+    size_t nr_alloc;
+    int pad;
+};
+
+int get_padding_length(size_t num);
+size_t _nonnull_ menu_entry_render(char *out, int pad, size_t idx,
+                                   const char *line, uint64_t nr_lines);
+size_t _nonnull_ menu_text_len(const struct menu *menu);
+int _must_use_ _nonnull_ menu_rebuild(struct menu *menu, struct clip_store *cs);
+int _must_use_ _nonnull_ menu_add_newest(struct menu *menu,
+                                         struct clip_store *cs);
+int _must_use_ _nonnull_ menu_replace_newest(struct menu *menu,
+                                             struct clip_store *cs);
+int _must_use_ _nonnull_ menu_snapshot(struct menu *menu,
+                                       struct clip_store *cs);
+void _nonnull_ menu_free(struct menu *menu);
+DEFINE_DROP_FUNC_PTR(struct menu, menu_free)
+
+#endif
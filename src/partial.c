@@ -0,0 +1,129 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "partial.h"
+
+/**
+ * PARTIAL DETECTION DESIGN
+ *
+ * Chromium and some other badly behaved applications spam PRIMARY during
+ * selection, so if you're selecting the text "abc", you get three clips: "a",
+ * "ab", and "abc" (or "c", "bc", "abc" if selecting right to left). It's
+ * possible we were not fast enough to get all of them, and the user may also
+ * expand and then retract the selection, so any clip which is a prefix or
+ * suffix of another is a possible partial of it.
+ *
+ * Every new clip is checked against several recent ones, and most of those
+ * checks fail, so they need to be cheap. Each clip is hashed once when it
+ * arrives with a polynomial rolling hash, keeping the hash of every
+ * PARTIAL_STRIDE-th prefix. With those, the hash of any prefix or substring
+ * can be found by hashing fewer than PARTIAL_STRIDE more bytes, so a check
+ * costs the same however long the clips are. Only when the hashes match do
+ * we compare the bytes, to rule out collisions.
+ */
+
+#define PARTIAL_HASH_BASE 0x100000001b3ULL
+
+static uint64_t hash_step(uint64_t hash, char c) {
+    return hash * PARTIAL_HASH_BASE + (unsigned char)c;
+}
+
+/**
+ * PARTIAL_HASH_BASE to the power of @exp, modulo 2^64.
+ */
+static uint64_t hash_pow(size_t exp) {
+    uint64_t result = 1, base = PARTIAL_HASH_BASE;
+    for (; exp; exp >>= 1) {
+        if (exp & 1) {
+            result *= base;
+        }
+        base *= base;
+    }
+    return result;
+}
+
+/**
+ * Prepare @text for partial detection. Free with partial_text_free().
+ *
+ * @pt: The partial text to initialise
+ * @text: The text, which must outlive @pt
+ * @len: The length of @text
+ */
+int partial_text_init(struct partial_text *pt, const char *text, size_t len) {
+    pt->text = text;
+    pt->len = len;
+    pt->marks = malloc((len / PARTIAL_STRIDE + 1) * sizeof(*pt->marks));
+    if (!pt->marks) {
+        return -ENOMEM;
+    }
+
+    uint64_t hash = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (i % PARTIAL_STRIDE == 0) {
+            pt->marks[i / PARTIAL_STRIDE] = hash;
+        }
+        hash = hash_step(hash, text[i]);
+    }
+    if (len % PARTIAL_STRIDE == 0) {
+        pt->marks[len / PARTIAL_STRIDE] = hash;
+    }
+    pt->hash = hash;
+    return 0;
+}
+
+void partial_text_free(struct partial_text *pt) {
+    free(pt->marks);
+    pt->marks = NULL;
+}
+
+/**
+ * The rolling hash of the first @len bytes of @pt.
+ */
+static uint64_t prefix_hash(const struct partial_text *pt, size_t len) {
+    size_t start = len - len % PARTIAL_STRIDE;
+    uint64_t hash = pt->marks[start / PARTIAL_STRIDE];
+    for (size_t i = start; i < len; i++) {
+        hash = hash_step(hash, pt->text[i]);
+    }
+    return hash;
+}
+
+/**
+ * The rolling hash of the last @len bytes of @pt.
+ */
+static uint64_t suffix_hash(const struct partial_text *pt, size_t len) {
+    return pt->hash - prefix_hash(pt, pt->len - len) * hash_pow(len);
+}
+
+/**
+ * Work out whether @new is a possible partial of @old, or vice versa.
+ *
+ * @old: The earlier clip
+ * @new: The new clip
+ */
+enum partial_match partial_match(const struct partial_text *old,
+                                 const struct partial_text *new) {
+    if (old->len <= new->len) {
+        if (prefix_hash(new, old->len) == old->hash &&
+            memcmp(new->text, old->text, old->len) == 0) {
+            return PARTIAL_EXTENDS;
+        }
+        if (suffix_hash(new, old->len) == old->hash &&
+            memcmp(new->text + new->len - old->len, old->text, old->len) ==
+                0) {
+            return PARTIAL_OTHER;
+        }
+    } else {
+        if (prefix_hash(old, new->len) == new->hash &&
+            memcmp(old->text, new->text, new->len) == 0) {
+            return PARTIAL_OTHER;
+        }
+        if (suffix_hash(old, new->len) == new->hash &&
+            memcmp(old->text + old->len - new->len, new->text, new->len) ==
+                0) {
+            return PARTIAL_OTHER;
+        }
+    }
+    return PARTIAL_NONE;
+}
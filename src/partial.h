@@ -0,0 +1,49 @@
+#ifndef CM_PARTIAL_H
+#define CM_PARTIAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "util.h"
+
+#define PARTIAL_STRIDE 64 /* Bytes between stored prefix hashes */
+
+/**
+ * A clip prepared for partial detection: its polynomial rolling hash, plus
+ * the hash of every prefix whose length is a multiple of PARTIAL_STRIDE. The
+ * hash of any prefix or substring can then be found by hashing fewer than
+ * PARTIAL_STRIDE bytes, rather than rescanning the text.
+ *
+ * @text: The text, which must outlive this
+ * @len: The length of @text
+ * @hash: The rolling hash of all of @text
+ * @marks: marks[i] is the rolling hash of the first i * PARTIAL_STRIDE bytes
+ */
+struct partial_text {
+    const char *text;
+    size_t len;
+    uint64_t hash;
+    uint64_t *marks;
+};
+
+/**
+ * How a new clip relates to an earlier one.
+ *
+ * @PARTIAL_NONE: Neither is a prefix or suffix of the other
+ * @PARTIAL_EXTENDS: The earlier clip is a prefix of the new one, so the new
+ *                   one only adds bytes at the end
+ * @PARTIAL_OTHER: One is a prefix or suffix of the other in some other way
+ */
+enum partial_match {
+    PARTIAL_NONE,
+    PARTIAL_EXTENDS,
+    PARTIAL_OTHER,
+};
+
+int _must_use_ _nonnull_ partial_text_init(struct partial_text *pt,
+                                           const char *text, size_t len);
+void _nonnull_ partial_text_free(struct partial_text *pt);
+enum partial_match _must_use_ _nonnull_
+partial_match(const struct partial_text *old, const struct partial_text *new);
+
+#endif
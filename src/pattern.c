@@ -0,0 +1,504 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pattern.h"
+
+/**
+ * PATTERN SET DESIGN
+ *
+ * Running every regex in a large set against every input is slow, and almost
+ * all of those runs fail. Most real patterns contain some literal text which
+ * any match must include, like "AKIA" in "AKIA[0-9A-Z]{16}", so we extract
+ * one such literal from each pattern and find all of them in a single pass
+ * over the input with an Aho-Corasick automaton. Only regexes whose literal
+ * turned up are run, and we stop at the first one which matches. Regexes with
+ * no usable literal are always run.
+ *
+ * The automaton is a dense DFA: one table lookup per input byte, however many
+ * literals there are. When there's only one literal, we use memmem() instead,
+ * which glibc vectorises.
+ *
+ * Literal extraction only has to be conservative: returning a shorter literal,
+ * or none at all, just means running the regex more often than needed. So
+ * anything we don't fully understand simply ends the current literal.
+ */
+
+#define PATTERN_NONE UINT32_MAX /* No regex, in `first` and `next` */
+
+/**
+ * Whether @c is special in an ERE, and so can be escaped to make it literal.
+ */
+static bool is_ere_special(char c) {
+    return c && strchr(".[]()*+?{}|^$\\", c);
+}
+
+/**
+ * State for pattern_literal(): the literal being built, and the best one so
+ * far.
+ *
+ * @cur: The current run of literal characters, truncated to
+ *       PATTERN_LITERAL_MAX
+ * @cur_len: The full length of the current run, which may exceed the size of
+ *           @cur
+ * @best: Output for the best literal
+ * @best_len: The length of @best
+ */
+struct literal_state {
+    char cur[PATTERN_LITERAL_MAX];
+    size_t cur_len;
+    char *best;
+    size_t best_len;
+};
+
+/**
+ * End the current run of literal characters, keeping it if it's the best so
+ * far.
+ */
+static void _nonnull_ literal_end_run(struct literal_state *ls) {
+    size_t len = ls->cur_len < PATTERN_LITERAL_MAX ? ls->cur_len
+                                                   : PATTERN_LITERAL_MAX;
+    if (len > ls->best_len) {
+        memcpy(ls->best, ls->cur, len);
+        ls->best_len = len;
+    }
+    ls->cur_len = 0;
+}
+
+/**
+ * Skip past a bracket expression, returning a pointer after its closing
+ * bracket, or NULL if it isn't closed.
+ *
+ * @p: Pointer to the opening bracket
+ */
+static const char *_nonnull_ skip_bracket(const char *p) {
+    p++;
+    if (*p == '^') {
+        p++;
+    }
+    if (*p == ']') {
+        p++; // A leading ] is literal
+    }
+    for (; *p && *p != ']'; p++) {
+        if (*p == '[' && (p[1] == ':' || p[1] == '=' || p[1] == '.')) {
+            char delim = p[1];
+            for (p += 2; *p && !(p[0] == delim && p[1] == ']'); p++) {
+            }
+            if (!*p) {
+                return NULL;
+            }
+            p++;
+        }
+    }
+    return *p ? p + 1 : NULL;
+}
+
+/**
+ * Skip past a parenthesised group, returning a pointer after its closing
+ * parenthesis, or NULL if it isn't closed.
+ *
+ * @p: Pointer to the opening parenthesis
+ */
+static const char *_nonnull_ skip_group(const char *p) {
+    size_t depth = 0;
+    while (*p) {
+        if (*p == '\\') {
+            if (!p[1]) {
+                return NULL;
+            }
+            p += 2;
+        } else if (*p == '[') {
+            p = skip_bracket(p);
+            if (!p) {
+                return NULL;
+            }
+        } else {
+            if (*p == '(') {
+                depth++;
+            } else if (*p == ')' && --depth == 0) {
+                return p + 1;
+            }
+            p++;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Extract a literal which every match of an ERE must contain, returning its
+ * length, or 0 if we couldn't find one. The literal is not null terminated.
+ *
+ * @pattern: The ERE
+ * @out: Output for the literal. Must be at least PATTERN_LITERAL_MAX bytes
+ */
+size_t pattern_literal(const char *pattern, char *out) {
+    struct literal_state ls = {.best = out};
+    bool last_literal = false; // Whether the last atom was a literal char
+
+    for (const char *p = pattern; *p;) {
+        char c = *p;
+        bool optional;
+
+        switch (c) {
+            case '|':
+                return 0; // Alternation at the top level, nothing is required
+            case '(':
+            case '[':
+                p = c == '(' ? skip_group(p) : skip_bracket(p);
+                if (!p) {
+                    return 0;
+                }
+                literal_end_run(&ls);
+                last_literal = false;
+                continue;
+            case '*':
+            case '?':
+            case '+':
+            case '{':
+                if (c == '{') {
+                    char *end;
+                    unsigned long min = strtoul(p + 1, &end, 10);
+                    if (end == p + 1 || !(end = strchr(end, '}'))) {
+                        return 0;
+                    }
+                    optional = min == 0;
+                    p = end + 1;
+                } else {
+                    optional = c != '+';
+                    p++;
+                }
+                // The atom before an optional quantifier may not appear at
+                // all, and a repeated one can't be part of a longer run
+                if (optional && last_literal) {
+                    ls.cur_len--;
+                }
+                literal_end_run(&ls);
+                last_literal = false;
+                continue;
+            case '\\':
+                if (!p[1]) {
+                    return 0;
+                }
+                if (!is_ere_special(p[1])) {
+                    // Backreferences, word boundaries and other GNU escapes
+                    literal_end_run(&ls);
+                    last_literal = false;
+                    p += 2;
+                    continue;
+                }
+                c = p[1];
+                p += 2;
+                break;
+            case '.':
+            case '^':
+            case '$':
+                literal_end_run(&ls);
+                last_literal = false;
+                p++;
+                continue;
+            default:
+                p++;
+                if ((unsigned char)c >= 0x80) {
+                    // Could be part of a multibyte character, so a following
+                    // quantifier may apply to more than this byte
+                    literal_end_run(&ls);
+                    last_literal = false;
+                    continue;
+                }
+                break;
+        }
+
+        if (ls.cur_len < PATTERN_LITERAL_MAX) {
+            ls.cur[ls.cur_len] = c;
+        }
+        ls.cur_len++;
+        last_literal = true;
+    }
+
+    literal_end_run(&ls);
+    return ls.best_len;
+}
+
+/**
+ * Initialise an empty pattern set.
+ *
+ * @set: The pattern set to initialise
+ * @multiline: Whether ^ and $ should match at line boundaries within the
+ *             input, as well as at its start and end
+ */
+void pattern_set_init(struct pattern_set *set, bool multiline) {
+    memset(set, '\0', sizeof(*set));
+    set->cflags = REG_EXTENDED | REG_NOSUB | (multiline ? REG_NEWLINE : 0);
+}
+
+/**
+ * Add a regex to the pattern set, returning -EINVAL if it doesn't compile.
+ * pattern_set_compile() must be called after adding regexes.
+ *
+ * @set: The pattern set to operate on
+ * @pattern: The ERE to add
+ */
+int pattern_set_add(struct pattern_set *set, const char *pattern) {
+    regex_t rgx;
+    if (regcomp(&rgx, pattern, set->cflags)) {
+        return -EINVAL;
+    }
+    regfree(&rgx);
+
+    if (set->nr == set->alloc) {
+        set->alloc = set->alloc ? set->alloc * 2 : 16;
+        set->patterns =
+            realloc(set->patterns, set->alloc * sizeof(*set->patterns));
+        set->literals =
+            realloc(set->literals, set->alloc * sizeof(*set->literals));
+        set->literal_lens =
+            realloc(set->literal_lens, set->alloc * sizeof(*set->literal_lens));
+        expect(set->patterns && set->literals && set->literal_lens);
+    }
+
+    char literal[PATTERN_LITERAL_MAX];
+    size_t literal_len = pattern_literal(pattern, literal);
+    set->patterns[set->nr] = strdup(pattern);
+    set->literals[set->nr] = NULL;
+    set->literal_lens[set->nr] = 0;
+    expect(set->patterns[set->nr]);
+    if (literal_len >= PATTERN_LITERAL_MIN) {
+        set->literals[set->nr] = malloc(literal_len);
+        expect(set->literals[set->nr]);
+        memcpy(set->literals[set->nr], literal, literal_len);
+        set->literal_lens[set->nr] = literal_len;
+    }
+    set->nr++;
+    return 0;
+}
+
+/**
+ * Add one regex per line of @text, skipping empty lines. Returns -EINVAL if
+ * any of them don't compile, in which case nothing after that line is added.
+ *
+ * @set: The pattern set to operate on
+ * @text: The regexes, separated by newlines
+ * @bad_line: Output for the 1-indexed line number of the regex which failed
+ *            to compile
+ */
+int pattern_set_add_lines(struct pattern_set *set, const char *text,
+                          size_t *bad_line) {
+    size_t line_nr = 0;
+    while (*text) {
+        size_t len = strcspn(text, "\n");
+        line_nr++;
+        if (len > 0) {
+            _drop_(free) char *pattern = strndup(text, len);
+            expect(pattern);
+            if (pattern_set_add(set, pattern) < 0) {
+                *bad_line = line_nr;
+                return -EINVAL;
+            }
+        }
+        text += len + (text[len] == '\n');
+    }
+    return 0;
+}
+
+/**
+ * Add a state to the automaton, returning its index.
+ */
+static uint32_t _nonnull_ automaton_add_state(struct pattern_set *set,
+                                              size_t *states_alloc) {
+    if (set->nr_states == *states_alloc) {
+        *states_alloc = *states_alloc ? *states_alloc * 2 : 64;
+        set->delta =
+            realloc(set->delta, *states_alloc * 256 * sizeof(*set->delta));
+        set->first = realloc(set->first, *states_alloc * sizeof(*set->first));
+        set->dict = realloc(set->dict, *states_alloc * sizeof(*set->dict));
+        expect(set->delta && set->first && set->dict);
+    }
+    uint32_t state = (uint32_t)set->nr_states++;
+    memset(set->delta + (size_t)state * 256, '\0', 256 * sizeof(*set->delta));
+    set->first[state] = PATTERN_NONE;
+    set->dict[state] = 0;
+    return state;
+}
+
+/**
+ * Build the Aho-Corasick automaton over every regex's literal. Must be called
+ * after adding regexes and before matching.
+ *
+ * @set: The pattern set to operate on
+ */
+void pattern_set_compile(struct pattern_set *set) {
+    size_t states_alloc = 0;
+    set->nr_states = 0;
+    set->nr_unfiltered = 0;
+    free(set->next);
+    free(set->unfiltered);
+    set->next = malloc((set->nr + 1) * sizeof(*set->next));
+    set->unfiltered = malloc((set->nr + 1) * sizeof(*set->unfiltered));
+    expect(set->next && set->unfiltered);
+    automaton_add_state(set, &states_alloc);
+
+    // Build the trie. In @delta, 0 means no edge until the BFS below fills
+    // in the failure transitions, since nothing can transition to the root.
+    for (size_t i = 0; i < set->nr; i++) {
+        if (!set->literals[i]) {
+            set->unfiltered[set->nr_unfiltered++] = (uint32_t)i;
+            continue;
+        }
+        uint32_t state = 0;
+        for (size_t j = 0; j < set->literal_lens[i]; j++) {
+            uint8_t c = (uint8_t)set->literals[i][j];
+            if (!set->delta[(size_t)state * 256 + c]) {
+                uint32_t child = automaton_add_state(set, &states_alloc);
+                set->delta[(size_t)state * 256 + c] = child;
+            }
+            state = set->delta[(size_t)state * 256 + c];
+        }
+        set->next[i] = set->first[state];
+        set->first[state] = (uint32_t)i;
+    }
+
+    // Breadth first, fill in every missing edge with the transition from the
+    // state's failure link, which is always shallower and so already done.
+    _drop_(free) uint32_t *fail = calloc(set->nr_states, sizeof(*fail));
+    _drop_(free) uint32_t *queue = malloc(set->nr_states * sizeof(*queue));
+    expect(fail && queue);
+    size_t head = 0, tail = 0;
+    queue[tail++] = 0;
+    while (head < tail) {
+        uint32_t state = queue[head++];
+        uint32_t *edges = set->delta + (size_t)state * 256;
+        const uint32_t *fail_edges = set->delta + (size_t)fail[state] * 256;
+        for (size_t c = 0; c < 256; c++) {
+            uint32_t child = edges[c];
+            if (!child) {
+                edges[c] = state ? fail_edges[c] : 0;
+                continue;
+            }
+            fail[child] = state ? fail_edges[c] : 0;
+            set->dict[child] = set->first[fail[child]] != PATTERN_NONE
+                                   ? fail[child]
+                                   : set->dict[fail[child]];
+            queue[tail++] = child;
+        }
+    }
+}
+
+/**
+ * Free the resources held by a pattern set.
+ *
+ * @set: The pattern set to free
+ */
+void pattern_set_free(struct pattern_set *set) {
+    for (size_t i = 0; i < set->nr; i++) {
+        free(set->patterns[i]);
+        free(set->literals[i]);
+    }
+    free(set->patterns);
+    free(set->literals);
+    free(set->literal_lens);
+    free(set->delta);
+    free(set->first);
+    free(set->next);
+    free(set->dict);
+    free(set->unfiltered);
+    memset(set, '\0', sizeof(*set));
+}
+
+/**
+ * Initialise a matcher for use by the calling thread.
+ *
+ * @m: The matcher to initialise
+ * @set: The compiled pattern set to match against
+ */
+void pattern_matcher_init(struct pattern_matcher *m,
+                          const struct pattern_set *set) {
+    m->set = set;
+    m->gen = 0;
+    m->rgxs = calloc(set->nr + 1, sizeof(*m->rgxs));
+    m->tried = calloc(set->nr + 1, sizeof(*m->tried));
+    expect(m->rgxs && m->tried);
+    for (size_t i = 0; i < set->nr; i++) {
+        // Already checked to compile in pattern_set_add()
+        expect(regcomp(m->rgxs + i, set->patterns[i], set->cflags) == 0);
+    }
+}
+
+/**
+ * Run a single regex against the input, unless it was already run against
+ * this input.
+ */
+static bool _nonnull_ matcher_try(struct pattern_matcher *m, uint32_t idx,
+                                  const char *data, size_t len) {
+    if (m->tried[idx] == m->gen) {
+        return false;
+    }
+    m->tried[idx] = m->gen;
+    regmatch_t bounds = {.rm_so = 0, .rm_eo = (regoff_t)len};
+    int ret = regexec(m->rgxs + idx, data, 1, &bounds, REG_STARTEND);
+    expect(ret == 0 || ret == REG_NOMATCH);
+    return ret == 0;
+}
+
+/**
+ * Check whether input matches any regex in the pattern set.
+ *
+ * @m: The calling thread's matcher
+ * @data: The input, which must be null terminated at @len
+ * @len: The length of @data
+ */
+bool pattern_match(struct pattern_matcher *m, const char *data, size_t len) {
+    const struct pattern_set *set = m->set;
+    if (++m->gen == 0) {
+        memset(m->tried, '\0', set->nr * sizeof(*m->tried));
+        m->gen = 1;
+    }
+
+    if (set->nr - set->nr_unfiltered == 1) {
+        // With a single literal, the trie is a chain ending in the last state
+        uint32_t idx = set->first[set->nr_states - 1];
+        if (memmem(data, len, set->literals[idx], set->literal_lens[idx]) &&
+            matcher_try(m, idx, data, len)) {
+            return true;
+        }
+    } else if (set->nr_states > 1) {
+        const uint32_t *delta = set->delta;
+        uint32_t state = 0;
+        for (size_t i = 0; i < len; i++) {
+            state = delta[(size_t)state * 256 + (uint8_t)data[i]];
+            uint32_t out = set->first[state] != PATTERN_NONE
+                               ? state
+                               : set->dict[state];
+            for (; out; out = set->dict[out]) {
+                for (uint32_t idx = set->first[out]; idx != PATTERN_NONE;
+                     idx = set->next[idx]) {
+                    if (matcher_try(m, idx, data, len)) {
+                        return true;
+                    }
+                }
+            }
+        }
+    }
+
+    for (size_t i = 0; i < set->nr_unfiltered; i++) {
+        if (matcher_try(m, set->unfiltered[i], data, len)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Free the resources held by a matcher.
+ *
+ * @m: The matcher to free
+ */
+void pattern_matcher_free(struct pattern_matcher *m) {
+    for (size_t i = 0; m->rgxs && i < m->set->nr; i++) {
+        regfree(m->rgxs + i);
+    }
+    free(m->rgxs);
+    free(m->tried);
+    memset(m, '\0', sizeof(*m));
+}
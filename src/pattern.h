@@ -0,0 +1,88 @@
+#ifndef CM_PATTERN_H
+#define CM_PATTERN_H
+
+#include <regex.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "util.h"
+
+#define PATTERN_LITERAL_MIN 2  /* Shorter literals aren't worth prefiltering */
+#define PATTERN_LITERAL_MAX 16 /* Longer literals are truncated */
+
+/**
+ * A set of POSIX extended regexes, matched together as one: input matches the
+ * set if it matches any of them.
+ *
+ * @patterns: The source of each regex
+ * @literals: For each regex, a literal which every match must contain, or
+ *            NULL if there is none
+ * @literal_lens: The length of each entry in @literals
+ * @nr: The number of regexes
+ * @alloc: The number of entries allocated in @patterns, @literals and
+ *         @literal_lens
+ * @cflags: The flags to compile each regex with
+ * @delta: The Aho-Corasick automaton over @literals, as a dense transition
+ *         table of 256 entries per state. State 0 is the root
+ * @nr_states: The number of states in @delta
+ * @first: For each state, the first regex whose literal ends there, or
+ *         UINT32_MAX
+ * @next: For each regex, the next regex whose literal ends in the same
+ *        state, or UINT32_MAX
+ * @dict: For each state, the nearest state along its failure links where a
+ *        literal ends, or 0 if there is none
+ * @unfiltered: The regexes with no usable literal, which are always run
+ * @nr_unfiltered: The number of entries in @unfiltered
+ */
+struct pattern_set {
+    char **patterns;
+    char **literals;
+    size_t *literal_lens;
+    size_t nr;
+    size_t alloc;
+    int cflags;
+
+    uint32_t *delta;
+    size_t nr_states;
+    uint32_t *first;
+    uint32_t *next;
+    uint32_t *dict;
+    uint32_t *unfiltered;
+    size_t nr_unfiltered;
+};
+
+/**
+ * The per-thread state for matching against a `struct pattern_set`.
+ * regexec() serialises calls sharing a regex_t, so each thread needs its own.
+ *
+ * @set: The compiled pattern set
+ * @rgxs: This thread's compiled copy of each regex
+ * @tried: For each regex, the value of @gen when it was last run
+ * @gen: Incremented for each input, so @tried needn't be cleared
+ */
+struct pattern_matcher {
+    const struct pattern_set *set;
+    regex_t *rgxs;
+    uint32_t *tried;
+    uint32_t gen;
+};
+
+size_t _nonnull_ pattern_literal(const char *pattern, char *out);
+void _nonnull_ pattern_set_init(struct pattern_set *set, bool multiline);
+int _must_use_ _nonnull_ pattern_set_add(struct pattern_set *set,
+                                         const char *pattern);
+int _must_use_ _nonnull_ pattern_set_add_lines(struct pattern_set *set,
+                                               const char *text,
+                                               size_t *bad_line);
+void _nonnull_ pattern_set_compile(struct pattern_set *set);
+void _nonnull_ pattern_set_free(struct pattern_set *set);
+DEFINE_DROP_FUNC_PTR(struct pattern_set, pattern_set_free)
+void _nonnull_ pattern_matcher_init(struct pattern_matcher *m,
+                                    const struct pattern_set *set);
+bool _nonnull_ pattern_match(struct pattern_matcher *m, const char *data,
+                             size_t len);
+void _nonnull_ pattern_matcher_free(struct pattern_matcher *m);
+DEFINE_DROP_FUNC_PTR(struct pattern_matcher, pattern_matcher_free)
+
+#endif
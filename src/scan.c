@@ -0,0 +1,240 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "scan.h"
+
+/**
+ * SCAN DESIGN
+ *
+ * Matching against the full content of every clip is dominated by reading
+ * the content, so the snips are shared out between a pool of worker threads,
+ * one per core. Content sizes vary wildly, so rather than splitting the snips
+ * into fixed ranges, workers claim small chunks from a shared counter until
+ * none are left. Each result is written to the slot for its snip, so they come
+ * out in history order without any merging.
+ *
+ * Content is read into a buffer owned by each worker rather than mmapped: with
+ * many threads running, every munmap() has to shoot down TLB entries on all
+ * of their cores, which costs more than the copy for typical clip sizes.
+ *
+ * The caller holds a reference on the clip store throughout, so the snips
+ * can't change under the workers. Only the content directory is touched from
+ * the workers, and only with openat() and read().
+ */
+
+/**
+ * State shared by every worker in a scan.
+ *
+ * @cs: The clip store being scanned
+ * @nr_snips: The number of snips to scan
+ * @next: The index of the next snip which hasn't been claimed by a worker
+ * @match: The match function
+ * @out: Output for whether each snip matched
+ * @status: The first error hit by any worker, or 0
+ */
+struct scan_shared {
+    struct clip_store *cs;
+    size_t nr_snips;
+    atomic_size_t next;
+    cs_scan_match_fn match;
+    bool *out;
+    atomic_int status;
+};
+
+/**
+ * A single worker in a scan.
+ *
+ * @shared: The state shared by all workers
+ * @private: The private data passed to the match function
+ * @thread: The worker's thread
+ */
+struct scan_worker {
+    struct scan_shared *shared;
+    void *private;
+    pthread_t thread;
+};
+
+/**
+ * Read the whole content for @hash into @buf, growing it as needed and null
+ * terminating it. Returns the length of the content, or a negative errno.
+ *
+ * @cs: The clip store to operate on
+ * @hash: The hash of the content to read
+ * @buf: The worker's buffer, reallocated as needed
+ * @buf_alloc: The size of @buf
+ */
+static ssize_t _nonnull_ scan_read_content(struct clip_store *cs,
+                                           uint64_t hash, char **buf,
+                                           size_t *buf_alloc) {
+    _drop_(close) int fd = cs_content_open(cs, hash);
+    if (fd < 0) {
+        return fd;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        return negative_errno();
+    }
+
+    size_t size = (size_t)st.st_size;
+    if (size + 1 > *buf_alloc) {
+        *buf_alloc = size + 1;
+        free(*buf);
+        *buf = malloc(*buf_alloc);
+        expect(*buf);
+    }
+    size_t len = read_safe(fd, *buf, size);
+    (*buf)[len] = '\0';
+    return (ssize_t)len;
+}
+
+/**
+ * Claim and match chunks of snips until there are none left. Runs as a
+ * pthread.
+ *
+ * @private: The `struct scan_worker`
+ */
+static void *scan_worker_run(void *private) {
+    struct scan_worker *worker = private;
+    struct scan_shared *shared = worker->shared;
+    _drop_(free) char *buf = NULL;
+    size_t buf_alloc = 0;
+
+    while (atomic_load(&shared->status) == 0) {
+        size_t start = atomic_fetch_add(&shared->next, SCAN_CHUNK_SNIPS);
+        if (start >= shared->nr_snips) {
+            break;
+        }
+        size_t end = start + SCAN_CHUNK_SNIPS;
+        if (end > shared->nr_snips) {
+            end = shared->nr_snips;
+        }
+
+        for (size_t i = start; i < end; i++) {
+            ssize_t len = scan_read_content(
+                shared->cs, shared->cs->snips[i].hash, &buf, &buf_alloc);
+            if (len == -ENOENT) {
+                shared->out[i] = false; // Removed from under the snip file
+                continue;
+            }
+            if (len < 0) {
+                int expected = 0;
+                atomic_compare_exchange_strong(&shared->status, &expected,
+                                               (int)len);
+                return NULL;
+            }
+            shared->out[i] =
+                shared->match(buf, (size_t)len, worker->private);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Decide how many workers to use for scanning @nr_snips snips.
+ *
+ * @nr_snips: The number of snips to be scanned
+ */
+size_t scan_nr_workers(size_t nr_snips) {
+    long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t nr_workers = nr_snips / SCAN_SNIPS_PER_WORKER + 1;
+    if (nr_cpus > 0 && nr_workers > (size_t)nr_cpus) {
+        nr_workers = (size_t)nr_cpus;
+    }
+    return nr_workers;
+}
+
+/**
+ * Match the full content of every snip in the clip store in parallel. The
+ * caller must hold a reference to the clip store, so that the results stay
+ * in step with the snips.
+ *
+ * @cs: The clip store to operate on
+ * @match: The function deciding whether content matches
+ * @privates: The private data for each worker's calls to @match
+ * @nr_workers: The number of workers, and entries in @privates. Usually from
+ *              scan_nr_workers()
+ * @out: Output for whether each snip matched, indexed like cs->snips. Must
+ *       have space for cs->header->nr_snips entries
+ */
+int cs_content_scan(struct clip_store *cs, cs_scan_match_fn match,
+                    void *const *privates, size_t nr_workers, bool *out) {
+    _drop_(cs_unref) struct ref_guard guard = cs_ref(cs);
+    if (guard.status < 0) {
+        return guard.status;
+    }
+    expect(nr_workers > 0);
+
+    struct scan_shared shared = {
+        .cs = cs,
+        .nr_snips = cs->header->nr_snips,
+        .match = match,
+        .out = out,
+    };
+    atomic_init(&shared.next, 0);
+    atomic_init(&shared.status, 0);
+
+    _drop_(free) struct scan_worker *workers =
+        calloc(nr_workers, sizeof(*workers));
+    expect(workers);
+    for (size_t i = 0; i < nr_workers; i++) {
+        workers[i].shared = &shared;
+        workers[i].private = privates[i];
+    }
+
+    // As with filtering, the first worker runs on this thread
+    for (size_t i = 1; i < nr_workers; i++) {
+        int ret = pthread_create(&workers[i].thread, NULL, scan_worker_run,
+                                 workers + i);
+        expect(ret == 0);
+    }
+    scan_worker_run(workers);
+    for (size_t i = 1; i < nr_workers; i++) {
+        expect(pthread_join(workers[i].thread, NULL) == 0);
+    }
+
+    return atomic_load(&shared.status);
+}
+
+/**
+ * cs_scan_match_fn for matching content against a pattern set.
+ *
+ * @private: The worker's `struct pattern_matcher`
+ */
+static bool scan_match_patterns(const char *data, size_t len, void *private) {
+    return pattern_match(private, data, len);
+}
+
+/**
+ * Match the full content of every snip against a compiled pattern set. The
+ * caller must hold a reference to the clip store.
+ *
+ * @cs: The clip store to operate on
+ * @set: The compiled pattern set
+ * @out: Output for whether each snip matched, as with cs_content_scan()
+ */
+int cs_content_match_patterns(struct clip_store *cs,
+                              const struct pattern_set *set, bool *out) {
+    size_t nr_workers = scan_nr_workers(cs->header->nr_snips);
+    _drop_(free) struct pattern_matcher *matchers =
+        calloc(nr_workers, sizeof(*matchers));
+    _drop_(free) void **privates = calloc(nr_workers, sizeof(*privates));
+    expect(matchers && privates);
+
+    for (size_t i = 0; i < nr_workers; i++) {
+        pattern_matcher_init(matchers + i, set);
+        privates[i] = matchers + i;
+    }
+
+    int ret =
+        cs_content_scan(cs, scan_match_patterns, privates, nr_workers, out);
+
+    for (size_t i = 0; i < nr_workers; i++) {
+        pattern_matcher_free(matchers + i);
+    }
+    return ret;
+}
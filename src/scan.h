@@ -0,0 +1,32 @@
+#ifndef CM_SCAN_H
+#define CM_SCAN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "pattern.h"
+#include "store.h"
+#include "util.h"
+
+#define SCAN_CHUNK_SNIPS 16       /* Snips claimed by a worker at a time */
+#define SCAN_SNIPS_PER_WORKER 256 /* Minimum snips to justify another worker */
+
+/**
+ * Decide whether a content entry matches. Called concurrently from several
+ * workers, each with its own @private.
+ *
+ * @data: The content, which is also null terminated at @len
+ * @len: The length of @data
+ * @private: The private data for the calling worker
+ */
+typedef bool (*cs_scan_match_fn)(const char *data, size_t len, void *private);
+
+size_t _must_use_ scan_nr_workers(size_t nr_snips);
+int _must_use_ _nonnull_ cs_content_scan(struct clip_store *cs,
+                                         cs_scan_match_fn match,
+                                         void *const *privates,
+                                         size_t nr_workers, bool *out);
+int _must_use_ _nonnull_ cs_content_match_patterns(
+    struct clip_store *cs, const struct pattern_set *set, bool *out);
+
+#endif
@@ -0,0 +1,597 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+    #include <emmintrin.h>
+#endif
+
+#include "ipc.h"
+#include "sensitive.h"
+
+/**
+ * SENSITIVE CONTENT DESIGN
+ *
+ * Every clip is scanned before it's stored, so the scan has to cost next to
+ * nothing on the overwhelming majority of clips which contain no secrets,
+ * however large they are. Each shape we look for has something cheap to spot
+ * which any match must contain:
+ *
+ * - API keys, JWTs and private keys all start with a known literal, like
+ *   "ghp_", "eyJ" or "-----BEGIN ". From each literal we pick one byte which
+ *   is rare in ordinary text, like the "_" in "ghp_" or the "J" in "eyJ", as
+ *   its anchor. We look for all the anchors at once, 16 bytes at a time with
+ *   SSE2. Literals share anchors, so there are only a handful to look for
+ *   however many literals there are.
+ * - Card numbers are runs of at least 13 bytes, each of which is a digit or
+ *   a separator following one. We find the digits at the same time, and use
+ *   a few shifts on the mask of them to find where such runs end. Card
+ *   numbers are only looked for in those runs.
+ *
+ * Chunks with neither cost a handful of vector operations per 16 bytes.
+ *
+ * Only the candidates turned up by either of those are checked properly, one
+ * byte at a time. Everything here is ASCII: no shape we look for can contain
+ * anything else.
+ */
+
+#define BLOCK 16 /* Bytes per vector */
+#define CHUNK 64 /* Bytes per prefilter step, one bit each in a uint64_t */
+#define CARD_DIGITS_MIN 13
+#define CARD_DIGITS_MAX 19
+#define CARD_FIRST_GROUP 4 /* Digits before the first separator, if any */
+#define CARD_GROUP_MIN 3
+#define CARD_GROUP_MAX 6
+#define CARD_SPAN_MAX 24 /* 4+3+3+3+3+3 digits, and the separators */
+#define JWT_SEGMENT_MIN 10 /* For the header and payload */
+#define PRIVATE_KEY_LINE_MAX 64
+
+static const char *const kind_names[SENSITIVE_KIND_MAX] = {
+    [SENSITIVE_API_KEY] = "api_key",
+    [SENSITIVE_JWT] = "jwt",
+    [SENSITIVE_PRIVATE_KEY] = "private_key",
+    [SENSITIVE_CARD] = "card",
+};
+
+/* Added when SENSITIVE_API_KEY is wanted */
+static const struct {
+    const char *literal;
+    size_t min_body;
+} builtin_api_keys[] = {
+    {"ghp_", 36},     {"gho_", 36},  {"ghu_", 36},
+    {"ghs_", 36},     {"ghr_", 36},  {"github_pat_", 22},
+    {"glpat-", 20},   {"sk-", 20},   {"sk_live_", 16},
+    {"rk_live_", 16}, {"xoxb-", 10}, {"xoxp-", 10},
+    {"xoxa-", 10},    {"xoxs-", 10}, {"AKIA", 16},
+    {"ASIA", 16},     {"AIza", 35},
+};
+
+const char *sensitive_kind_name(enum sensitive_kind kind) {
+    return kind < SENSITIVE_KIND_MAX ? kind_names[kind] : "unknown";
+}
+
+void sensitive_rules_init(struct sensitive_rules *rules) {
+    memset(rules, '\0', sizeof(*rules));
+}
+
+static void _nonnull_ prefix_add(struct sensitive_rules *rules,
+                                 const char *literal, size_t min_body,
+                                 enum sensitive_kind kind) {
+    struct sensitive_prefix *prefixes =
+        realloc(rules->prefixes, (rules->nr_prefixes + 1) * sizeof(*prefixes));
+    expect(prefixes);
+    rules->prefixes = prefixes;
+    struct sensitive_prefix *prefix = &prefixes[rules->nr_prefixes++];
+    prefix->literal = strdup(literal);
+    expect(prefix->literal);
+    prefix->len = strlen(literal);
+    prefix->min_body = min_body;
+    prefix->kind = kind;
+}
+
+/**
+ * Roughly how common @c is in ordinary text and code, higher being more
+ * common.
+ */
+static int byte_commonness(unsigned char c) {
+    if ((c >= 'a' && c <= 'z') || c == ' ') {
+        return 3;
+    }
+    if ((c >= '0' && c <= '9') || c == '_' || c == '-' || c == '.') {
+        return 2;
+    }
+    return 1;
+}
+
+/**
+ * Pick the anchor for @prefix: its least common byte, preferring bytes which
+ * are already anchors for other prefixes. Returns -E2BIG if it would need a
+ * new anchor and there are already SENSITIVE_ANCHORS_MAX.
+ */
+static int _nonnull_ anchor_pick(struct sensitive_rules *rules,
+                                 struct sensitive_prefix *prefix) {
+    const unsigned char *lit = (const unsigned char *)prefix->literal;
+    int best_score = INT_MAX;
+    for (size_t i = 0; i < prefix->len; i++) {
+        bool known = memchr(rules->anchors, lit[i], rules->nr_anchors);
+        // Known anchors cost nothing extra to look for, so win ties
+        int score = byte_commonness(lit[i]) * 2 - known;
+        if (score < best_score) {
+            best_score = score;
+            prefix->anchor = i;
+        }
+    }
+
+    unsigned char anchor = lit[prefix->anchor];
+    if (memchr(rules->anchors, anchor, rules->nr_anchors)) {
+        return 0;
+    }
+    if (rules->nr_anchors == SENSITIVE_ANCHORS_MAX) {
+        return -E2BIG;
+    }
+    rules->anchors[rules->nr_anchors++] = anchor;
+    return 0;
+}
+
+/**
+ * Add a literal which starts an API key, followed by at least @min_body token
+ * characters. Returns -EINVAL if it's too short to prefilter on.
+ * sensitive_rules_compile() must be called after adding prefixes.
+ *
+ * @rules: The rules to add to
+ * @literal: The literal
+ * @min_body: How many token characters must follow it
+ */
+int sensitive_rules_add_prefix(struct sensitive_rules *rules,
+                               const char *literal, size_t min_body) {
+    if (strlen(literal) < 2) {
+        return -EINVAL;
+    }
+    prefix_add(rules, literal, min_body, SENSITIVE_API_KEY);
+    return 0;
+}
+
+static unsigned char _nonnull_
+prefix_anchor(const struct sensitive_prefix *prefix) {
+    return (unsigned char)prefix->literal[prefix->anchor];
+}
+
+static int anchor_cmp(const void *a, const void *b) {
+    return *(const unsigned char *)a - *(const unsigned char *)b;
+}
+
+static int prefix_anchor_cmp(const void *a, const void *b) {
+    return prefix_anchor(a) - prefix_anchor(b);
+}
+
+/**
+ * Add the built in prefixes for the wanted kinds, and work out what to
+ * prefilter on. Returns -E2BIG if the prefixes need too many distinct anchors.
+ *
+ * @rules: The rules to compile
+ */
+int sensitive_rules_compile(struct sensitive_rules *rules) {
+    if (rules->kinds & (1u << SENSITIVE_API_KEY)) {
+        for (size_t i = 0; i < arrlen(builtin_api_keys); i++) {
+            prefix_add(rules, builtin_api_keys[i].literal,
+                       builtin_api_keys[i].min_body, SENSITIVE_API_KEY);
+        }
+    }
+    if (rules->kinds & (1u << SENSITIVE_JWT)) {
+        prefix_add(rules, "eyJ", 0, SENSITIVE_JWT);
+    }
+    if (rules->kinds & (1u << SENSITIVE_PRIVATE_KEY)) {
+        prefix_add(rules, "-----BEGIN ", 0, SENSITIVE_PRIVATE_KEY);
+    }
+
+    rules->nr_anchors = 0;
+    rules->max_anchor = 0;
+    for (size_t i = 0; i < rules->nr_prefixes; i++) {
+        int ret = anchor_pick(rules, &rules->prefixes[i]);
+        if (ret < 0) {
+            return ret;
+        }
+        if (rules->prefixes[i].anchor > rules->max_anchor) {
+            rules->max_anchor = rules->prefixes[i].anchor;
+        }
+    }
+
+    // Group the prefixes by anchor, in the same order as the anchors
+    qsort(rules->anchors, rules->nr_anchors, sizeof(*rules->anchors),
+          anchor_cmp);
+    qsort(rules->prefixes, rules->nr_prefixes, sizeof(*rules->prefixes),
+          prefix_anchor_cmp);
+    for (size_t i = 0, j = 0; i < rules->nr_anchors; i++) {
+        while (j < rules->nr_prefixes && prefix_anchor(&rules->prefixes[j]) ==
+                                             rules->anchors[i]) {
+            j++;
+        }
+        rules->anchor_ends[i] = j;
+    }
+    return 0;
+}
+
+void sensitive_rules_free(struct sensitive_rules *rules) {
+    for (size_t i = 0; i < rules->nr_prefixes; i++) {
+        free(rules->prefixes[i].literal);
+    }
+    free(rules->prefixes);
+    memset(rules, '\0', sizeof(*rules));
+}
+
+static bool is_digit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+static bool is_alnum(char c) {
+    return is_digit(c) || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+/**
+ * Whether @c can be part of an API key, or of a base64url JWT segment.
+ */
+static bool is_token_char(char c) {
+    return is_alnum(c) || c == '_' || c == '-';
+}
+
+static size_t _nonnull_ token_run(const char *text, size_t len, size_t pos) {
+    size_t start = pos;
+    while (pos < len && is_token_char(text[pos])) {
+        pos++;
+    }
+    return pos - start;
+}
+
+/**
+ * Check for a JWT at @pos: a header starting with "eyJ", a payload starting
+ * with "eyJ", and a signature, which may be empty for unsigned tokens.
+ */
+static bool _nonnull_ check_jwt(const char *text, size_t len, size_t pos,
+                                struct sensitive_span *out) {
+    size_t end = pos;
+    for (size_t seg = 0; seg < 3; seg++) {
+        size_t run = token_run(text, len, end);
+        if (seg < 2) {
+            if (run < JWT_SEGMENT_MIN || strncmp(text + end, "eyJ", 3) != 0 ||
+                end + run >= len || text[end + run] != '.') {
+                return false;
+            }
+            run++;
+        }
+        end += run;
+    }
+    *out = (struct sensitive_span){pos, end - pos, SENSITIVE_JWT};
+    return true;
+}
+
+/**
+ * Check for a PEM private key header at @pos, which is already known to start
+ * with "-----BEGIN ". The span runs to the end of the END line, or of the
+ * text if it's been cut short.
+ */
+static bool _nonnull_ check_private_key(const char *text, size_t len,
+                                        size_t pos,
+                                        struct sensitive_span *out) {
+    static const char header_end[] = "PRIVATE KEY-----";
+    static const char footer[] = "-----END ";
+    size_t line_len = len - pos < PRIVATE_KEY_LINE_MAX ? len - pos
+                                                       : PRIVATE_KEY_LINE_MAX;
+    const char *nl = memchr(text + pos, '\n', line_len);
+    if (nl) {
+        line_len = (size_t)(nl - (text + pos));
+    }
+    const char *found =
+        memmem(text + pos, line_len, header_end, sizeof(header_end) - 1);
+    if (!found) {
+        return false;
+    }
+
+    size_t end = len;
+    const char *end_line =
+        memmem(found, len - (size_t)(found - text), footer, sizeof(footer) - 1);
+    if (end_line) {
+        const char *dashes = end_line + sizeof(footer) - 1;
+        dashes = memmem(dashes, len - (size_t)(dashes - text), "-----", 5);
+        if (dashes) {
+            end = (size_t)(dashes - text) + 5;
+        }
+    }
+    *out = (struct sensitive_span){pos, end - pos, SENSITIVE_PRIVATE_KEY};
+    return true;
+}
+
+/**
+ * Check @prefix, which would start at @pos.
+ */
+static bool _nonnull_ check_prefix(const struct sensitive_prefix *prefix,
+                                   const char *text, size_t len, size_t pos,
+                                   struct sensitive_span *out) {
+    if (len - pos < prefix->len ||
+        memcmp(text + pos, prefix->literal, prefix->len) != 0) {
+        return false;
+    }
+    switch (prefix->kind) {
+        case SENSITIVE_PRIVATE_KEY:
+            return check_private_key(text, len, pos, out);
+        case SENSITIVE_JWT:
+            return (pos == 0 || !is_token_char(text[pos - 1])) &&
+                   check_jwt(text, len, pos, out);
+        default: {
+            if (pos > 0 && is_token_char(text[pos - 1])) {
+                return false;
+            }
+            size_t body = token_run(text, len, pos + prefix->len);
+            if (body < prefix->min_body) {
+                return false;
+            }
+            *out = (struct sensitive_span){pos, prefix->len + body,
+                                           SENSITIVE_API_KEY};
+            return true;
+        }
+    }
+}
+
+/**
+ * Check every prefix anchored on the byte at @hit, for one starting at or
+ * after @from, and before @out if it's already set.
+ */
+static void _nonnull_ check_anchor(const struct sensitive_rules *rules,
+                                   const char *text, size_t len, size_t from,
+                                   size_t hit, struct sensitive_span *out) {
+    size_t k = 0;
+    while (rules->anchors[k] != (unsigned char)text[hit]) {
+        k++;
+    }
+    for (size_t i = k ? rules->anchor_ends[k - 1] : 0;
+         i < rules->anchor_ends[k]; i++) {
+        const struct sensitive_prefix *prefix = &rules->prefixes[i];
+        struct sensitive_span span;
+        size_t pos = hit - prefix->anchor;
+        // Most hits are on no prefix at all, so rule them out without a call.
+        // Literals are at least two bytes, and text[len] is the terminator
+        if (hit >= from + prefix->anchor && pos < out->start &&
+            text[pos] == prefix->literal[0] &&
+            text[pos + 1] == prefix->literal[1] &&
+            check_prefix(prefix, text, len, pos, &span)) {
+            *out = span;
+        }
+    }
+}
+
+/**
+ * Check for a card number starting at @pos: digits passing the Luhn check,
+ * either all together, or in groups the way cards print them, like "4-4-4-4"
+ * or "4-6-5", all separated by the same one of space or dash.
+ */
+static bool _nonnull_ check_card(const char *text, size_t len, size_t pos,
+                                 struct sensitive_span *out) {
+    char digits[CARD_DIGITS_MAX];
+    size_t nr_digits = 0, group = 0, nr_groups = 0, end = pos;
+    char separator = '\0';
+    for (; end < len; end++) {
+        if (is_digit(text[end])) {
+            if (nr_digits == CARD_DIGITS_MAX) {
+                return false;
+            }
+            digits[nr_digits++] = text[end];
+            group++;
+            continue;
+        }
+        bool is_separator = separator ? text[end] == separator
+                                      : text[end] == ' ' || text[end] == '-';
+        if (!is_separator || end + 1 == len || !is_digit(text[end + 1])) {
+            break;
+        }
+        if (nr_groups == 0 ? group != CARD_FIRST_GROUP
+                           : group < CARD_GROUP_MIN || group > CARD_GROUP_MAX) {
+            return false;
+        }
+        separator = text[end];
+        nr_groups++;
+        group = 0;
+    }
+    if (nr_groups && (group < CARD_GROUP_MIN || group > CARD_GROUP_MAX)) {
+        return false;
+    }
+    if (nr_digits < CARD_DIGITS_MIN || (end < len && is_alnum(text[end]))) {
+        return false;
+    }
+
+    // Luhn: double every second digit from the right
+    unsigned int sum = 0;
+    for (size_t i = 0; i < nr_digits; i++) {
+        unsigned int d = (unsigned int)(digits[nr_digits - 1 - i] - '0');
+        if (i % 2) {
+            d = d * 2 > 9 ? d * 2 - 9 : d * 2;
+        }
+        sum += d;
+    }
+    if (sum % 10) {
+        return false;
+    }
+    *out = (struct sensitive_span){pos, end - pos, SENSITIVE_CARD};
+    return true;
+}
+
+/**
+ * Find the first card number starting in [@start, @end).
+ */
+static bool _nonnull_ find_card(const char *text, size_t len, size_t start,
+                                size_t end, struct sensitive_span *out) {
+    for (size_t pos = start; pos < end; pos++) {
+        if (is_digit(text[pos]) && (pos == 0 || !is_alnum(text[pos - 1])) &&
+            check_card(text, len, pos, out)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * The prefilter for one sensitive_find() call: each anchor splatted across a
+ * vector once, rather than for every block.
+ */
+struct prefilter {
+    const struct sensitive_rules *rules;
+#ifdef __SSE2__
+    __m128i anchors[SENSITIVE_ANCHORS_MAX];
+#endif
+};
+
+static void _nonnull_ prefilter_init(struct prefilter *pf,
+                                     const struct sensitive_rules *rules) {
+    pf->rules = rules;
+#ifdef __SSE2__
+    for (size_t i = 0; i < rules->nr_anchors; i++) {
+        pf->anchors[i] = _mm_set1_epi8((char)rules->anchors[i]);
+    }
+#endif
+}
+
+/**
+ * Look at the chunk of up to 64 bytes at @pos, returning a mask of where the
+ * anchors are, and setting @digits to a mask of where the digits are.
+ */
+static uint64_t _nonnull_ chunk_scan(const struct prefilter *pf,
+                                     const char *text, size_t len, size_t pos,
+                                     uint64_t *digits) {
+    const struct sensitive_rules *rules = pf->rules;
+    uint64_t anchors = 0, digit_bits = 0;
+    size_t off = 0;
+
+#ifdef __SSE2__
+    for (; off < CHUNK && pos + off + BLOCK <= len; off += BLOCK) {
+        __m128i c = _mm_loadu_si128((const __m128i *)(text + pos + off));
+        __m128i any = _mm_setzero_si128();
+        for (size_t i = 0; i < rules->nr_anchors; i++) {
+            any = _mm_or_si128(any, _mm_cmpeq_epi8(c, pf->anchors[i]));
+        }
+        // Digits are the bytes which are unchanged by clamping c - '0' to 9
+        __m128i d = _mm_sub_epi8(c, _mm_set1_epi8('0'));
+        __m128i digit = _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(9)), d);
+        anchors |= (uint64_t)(unsigned int)_mm_movemask_epi8(any) << off;
+        digit_bits |= (uint64_t)(unsigned int)_mm_movemask_epi8(digit) << off;
+    }
+#endif
+
+    size_t end = pos + CHUNK < len ? pos + CHUNK : len;
+    for (size_t i = pos + off; i < end; i++) {
+        digit_bits |= (uint64_t)is_digit(text[i]) << (i - pos);
+        if (memchr(rules->anchors, text[i], rules->nr_anchors)) {
+            anchors |= 1ULL << (i - pos);
+        }
+    }
+    *digits = digit_bits;
+    return anchors;
+}
+
+/**
+ * Given where the digits are in this chunk and the one before it, return a
+ * mask of the positions in this chunk which end a run of at least
+ * CARD_DIGITS_MIN bytes which are each a digit or follow one. Every card
+ * number is such a run, so nothing else can end one.
+ */
+static uint64_t card_run_ends(uint64_t prev_digits, uint64_t digits) {
+    uint64_t prev = prev_digits | prev_digits << 1;
+    uint64_t cur = digits | digits << 1 | prev_digits >> 63;
+    // Each step extends the run length checked for by the shift: 1+1+2+4+5
+    static const unsigned int shifts[] = {1, 2, 4, 5};
+    static_assert(1 + 1 + 2 + 4 + 5 == CARD_DIGITS_MIN, "wrong shifts");
+    for (size_t i = 0; i < arrlen(shifts); i++) {
+        cur &= cur << shifts[i] | prev >> (64 - shifts[i]);
+        prev &= prev << shifts[i];
+    }
+    return cur;
+}
+
+/**
+ * Find the first sensitive span in @text starting at or after @from.
+ *
+ * @rules: The compiled rules
+ * @text: The text, null terminated at @len
+ * @len: The length of @text
+ * @from: Where to start looking
+ * @out: Where to put the span, if one is found
+ */
+bool sensitive_find(const struct sensitive_rules *rules, const char *text,
+                    size_t len, size_t from, struct sensitive_span *out) {
+    bool cards = rules->kinds & (1u << SENSITIVE_CARD);
+    if (!cards && rules->nr_anchors == 0) {
+        return false;
+    }
+
+    struct prefilter pf;
+    prefilter_init(&pf, rules);
+    uint64_t prev_digits = 0;
+    size_t card_from = from;
+
+    for (size_t pos = from; pos < len; pos += CHUNK) {
+        uint64_t digits;
+        uint64_t anchors = chunk_scan(&pf, text, len, pos, &digits);
+        uint64_t card_ends = cards ? card_run_ends(prev_digits, digits) : 0;
+        prev_digits = digits;
+        if (likely(!anchors && !card_ends)) {
+            continue;
+        }
+
+        struct sensitive_span best = {.start = SIZE_MAX};
+        if (card_ends) {
+            // Cards can only start in the runs, at most CARD_SPAN_MAX back
+            // from where they end
+            size_t first_end = pos + (size_t)__builtin_ctzll(card_ends);
+            size_t last_end = pos + 63 - (size_t)__builtin_clzll(card_ends);
+            size_t start = first_end > CARD_SPAN_MAX ? first_end - CARD_SPAN_MAX
+                                                     : 0;
+            start = start > card_from ? start : card_from;
+            find_card(text, len, start, last_end + 1, &best);
+            card_from = last_end + 1;
+        }
+
+        // Later anchors can still find an earlier start, up to max_anchor
+        // bytes before them
+        while (anchors) {
+            size_t hit = pos + (size_t)__builtin_ctzll(anchors);
+            anchors &= anchors - 1;
+            if (best.start != SIZE_MAX &&
+                hit >= best.start + rules->max_anchor) {
+                break;
+            }
+            check_anchor(rules, text, len, from, hit, &best);
+        }
+
+        if (best.start != SIZE_MAX) {
+            *out = best;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Replace every sensitive span in @text with SENSITIVE_REDACTED. If there were
+ * any, @text is replaced with a new string, and the old one freed. Returns the
+ * number of spans replaced.
+ *
+ * @rules: The compiled rules
+ * @text: The text to redact, to be freed with free()
+ */
+size_t sensitive_redact(const struct sensitive_rules *rules, char **text) {
+    size_t len = strlen(*text), pos = 0, nr_spans = 0;
+    struct cm_buf buf = {0};
+    struct sensitive_span span;
+    while (sensitive_find(rules, *text, len, pos, &span)) {
+        cm_buf_append(&buf, *text + pos, span.start - pos);
+        cm_buf_append(&buf, SENSITIVE_REDACTED, strlen(SENSITIVE_REDACTED));
+        pos = span.start + span.len;
+        nr_spans++;
+    }
+    if (nr_spans) {
+        cm_buf_append(&buf, *text + pos, len - pos + 1);
+        free(*text);
+        *text = buf.data;
+    }
+    return nr_spans;
+}
@@ -0,0 +1,116 @@
+#ifndef CM_SENSITIVE_H
+#define CM_SENSITIVE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "util.h"
+
+#define SENSITIVE_ANCHORS_MAX 16 /* Distinct bytes we prefilter on */
+#define SENSITIVE_PREFIX_BODY_MIN 16 /* Default token length after a prefix */
+#define SENSITIVE_REDACTED "[redacted]"
+
+/**
+ * The shapes of sensitive content we can recognise.
+ *
+ * @SENSITIVE_API_KEY: A token starting with a known API key prefix, like
+ *                     "ghp_" or "AKIA", or one added with sensitive_prefix
+ * @SENSITIVE_JWT: A JSON web token, three base64url segments joined by dots
+ * @SENSITIVE_PRIVATE_KEY: A PEM private key, from its BEGIN line to its END
+ *                         line
+ * @SENSITIVE_CARD: A payment card number, 13 to 19 digits passing the Luhn
+ *                  check, optionally grouped with spaces or dashes
+ */
+enum sensitive_kind {
+    SENSITIVE_API_KEY,
+    SENSITIVE_JWT,
+    SENSITIVE_PRIVATE_KEY,
+    SENSITIVE_CARD,
+    SENSITIVE_KIND_MAX
+};
+
+/**
+ * What to do with a clip containing sensitive content.
+ *
+ * @SENSITIVE_ACTION_TTL: Store it, but expire it after the sensitive TTL
+ * @SENSITIVE_ACTION_SKIP: Don't store it at all
+ * @SENSITIVE_ACTION_REDACT: Store it with each sensitive span replaced by
+ *                           SENSITIVE_REDACTED
+ */
+enum sensitive_action {
+    SENSITIVE_ACTION_TTL,
+    SENSITIVE_ACTION_SKIP,
+    SENSITIVE_ACTION_REDACT,
+};
+
+/**
+ * A literal which starts sensitive content.
+ *
+ * @literal: The literal, at least two bytes long
+ * @len: The length of @literal
+ * @min_body: For SENSITIVE_API_KEY, how many token characters must follow
+ * @kind: What the literal starts
+ * @anchor: The offset in @literal of the byte the prefilter looks for
+ */
+struct sensitive_prefix {
+    char *literal;
+    size_t len;
+    size_t min_body;
+    enum sensitive_kind kind;
+    size_t anchor;
+};
+
+/**
+ * The sensitive content to look for, and what to do on finding it.
+ *
+ * @kinds: Which shapes to look for, a mask of 1 << `enum sensitive_kind`
+ * @action: What to do with clips containing any of them
+ * @ttl: For SENSITIVE_ACTION_TTL, the TTL in seconds
+ * @prefixes: The literals starting API keys, JWTs and private keys
+ * @nr_prefixes: The number of entries in @prefixes
+ * @anchors: The distinct anchor bytes of @prefixes, in ascending order
+ * @anchor_ends: For each anchor, the index in @prefixes after the last one
+ *               with that anchor. @prefixes is sorted by anchor
+ * @nr_anchors: The number of entries in @anchors
+ * @max_anchor: The largest anchor offset in @prefixes
+ */
+struct sensitive_rules {
+    uint32_t kinds;
+    enum sensitive_action action;
+    uint64_t ttl;
+    struct sensitive_prefix *prefixes;
+    size_t nr_prefixes;
+    unsigned char anchors[SENSITIVE_ANCHORS_MAX];
+    size_t anchor_ends[SENSITIVE_ANCHORS_MAX];
+    size_t nr_anchors;
+    size_t max_anchor;
+};
+
+/**
+ * A run of sensitive content found by sensitive_find().
+ *
+ * @start: The offset of the first byte
+ * @len: The length
+ * @kind: What it is
+ */
+struct sensitive_span {
+    size_t start;
+    size_t len;
+    enum sensitive_kind kind;
+};
+
+void _nonnull_ sensitive_rules_init(struct sensitive_rules *rules);
+int _must_use_ _nonnull_ sensitive_rules_add_prefix(
+    struct sensitive_rules *rules, const char *literal, size_t min_body);
+int _must_use_ _nonnull_ sensitive_rules_compile(struct sensitive_rules *rules);
+void _nonnull_ sensitive_rules_free(struct sensitive_rules *rules);
+bool _must_use_ _nonnull_ sensitive_find(const struct sensitive_rules *rules,
+                                         const char *text, size_t len,
+                                         size_t from,
+                                         struct sensitive_span *out);
+size_t _nonnull_ sensitive_redact(const struct sensitive_rules *rules,
+                                  char **text);
+const char _nonnull_ *sensitive_kind_name(enum sensitive_kind kind);
+
+#endif
@@ -0,0 +1,68 @@
+#include <errno.h>
+#include <stdlib.h>
+
+#include "spsc.h"
+
+/**
+ * Set up an empty queue.
+ *
+ * @q: The queue to initialise
+ * @capacity: How many items it can hold at once, which must be a power of two
+ */
+int spsc_queue_init(struct spsc_queue *q, size_t capacity) {
+    if (capacity == 0 || (capacity & (capacity - 1))) {
+        return -EINVAL;
+    }
+    q->slots = calloc(capacity, sizeof(*q->slots));
+    expect(q->slots);
+    q->mask = capacity - 1;
+    atomic_init(&q->tail, 0);
+    atomic_init(&q->head, 0);
+    q->head_cache = 0;
+    q->tail_cache = 0;
+    return 0;
+}
+
+/**
+ * Add @item to the queue. Only the producer may call this. Returns false if
+ * the queue is full, in which case @item is still the caller's.
+ */
+bool spsc_queue_push(struct spsc_queue *q, void *item) {
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    if (tail - q->head_cache > q->mask) {
+        q->head_cache = atomic_load_explicit(&q->head, memory_order_acquire);
+        if (tail - q->head_cache > q->mask) {
+            return false;
+        }
+    }
+    q->slots[tail & q->mask] = item;
+    // Publish the item before the index which makes it visible
+    atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+/**
+ * Take the oldest item from the queue. Only the consumer may call this.
+ * Returns NULL if the queue is empty.
+ */
+void *spsc_queue_pop(struct spsc_queue *q) {
+    size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    if (head == q->tail_cache) {
+        q->tail_cache = atomic_load_explicit(&q->tail, memory_order_acquire);
+        if (head == q->tail_cache) {
+            return NULL;
+        }
+    }
+    void *item = q->slots[head & q->mask];
+    // Only hand the slot back once we're done reading it
+    atomic_store_explicit(&q->head, head + 1, memory_order_release);
+    return item;
+}
+
+/**
+ * Free the queue's storage. Any items still in it are not freed.
+ */
+void spsc_queue_free(struct spsc_queue *q) {
+    free(q->slots);
+    q->slots = NULL;
+}
@@ -0,0 +1,46 @@
+#ifndef CM_SPSC_H
+#define CM_SPSC_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "util.h"
+
+#define SPSC_CACHE_LINE 64
+
+/**
+ * A bounded queue of pointers from exactly one producer thread to exactly one
+ * consumer thread. Neither side ever blocks: pushing to a full queue or
+ * popping from an empty one fails straight away, and it's up to the caller
+ * what to do about it.
+ *
+ * @head and @tail only ever increase, and are masked to index @slots. Each is
+ * only written by one side, and they live on separate cache lines so that the
+ * two sides don't keep taking the line from each other. Each side also keeps
+ * its last look at the other's index, and only reads it again when that says
+ * the queue is full or empty.
+ *
+ * @slots: The items, @mask + 1 of them
+ * @mask: The capacity minus one
+ * @tail: Where the producer puts the next item
+ * @head_cache: The producer's last look at @head
+ * @head: Where the consumer takes the next item from
+ * @tail_cache: The consumer's last look at @tail
+ */
+struct spsc_queue {
+    void **slots;
+    size_t mask;
+    _Alignas(SPSC_CACHE_LINE) atomic_size_t tail;
+    size_t head_cache;
+    _Alignas(SPSC_CACHE_LINE) atomic_size_t head;
+    size_t tail_cache;
+};
+
+int _must_use_ _nonnull_ spsc_queue_init(struct spsc_queue *q,
+                                         size_t capacity);
+bool _must_use_ _nonnull_ spsc_queue_push(struct spsc_queue *q, void *item);
+void _nonnull_ *spsc_queue_pop(struct spsc_queue *q);
+void _nonnull_ spsc_queue_free(struct spsc_queue *q);
+
+#endif
@@ -0,0 +1,314 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "stats.h"
+
+/**
+ * The current value of the monotonic clock in microseconds.
+ */
+uint64_t stats_now_us(void) {
+    struct timespec ts;
+    expect(clock_gettime(CLOCK_MONOTONIC, &ts) == 0);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+/**
+ * Record a latency sample in a histogram.
+ */
+static void _nonnull_ hist_record(struct stats_hist *hist,
+                                  uint64_t elapsed_us) {
+    size_t bucket =
+        elapsed_us < 2 ? 0 : 63 - (size_t)__builtin_clzll(elapsed_us);
+    if (bucket >= STATS_NR_BUCKETS) {
+        bucket = STATS_NR_BUCKETS - 1;
+    }
+
+    __atomic_fetch_add(&hist->buckets[bucket], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&hist->sum_us, elapsed_us, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&hist->count, 1, __ATOMIC_RELAXED);
+
+    uint64_t max = __atomic_load_n(&hist->max_us, __ATOMIC_RELAXED);
+    while (elapsed_us > max &&
+           !__atomic_compare_exchange_n(&hist->max_us, &max, elapsed_us, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+/**
+ * Record a latency sample in a histogram. Does nothing if @st is NULL.
+ *
+ * @st: The stats region, or NULL
+ * @h: The histogram to record in
+ * @elapsed_us: The latency in microseconds
+ */
+void stats_record(struct cm_stats *st, enum stats_histogram h,
+                  uint64_t elapsed_us) {
+    if (st) {
+        hist_record(&st->hists[h], elapsed_us);
+    }
+}
+
+/**
+ * The lock site slots this process has already found. Callers pass __func__,
+ * so the string's address identifies the site within this process, and we can
+ * usually skip comparing names in the shared slots. Emptied by stats_unmap(),
+ * since a later mapping may land at the same address.
+ */
+static struct {
+    const struct cm_stats *st;
+    const char *site;
+    struct stats_lock_site *slot;
+} lock_site_cache[STATS_NR_LOCK_SITES];
+static size_t nr_lock_sites_cached;
+
+/**
+ * Find the lock site slot for @site, claiming a free one if it has none yet.
+ * Returns NULL if every slot is taken by other sites.
+ */
+static struct stats_lock_site *_nonnull_ lock_site_find(struct cm_stats *st,
+                                                        const char *site) {
+    for (size_t i = 0; i < nr_lock_sites_cached; i++) {
+        if (lock_site_cache[i].st == st && lock_site_cache[i].site == site) {
+            return lock_site_cache[i].slot;
+        }
+    }
+
+    struct stats_lock_site *slot = NULL;
+    for (size_t i = 0; i < STATS_NR_LOCK_SITES && !slot; i++) {
+        struct stats_lock_site *cur = &st->lock_sites[i];
+        uint32_t state = 0;
+        if (__atomic_compare_exchange_n(&cur->state, &state, 1, false,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+            snprintf_safe(cur->name, sizeof(cur->name), "%.*s",
+                          (int)sizeof(cur->name) - 1, site);
+            __atomic_store_n(&cur->state, 2, __ATOMIC_RELEASE);
+            slot = cur;
+            break;
+        }
+        // Someone else is claiming it, wait for them to name it
+        while (state == 1) {
+            state = __atomic_load_n(&cur->state, __ATOMIC_ACQUIRE);
+        }
+        if (strncmp(cur->name, site, sizeof(cur->name) - 1) == 0) {
+            slot = cur;
+        }
+    }
+
+    if (slot && nr_lock_sites_cached < arrlen(lock_site_cache)) {
+        lock_site_cache[nr_lock_sites_cached].st = st;
+        lock_site_cache[nr_lock_sites_cached].site = site;
+        lock_site_cache[nr_lock_sites_cached].slot = slot;
+        nr_lock_sites_cached++;
+    }
+    return slot;
+}
+
+/**
+ * Record how long a caller of cs_ref() waited for and then held the clip
+ * store lock. Does nothing if @st is NULL, or if there are already too many
+ * distinct sites to track another.
+ *
+ * @st: The stats region, or NULL
+ * @site: The name of the function which took the lock
+ * @wait_us: How long it took to get the lock, in microseconds
+ * @hold_us: How long the lock was held, in microseconds
+ */
+void stats_record_lock(struct cm_stats *st, const char *site,
+                       uint64_t wait_us, uint64_t hold_us) {
+    if (!st) {
+        return;
+    }
+    struct stats_lock_site *slot = lock_site_find(st, site);
+    if (slot) {
+        hist_record(&slot->wait, wait_us);
+        hist_record(&slot->hold, hold_us);
+    }
+}
+
+/**
+ * Map the stats region at @path.
+ *
+ * clipmenud maps it with STATS_MAP_CREATE, which creates the file if needed
+ * and resets the stats, so they cover the lifetime of the current daemon.
+ * Other users of the clip store map it with STATS_MAP_APPEND so that their
+ * lock timings are counted too, and readers use STATS_MAP_READ. Both get
+ * -ENOENT if clipmenud hasn't created it yet, or -EPROTO if it was created
+ * by an incompatible version.
+ *
+ * @path: The path to the stats file
+ * @mode: How to map the region, see `enum stats_map_mode`
+ * @out: Output for the mapped region, to be released with stats_unmap()
+ */
+int stats_map(const char *path, enum stats_map_mode mode,
+              struct cm_stats **out) {
+    bool create = mode == STATS_MAP_CREATE, writable = mode != STATS_MAP_READ;
+    _drop_(close) int fd =
+        create ? open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600)
+               : open(path, (writable ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+    if (fd < 0) {
+        return negative_errno();
+    }
+
+    if (create && ftruncate(fd, sizeof(struct cm_stats)) < 0) {
+        return negative_errno();
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        return negative_errno();
+    }
+    if ((size_t)st.st_size < sizeof(struct cm_stats)) {
+        return -EPROTO;
+    }
+
+    struct cm_stats *stats =
+        mmap(NULL, sizeof(*stats), PROT_READ | (writable ? PROT_WRITE : 0),
+             MAP_SHARED, fd, 0);
+    if (stats == MAP_FAILED) {
+        return negative_errno();
+    }
+
+    if (create) {
+        memset(stats, 0, sizeof(*stats));
+        stats->version = STATS_VERSION;
+        stats->started = (uint64_t)time(NULL);
+        __atomic_store_n(&stats->magic, STATS_MAGIC, __ATOMIC_RELEASE);
+    } else if (__atomic_load_n(&stats->magic, __ATOMIC_ACQUIRE) !=
+                   STATS_MAGIC ||
+               stats->version != STATS_VERSION) {
+        munmap(stats, sizeof(*stats));
+        return -EPROTO;
+    }
+
+    *out = stats;
+    return 0;
+}
+
+/**
+ * Unmap a stats region mapped with stats_map(). Does nothing if @st is NULL.
+ */
+void stats_unmap(struct cm_stats *st) {
+    if (!st) {
+        return;
+    }
+    size_t kept = 0;
+    for (size_t i = 0; i < nr_lock_sites_cached; i++) {
+        if (lock_site_cache[i].st != st) {
+            lock_site_cache[kept++] = lock_site_cache[i];
+        }
+    }
+    nr_lock_sites_cached = kept;
+    expect(munmap(st, sizeof(*st)) == 0);
+}
+
+static const char *const counter_names[STAT_MAX] = {
+    [STAT_CLIPS_ADDED] = "clips_added",
+    [STAT_DEDUPE_HITS] = "dedupe_hits",
+    [STAT_PARTIAL_REPLACEMENTS] = "partial_replacements",
+    [STAT_TRIMS] = "trims",
+    [STAT_TRIMMED_SNIPS] = "trimmed_snips",
+    [STAT_EVICTED_SNIPS] = "evicted_snips",
+    [STAT_EXPIRED_SNIPS] = "expired_snips",
+    [STAT_GC_ENTRIES] = "gc_entries",
+    [STAT_REMAPS] = "remaps",
+    [STAT_LOCK_WAITS] = "lock_waits",
+    [STAT_SELECTION_NOTIFIES] = "selection_notifies",
+    [STAT_CONVERSIONS] = "conversions",
+    [STAT_DEBOUNCED] = "debounced",
+    [STAT_X_ROUND_TRIPS] = "x_round_trips",
+    [STAT_SENSITIVE_CLIPS] = "sensitive_clips",
+    [STAT_STORE_QUEUE_FULL] = "store_queue_full",
+    [STAT_STORE_QUEUE_DROPS] = "store_queue_drops",
+    [STAT_DISPLAY_DUPLICATES] = "display_duplicates",
+    [STAT_BYTES_STORED] = "bytes_stored",
+};
+
+static const char *const hist_names[HIST_MAX] = {
+    [HIST_INGEST] = "ingest",
+    [HIST_TRIM] = "trim",
+    [HIST_GC] = "gc",
+    [HIST_LOCK_WAIT] = "lock_wait",
+};
+
+/**
+ * Find the upper bound of the bucket containing the given quantile of a
+ * histogram's samples, in microseconds.
+ */
+static uint64_t _nonnull_ hist_quantile(const uint64_t *buckets,
+                                        uint64_t count, double q) {
+    uint64_t target = (uint64_t)((double)count * q), seen = 0;
+    for (size_t i = 0; i < STATS_NR_BUCKETS; i++) {
+        seen += buckets[i];
+        if (seen > target) {
+            return (uint64_t)1 << (i + 1);
+        }
+    }
+    return (uint64_t)1 << STATS_NR_BUCKETS;
+}
+
+/**
+ * Print the summary of a histogram, with each line prefixed by @name.
+ */
+static void _nonnull_ hist_print(const struct stats_hist *hist,
+                                 const char *name, FILE *out) {
+    uint64_t buckets[STATS_NR_BUCKETS], count = 0;
+    for (size_t b = 0; b < STATS_NR_BUCKETS; b++) {
+        buckets[b] = __atomic_load_n(&hist->buckets[b], __ATOMIC_RELAXED);
+        count += buckets[b];
+    }
+    uint64_t sum = __atomic_load_n(&hist->sum_us, __ATOMIC_RELAXED);
+
+    fprintf(out, "%s_count %" PRIu64 "\n", name, count);
+    if (count == 0) {
+        return;
+    }
+    fprintf(out, "%s_mean_us %" PRIu64 "\n", name, sum / count);
+    fprintf(out, "%s_p50_us %" PRIu64 "\n", name,
+            hist_quantile(buckets, count, 0.5));
+    fprintf(out, "%s_p99_us %" PRIu64 "\n", name,
+            hist_quantile(buckets, count, 0.99));
+    fprintf(out, "%s_max_us %" PRIu64 "\n", name,
+            __atomic_load_n(&hist->max_us, __ATOMIC_RELAXED));
+}
+
+/**
+ * Print every counter and histogram summary, one per line, as "name value"
+ * pairs. Latencies are in microseconds, and percentiles are the upper bound
+ * of the bucket they fall in. Lock timings for each cs_ref() caller are
+ * printed as lock_<caller>_wait_* and lock_<caller>_hold_*.
+ *
+ * @st: The stats region
+ * @out: The file to print to
+ */
+void stats_print(const struct cm_stats *st, FILE *out) {
+    uint64_t now = (uint64_t)time(NULL);
+    fprintf(out, "uptime_secs %" PRIu64 "\n",
+            now > st->started ? now - st->started : 0);
+
+    for (size_t i = 0; i < STAT_MAX; i++) {
+        fprintf(out, "%s %" PRIu64 "\n", counter_names[i],
+                __atomic_load_n(&st->counters[i], __ATOMIC_RELAXED));
+    }
+
+    for (size_t i = 0; i < HIST_MAX; i++) {
+        hist_print(&st->hists[i], hist_names[i], out);
+    }
+
+    for (size_t i = 0; i < STATS_NR_LOCK_SITES; i++) {
+        const struct stats_lock_site *site = &st->lock_sites[i];
+        if (__atomic_load_n(&site->state, __ATOMIC_ACQUIRE) != 2) {
+            continue;
+        }
+        char name[STATS_LOCK_SITE_NAME + 16];
+        snprintf_safe(name, sizeof(name), "lock_%.*s_wait",
+                      (int)sizeof(site->name) - 1, site->name);
+        hist_print(&site->wait, name, out);
+        snprintf_safe(name, sizeof(name), "lock_%.*s_hold",
+                      (int)sizeof(site->name) - 1, site->name);
+        hist_print(&site->hold, name, out);
+    }
+}
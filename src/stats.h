@@ -0,0 +1,183 @@
+#ifndef CM_STATS_H
+#define CM_STATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "util.h"
+
+#define STATS_MAGIC 0x54534d43 /* "CMST" */
+#define STATS_VERSION 8        /* Bump when struct cm_stats changes */
+#define STATS_NR_BUCKETS 32    /* Power of two microsecond buckets */
+#define STATS_NR_LOCK_SITES 32 /* Distinct cs_ref() callers tracked */
+#define STATS_LOCK_SITE_NAME 32
+
+/**
+ * Monotonic counters in the stats region.
+ *
+ * @STAT_CLIPS_ADDED: Clips added as new entries
+ * @STAT_DEDUPE_HITS: Clips whose content was already in the content directory
+ * @STAT_PARTIAL_REPLACEMENTS: Clips which replaced a partial previous clip
+ * @STAT_TRIMS: Times the clip store was trimmed or evicted from
+ * @STAT_TRIMMED_SNIPS: Snips removed by trimming for max_clips
+ * @STAT_EVICTED_SNIPS: Snips removed by eviction for max_bytes
+ * @STAT_EXPIRED_SNIPS: Snips removed by expiry
+ * @STAT_GC_ENTRIES: Removed content entries deleted from the graveyard
+ * @STAT_REMAPS: Times cs_ref() found the snip file had changed under it
+ * @STAT_LOCK_WAITS: Times cs_ref() had to wait for another process's lock
+ * @STAT_SELECTION_NOTIFIES: Times a watched selection changed owner
+ * @STAT_CONVERSIONS: Times we asked a selection owner to convert the selection
+ * @STAT_DEBOUNCED: Owner changes folded into a later one by the debounce
+ * @STAT_X_ROUND_TRIPS: Requests clipmenud waited on a reply for while
+ *                      handling selection changes
+ * @STAT_SENSITIVE_CLIPS: Clips found to contain sensitive content
+ * @STAT_STORE_QUEUE_FULL: Clips held back because the storage thread's queue
+ *                         was full
+ * @STAT_STORE_QUEUE_DROPS: Held back clips replaced by a newer one from the
+ *                          same selection before there was room for them
+ * @STAT_DISPLAY_DUPLICATES: Clips not stored because the same text had just
+ *                           been stored from another display
+ * @STAT_BYTES_STORED: The current size of the content directory. This is a
+ *                     gauge rather than a counter
+ */
+enum stats_counter {
+    STAT_CLIPS_ADDED,
+    STAT_DEDUPE_HITS,
+    STAT_PARTIAL_REPLACEMENTS,
+    STAT_TRIMS,
+    STAT_TRIMMED_SNIPS,
+    STAT_EVICTED_SNIPS,
+    STAT_EXPIRED_SNIPS,
+    STAT_GC_ENTRIES,
+    STAT_REMAPS,
+    STAT_LOCK_WAITS,
+    STAT_SELECTION_NOTIFIES,
+    STAT_CONVERSIONS,
+    STAT_DEBOUNCED,
+    STAT_X_ROUND_TRIPS,
+    STAT_SENSITIVE_CLIPS,
+    STAT_STORE_QUEUE_FULL,
+    STAT_STORE_QUEUE_DROPS,
+    STAT_DISPLAY_DUPLICATES,
+    STAT_BYTES_STORED,
+    STAT_MAX
+};
+
+/**
+ * Latency histograms in the stats region.
+ *
+ * @HIST_INGEST: From being told about a new selection to it being stored
+ * @HIST_TRIM: Trimming, evicting or expiring snips
+ * @HIST_GC: Deleting a slice of removed content entries from the graveyard
+ * @HIST_LOCK_WAIT: Waiting for the clip store lock, when we had to wait. See
+ *                  also `struct stats_lock_site` for a breakdown by caller
+ */
+enum stats_histogram {
+    HIST_INGEST,
+    HIST_TRIM,
+    HIST_GC,
+    HIST_LOCK_WAIT,
+    HIST_MAX
+};
+
+/**
+ * A latency histogram. Bucket 0 counts samples under 2us, and bucket n > 0
+ * counts samples in [2^n, 2^(n+1)) us, with the last bucket also taking
+ * anything larger.
+ *
+ * @count: The number of samples
+ * @sum_us: The sum of all samples in microseconds
+ * @max_us: The largest sample in microseconds
+ * @buckets: The number of samples in each bucket
+ */
+struct stats_hist {
+    uint64_t count;
+    uint64_t sum_us;
+    uint64_t max_us;
+    uint64_t buckets[STATS_NR_BUCKETS];
+};
+
+/**
+ * How long one caller of cs_ref() waited for and held the clip store lock,
+ * across every process attached to the stats region. Only the outermost
+ * reference counts, since nested ones don't touch the lock.
+ *
+ * @state: 0 while the slot is free, 1 while a process is claiming it, and 2
+ *         once @name is valid
+ * @name: The name of the calling function, possibly truncated
+ * @wait: Time from asking for the lock to getting it, including when it was
+ *        uncontended
+ * @hold: Time from getting the lock to releasing it
+ */
+struct stats_lock_site {
+    uint32_t state;
+    char name[STATS_LOCK_SITE_NAME];
+    struct stats_hist wait;
+    struct stats_hist hold;
+};
+
+/**
+ * The shared memory stats region, mapped from a file in the cache directory.
+ * Every field is updated with relaxed atomics, so writers never take a lock
+ * and readers may see a snapshot which is slightly inconsistent between
+ * fields.
+ *
+ * @magic: STATS_MAGIC, once the region is initialised
+ * @version: STATS_VERSION
+ * @started: The Unix time clipmenud started at
+ * @counters: Indexed by `enum stats_counter`
+ * @hists: Indexed by `enum stats_histogram`
+ * @lock_sites: Lock timings by caller, claimed in order of first use
+ */
+struct cm_stats {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t started;
+    uint64_t counters[STAT_MAX];
+    struct stats_hist hists[HIST_MAX];
+    struct stats_lock_site lock_sites[STATS_NR_LOCK_SITES];
+};
+
+/**
+ * How to map the stats region.
+ *
+ * @STATS_MAP_READ: Map an existing region read only
+ * @STATS_MAP_APPEND: Map an existing region for writing, keeping its stats
+ * @STATS_MAP_CREATE: Create the region if needed, and reset it
+ */
+enum stats_map_mode { STATS_MAP_READ, STATS_MAP_APPEND, STATS_MAP_CREATE };
+
+/**
+ * Add to a counter. Does nothing if @st is NULL, so callers can update stats
+ * unconditionally whether or not a stats region is attached.
+ */
+static inline void stats_add(struct cm_stats *st, enum stats_counter c,
+                             uint64_t n) {
+    if (st) {
+        __atomic_fetch_add(&st->counters[c], n, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Set a gauge. Does nothing if @st is NULL.
+ */
+static inline void stats_set(struct cm_stats *st, enum stats_counter c,
+                             uint64_t val) {
+    if (st) {
+        __atomic_store_n(&st->counters[c], val, __ATOMIC_RELAXED);
+    }
+}
+
+uint64_t stats_now_us(void);
+void stats_record(struct cm_stats *st, enum stats_histogram h,
+                  uint64_t elapsed_us);
+void stats_record_lock(struct cm_stats *st, const char *site,
+                       uint64_t wait_us, uint64_t hold_us);
+int _must_use_ _nonnull_ stats_map(const char *path, enum stats_map_mode mode,
+                                   struct cm_stats **out);
+void stats_unmap(struct cm_stats *st);
+DEFINE_DROP_FUNC(struct cm_stats *, stats_unmap)
+void _nonnull_ stats_print(const struct cm_stats *st, FILE *out);
+
+#endif
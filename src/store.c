@@ -10,8 +10,11 @@
 #include <sys/file.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "index.h"
+#include "stats.h"
 #include "store.h"
 
 /**
@@ -31,6 +34,8 @@
  * - cs_trim - trim to the newest/oldest N entries
  * - cs_snip_iter - iterate over snip hashes and lines
  * - cs_content_get - get the content for a snip hash
+ * - cs_search - search the full content of every entry, see index.c
+ * - cs_gc - delete removed content entries, a bounded number at a time
  *
  * CLIP STORE DESIGN
  *
@@ -46,6 +51,13 @@
  * name as the snip hash. This allows quickly going from the one line summary
  * in the snip to the full contents.
  *
+ * Deleting a large file is slow, and removing an entry used to delete it with
+ * the lock held, so a trim of many entries held up everyone else. Instead, an
+ * entry whose last snip is removed is renamed into the graveyard directory,
+ * which is a single cheap rename, and its bytes stop counting towards
+ * header->nr_bytes straight away. cs_gc() deletes the graveyard's contents
+ * later, without the lock, as many at a time as the caller can afford.
+ *
  * SYNCHRONISATION
  *
  * The clip store's size may be increased or decreased by another program using
@@ -91,19 +103,42 @@ void cs_unref(struct clip_store *cs) {
     cs->refcount--;
     if (cs->refcount == 0) {
         expect(flock(cs->snip_fd, LOCK_UN) == 0);
+        // The stats may have been attached while we held the lock
+        if (cs->stats && cs->lock_site) {
+            stats_record_lock(cs->stats, cs->lock_site, cs->lock_wait_us,
+                              stats_now_us() - cs->lock_start_us);
+        }
+        cs->lock_site = NULL;
     }
 }
 
 /**
  * Increase the reference count for the clip store lock.
  *
+ * If a stats region is attached, the outermost reference also notes how long
+ * it took to get the lock and when, so that cs_unref() can record the wait and
+ * hold times against @site.
+ *
  * @cs: The clip store to operate on
+ * @site: The name of the calling function
  */
 static struct ref_guard _must_use_ _nonnull_
-cs_ref_no_update(struct clip_store *cs) {
+cs_ref_no_update(struct clip_store *cs, const char *site) {
     struct ref_guard guard = {.status = 0, .unref = cs_unref, .cs = cs};
     if (cs->refcount == 0) {
-        expect(flock(cs->snip_fd, LOCK_EX) == 0);
+        uint64_t start = cs->stats ? stats_now_us() : 0;
+        if (flock(cs->snip_fd, LOCK_EX | LOCK_NB) < 0) {
+            expect(errno == EWOULDBLOCK);
+            start = start ? start : stats_now_us();
+            expect(flock(cs->snip_fd, LOCK_EX) == 0);
+            stats_add(cs->stats, STAT_LOCK_WAITS, 1);
+            stats_record(cs->stats, HIST_LOCK_WAIT, stats_now_us() - start);
+        }
+        if (cs->stats) {
+            cs->lock_site = site;
+            cs->lock_start_us = stats_now_us();
+            cs->lock_wait_us = cs->lock_start_us - start;
+        }
     }
     static_assert(sizeof(cs->refcount) == sizeof(size_t),
                   "refcount type wrong");
@@ -114,14 +149,15 @@ cs_ref_no_update(struct clip_store *cs) {
 
 /**
  * Increase the reference count for the clip store lock, and remap as needed if
- * the header values have changed.
+ * the header values have changed. Usually called through cs_ref().
  *
  * Even if the guard status indicates an error, you must still call cs_unref().
  *
  * @cs: The clip store to operate on
+ * @site: The name of the calling function, for lock timings
  */
-struct ref_guard cs_ref(struct clip_store *cs) {
-    struct ref_guard guard = cs_ref_no_update(cs);
+struct ref_guard cs_ref_at(struct clip_store *cs, const char *site) {
+    struct ref_guard guard = cs_ref_no_update(cs, site);
 
     if (cs->refcount > 1) {
         // We're an inner reference, so any necessary remapping has already
@@ -131,6 +167,7 @@ struct ref_guard cs_ref(struct clip_store *cs) {
 
     if (cs->local_nr_snips != cs->header->nr_snips ||
         cs->local_nr_snips_alloc != cs->header->nr_snips_alloc) {
+        stats_add(cs->stats, STAT_REMAPS, 1);
         struct stat st;
         if (fstat(cs->snip_fd, &st) < 0) {
             guard.status = negative_errno();
@@ -181,6 +218,10 @@ void drop_cs_unref(struct ref_guard *guard) {
  */
 int cs_destroy(struct clip_store *cs) {
     cs->ready = false;
+    if (cs->index) {
+        cs_index_free(cs->index);
+        cs->index = NULL;
+    }
     // Don't use the value from the header: if it's out of date, we haven't
     // done mremap() with the new size yet
     if (munmap(cs->header, cs_file_size(cs->local_nr_snips_alloc))) {
@@ -212,7 +253,10 @@ int cs_init(struct clip_store *cs, int snip_fd, int content_dir_fd) {
     cs->snip_fd = snip_fd;
     cs->content_dir_fd = content_dir_fd;
     cs->refcount = 0;
-    _drop_(cs_unref) struct ref_guard guard = cs_ref_no_update(cs);
+    cs->index = NULL;
+    cs->stats = NULL;
+    cs->lock_site = NULL;
+    _drop_(cs_unref) struct ref_guard guard = cs_ref_no_update(cs, __func__);
 
     struct stat st;
     if (fstat(snip_fd, &st) < 0) {
@@ -242,6 +286,12 @@ int cs_init(struct clip_store *cs, int snip_fd, int content_dir_fd) {
         return ret;
     }
 
+    if (mkdirat(content_dir_fd, CS_GRAVEYARD, 0700) < 0 && errno != EEXIST) {
+        ret = negative_errno();
+        munmap(cs->header, file_size);
+        return ret;
+    }
+
     cs->snips = (struct cs_snip *)(cs->header + 1);
     cs->local_nr_snips = cs->header->nr_snips;
     cs->local_nr_snips_alloc = cs->header->nr_snips_alloc;
@@ -318,12 +368,15 @@ static int _must_use_ _nonnull_ cs_file_resize(struct clip_store *cs,
  * @hash: The new hash value for the snip
  * @line: The new line content for the snip
  * @nr_lines: The number of lines in the line content
+ * @size: The size of the content in bytes
  */
 static void _nonnull_ cs_snip_update(struct cs_snip *snip, uint64_t hash,
-                                     const char *line, uint64_t nr_lines) {
+                                     const char *line, uint64_t nr_lines,
+                                     uint64_t size) {
     snip->hash = hash;
     snip->doomed = false;
     snip->nr_lines = nr_lines;
+    snip->size = size;
     strncpy(snip->line, line, CS_SNIP_LINE_SIZE - 1);
     snip->line[CS_SNIP_LINE_SIZE - 1] = '\0';
 }
@@ -333,7 +386,7 @@ static void _nonnull_ cs_snip_update(struct cs_snip *snip, uint64_t hash,
  *
  * @buf: The input buffer to hash.
  */
-static uint64_t djb64_hash(const char *buf) {
+uint64_t djb64_hash(const char *buf) {
     const uint8_t *src = (const uint8_t *)buf;
     uint64_t hash = 5381;
     uint8_t c;
@@ -375,36 +428,56 @@ size_t first_line(const char *text, char *out) {
  * the clip store. The snip file size is grown as necessary to accommodate the
  * new snip.
  *
+ * The capture time is clamped to be no earlier than the newest existing snip,
+ * so that snips stay sorted by capture time even if the clock goes backwards.
+ *
  * @cs: The clip store to operate on
  * @hash: The hash value of the snip to add
  * @line: The line content of the snip to add
  * @nr_lines: The number of lines in the line content
+ * @size: The size of the content in bytes
+ * @ttl: The number of seconds after which the snip expires, or 0 for none
  */
 static int _must_use_ _nonnull_ cs_snip_add(struct clip_store *cs,
                                             uint64_t hash, const char *line,
-                                            uint64_t nr_lines) {
+                                            uint64_t nr_lines, uint64_t size,
+                                            uint64_t ttl) {
     _drop_(cs_unref) struct ref_guard guard = cs_ref(cs);
     if (guard.status < 0) {
         return guard.status;
     }
-    int ret = cs_file_resize(cs, cs->header->nr_snips + 1);
+
+    uint64_t captured = (uint64_t)time(NULL);
+    size_t nr_snips = cs->header->nr_snips;
+    if (nr_snips > 0 && cs->snips[nr_snips - 1].captured > captured) {
+        captured = cs->snips[nr_snips - 1].captured;
+    }
+
+    int ret = cs_file_resize(cs, nr_snips + 1);
     if (ret < 0) {
         return ret;
     }
-    cs_snip_update(cs->snips + cs->header->nr_snips - 1, hash, line, nr_lines);
+    struct cs_snip *snip = cs->snips + cs->header->nr_snips - 1;
+    cs_snip_update(snip, hash, line, nr_lines, size);
+    snip->captured = captured;
+    snip->expires = ttl ? captured + ttl : 0;
     return 0;
 }
 
 /**
- * Add content to the content directory using the hash as the filename.
+ * Add content to the content directory using the hash as the filename. Must
+ * be called with the lock held, since new content is added to
+ * header->nr_bytes.
  *
  * @cs: The clip store to operate on
  * @hash: The hash of the content to add
  * @content: The content to add to the file
+ * @len: The length of @content
  */
 static int _must_use_ _nonnull_ cs_content_add(struct clip_store *cs,
                                                uint64_t hash,
-                                               const char *content) {
+                                               const char *content,
+                                               size_t len) {
     bool dupe = false;
 
     char dir_path[CS_HASH_STR_MAX];
@@ -436,6 +509,7 @@ static int _must_use_ _nonnull_ cs_content_add(struct clip_store *cs,
             return negative_errno();
         }
 
+        stats_add(cs->stats, STAT_DEDUPE_HITS, 1);
         return 0;
     }
 
@@ -447,7 +521,7 @@ static int _must_use_ _nonnull_ cs_content_add(struct clip_store *cs,
     }
 
     const char *cur = content;
-    size_t remaining = strlen(content);
+    size_t remaining = len;
 
     while (remaining > 0) {
         ssize_t written = write(fd, cur, remaining);
@@ -458,6 +532,8 @@ static int _must_use_ _nonnull_ cs_content_add(struct clip_store *cs,
         cur += written;
     }
 
+    cs->header->nr_bytes += len;
+    stats_set(cs->stats, STAT_BYTES_STORED, cs->header->nr_bytes);
     return 0;
 }
 
@@ -487,6 +563,21 @@ void drop_cs_content_unmap(struct cs_content *content) {
     expect(ret == 0);
 }
 
+/**
+ * Open the content associated with a given hash read-only, returning the fd or
+ * a negative errno.
+ *
+ * @cs: The clip store to operate on
+ * @hash: The hash of the content to open
+ */
+int cs_content_open(struct clip_store *cs, uint64_t hash) {
+    char filename[PATH_MAX];
+    snprintf(filename, sizeof(filename), "%" PRIu64 "/1", hash);
+
+    int fd = openat(cs->content_dir_fd, filename, O_RDONLY | O_CLOEXEC);
+    return fd < 0 ? negative_errno() : fd;
+}
+
 /**
  * Retrieve the content associated with a given hash from the content directory
  * and map it into memory.
@@ -500,12 +591,9 @@ int cs_content_get(struct clip_store *cs, uint64_t hash,
                    struct cs_content *content) {
     memset(content, '\0', sizeof(struct cs_content));
 
-    char filename[PATH_MAX];
-    snprintf(filename, sizeof(filename), "%" PRIu64 "/1", hash);
-
-    _drop_(close) int fd = openat(cs->content_dir_fd, filename, O_RDONLY);
+    _drop_(close) int fd = cs_content_open(cs, hash);
     if (fd < 0) {
-        return negative_errno();
+        return fd;
     }
 
     struct stat st;
@@ -530,23 +618,34 @@ int cs_content_get(struct clip_store *cs, uint64_t hash,
  *
  * @cs: The clip store to operate on
  * @content: The content to add
+ * @ttl: The number of seconds after which the clip expires, or 0 for none
  * @out_hash: Output for the generated hash, or NULL
  */
-int cs_add(struct clip_store *cs, const char *content, uint64_t *out_hash) {
+int cs_add(struct clip_store *cs, const char *content, uint64_t ttl,
+           uint64_t *out_hash) {
+    _drop_(cs_unref) struct ref_guard guard = cs_ref(cs);
+    if (guard.status < 0) {
+        return guard.status;
+    }
+
     uint64_t hash = djb64_hash(content);
     char line[CS_SNIP_LINE_SIZE];
     size_t nr_lines = first_line(content, line);
+    size_t len = strlen(content);
 
-    int ret = cs_content_add(cs, hash, content);
+    int ret = cs_content_add(cs, hash, content, len);
     if (ret < 0) {
         return ret;
     }
+    if (cs->index) {
+        cs_index_add(cs->index, hash, content, len);
+    }
 
     if (out_hash) {
         *out_hash = hash;
     }
 
-    return cs_snip_add(cs, hash, line, nr_lines);
+    return cs_snip_add(cs, hash, line, nr_lines, len, ttl);
 }
 
 /**
@@ -583,42 +682,149 @@ bool cs_snip_iter(struct ref_guard *guard, enum cs_iter_direction direction,
 
 /**
  * Remove content from the content directory using the hash as the filename.
+ * Once no snip uses it any more, the entry is moved to the graveyard for
+ * cs_gc() to delete. Must be called with the lock held.
  *
  * @cs: The clip store to operate on
  * @hash: The hash of the content to remove
  */
 static int _must_use_ _nonnull_ cs_content_remove(struct clip_store *cs,
                                                   uint64_t hash) {
-
     char hash_dir_name[CS_HASH_STR_MAX];
     snprintf(hash_dir_name, sizeof(hash_dir_name), "%" PRIu64, hash);
 
-    _drop_(close) int hash_dir_fd =
-        openat(cs->content_dir_fd, hash_dir_name, O_RDONLY);
-    if (hash_dir_fd < 0) {
+    char base_file_path[PATH_MAX];
+    snprintf(base_file_path, sizeof(base_file_path), "%s/1", hash_dir_name);
+    struct stat st;
+    if (fstatat(cs->content_dir_fd, base_file_path, &st, 0) < 0) {
         return negative_errno();
     }
 
-    struct stat st;
-    if (fstatat(hash_dir_fd, "1", &st, 0) < 0) {
+    if (st.st_nlink > 1) {
+        // A duplicate still uses the content, so only drop one link to it
+        char nlink_path[PATH_MAX];
+        snprintf(nlink_path, sizeof(nlink_path), "%s/%u", hash_dir_name,
+                 (unsigned)st.st_nlink);
+        if (unlinkat(cs->content_dir_fd, nlink_path, 0) < 0) {
+            return negative_errno();
+        }
+        return 0;
+    }
+
+    char grave_path[PATH_MAX];
+    snprintf(grave_path, sizeof(grave_path), "%s/%s.%" PRIu64, CS_GRAVEYARD,
+             hash_dir_name, cs->header->nr_buried);
+    if (renameat(cs->content_dir_fd, hash_dir_name, cs->content_dir_fd,
+                 grave_path) < 0) {
         return negative_errno();
     }
+    cs->header->nr_buried++;
+
+    uint64_t size = (uint64_t)st.st_size;
+    cs->header->nr_bytes -= size < cs->header->nr_bytes
+                                ? size
+                                : cs->header->nr_bytes;
+    stats_set(cs->stats, STAT_BYTES_STORED, cs->header->nr_bytes);
+    if (cs->index) {
+        cs_index_remove(cs->index, hash);
+    }
 
-    char nlink_path[PATH_MAX];
-    snprintf(nlink_path, sizeof(nlink_path), "%u", (unsigned)st.st_nlink);
+    return 0;
+}
 
-    if (unlinkat(hash_dir_fd, nlink_path, 0) < 0) {
+/**
+ * Delete the entry @name in the graveyard, and everything in it. Entries
+ * which are already gone, because someone else collected them first, are
+ * fine.
+ *
+ * @grave_fd: The graveyard directory
+ * @name: The entry to delete
+ */
+static int _must_use_ _nonnull_ cs_gc_entry(int grave_fd, const char *name) {
+    // Entries are only buried once their last link is gone, so all that's
+    // usually in them is the one file
+    char base_file_path[PATH_MAX];
+    snprintf(base_file_path, sizeof(base_file_path), "%s/1", name);
+    if (unlinkat(grave_fd, base_file_path, 0) < 0 && errno != ENOENT) {
         return negative_errno();
     }
-
-    if (st.st_nlink == 1 &&
-        unlinkat(cs->content_dir_fd, hash_dir_name, AT_REMOVEDIR) < 0) {
+    if (unlinkat(grave_fd, name, AT_REMOVEDIR) == 0 || errno == ENOENT) {
+        return 0;
+    }
+    if (errno != ENOTEMPTY) {
         return negative_errno();
     }
 
+    int entry_fd = openat(grave_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (entry_fd < 0) {
+        return errno == ENOENT ? 0 : negative_errno();
+    }
+    _drop_(closedir) DIR *dir = fdopendir(entry_fd);
+    if (!dir) {
+        int ret = negative_errno();
+        close(entry_fd);
+        return ret;
+    }
+    struct dirent *ent;
+    while ((ent = readdir(dir))) {
+        if (!streq(ent->d_name, ".") && !streq(ent->d_name, "..") &&
+            unlinkat(entry_fd, ent->d_name, 0) < 0 && errno != ENOENT) {
+            return negative_errno();
+        }
+    }
+    if (unlinkat(grave_fd, name, AT_REMOVEDIR) < 0 && errno != ENOENT) {
+        return negative_errno();
+    }
     return 0;
 }
 
+/**
+ * Delete up to @budget content entries from the graveyard. The lock isn't
+ * needed, since nothing but cs_gc() ever looks in the graveyard. Returns how
+ * many were deleted, or a negative errno.
+ *
+ * @cs: The clip store to operate on
+ * @budget: The most entries to delete, so that callers can do a little at a
+ *          time. SIZE_MAX empties the graveyard
+ * @out_more: Output for whether any entries are left, or NULL
+ */
+int cs_gc(struct clip_store *cs, size_t budget, bool *out_more) {
+    int grave_fd = openat(cs->content_dir_fd, CS_GRAVEYARD,
+                          O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (grave_fd < 0) {
+        return negative_errno();
+    }
+    _drop_(closedir) DIR *dir = fdopendir(grave_fd);
+    if (!dir) {
+        int ret = negative_errno();
+        close(grave_fd);
+        return ret;
+    }
+
+    size_t nr_deleted = 0;
+    bool more = false;
+    struct dirent *ent;
+    while ((ent = readdir(dir))) {
+        if (streq(ent->d_name, ".") || streq(ent->d_name, "..")) {
+            continue;
+        }
+        if (nr_deleted == budget) {
+            more = true;
+            break;
+        }
+        int ret = cs_gc_entry(grave_fd, ent->d_name);
+        if (ret < 0) {
+            return ret;
+        }
+        nr_deleted++;
+    }
+
+    if (out_more) {
+        *out_more = more;
+    }
+    return nr_deleted > INT_MAX ? INT_MAX : (int)nr_deleted;
+}
+
 /**
  * Compacts the clip store by removing doomed snips, finalising their removal
  * after being marked in cs_remove().
@@ -733,9 +939,298 @@ int cs_trim(struct clip_store *cs, enum cs_iter_direction direction,
     return 0;
 }
 
+/**
+ * Private data for evict_callback.
+ *
+ * @cs: The clip store being evicted from
+ * @max_bytes: The byte budget to get back under
+ * @doomed: For CS_EVICT_LARGEST, which snips to evict, oldest first. NULL for
+ *          CS_EVICT_OLDEST, where snips are evicted in iteration order
+ * @pos: The index of the next snip to be passed to the callback
+ * @nr_candidates: The number of snips which may be evicted, oldest first
+ * @nr_evicted: The number of snips evicted so far
+ */
+struct evict_state {
+    struct clip_store *cs;
+    uint64_t max_bytes;
+    const bool *doomed;
+    size_t pos;
+    size_t nr_candidates;
+    size_t nr_evicted;
+};
+
+/**
+ * Callback for cs_remove deciding which snips to evict. header->nr_bytes is
+ * updated as each snip is removed, so we can stop as soon as we are back
+ * within budget.
+ */
+static enum cs_remove_action _must_use_ _nonnull_
+evict_callback(uint64_t hash, const char *line, void *private) {
+    (void)hash;
+    (void)line;
+
+    struct evict_state *state = private;
+    size_t idx = state->pos++;
+    if (state->cs->header->nr_bytes <= state->max_bytes ||
+        idx >= state->nr_candidates) {
+        return CS_ACTION_KEEP | CS_ACTION_STOP;
+    }
+    if (state->doomed && !state->doomed[idx]) {
+        return CS_ACTION_KEEP;
+    }
+    state->nr_evicted++;
+    return CS_ACTION_REMOVE;
+}
+
+/**
+ * qsort_r() comparator ordering snip indexes by the size of their content,
+ * largest first. Snips of the same size go oldest first, so that which of
+ * them is evicted doesn't depend on the qsort_r() implementation.
+ */
+static int evict_cmp_largest(const void *a, const void *b, void *snips) {
+    const struct cs_snip *s = snips;
+    size_t ia = *(const size_t *)a, ib = *(const size_t *)b;
+    uint64_t sa = s[ia].size, sb = s[ib].size;
+    if (sa != sb) {
+        return (sa < sb) - (sa > sb);
+    }
+    return (ia > ib) - (ia < ib);
+}
+
+/**
+ * Plan which snips to evict to get back within a byte budget, taking the
+ * largest first. Returns an array of nr_candidates flags, oldest first.
+ *
+ * @cs: The clip store to operate on
+ * @nr_candidates: The number of oldest snips which may be evicted
+ * @max_bytes: The byte budget
+ */
+static bool *_nonnull_ evict_plan_largest(struct clip_store *cs,
+                                          size_t nr_candidates,
+                                          uint64_t max_bytes) {
+    _drop_(free) size_t *order = malloc(nr_candidates * sizeof(*order));
+    bool *doomed = calloc(nr_candidates, sizeof(*doomed));
+    expect(order && doomed);
+    for (size_t i = 0; i < nr_candidates; i++) {
+        order[i] = i;
+    }
+    qsort_r(order, nr_candidates, sizeof(*order), evict_cmp_largest,
+            cs->snips);
+
+    uint64_t excess = cs->header->nr_bytes - max_bytes, freed = 0;
+    for (size_t i = 0; i < nr_candidates && freed < excess; i++) {
+        doomed[order[i]] = true;
+        freed += cs->snips[order[i]].size;
+    }
+    return doomed;
+}
+
+/**
+ * Evict snips until the content in the clip store fits in a byte budget. The
+ * newest snip is never evicted, so a single clip larger than the budget is
+ * still kept until something newer arrives.
+ *
+ * Each pass marks enough snips to get back within budget and removes them in
+ * a single cs_remove(). Duplicate snips share content, so evicting one of
+ * them may free nothing, in which case another pass is needed. Every pass
+ * evicts at least one snip.
+ *
+ * @cs: The clip store to operate on
+ * @policy: Which snips to evict first
+ * @max_bytes: The byte budget
+ * @out_nr: Output for the number of snips evicted, or NULL
+ */
+int cs_evict(struct clip_store *cs, enum cs_evict_policy policy,
+             uint64_t max_bytes, size_t *out_nr) {
+    _drop_(cs_unref) struct ref_guard guard = cs_ref(cs);
+    if (guard.status < 0) {
+        return guard.status;
+    }
+
+    size_t nr_evicted = 0;
+    while (cs->header->nr_bytes > max_bytes && cs->header->nr_snips > 1) {
+        struct evict_state state = {.cs = cs,
+                                    .max_bytes = max_bytes,
+                                    .nr_candidates = cs->header->nr_snips - 1};
+        _drop_(free) bool *doomed =
+            policy == CS_EVICT_LARGEST
+                ? evict_plan_largest(cs, state.nr_candidates, max_bytes)
+                : NULL;
+        state.doomed = doomed;
+
+        int ret = cs_remove(cs, CS_ITER_OLDEST_FIRST, evict_callback, &state);
+        if (ret < 0) {
+            return ret;
+        }
+        nr_evicted += state.nr_evicted;
+    }
+
+    if (out_nr) {
+        *out_nr = nr_evicted;
+    }
+    return 0;
+}
+
+/**
+ * Create the content entry for @new_hash from the entry for @old_hash, which
+ * @content starts with, and remove the old entry. The old content is copied
+ * in the kernel, which on some filesystems only shares its blocks, so only
+ * the rest of @content is written from memory.
+ *
+ * The new content goes to a temporary file, which is only renamed to its hash
+ * once it's complete, and the old entry is never written to. So a crash, or
+ * anyone reading either entry meanwhile, never sees content which doesn't
+ * match its hash. If the old entry can't be removed, the new one is removed
+ * again, so the entries and nr_bytes still match the snip.
+ *
+ * Returns -EEXIST without changing anything if the new entry already exists,
+ * or the old content is longer than @content, in which case the caller should
+ * rewrite it instead.
+ *
+ * @cs: The clip store to operate on
+ * @old_hash: The hash of the content to extend, which @content starts with
+ * @new_hash: The hash of @content
+ * @content: The new content
+ * @len: The length of @content
+ */
+static int _must_use_ _nonnull_ cs_content_extend(struct clip_store *cs,
+                                                  uint64_t old_hash,
+                                                  uint64_t new_hash,
+                                                  const char *content,
+                                                  size_t len) {
+    char old_path[PATH_MAX], new_dir[CS_HASH_STR_MAX], new_path[PATH_MAX],
+        tmp_path[PATH_MAX];
+    snprintf(old_path, sizeof(old_path), "%" PRIu64 "/1", old_hash);
+    snprintf(new_dir, sizeof(new_dir), "%" PRIu64, new_hash);
+    snprintf(new_path, sizeof(new_path), "%s/1", new_dir);
+    // Only ever written with the lock held, so one left by a crash is stale
+    snprintf(tmp_path, sizeof(tmp_path), ".extend.%s", new_dir);
+
+    struct stat st;
+    if (fstatat(cs->content_dir_fd, new_dir, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+        return -EEXIST;
+    } else if (errno != ENOENT) {
+        return negative_errno();
+    }
+
+    _drop_(close) int old_fd =
+        openat(cs->content_dir_fd, old_path, O_RDONLY | O_CLOEXEC);
+    if (old_fd < 0) {
+        return negative_errno();
+    }
+    if (fstat(old_fd, &st) < 0) {
+        return negative_errno();
+    }
+    size_t old_len = (size_t)st.st_size;
+    if (old_len > len) {
+        return -EEXIST;
+    }
+
+    _drop_(close) int fd =
+        openat(cs->content_dir_fd, tmp_path,
+               O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return negative_errno();
+    }
+
+    size_t pos = 0;
+    while (pos < old_len) {
+        ssize_t copied =
+            copy_file_range(old_fd, NULL, fd, NULL, old_len - pos, 0);
+        if (copied <= 0) {
+            // Not supported here, so write the rest from memory
+            break;
+        }
+        pos += (size_t)copied;
+    }
+    while (pos < len) {
+        ssize_t written = pwrite(fd, content + pos, len - pos, (off_t)pos);
+        if (written < 0) {
+            int ret = negative_errno();
+            unlinkat(cs->content_dir_fd, tmp_path, 0);
+            return ret;
+        }
+        pos += (size_t)written;
+    }
+
+    if (mkdirat(cs->content_dir_fd, new_dir, 0700) < 0) {
+        int ret = negative_errno();
+        unlinkat(cs->content_dir_fd, tmp_path, 0);
+        return ret;
+    }
+    if (renameat(cs->content_dir_fd, tmp_path, cs->content_dir_fd,
+                 new_path) < 0) {
+        int ret = negative_errno();
+        unlinkat(cs->content_dir_fd, tmp_path, 0);
+        unlinkat(cs->content_dir_fd, new_dir, AT_REMOVEDIR);
+        return ret;
+    }
+
+    // Nothing refers to the new entry until the snip is updated, so it can
+    // simply be deleted again
+    int ret = cs_content_remove(cs, old_hash);
+    if (ret < 0) {
+        unlinkat(cs->content_dir_fd, new_path, 0);
+        unlinkat(cs->content_dir_fd, new_dir, AT_REMOVEDIR);
+        return ret;
+    }
+
+    cs->header->nr_bytes += len;
+    stats_set(cs->stats, STAT_BYTES_STORED, cs->header->nr_bytes);
+    if (cs->index) {
+        cs_index_add(cs->index, new_hash, content, len);
+    }
+    return 0;
+}
+
+/**
+ * Replace the content of @snip, and update it to match. The capture and
+ * expiry times of the snip are kept. Must be called with the lock held.
+ *
+ * @cs: The clip store to operate on
+ * @snip: The snip to replace
+ * @content: The content to replace it with
+ * @len: The length of @content
+ * @extends: Whether @content starts with the old content, so the new content
+ *           entry can be built from the old one rather than from scratch
+ * @out_hash: Output for the generated hash, or NULL
+ */
+static int _must_use_ _nonnull_n_(1, 2, 3)
+    cs_snip_replace(struct clip_store *cs, struct cs_snip *snip,
+                    const char *content, size_t len, bool extends,
+                    uint64_t *out_hash) {
+    uint64_t hash = djb64_hash(content);
+    int ret = extends && hash != snip->hash
+                  ? cs_content_extend(cs, snip->hash, hash, content, len)
+                  : -EEXIST;
+    if (ret == -EEXIST) {
+        ret = cs_content_remove(cs, snip->hash);
+        if (ret) {
+            return ret;
+        }
+        ret = cs_content_add(cs, hash, content, len);
+        if (ret) {
+            return ret;
+        }
+        if (cs->index) {
+            cs_index_add(cs->index, hash, content, len);
+        }
+    } else if (ret < 0) {
+        return ret;
+    }
+
+    char line[CS_SNIP_LINE_SIZE];
+    size_t nr_lines = first_line(content, line);
+    cs_snip_update(snip, hash, line, nr_lines, len);
+    if (out_hash) {
+        *out_hash = hash;
+    }
+    return 0;
+}
+
 /**
  * Replace the content and snip for an entry in the clip store, identified by
- * its age.
+ * its age. The capture and expiry times of the snip are kept.
  *
  * @cs: The clip store to operate on
  * @age: The age of the snip to replace, with 0 being the newest
@@ -757,23 +1252,96 @@ int cs_replace(struct clip_store *cs, enum cs_iter_direction direction,
     size_t idx = direction == CS_ITER_NEWEST_FIRST
                      ? cs->header->nr_snips - age - 1
                      : age;
-    struct cs_snip *snip = cs->snips + idx;
+    return cs_snip_replace(cs, cs->snips + idx, content, strlen(content),
+                           false, out_hash);
+}
 
-    int ret = cs_content_remove(cs, snip->hash);
-    if (ret) {
-        return ret;
+/**
+ * Merge a partial clip into the newest entry with @old_hash, replacing its
+ * content and snip. The capture and expiry times of the snip are kept.
+ *
+ * When @content only adds to the end of the old content, the new content
+ * entry is copied from the old one, so only the new bytes are written from
+ * memory.
+ *
+ * @cs: The clip store to operate on
+ * @old_hash: The hash of the entry to merge into
+ * @content: The content to replace this entry with
+ * @len: The length of @content
+ * @extends: Whether @content starts with the old content
+ * @out_age: Output for the age of the merged entry, with 0 being the newest,
+ *           or NULL
+ * @out_hash: Output for the generated hash, or NULL
+ *
+ * Returns -ENOENT if there is no entry with @old_hash.
+ */
+int cs_merge(struct clip_store *cs, uint64_t old_hash, const char *content,
+             size_t len, bool extends, size_t *out_age, uint64_t *out_hash) {
+    _drop_(cs_unref) struct ref_guard guard = cs_ref(cs);
+    if (guard.status < 0) {
+        return guard.status;
     }
-    char line[CS_SNIP_LINE_SIZE];
-    size_t nr_lines = first_line(content, line);
-    uint64_t hash = djb64_hash(content);
-    cs_snip_update(snip, hash, line, nr_lines);
-    ret = cs_content_add(cs, hash, content);
-    if (ret) {
-        return ret;
+
+    struct cs_snip *snip = NULL;
+    size_t age = 0;
+    while (cs_snip_iter(&guard, CS_ITER_NEWEST_FIRST, &snip)) {
+        if (snip->hash == old_hash) {
+            if (out_age) {
+                *out_age = age;
+            }
+            return cs_snip_replace(cs, snip, content, len, extends, out_hash);
+        }
+        age++;
     }
-    if (out_hash) {
-        *out_hash = hash;
+    return -ENOENT;
+}
+
+/**
+ * Move the newest entry with @hash to be the newest entry, as if it had just
+ * been captured. An expiry time from its own TTL moves along with it.
+ *
+ * @cs: The clip store to operate on
+ * @hash: The hash of the entry to bump
+ * @out_age: Output for the age the entry had before, with 0 being the newest,
+ *           or NULL
+ *
+ * Returns -ENOENT if there is no entry with @hash.
+ */
+int cs_bump(struct clip_store *cs, uint64_t hash, size_t *out_age) {
+    _drop_(cs_unref) struct ref_guard guard = cs_ref(cs);
+    if (guard.status < 0) {
+        return guard.status;
+    }
+
+    struct cs_snip *snip = NULL;
+    size_t age = 0;
+    while (cs_snip_iter(&guard, CS_ITER_NEWEST_FIRST, &snip)) {
+        if (snip->hash == hash) {
+            break;
+        }
+        age++;
+    }
+    if (age == cs->header->nr_snips) {
+        return -ENOENT;
+    }
+    if (out_age) {
+        *out_age = age;
+    }
+
+    // Capture times never decrease towards the newest snip
+    struct cs_snip *newest = cs->snips + cs->header->nr_snips - 1;
+    uint64_t captured = (uint64_t)time(NULL);
+    if (newest->captured > captured) {
+        captured = newest->captured;
+    }
+
+    struct cs_snip bumped = *snip;
+    memmove(snip, snip + 1, age * sizeof(*snip));
+    if (bumped.expires) {
+        bumped.expires += captured - bumped.captured;
     }
+    bumped.captured = captured;
+    *newest = bumped;
     return 0;
 }
 
@@ -791,3 +1359,116 @@ int cs_len(struct clip_store *cs, size_t *out_len) {
     *out_len = cs->header->nr_snips;
     return 0;
 }
+
+/**
+ * Find how many snips were captured before a given time. Since snips are
+ * sorted by capture time, these are always the oldest ones, so this is a
+ * binary search.
+ *
+ * @guard: The guard lock
+ * @cutoff: The Unix time to compare against
+ */
+size_t cs_snip_captured_before(struct ref_guard *guard, uint64_t cutoff) {
+    if (guard->status < 0) {
+        return 0;
+    }
+
+    const struct cs_snip *snips = guard->cs->snips;
+    size_t lo = 0, hi = guard->cs->header->nr_snips;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (snips[mid].captured < cutoff) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/**
+ * Find the snips captured within a time range, as indexes from the oldest
+ * snip. Since snips are sorted by capture time, these are contiguous.
+ *
+ * @guard: The guard lock
+ * @after: Only include snips captured at or after this Unix time, or 0
+ * @before: Only include snips captured before this Unix time, or 0
+ * @out_start: Output for the index of the first snip in the range
+ * @out_end: Output for the index after the last snip in the range
+ */
+void cs_snip_time_range(struct ref_guard *guard, uint64_t after,
+                        uint64_t before, size_t *out_start, size_t *out_end) {
+    size_t start = after ? cs_snip_captured_before(guard, after) : 0;
+    size_t end = before ? cs_snip_captured_before(guard, before)
+                 : guard->status < 0 ? 0
+                                     : guard->cs->header->nr_snips;
+    *out_start = start;
+    *out_end = end > start ? end : start;
+}
+
+/**
+ * Remove every snip which has expired, either through its own expiry time or
+ * through being older than @max_age, in a single batch.
+ *
+ * The snips older than @max_age are always a run of the oldest snips, so they
+ * are found with cs_snip_captured_before() rather than by looking at each of
+ * them.
+ *
+ * @cs: The clip store to operate on
+ * @now: The current Unix time
+ * @max_age: The global TTL in seconds, or 0 for none
+ * @out_nr: Output for the number of snips removed, or NULL
+ * @out_next: Output for the Unix time at which the next snip expires, or 0 if
+ *            none will. May be NULL
+ */
+int cs_expire(struct clip_store *cs, uint64_t now, uint64_t max_age,
+              size_t *out_nr, uint64_t *out_next) {
+    _drop_(cs_unref) struct ref_guard guard = cs_ref(cs);
+    if (guard.status < 0) {
+        return guard.status;
+    }
+
+    size_t nr_old = 0;
+    if (max_age && now > max_age) {
+        nr_old = cs_snip_captured_before(&guard, now - max_age + 1);
+    }
+
+    size_t nr_doomed = 0;
+    uint64_t next = 0;
+    for (size_t i = 0; i < cs->header->nr_snips; i++) {
+        struct cs_snip *snip = cs->snips + i;
+        if (i < nr_old || (snip->expires && snip->expires <= now)) {
+            int ret = cs_content_remove(cs, snip->hash);
+            if (ret < 0) {
+                return ret;
+            }
+            snip->doomed = true;
+            nr_doomed++;
+        } else if (snip->expires && (!next || snip->expires < next)) {
+            next = snip->expires;
+        }
+    }
+
+    if (max_age && nr_old < cs->header->nr_snips) {
+        uint64_t oldest = cs->snips[nr_old].captured + max_age;
+        if (!next || oldest < next) {
+            next = oldest;
+        }
+    }
+
+    if (nr_doomed > 0) {
+        expect(cs_snip_remove_doomed(&guard) == nr_doomed);
+        int ret = cs_file_resize(cs, cs->header->nr_snips - nr_doomed);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    if (out_nr) {
+        *out_nr = nr_doomed;
+    }
+    if (out_next) {
+        *out_next = next;
+    }
+    return 0;
+}
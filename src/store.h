@@ -10,6 +10,7 @@
 #define CS_SNIP_SIZE 256         /* The size of each struct cs_snip */
 #define CS_SNIP_ALLOC_BATCH 1024 /* How many snips to allocate when growing */
 #define CS_HASH_STR_MAX 21       /* String length of (1 << 64) - 1) + \0 */
+#define CS_GRAVEYARD ".graveyard" /* Removed content waiting for cs_gc() */
 
 /**
  * A single snip within the clip store.
@@ -17,14 +18,22 @@
  * @hash: A 64-bit hash value associated with the content entry
  * @doomed: Used during cs_remove to batch mark entries for removal
  * @nr_lines: The number of lines in the content entry
+ * @size: The size of the content entry in bytes
+ * @captured: The Unix time the clip was captured at. Never decreases from
+ *            oldest to newest snip, so time ranges can be binary searched
+ * @expires: The Unix time after which the clip should be removed, or 0 if it
+ *           only expires with the global TTL (if any)
  * @line: A character array containing the first salient line, terminated by a
  *        null byte
  */
-#define CS_SNIP_LINE_SIZE CS_SNIP_SIZE - (sizeof(uint64_t) * 2) - sizeof(bool)
+#define CS_SNIP_LINE_SIZE CS_SNIP_SIZE - (sizeof(uint64_t) * 5) - sizeof(bool)
 struct _packed_ cs_snip {
     uint64_t hash;
     bool doomed;
     uint64_t nr_lines;
+    uint64_t size;
+    uint64_t captured;
+    uint64_t expires;
     char line[CS_SNIP_LINE_SIZE];
 };
 
@@ -37,12 +46,18 @@ struct _packed_ cs_snip {
  * @nr_snips_alloc: The total number of allocated snips in the clip store
  *                    that can be used without _cs_file_resize(), excluding the
  *                    header
+ * @nr_bytes: The total size of every content entry in the content directory.
+ *            Duplicate clips share a content entry, so are only counted once
+ * @nr_buried: The number of content entries ever moved to the graveyard, used
+ *             to give each a unique name there
  * @_unused_padding: Padding to match the size of cs_snip
  */
-#define CS_HEADER_PADDING_SIZE CS_SNIP_SIZE - (sizeof(uint64_t) * 2)
+#define CS_HEADER_PADDING_SIZE CS_SNIP_SIZE - (sizeof(uint64_t) * 4)
 struct _packed_ cs_header {
     uint64_t nr_snips;
     uint64_t nr_snips_alloc;
+    uint64_t nr_bytes;
+    uint64_t nr_buried;
     char _unused_padding[CS_HEADER_PADDING_SIZE];
 };
 
@@ -50,6 +65,9 @@ static_assert(sizeof(struct cs_snip) == CS_SNIP_SIZE, "cs_snip wrong size");
 static_assert(sizeof(struct cs_snip) == sizeof(struct cs_header),
               "cs_header and cs_snip must be the same size");
 
+struct cs_index;
+struct cm_stats;
+
 /**
  * The main interface to the clip store for the user.
  *
@@ -62,6 +80,11 @@ static_assert(sizeof(struct cs_snip) == sizeof(struct cs_header),
  * @refcount: The reference count for the fd flock
  * @local_nr_snips: Our last known header->nr_snips
  * @local_nr_snips_alloc: Our last known header->nr_snips_alloc
+ * @index: The full content index, or NULL until the first cs_search()
+ * @stats: The stats region to count store activity in, or NULL
+ * @lock_site: The function which took the outermost reference on the lock
+ * @lock_wait_us: How long @lock_site waited for the lock
+ * @lock_start_us: When @lock_site got the lock, from stats_now_us()
  */
 struct clip_store {
     /* FDs */
@@ -77,6 +100,13 @@ struct clip_store {
     size_t local_nr_snips;
     size_t local_nr_snips_alloc;
     bool ready;
+
+    /* In-memory only, not shared with other users of the clip store */
+    struct cs_index *index;
+    struct cm_stats *stats;
+    const char *lock_site;
+    uint64_t lock_wait_us;
+    uint64_t lock_start_us;
 };
 
 /**
@@ -119,6 +149,14 @@ struct cs_content {
  */
 enum cs_iter_direction { CS_ITER_NEWEST_FIRST, CS_ITER_OLDEST_FIRST };
 
+/**
+ * Which snips to evict first when the clip store is over its byte budget.
+ *
+ * @CS_EVICT_OLDEST: Evict the least recently captured snips first
+ * @CS_EVICT_LARGEST: Evict the snips with the largest content first
+ */
+enum cs_evict_policy { CS_EVICT_OLDEST, CS_EVICT_LARGEST };
+
 /**
  * Set the bit at position n.
  *
@@ -143,7 +181,13 @@ enum cs_remove_action {
     CS_ACTION_STOP = BIT(2),
 };
 
-struct ref_guard _must_use_ _nonnull_ cs_ref(struct clip_store *cs);
+struct ref_guard _must_use_ _nonnull_ cs_ref_at(struct clip_store *cs,
+                                                const char *site);
+/**
+ * Take a reference on the clip store lock, see cs_ref_at(). Time spent
+ * waiting for and holding the lock is attributed to the calling function.
+ */
+#define cs_ref(cs) cs_ref_at((cs), __func__)
 void _nonnull_ cs_unref(struct clip_store *cs);
 void _nonnull_ drop_cs_unref(struct ref_guard *guard);
 int _must_use_ _nonnull_ cs_destroy(struct clip_store *cs);
@@ -152,10 +196,12 @@ int _must_use_ _nonnull_ cs_init(struct clip_store *cs, int snip_fd,
 int _must_use_ cs_content_unmap(struct cs_content *content);
 void drop_cs_content_unmap(struct cs_content *content);
 void drop_cs_destroy(struct clip_store *cs);
+int _must_use_ _nonnull_ cs_content_open(struct clip_store *cs, uint64_t hash);
 int _must_use_ _nonnull_ cs_content_get(struct clip_store *cs, uint64_t hash,
                                         struct cs_content *content);
 int _must_use_ _nonnull_n_(1)
-    cs_add(struct clip_store *cs, const char *content, uint64_t *out_hash);
+    cs_add(struct clip_store *cs, const char *content, uint64_t ttl,
+           uint64_t *out_hash);
 bool _must_use_ _nonnull_ cs_snip_iter(struct ref_guard *guard,
                                        enum cs_iter_direction direction,
                                        struct cs_snip **snip);
@@ -166,11 +212,30 @@ int _must_use_ _nonnull_ cs_remove(
 int _must_use_ _nonnull_ cs_trim(struct clip_store *cs,
                                  enum cs_iter_direction direction,
                                  size_t nr_keep);
+int _must_use_ _nonnull_n_(1) cs_evict(struct clip_store *cs,
+                                       enum cs_evict_policy policy,
+                                       uint64_t max_bytes, size_t *out_nr);
 int _must_use_ _nonnull_n_(1, 4)
     cs_replace(struct clip_store *cs, enum cs_iter_direction direction,
                size_t age, const char *content, uint64_t *out_hash);
+int _must_use_ _nonnull_n_(1, 3)
+    cs_merge(struct clip_store *cs, uint64_t old_hash, const char *content,
+             size_t len, bool extends, size_t *out_age, uint64_t *out_hash);
+int _must_use_ _nonnull_n_(1)
+    cs_bump(struct clip_store *cs, uint64_t hash, size_t *out_age);
 int _nonnull_ cs_len(struct clip_store *cs, size_t *out_len);
+size_t _nonnull_ cs_snip_captured_before(struct ref_guard *guard,
+                                         uint64_t cutoff);
+void _nonnull_ cs_snip_time_range(struct ref_guard *guard, uint64_t after,
+                                  uint64_t before, size_t *out_start,
+                                  size_t *out_end);
+int _must_use_ _nonnull_n_(1) cs_expire(struct clip_store *cs, uint64_t now,
+                                        uint64_t max_age, size_t *out_nr,
+                                        uint64_t *out_next);
+int _must_use_ _nonnull_n_(1) cs_gc(struct clip_store *cs, size_t budget,
+                                   bool *out_more);
 
 size_t _nonnull_ first_line(const char *text, char *out);
+uint64_t _nonnull_ djb64_hash(const char *buf);
 
 #endif
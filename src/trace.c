@@ -0,0 +1,222 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+/* Cached so that recording doesn't need a getpid() syscall every time */
+static uint32_t trace_pid;
+
+/**
+ * The current value of the given clock in nanoseconds.
+ */
+static uint64_t clock_ns(clockid_t clock) {
+    struct timespec ts;
+    expect(clock_gettime(clock, &ts) == 0);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * Record an event in the trace ring. Does nothing if @tr is NULL, so callers
+ * can trace unconditionally whether or not a ring is attached.
+ *
+ * This is cheap enough to leave on all the time: a clock read, an atomic
+ * increment and a few stores into shared memory.
+ *
+ * @tr: The trace ring, or NULL
+ * @event: The event to record
+ * @sel: The `enum selection_type` the event is about, or TRACE_NO_SEL
+ * @hash: The clip hash the event is about, or 0
+ * @arg: Event specific, see `enum trace_event`
+ */
+void trace_emit(struct cm_trace *tr, enum trace_event event, uint8_t sel,
+                uint64_t hash, uint64_t arg) {
+    if (!tr) {
+        return;
+    }
+
+    uint64_t pos = __atomic_fetch_add(&tr->head, 1, __ATOMIC_RELAXED);
+    struct trace_record *rec = &tr->records[pos & (TRACE_NR_RECORDS - 1)];
+
+    __atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    rec->ts_ns = clock_ns(CLOCK_MONOTONIC);
+    rec->hash = hash;
+    rec->arg = arg;
+    rec->pid = trace_pid;
+    rec->event = (uint8_t)event;
+    rec->sel = sel;
+    __atomic_store_n(&rec->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Map the trace ring at @path.
+ *
+ * clipmenud maps it with TRACE_MAP_CREATE, which creates the file if needed
+ * and resets it. Other recorders, like clipserve, use TRACE_MAP_APPEND so as
+ * not to wipe what clipmenud recorded. Both get -ENOENT or -EPROTO in the
+ * same cases as TRACE_MAP_READ if there is no usable ring to append to.
+ *
+ * @path: The path to the trace file
+ * @mode: How to map the ring, see `enum trace_map_mode`
+ * @out: Output for the mapped ring, to be released with trace_unmap()
+ */
+int trace_map(const char *path, enum trace_map_mode mode,
+              struct cm_trace **out) {
+    bool create = mode == TRACE_MAP_CREATE, writable = mode != TRACE_MAP_READ;
+    _drop_(close) int fd =
+        create ? open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600)
+               : open(path, (writable ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+    if (fd < 0) {
+        return negative_errno();
+    }
+
+    if (create && ftruncate(fd, sizeof(struct cm_trace)) < 0) {
+        return negative_errno();
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        return negative_errno();
+    }
+    if ((size_t)st.st_size < sizeof(struct cm_trace)) {
+        return -EPROTO;
+    }
+
+    struct cm_trace *tr =
+        mmap(NULL, sizeof(*tr), PROT_READ | (writable ? PROT_WRITE : 0),
+             MAP_SHARED, fd, 0);
+    if (tr == MAP_FAILED) {
+        return negative_errno();
+    }
+
+    if (create) {
+        memset(tr, 0, sizeof(*tr));
+        tr->version = TRACE_VERSION;
+        __atomic_store_n(&tr->magic, TRACE_MAGIC, __ATOMIC_RELEASE);
+    } else if (__atomic_load_n(&tr->magic, __ATOMIC_ACQUIRE) != TRACE_MAGIC ||
+               tr->version != TRACE_VERSION) {
+        munmap(tr, sizeof(*tr));
+        return -EPROTO;
+    }
+
+    trace_pid = (uint32_t)getpid();
+    *out = tr;
+    return 0;
+}
+
+/**
+ * Unmap a trace ring mapped with trace_map(). Does nothing if @tr is NULL.
+ */
+void trace_unmap(struct cm_trace *tr) {
+    if (tr) {
+        expect(munmap(tr, sizeof(*tr)) == 0);
+    }
+}
+
+/**
+ * How to print each event: its name, and the name of its argument if it has
+ * one worth printing.
+ */
+static const struct {
+    const char *name;
+    const char *arg_name;
+    bool arg_hex;
+} event_formats[TRACE_MAX] = {
+    [TRACE_XFIXES_NOTIFY] = {"xfixes_notify", "owner", true},
+    [TRACE_CONVERT_REQUEST] = {"convert_request", "owner", true},
+    [TRACE_PROPERTY_NOTIFY] = {"property_notify", "len", false},
+    [TRACE_IGNORE] = {"ignore", NULL, false},
+    [TRACE_STORE] = {"store", "partial", false},
+    [TRACE_TRIM] = {"trim", "removed", false},
+    [TRACE_EXPIRE] = {"expire", "removed", false},
+    [TRACE_SERVE_START] = {"serve_start", NULL, false},
+    [TRACE_SERVE_REQUEST] = {"serve_request", "requestor", true},
+    [TRACE_SERVE_STOP] = {"serve_stop", NULL, false},
+};
+
+static const char *const ignore_reasons[TRACE_IGNORE_MAX] = {
+    [TRACE_IGNORE_DISABLED] = "disabled",
+    [TRACE_IGNORE_WINDOW] = "window",
+    [TRACE_IGNORE_WHITESPACE] = "whitespace",
+    [TRACE_IGNORE_SENSITIVE] = "sensitive",
+    [TRACE_IGNORE_QUEUE_FULL] = "queue_full",
+    [TRACE_IGNORE_DUPLICATE] = "duplicate",
+};
+
+/**
+ * Copy out the record at @pos, if it is still in the ring and not being
+ * written. Returns whether @out is valid.
+ *
+ * @tr: The trace ring
+ * @pos: The position of the record, counting from when the ring was created
+ * @out: Output for the record
+ */
+bool trace_read(const struct cm_trace *tr, uint64_t pos,
+                struct trace_record *out) {
+    const struct trace_record *rec =
+        &tr->records[pos & (TRACE_NR_RECORDS - 1)];
+    uint64_t before = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+    memcpy(out, rec, sizeof(*out));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    uint64_t after = __atomic_load_n(&rec->seq, __ATOMIC_RELAXED);
+    return before == pos + 1 && after == pos + 1;
+}
+
+/**
+ * Print every record in the ring, oldest first, one per line. Timestamps are
+ * converted from the monotonic clock to local wall clock time.
+ *
+ * Records which are overwritten or still being written while we print are
+ * skipped, so this is safe to run while events are being recorded.
+ *
+ * @tr: The trace ring
+ * @sel_names: The name of each selection, indexed by `enum selection_type`
+ * @nr_sels: The number of entries in @sel_names
+ * @out: The file to print to
+ */
+void trace_print(const struct cm_trace *tr, const char *const *sel_names,
+                 size_t nr_sels, FILE *out) {
+    uint64_t mono_to_real =
+        clock_ns(CLOCK_REALTIME) - clock_ns(CLOCK_MONOTONIC);
+    uint64_t head = __atomic_load_n(&tr->head, __ATOMIC_ACQUIRE);
+    uint64_t pos = head > TRACE_NR_RECORDS ? head - TRACE_NR_RECORDS : 0;
+
+    for (; pos < head; pos++) {
+        struct trace_record rec;
+        if (!trace_read(tr, pos, &rec) || rec.event >= TRACE_MAX) {
+            continue;
+        }
+
+        uint64_t real_ns = rec.ts_ns + mono_to_real;
+        time_t secs = (time_t)(real_ns / 1000000000);
+        struct tm tm;
+        char date[32];
+        expect(localtime_r(&secs, &tm));
+        expect(strftime(date, sizeof(date), "%F %T", &tm) > 0);
+        fprintf(out, "%s.%06" PRIu64 " pid=%" PRIu32 " %s", date,
+                real_ns % 1000000000 / 1000, rec.pid,
+                event_formats[rec.event].name);
+
+        if (rec.sel < nr_sels) {
+            fprintf(out, " sel=%s", sel_names[rec.sel]);
+        }
+        if (rec.hash) {
+            fprintf(out, " hash=%" PRIu64, rec.hash);
+        }
+        if (rec.event == TRACE_IGNORE && rec.arg < TRACE_IGNORE_MAX) {
+            fprintf(out, " reason=%s", ignore_reasons[rec.arg]);
+        } else if (event_formats[rec.event].arg_hex) {
+            fprintf(out, " %s=0x%" PRIx64, event_formats[rec.event].arg_name,
+                    rec.arg);
+        } else if (event_formats[rec.event].arg_name) {
+            fprintf(out, " %s=%" PRIu64, event_formats[rec.event].arg_name,
+                    rec.arg);
+        }
+        fputc('\n', out);
+    }
+}
@@ -0,0 +1,125 @@
+#ifndef CM_TRACE_H
+#define CM_TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "util.h"
+
+#define TRACE_MAGIC 0x52544d43 /* "CMTR" */
+#define TRACE_VERSION 1        /* Bump when struct cm_trace changes */
+#define TRACE_NR_RECORDS 4096  /* Must be a power of two */
+#define TRACE_NO_SEL UINT8_MAX /* For events not about a selection */
+
+/**
+ * Events recorded in the trace ring. The meaning of a record's @arg depends
+ * on its event.
+ *
+ * @TRACE_XFIXES_NOTIFY: A selection changed owner. @arg is the owner window
+ * @TRACE_CONVERT_REQUEST: We asked the owner to convert a selection. @arg is
+ *                         the owner window
+ * @TRACE_PROPERTY_NOTIFY: A converted selection arrived. @arg is its length
+ * @TRACE_IGNORE: A selection was not stored. @arg is a `enum trace_ignore`
+ * @TRACE_STORE: A clip was stored. @arg is 1 if it replaced a partial
+ * @TRACE_TRIM: Clips were trimmed or evicted. @arg is the number removed
+ * @TRACE_EXPIRE: Clips expired. @arg is the number removed
+ * @TRACE_SERVE_START: clipserve took ownership of the selections
+ * @TRACE_SERVE_REQUEST: clipserve was asked for the clip. @arg is the
+ *                       requestor window
+ * @TRACE_SERVE_STOP: clipserve lost all its selections and exited
+ */
+enum trace_event {
+    TRACE_XFIXES_NOTIFY,
+    TRACE_CONVERT_REQUEST,
+    TRACE_PROPERTY_NOTIFY,
+    TRACE_IGNORE,
+    TRACE_STORE,
+    TRACE_TRIM,
+    TRACE_EXPIRE,
+    TRACE_SERVE_START,
+    TRACE_SERVE_REQUEST,
+    TRACE_SERVE_STOP,
+    TRACE_MAX
+};
+
+/**
+ * Why a selection was not stored, for TRACE_IGNORE.
+ */
+enum trace_ignore {
+    TRACE_IGNORE_DISABLED,
+    TRACE_IGNORE_WINDOW,
+    TRACE_IGNORE_WHITESPACE,
+    TRACE_IGNORE_SENSITIVE,
+    TRACE_IGNORE_QUEUE_FULL,
+    TRACE_IGNORE_DUPLICATE,
+    TRACE_IGNORE_MAX
+};
+
+/**
+ * A single trace record.
+ *
+ * Records are written seqlock style: @seq is zeroed before the other fields
+ * are written, and set to the record's position in the ring plus one after.
+ * A reader which sees the same expected @seq before and after copying the
+ * record knows that it was not overwritten in between.
+ *
+ * @seq: The position of this record in the ring plus one, or 0 if it is
+ *       being written
+ * @ts_ns: CLOCK_MONOTONIC at the time of the event, in nanoseconds
+ * @hash: The clip hash, or 0 if not applicable
+ * @arg: Event specific, see `enum trace_event`
+ * @pid: The process which recorded the event
+ * @event: The `enum trace_event`
+ * @sel: The `enum selection_type`, or TRACE_NO_SEL
+ */
+struct trace_record {
+    uint64_t seq;
+    uint64_t ts_ns;
+    uint64_t hash;
+    uint64_t arg;
+    uint32_t pid;
+    uint8_t event;
+    uint8_t sel;
+    uint8_t padding[2];
+};
+
+/**
+ * The shared memory trace ring, mapped from a file in the cache directory.
+ * Writers claim a position by atomically incrementing @head, so any number of
+ * processes can record at once without taking a lock. Once the ring is full,
+ * each new record overwrites the oldest one.
+ *
+ * @magic: TRACE_MAGIC, once the ring is initialised
+ * @version: TRACE_VERSION
+ * @head: The number of records ever claimed
+ * @records: The ring, indexed by position modulo TRACE_NR_RECORDS
+ */
+struct cm_trace {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t head;
+    struct trace_record records[TRACE_NR_RECORDS];
+};
+
+/**
+ * How to map the trace ring.
+ *
+ * @TRACE_MAP_READ: Map an existing ring read only, for dumping it
+ * @TRACE_MAP_APPEND: Map an existing ring for recording, keeping its records
+ * @TRACE_MAP_CREATE: Create the ring if needed, and reset it
+ */
+enum trace_map_mode { TRACE_MAP_READ, TRACE_MAP_APPEND, TRACE_MAP_CREATE };
+
+void trace_emit(struct cm_trace *tr, enum trace_event event, uint8_t sel,
+                uint64_t hash, uint64_t arg);
+int _must_use_ _nonnull_ trace_map(const char *path, enum trace_map_mode mode,
+                                   struct cm_trace **out);
+void trace_unmap(struct cm_trace *tr);
+bool _must_use_ _nonnull_ trace_read(const struct cm_trace *tr, uint64_t pos,
+                                     struct trace_record *out);
+void _nonnull_ trace_print(const struct cm_trace *tr,
+                           const char *const *sel_names, size_t nr_sels,
+                           FILE *out);
+
+#endif
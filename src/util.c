@@ -51,13 +51,14 @@ size_t snprintf_safe(char *buf, size_t len, const char *fmt, ...) {
 }
 
 /**
- * Runs clipserve to handle selection requests for a hash in the clip store.
+ * Runs clipserve to handle selection requests for a hash in the clip store,
+ * on @display, or on $DISPLAY if that's NULL.
  */
-void run_clipserve(uint64_t hash) {
+void run_clipserve(uint64_t hash, const char *display) {
     char hash_str[UINT64_MAX_STRLEN + 1];
     uint64_to_str(hash, hash_str);
 
-    const char *const cmd[] = {"clipserve", hash_str, NULL};
+    const char *const cmd[] = {"clipserve", hash_str, display, NULL};
     pid_t pid = fork();
     expect(pid >= 0);
 
@@ -103,6 +104,68 @@ int str_to_uint64(const char *input, uint64_t *output) {
     return 0;
 }
 
+/**
+ * A suffix multiplying the number before it, like the "m" in "5m".
+ */
+struct unit_suffix {
+    char suffix;
+    uint64_t mult;
+};
+
+/**
+ * Convert a string consisting of a number and an optional suffix from @units
+ * to an unsigned 64-bit integer.
+ */
+static int _nonnull_ str_to_uint64_unit(const char *input,
+                                        const struct unit_suffix *units,
+                                        size_t nr_units, uint64_t *output) {
+    char buf[UINT64_MAX_STRLEN + 2];
+    size_t len = strlen(input);
+    if (len == 0 || len >= sizeof(buf)) {
+        return -EINVAL;
+    }
+    memcpy(buf, input, len + 1);
+
+    uint64_t mult = 1;
+    for (size_t i = 0; i < nr_units; i++) {
+        if (buf[len - 1] == units[i].suffix) {
+            mult = units[i].mult;
+            buf[len - 1] = '\0';
+            break;
+        }
+    }
+
+    uint64_t val;
+    int ret = str_to_uint64(buf, &val);
+    if (ret < 0) {
+        return ret;
+    }
+    if (val > UINT64_MAX / mult) {
+        return -ERANGE;
+    }
+    *output = val * mult;
+    return 0;
+}
+
+/**
+ * Convert a duration such as "30", "30s", "5m", "2h" or "1d" to a number of
+ * seconds.
+ */
+int str_to_duration(const char *input, uint64_t *output) {
+    const struct unit_suffix units[] = {
+        {'s', 1}, {'m', 60}, {'h', 60 * 60}, {'d', 24 * 60 * 60}};
+    return str_to_uint64_unit(input, units, arrlen(units), output);
+}
+
+/**
+ * Convert a size such as "4096", "512K", "100M" or "1G" to a number of bytes.
+ */
+int str_to_size(const char *input, uint64_t *output) {
+    const struct unit_suffix units[] = {
+        {'K', 1ULL << 10}, {'M', 1ULL << 20}, {'G', 1ULL << 30}};
+    return str_to_uint64_unit(input, units, arrlen(units), output);
+}
+
 /**
  * Convert an unsigned 64-bit integer to a string representation.
  */
@@ -69,7 +69,7 @@ size_t _nonnull_ read_safe(int fd, char *buf, size_t count);
 size_t _printf_(3, 4)
     snprintf_safe(char *buf, size_t len, const char *fmt, ...);
 
-void run_clipserve(uint64_t hash);
+void run_clipserve(uint64_t hash, const char *display);
 
 /**
  * __attribute__((cleanup)) functions
@@ -100,6 +100,8 @@ DEFINE_DROP_FUNC(DIR *, closedir)
 
 int _must_use_ negative_errno(void);
 int _nonnull_ str_to_uint64(const char *input, uint64_t *output);
+int _nonnull_ str_to_duration(const char *input, uint64_t *output);
+int _nonnull_ str_to_size(const char *input, uint64_t *output);
 void _nonnull_ uint64_to_str(uint64_t input, char *output);
 bool debug_mode_enabled(void);
 
@@ -1,54 +1,631 @@
-#include <X11/Xatom.h>
-#include <X11/Xproto.h>
+#include <errno.h>
 #include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <xcb/xcbext.h>
 
 #include "x.h"
 
+/* XFixes requests we send, see the XFixes protocol specification */
+#define XFIXES_QUERY_VERSION 0
+#define XFIXES_SELECT_SELECTION_INPUT 2
+
+/* X-Resource requests we send, see the X-Resource protocol specification */
+#define XRES_QUERY_VERSION 0
+#define XRES_QUERY_CLIENT_IDS 4
+#define XRES_CLIENT_ID_PID_MASK (1 << 1)
+
+static xcb_extension_t xfixes_id = {"XFIXES", 0};
+static xcb_extension_t xres_id = {"X-Resource", 0};
+
+struct xfixes_query_version_request {
+    uint8_t major_opcode;
+    uint8_t minor_opcode;
+    uint16_t length;
+    uint32_t client_major_version;
+    uint32_t client_minor_version;
+};
+
+struct xfixes_query_version_reply {
+    uint8_t response_type;
+    uint8_t pad0;
+    uint16_t sequence;
+    uint32_t length;
+    uint32_t major_version;
+    uint32_t minor_version;
+    uint8_t pad1[16];
+};
+
+struct xfixes_select_selection_input_request {
+    uint8_t major_opcode;
+    uint8_t minor_opcode;
+    uint16_t length;
+    xcb_window_t window;
+    xcb_atom_t selection;
+    uint32_t event_mask;
+};
+
+struct xres_query_version_request {
+    uint8_t major_opcode;
+    uint8_t minor_opcode;
+    uint16_t length;
+    uint8_t client_major;
+    uint8_t client_minor;
+    uint16_t pad;
+};
+
+struct xres_query_version_reply {
+    uint8_t response_type;
+    uint8_t pad0;
+    uint16_t sequence;
+    uint32_t length;
+    uint16_t server_major;
+    uint16_t server_minor;
+    uint8_t pad1[20];
+};
+
+/* A single spec, asking for the pid of the client owning a resource */
+struct xres_query_client_ids_request {
+    uint8_t major_opcode;
+    uint8_t minor_opcode;
+    uint16_t length;
+    uint32_t num_specs;
+    uint32_t client;
+    uint32_t mask;
+};
+
+struct xres_query_client_ids_reply {
+    uint8_t response_type;
+    uint8_t pad0;
+    uint16_t sequence;
+    uint32_t length;
+    uint32_t num_ids;
+    uint8_t pad1[20];
+};
+
+/* Each of the reply's num_ids values: the spec, and then length bytes */
+struct xres_client_id_value {
+    uint32_t client;
+    uint32_t mask;
+    uint32_t length;
+};
+
+/**
+ * Connect to an X server.
+ *
+ * @display: The display name, or NULL for $DISPLAY
+ * @out_root: Output for the root window of the default screen
+ */
+xcb_connection_t *x_connect(const char *display, xcb_window_t *out_root) {
+    int screen_nr;
+    xcb_connection_t *conn = xcb_connect(display, &screen_nr);
+    die_on(xcb_connection_has_error(conn), "Cannot open display %s\n",
+           display ? display : strnull(getenv("DISPLAY")));
+
+    xcb_screen_iterator_t it = xcb_setup_roots_iterator(xcb_get_setup(conn));
+    for (; it.rem && screen_nr > 0; screen_nr--) {
+        xcb_screen_next(&it);
+    }
+    expect(it.rem);
+    *out_root = it.data->root;
+    return conn;
+}
+
+/**
+ * Wait for the reply to a request, to be freed with free(). Returns NULL if
+ * the request failed in a way x_check_error() lets us survive.
+ *
+ * A wait only costs a round trip if the reply isn't already here. When several
+ * requests are sent before waiting on any, only the first wait usually does,
+ * and only those are counted.
+ *
+ * @conn: The X connection
+ * @sequence: The sequence number from the request's cookie
+ * @stats: If set, where to count the wait if it was a round trip
+ */
+void *x_wait_reply(xcb_connection_t *conn, unsigned int sequence,
+                   struct cm_stats *stats) {
+    void *reply = NULL;
+    xcb_generic_error_t *err = NULL;
+    xcb_flush(conn);
+    if (!xcb_poll_for_reply(conn, sequence, &reply, &err)) {
+        stats_add(stats, STAT_X_ROUND_TRIPS, 1);
+        reply = xcb_wait_for_reply(conn, sequence, &err);
+    }
+    if (err) {
+        x_check_error(err);
+        free(err);
+    }
+    die_on(xcb_connection_has_error(conn), "Lost connection to X server\n");
+    return reply;
+}
+
 /**
- * Fetch the title of the window with the specified window ID.
+ * Intern several atoms in a single round trip.
+ *
+ * @conn: The X connection
+ * @names: The atom names
+ * @nr: The number of atoms
+ * @out: Output for the atoms, in the same order as @names
  */
-char *get_window_title(Display *dpy, Window owner) {
-    Atom props[] = {XInternAtom(dpy, "_NET_WM_NAME", False), XA_WM_NAME};
-    Atom utf8_string = XInternAtom(dpy, "UTF8_STRING", False);
-    Atom actual_type;
-    int format;
-    unsigned long nr_items, bytes_after;
-    unsigned char *prop = NULL;
+void x_intern_atoms(xcb_connection_t *conn, const char *const *names, size_t nr,
+                    xcb_atom_t *out) {
+    xcb_intern_atom_cookie_t cookies[nr];
+    for (size_t i = 0; i < nr; i++) {
+        cookies[i] =
+            xcb_intern_atom(conn, 0, (uint16_t)strlen(names[i]), names[i]);
+    }
+    for (size_t i = 0; i < nr; i++) {
+        _drop_(free) xcb_intern_atom_reply_t *reply =
+            x_wait_reply(conn, cookies[i].sequence, NULL);
+        expect(reply);
+        out[i] = reply->atom;
+    }
+}
 
-    for (size_t i = 0; i < arrlen(props); i++) {
-        if (XGetWindowProperty(dpy, owner, props[i], 0, (~0L), False,
-                               (props[i] == XA_WM_NAME) ? AnyPropertyType
-                                                        : utf8_string,
-                               &actual_type, &format, &nr_items, &bytes_after,
-                               &prop) == Success &&
-            prop) {
-            return (char *)prop;
+/**
+ * Intern every atom in `struct x_atoms` in a single round trip.
+ */
+void x_atoms_init(xcb_connection_t *conn, struct x_atoms *atoms) {
+    static const char *const names[] = {"UTF8_STRING", "_NET_WM_NAME",
+                                        "TARGETS", "CLIPBOARD", "INCR"};
+    xcb_atom_t out[arrlen(names)];
+    x_intern_atoms(conn, names, arrlen(names), out);
+    atoms->utf8_string = out[0];
+    atoms->net_wm_name = out[1];
+    atoms->targets = out[2];
+    atoms->clipboard = out[3];
+    atoms->incr = out[4];
+}
+
+/**
+ * Send a request of @len bytes in @req for extension @ext, returning its
+ * sequence number. The opcodes and length in @req are filled in by XCB.
+ */
+static unsigned int _nonnull_ ext_send(xcb_connection_t *conn,
+                                       xcb_extension_t *ext, uint8_t opcode,
+                                       bool has_reply, void *req, size_t len) {
+    xcb_protocol_request_t proto = {
+        .count = 1, .ext = ext, .opcode = opcode, .isvoid = !has_reply};
+    // xcb_send_request() needs two spare entries before the request
+    struct iovec parts[3] = {[2] = {.iov_base = req, .iov_len = len}};
+    return xcb_send_request(conn, has_reply ? XCB_REQUEST_CHECKED : 0,
+                            parts + 2, &proto);
+}
+
+/**
+ * Make sure the server has XFixes, and tell it which version we speak, which
+ * it requires before any other XFixes request. Returns -EOPNOTSUPP if XFixes
+ * is missing.
+ *
+ * @conn: The X connection
+ * @out_event_base: Output for the event number of the first XFixes event
+ */
+int x_xfixes_init(xcb_connection_t *conn, uint8_t *out_event_base) {
+    const xcb_query_extension_reply_t *ext =
+        xcb_get_extension_data(conn, &xfixes_id);
+    if (!ext || !ext->present) {
+        return -EOPNOTSUPP;
+    }
+
+    struct xfixes_query_version_request req = {.client_major_version = 1};
+    unsigned int sequence = ext_send(conn, &xfixes_id, XFIXES_QUERY_VERSION,
+                                     true, &req, sizeof(req));
+    _drop_(free) struct xfixes_query_version_reply *reply =
+        x_wait_reply(conn, sequence, NULL);
+    if (!reply || reply->major_version < 1) {
+        return -EOPNOTSUPP;
+    }
+
+    *out_event_base = ext->first_event;
+    return 0;
+}
+
+/**
+ * Ask for XFixes events about @selection to be sent to @window.
+ *
+ * @conn: The X connection
+ * @window: The window to receive the events
+ * @selection: The selection to watch
+ * @event_mask: Which events to send, a mask of X_XFIXES_*_MASK
+ */
+void x_xfixes_select_selection_input(xcb_connection_t *conn,
+                                     xcb_window_t window, xcb_atom_t selection,
+                                     uint32_t event_mask) {
+    struct xfixes_select_selection_input_request req = {
+        .window = window, .selection = selection, .event_mask = event_mask};
+    ext_send(conn, &xfixes_id, XFIXES_SELECT_SELECTION_INPUT, false, &req,
+             sizeof(req));
+}
+
+/**
+ * Make sure the server has X-Resource 1.2, which can tell us which process
+ * owns a window. Returns -EOPNOTSUPP if it doesn't.
+ */
+static int _nonnull_ xres_init(xcb_connection_t *conn) {
+    const xcb_query_extension_reply_t *ext =
+        xcb_get_extension_data(conn, &xres_id);
+    if (!ext || !ext->present) {
+        return -EOPNOTSUPP;
+    }
+
+    struct xres_query_version_request req = {.client_major = 1,
+                                             .client_minor = 2};
+    unsigned int sequence =
+        ext_send(conn, &xres_id, XRES_QUERY_VERSION, true, &req, sizeof(req));
+    _drop_(free) struct xres_query_version_reply *reply =
+        x_wait_reply(conn, sequence, NULL);
+    if (!reply || reply->server_major < 1 ||
+        (reply->server_major == 1 && reply->server_minor < 2)) {
+        return -EOPNOTSUPP;
+    }
+    return 0;
+}
+
+/**
+ * Ask which process owns @window, to be collected with xres_pid_collect().
+ */
+static unsigned int _nonnull_ xres_pid_request(xcb_connection_t *conn,
+                                               xcb_window_t window) {
+    struct xres_query_client_ids_request req = {
+        .num_specs = 1, .client = window, .mask = XRES_CLIENT_ID_PID_MASK};
+    return ext_send(conn, &xres_id, XRES_QUERY_CLIENT_IDS, true, &req,
+                    sizeof(req));
+}
+
+/**
+ * Collect the reply to xres_pid_request(). Returns the pid, or 0 if the server
+ * doesn't know it, like when the client isn't local.
+ */
+static uint32_t _nonnull_n_(1) xres_pid_collect(xcb_connection_t *conn,
+                                                unsigned int sequence,
+                                                struct cm_stats *stats) {
+    _drop_(free) struct xres_query_client_ids_reply *reply =
+        x_wait_reply(conn, sequence, stats);
+    if (!reply) {
+        return 0;
+    }
+
+    const char *pos = (const char *)(reply + 1);
+    const char *end = pos + (size_t)reply->length * 4;
+    for (uint32_t i = 0; i < reply->num_ids; i++) {
+        struct xres_client_id_value value;
+        if ((size_t)(end - pos) < sizeof(value)) {
+            break;
+        }
+        memcpy(&value, pos, sizeof(value));
+        pos += sizeof(value);
+        if ((size_t)(end - pos) < value.length) {
+            break;
+        }
+        if ((value.mask & XRES_CLIENT_ID_PID_MASK) &&
+            value.length >= sizeof(uint32_t)) {
+            uint32_t pid;
+            memcpy(&pid, pos, sizeof(pid));
+            return pid;
+        }
+        pos += value.length;
+    }
+    return 0;
+}
+
+/**
+ * Set which events we get for @window, replacing any we asked for before.
+ */
+void x_select_input(xcb_connection_t *conn, xcb_window_t window,
+                    uint32_t event_mask) {
+    xcb_change_window_attributes(conn, window, XCB_CW_EVENT_MASK, &event_mask);
+}
+
+/**
+ * Wait for the reply to a GetProperty request, and append the property's
+ * value and a terminating NUL to @out. Returns -ENOENT if the window or the
+ * property don't exist, or the property isn't of the type asked for.
+ *
+ * @conn: The X connection
+ * @cookie: The cookie from xcb_get_property()
+ * @stats: If set, where to count the wait if it was a round trip
+ * @out: The buffer to append to
+ */
+int x_property_read(xcb_connection_t *conn, xcb_get_property_cookie_t cookie,
+                    struct cm_stats *stats, struct cm_buf *out) {
+    _drop_(free) xcb_get_property_reply_t *reply =
+        x_wait_reply(conn, cookie.sequence, stats);
+    if (!reply || reply->type == XCB_NONE) {
+        return -ENOENT;
+    }
+    int len = xcb_get_property_value_length(reply);
+    // With the wrong type, we get how long it is, but none of it
+    if (len == 0 && reply->bytes_after) {
+        return -ENOENT;
+    }
+    cm_buf_append(out, xcb_get_property_value(reply), (size_t)len);
+    cm_buf_append(out, "", 1);
+    return 0;
+}
+
+/**
+ * Ask for both of the properties a window's title may be in, so that we can
+ * wait for them together.
+ */
+static void _nonnull_ title_request(xcb_connection_t *conn,
+                                    const struct x_atoms *atoms,
+                                    xcb_window_t window,
+                                    xcb_get_property_cookie_t *cookies) {
+    cookies[0] = xcb_get_property(conn, 0, window, atoms->net_wm_name,
+                                  atoms->utf8_string, 0, X_PROPERTY_ALL);
+    cookies[1] = xcb_get_property(conn, 0, window, XCB_ATOM_WM_NAME,
+                                  XCB_GET_PROPERTY_TYPE_ANY, 0, X_PROPERTY_ALL);
+}
+
+/**
+ * Collect the replies to title_request(), preferring _NET_WM_NAME. Returns the
+ * title, to be freed with free(), or NULL if the window has none.
+ */
+static char *_nonnull_n_(1, 2)
+    title_collect(xcb_connection_t *conn,
+                  const xcb_get_property_cookie_t *cookies,
+                  struct cm_stats *stats) {
+    struct cm_buf buf = {0};
+    for (size_t i = 0; i < 2; i++) {
+        if (buf.data) {
+            xcb_discard_reply(conn, cookies[i].sequence);
+        } else if (x_property_read(conn, cookies[i], stats, &buf) < 0) {
+            cm_buf_free(&buf);
+        }
+    }
+    return buf.data;
+}
+
+/**
+ * Fetch the title of a window, to be freed with free().
+ *
+ * @conn: The X connection
+ * @atoms: Atoms from x_atoms_init()
+ * @window: The window
+ */
+char *x_window_title(xcb_connection_t *conn, const struct x_atoms *atoms,
+                     xcb_window_t window) {
+    xcb_get_property_cookie_t cookies[2];
+    title_request(conn, atoms, window, cookies);
+    return title_collect(conn, cookies, NULL);
+}
+
+/**
+ * Set up a window cache. If @attrs asks for pids but the server can't tell us
+ * them, they are left as 0.
+ *
+ * @wc: The window cache
+ * @conn: The connection the windows are on
+ * @root: The root window
+ * @atoms: Atoms from x_atoms_init()
+ * @attrs: What to fetch besides titles, a mask of `enum x_window_attr`
+ */
+void x_window_cache_init(struct x_window_cache *wc, xcb_connection_t *conn,
+                         xcb_window_t root, const struct x_atoms *atoms,
+                         uint32_t attrs) {
+    *wc = (struct x_window_cache){
+        .conn = conn, .root = root, .atoms = atoms, .attrs = attrs};
+    if ((attrs & X_WINDOW_PID) && xres_init(conn) < 0) {
+        dbg("X-Resource 1.2 is missing, window pids are unknown\n");
+        wc->attrs &= ~(uint32_t)X_WINDOW_PID;
+    }
+}
+
+/**
+ * Forget the replies to any requests we have in flight for @entry.
+ */
+static void _nonnull_ window_entry_discard(struct x_window_cache *wc,
+                                           struct x_window_entry *entry) {
+    if (!entry->pending) {
+        return;
+    }
+    for (size_t i = 0; i < arrlen(entry->title_cookies); i++) {
+        xcb_discard_reply(wc->conn, entry->title_cookies[i].sequence);
+    }
+    if (wc->attrs & X_WINDOW_CLASS) {
+        xcb_discard_reply(wc->conn, entry->class_cookie.sequence);
+    }
+    if (wc->attrs & X_WINDOW_PID) {
+        xcb_discard_reply(wc->conn, entry->pid_sequence);
+    }
+    entry->pending = false;
+}
+
+static void _nonnull_ window_entry_clear(struct x_window_cache *wc,
+                                         struct x_window_entry *entry) {
+    window_entry_discard(wc, entry);
+    free(entry->title);
+    free(entry->wm_class);
+    *entry = (struct x_window_entry){.window = XCB_NONE};
+}
+
+static struct x_window_entry _nonnull_ *
+window_cache_find(struct x_window_cache *wc, xcb_window_t window) {
+    for (size_t i = 0; i < X_WINDOW_CACHE_SIZE; i++) {
+        if (wc->entries[i].window != XCB_NONE &&
+            wc->entries[i].window == window) {
+            return &wc->entries[i];
         }
     }
     return NULL;
 }
 
+/**
+ * Start fetching what we want to know about @window, unless we already have it
+ * or are already fetching it. Nothing is waited for until x_window_cache_get().
+ *
+ * The root window isn't cached, since we'd be changing which events we get
+ * for it, and it's never a selection owner anyway.
+ *
+ * @wc: The window cache
+ * @window: The window
+ */
+void x_window_cache_prefetch(struct x_window_cache *wc, xcb_window_t window) {
+    if (window == XCB_NONE || window == wc->root) {
+        return;
+    }
+
+    struct x_window_entry *entry = window_cache_find(wc, window);
+    if (!entry) {
+        for (size_t i = 0; i < X_WINDOW_CACHE_SIZE && !entry; i++) {
+            if (wc->entries[i].window == XCB_NONE) {
+                entry = &wc->entries[i];
+            }
+        }
+        if (!entry) {
+            entry = &wc->entries[wc->next_victim];
+            wc->next_victim = (wc->next_victim + 1) % X_WINDOW_CACHE_SIZE;
+            // Asynchronous, and a BadWindow if it's gone is harmless
+            x_select_input(wc->conn, entry->window, XCB_EVENT_MASK_NO_EVENT);
+            window_entry_clear(wc, entry);
+        }
+        // Select before fetching, so we can't miss a change in between
+        entry->window = window;
+        x_select_input(wc->conn, window,
+                       XCB_EVENT_MASK_PROPERTY_CHANGE |
+                           XCB_EVENT_MASK_STRUCTURE_NOTIFY);
+    } else if (entry->valid || entry->pending) {
+        return;
+    }
+
+    title_request(wc->conn, wc->atoms, window, entry->title_cookies);
+    if (wc->attrs & X_WINDOW_CLASS) {
+        entry->class_cookie =
+            xcb_get_property(wc->conn, 0, window, XCB_ATOM_WM_CLASS,
+                             XCB_ATOM_STRING, 0, X_PROPERTY_ALL);
+    }
+    if (wc->attrs & X_WINDOW_PID) {
+        entry->pid_sequence = xres_pid_request(wc->conn, window);
+    }
+    entry->pending = true;
+}
+
+/**
+ * Collect the replies to the requests x_window_cache_prefetch() sent for
+ * @entry.
+ */
+static void _nonnull_ window_entry_collect(struct x_window_cache *wc,
+                                           struct x_window_entry *entry) {
+    free(entry->title);
+    free(entry->wm_class);
+    entry->title = title_collect(wc->conn, entry->title_cookies, wc->stats);
+    entry->wm_class = NULL;
+    entry->info = (struct x_window_info){.title = entry->title};
+
+    if (wc->attrs & X_WINDOW_CLASS) {
+        // WM_CLASS is the instance and then the class, each null terminated
+        struct cm_buf buf = {0};
+        if (x_property_read(wc->conn, entry->class_cookie, wc->stats, &buf) ==
+            0) {
+            entry->wm_class = buf.data;
+            size_t instance_len = strnlen(buf.data, buf.len);
+            entry->info.instance = buf.data;
+            entry->info.class =
+                instance_len + 1 < buf.len ? buf.data + instance_len + 1 : NULL;
+        }
+    }
+    if (wc->attrs & X_WINDOW_PID) {
+        entry->info.pid =
+            xres_pid_collect(wc->conn, entry->pid_sequence, wc->stats);
+    }
+
+    entry->pending = false;
+    entry->valid = true;
+}
+
+/**
+ * Get what we know about @window, fetching it only if we haven't already, or
+ * it changed since. The result is owned by the cache, and is only valid until
+ * the next call into it. Returns NULL for the root window.
+ *
+ * @wc: The window cache
+ * @window: The window
+ */
+struct x_window_info *x_window_cache_get(struct x_window_cache *wc,
+                                         xcb_window_t window) {
+    x_window_cache_prefetch(wc, window);
+    struct x_window_entry *entry =
+        window == wc->root ? NULL : window_cache_find(wc, window);
+    if (!entry) {
+        return NULL;
+    }
+    if (entry->pending) {
+        window_entry_collect(wc, entry);
+    }
+    return &entry->info;
+}
+
+/**
+ * Update the cache for an event. Returns true if the event was about a cached
+ * window, in which case nobody else should need it.
+ *
+ * @wc: The window cache
+ * @evt: The event
+ */
+bool x_window_cache_handle_event(struct x_window_cache *wc,
+                                 const xcb_generic_event_t *evt) {
+    xcb_window_t window;
+    xcb_atom_t atom = XCB_NONE;
+    switch (evt->response_type & ~0x80) {
+        case XCB_DESTROY_NOTIFY:
+            window = ((const xcb_destroy_notify_event_t *)evt)->window;
+            break;
+        case XCB_PROPERTY_NOTIFY: {
+            const xcb_property_notify_event_t *pe = (const void *)evt;
+            window = pe->window;
+            atom = pe->atom;
+            break;
+        }
+        case XCB_UNMAP_NOTIFY:
+        case XCB_MAP_NOTIFY:
+        case XCB_REPARENT_NOTIFY:
+        case XCB_CONFIGURE_NOTIFY:
+        case XCB_GRAVITY_NOTIFY:
+        case XCB_CIRCULATE_NOTIFY:
+            // The rest of what StructureNotify gets us. They all have the
+            // window they were selected on in the same place.
+            window = ((const xcb_map_notify_event_t *)evt)->event;
+            break;
+        default:
+            return false;
+    }
+
+    struct x_window_entry *entry = window_cache_find(wc, window);
+    if (!entry) {
+        return false;
+    }
+
+    if ((evt->response_type & ~0x80) == XCB_DESTROY_NOTIFY) {
+        window_entry_clear(wc, entry);
+    } else if (atom == XCB_ATOM_WM_NAME || atom == wc->atoms->net_wm_name ||
+               ((wc->attrs & X_WINDOW_CLASS) && atom == XCB_ATOM_WM_CLASS)) {
+        entry->valid = false;
+    }
+    return true;
+}
+
+void x_window_cache_free(struct x_window_cache *wc) {
+    for (size_t i = 0; i < X_WINDOW_CACHE_SIZE; i++) {
+        window_entry_clear(wc, &wc->entries[i]);
+    }
+}
+
 /**
  * Certain X11 operations may fail in expected ways. For example, when
- * attempting to interact with a window that has been closed. This handler
- * avoids the application terminating in such cases.
- *
- * The cppcheck suppression is for a false positive: this is a callback and
- * cannot be changed.
- */
-// cppcheck-suppress [constParameterPointer,unmatchedSuppression]
-int xerror_handler(Display *dpy _unused_, XErrorEvent *ee) {
-    if (ee->error_code == BadWindow ||
-        (ee->request_code == X_SetInputFocus && ee->error_code == BadMatch) ||
-        (ee->request_code == X_PolyText8 && ee->error_code == BadDrawable) ||
-        (ee->request_code == X_PolyFillRectangle &&
-         ee->error_code == BadDrawable) ||
-        (ee->request_code == X_PolySegment && ee->error_code == BadDrawable) ||
-        (ee->request_code == X_ConfigureWindow && ee->error_code == BadMatch) ||
-        (ee->request_code == X_GrabButton && ee->error_code == BadAccess) ||
-        (ee->request_code == X_GrabKey && ee->error_code == BadAccess) ||
-        (ee->request_code == X_CopyArea && ee->error_code == BadDrawable))
-        return 0;
-    die("X error with request code=%d, error code=%d\n", ee->request_code,
-        ee->error_code);
+ * attempting to interact with a window that has been closed. Those are
+ * ignored, anything else is fatal.
+ *
+ * Errors come back either in place of a reply, or, for requests without one,
+ * as events with a response type of 0.
+ *
+ * @err: The error
+ */
+void x_check_error(const xcb_generic_error_t *err) {
+    if (err->error_code == XCB_WINDOW) {
+        return;
+    }
+    die("X error with request code=%d, error code=%d\n", err->major_code,
+        err->error_code);
 }
@@ -1,13 +1,167 @@
 #ifndef CM_X_H
 #define CM_X_H
 
-#include <X11/Xlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <xcb/xcb.h>
 
+#include "ipc.h"
+#include "stats.h"
 #include "util.h"
 
-DEFINE_DROP_FUNC_VOID(XFree)
+#define X_WINDOW_CACHE_SIZE 32 /* Windows whose details we keep */
 
-char _nonnull_ *get_window_title(Display *dpy, Window owner);
-int xerror_handler(Display *dpy _unused_, XErrorEvent *ee);
+/* Property lengths are in 32-bit units, this asks for all of it */
+#define X_PROPERTY_ALL (UINT32_MAX / 4)
+
+/**
+ * The parts of XFixes we use. We speak it directly rather than through
+ * xcb-xfixes, whose headers aren't installed everywhere libxcb's are.
+ */
+#define X_XFIXES_SELECTION_NOTIFY 0 /* Offset from the extension event base */
+#define X_XFIXES_SET_SELECTION_OWNER_NOTIFY_MASK (1 << 0)
+
+struct x_xfixes_selection_notify_event {
+    uint8_t response_type;
+    uint8_t subtype;
+    uint16_t sequence;
+    xcb_window_t window;
+    xcb_window_t owner;
+    xcb_atom_t selection;
+    xcb_timestamp_t timestamp;
+    xcb_timestamp_t selection_timestamp;
+    uint8_t pad[8];
+};
+
+/**
+ * Atoms which don't have a predefined XCB_ATOM_* value, interned together by
+ * x_atoms_init() so that it only costs one round trip.
+ */
+struct x_atoms {
+    xcb_atom_t utf8_string;
+    xcb_atom_t net_wm_name;
+    xcb_atom_t targets;
+    xcb_atom_t clipboard;
+    xcb_atom_t incr;
+};
+
+/**
+ * What x_window_cache fetches for each window besides its title.
+ *
+ * @X_WINDOW_CLASS: The WM_CLASS property
+ * @X_WINDOW_PID: The pid of the client which created the window, from
+ *                X-Resource
+ */
+enum x_window_attr {
+    X_WINDOW_CLASS = 1 << 0,
+    X_WINDOW_PID = 1 << 1,
+};
+
+/**
+ * What we know about a window. Strings are NULL if the window doesn't have
+ * them, or they weren't asked for.
+ *
+ * @title: The title
+ * @instance: The instance name from WM_CLASS
+ * @class: The class name from WM_CLASS
+ * @pid: The pid of the client which created the window, or 0 if unknown
+ * @verdicts: Free for the caller to remember conclusions drawn from the above.
+ *            Cleared whenever they are fetched again
+ */
+struct x_window_info {
+    const char *title;
+    const char *instance;
+    const char *class;
+    uint32_t pid;
+    uint32_t verdicts;
+};
+
+/**
+ * A window we know about, or are finding out about.
+ *
+ * @window: The window, or XCB_NONE if the slot is unused
+ * @valid: Whether @info is up to date. Cleared when a property in it changes
+ * @pending: Whether the requests below are in flight
+ * @title_cookies: The requests for _NET_WM_NAME and WM_NAME
+ * @class_cookie: The request for WM_CLASS, if X_WINDOW_CLASS is wanted
+ * @pid_sequence: The request for the pid, if X_WINDOW_PID is wanted
+ * @title: The storage for @info.title
+ * @wm_class: The storage for @info.instance and @info.class
+ * @info: What we know
+ */
+struct x_window_entry {
+    xcb_window_t window;
+    bool valid;
+    bool pending;
+    xcb_get_property_cookie_t title_cookies[2];
+    xcb_get_property_cookie_t class_cookie;
+    unsigned int pid_sequence;
+    char *title;
+    char *wm_class;
+    struct x_window_info info;
+};
+
+/**
+ * Details of windows we have already fetched, so that asking about the same
+ * one again doesn't cost a round trip to the X server. We select for property
+ * changes and destruction on each cached window, so
+ * x_window_cache_handle_event() must see every event.
+ *
+ * Fetching is split in two, so that several windows can be asked about with
+ * x_window_cache_prefetch() before waiting on any of them. Everything about a
+ * window is asked for at once, so it costs one round trip however much we
+ * want to know.
+ *
+ * @conn: The connection the windows are on
+ * @root: The root window, which we never cache
+ * @atoms: Atoms from x_atoms_init()
+ * @attrs: What we fetch besides titles, a mask of `enum x_window_attr`
+ * @entries: The cached windows
+ * @next_victim: The slot to reuse when the cache is full
+ * @stats: If set, round trips made to fetch details are counted here
+ */
+struct x_window_cache {
+    xcb_connection_t *conn;
+    xcb_window_t root;
+    const struct x_atoms *atoms;
+    uint32_t attrs;
+    struct x_window_entry entries[X_WINDOW_CACHE_SIZE];
+    size_t next_victim;
+    struct cm_stats *stats;
+};
+
+xcb_connection_t _nonnull_n_(2) *
+    x_connect(const char *display, xcb_window_t *out_root);
+void _nonnull_n_(1) * x_wait_reply(xcb_connection_t *conn,
+                                   unsigned int sequence,
+                                   struct cm_stats *stats);
+void _nonnull_ x_intern_atoms(xcb_connection_t *conn, const char *const *names,
+                              size_t nr, xcb_atom_t *out);
+void _nonnull_ x_atoms_init(xcb_connection_t *conn, struct x_atoms *atoms);
+int _must_use_ _nonnull_ x_xfixes_init(xcb_connection_t *conn,
+                                       uint8_t *out_event_base);
+void _nonnull_ x_xfixes_select_selection_input(xcb_connection_t *conn,
+                                               xcb_window_t window,
+                                               xcb_atom_t selection,
+                                               uint32_t event_mask);
+void _nonnull_ x_select_input(xcb_connection_t *conn, xcb_window_t window,
+                              uint32_t event_mask);
+int _must_use_ _nonnull_n_(1, 4)
+    x_property_read(xcb_connection_t *conn, xcb_get_property_cookie_t cookie,
+                    struct cm_stats *stats, struct cm_buf *out);
+char _nonnull_ *x_window_title(xcb_connection_t *conn,
+                               const struct x_atoms *atoms,
+                               xcb_window_t window);
+void _nonnull_ x_window_cache_init(struct x_window_cache *wc,
+                                   xcb_connection_t *conn, xcb_window_t root,
+                                   const struct x_atoms *atoms, uint32_t attrs);
+void _nonnull_ x_window_cache_prefetch(struct x_window_cache *wc,
+                                       xcb_window_t window);
+struct x_window_info _nonnull_ *x_window_cache_get(struct x_window_cache *wc,
+                                                   xcb_window_t window);
+bool _nonnull_ x_window_cache_handle_event(struct x_window_cache *wc,
+                                           const xcb_generic_event_t *evt);
+void _nonnull_ x_window_cache_free(struct x_window_cache *wc);
+void _nonnull_ x_check_error(const xcb_generic_error_t *err);
 
 #endif